@@ -19,16 +19,108 @@ struct FlashCtx {
     void (*ReadCR)(uint8_t dest[1]);
     uint32_t (*GetSmallestEraseSize)(void);
     const char* (*GetName)(void);
+    // Optional 512 bytes sector access for block devices, NULL otherwise.
+    // Unlike the byte address API it is not limited to 4GB.
+    void (*ReadSectors)(uint64_t lba, void *buffer, uint32_t count);
+    void (*WriteSectors)(uint64_t lba, const void *buffer, uint32_t count);
+    // Optional non-blocking erase and program, NULL otherwise. The next
+    // command may be issued once IsBusy() returns false. EraseAsync issues
+    // a single erase, or none if the start of the range is blank, and
+    // ProgramAsync programs up to the end of the page, both return the
+    // number of bytes done.
+    bool (*IsBusy)(void);
+    uint32_t (*EraseAsync)(uint32_t address, uint32_t size);
+    size_t (*ProgramAsync)(uint32_t address, const void *buffer, size_t buffer_size);
+    // Optional, NULL if the chip can't suspend an erase. SuspendErase
+    // suspends the EraseAsync erase still running so the flash can be read
+    // and returns true, or false if the last async command was a program.
+    // ResumeErase resumes it and returns true, or false if none was
+    // suspended. Other commands complete a suspended erase first.
+    bool (*SuspendErase)(void);
+    bool (*ResumeErase)(void);
     bool Presented : 1;
 };
 
 extern struct FlashCtx FlashCtx;
 
+// Queued erases and programs of the SPI flash, run in short slices by
+// flash_job_step() from the frame slack so the memory mapped reads of the
+// rest of the flash keep working in between. The data must stay unchanged
+// until the job is done. The FlashCtx Read, Write, Erase and Format run
+// the queue first.
+void flash_job_erase(uint32_t address, uint32_t size);
+void flash_job_program(uint32_t address, const void *data, uint32_t size);
+bool flash_job_pending(uint32_t address, uint32_t size);
+// Returns true if jobs are left
+bool flash_job_step(void);
+void flash_job_flush(void);
+
+// The SPI flash erases are planned with the largest aligned erase command,
+// a smaller one if most of its sectors are blank already, and the blank
+// sectors are skipped. EraseAsync checks only the first sector to keep the
+// slices short. The counts are since boot.
+struct flash_erase_stats {
+    uint32_t ops[4];      /* Erase commands per erase size, smallest first */
+    uint32_t chip_erases;
+    uint32_t blank_bytes; /* Not erased as they were blank */
+};
+
+void flash_get_erase_stats(struct flash_erase_stats *stats);
+
 #if SD_CARD != 0
 extern struct FlashCtx SdCtx;
 
+struct fs_extent;
+
 void reset_flash_allocator(void);
-uint32_t copy_sd_to_flash(uint32_t sd_address, uint32_t size);
+uint32_t copy_sd_to_flash(uint64_t lba, uint32_t offset, uint32_t size);
+uint32_t copy_extents_to_flash(const struct fs_extent *extents, uint32_t num_extents,
+                               uint32_t size);
+
+// Background copy, begin returns true if the data is already in flash,
+// otherwise the step should be called until it returns true. The steps
+// don't wait for the erases, finish does and completes the copy. Blocked
+// is true while the copy waits for flash_alloc_pre_erase(), on the chips
+// that can't suspend an erase.
+bool copy_sd_to_flash_begin(uint64_t lba, uint32_t offset, uint32_t size,
+                            uint32_t *flash_address);
+bool copy_sd_to_flash_step(uint32_t max_bytes);
+void copy_sd_to_flash_finish(void);
+bool copy_sd_to_flash_blocked(void);
+void copy_sd_to_flash_cancel(void);
+
+// Idle job erasing the free flash cache units ahead of the copies, erases
+// the smallest erase size per call. Returns false if there is nothing left
+// to erase.
+bool flash_alloc_pre_erase(void);
+
+struct flash_alloc_stats {
+    uint32_t entries;
+    uint32_t unit_size;
+    uint32_t total_kb;
+    uint32_t free_kb;
+    uint32_t largest_free_kb; /* Largest allocation that fits without eviction */
+    uint32_t free_gaps;
+    uint32_t fragmentation;   /* Percent of the free space not in the largest fit */
+};
+
+void flash_alloc_get_stats(struct flash_alloc_stats *stats);
+
+// Entries written by the caller, e.g. with the data in another format.
+// kind is mixed in the tag to tell the formats of the same SD data apart,
+// kind 0 finds the copies of copy_sd_to_flash(). The entry found may be a
+// part of the data left by the eviction, the caller checks the length.
+bool flash_alloc_find(uint64_t lba, uint32_t offset, uint32_t size, uint32_t kind,
+                      uint32_t *flash_address, uint32_t *length);
+
+// Reserves max_length bytes, returns the flash address or 0 if it doesn't
+// fit. The writes must go in the increasing order, the entry is found by
+// flash_alloc_find() only after the end that keeps the first length bytes.
+uint32_t flash_alloc_stream_begin(uint64_t lba, uint32_t offset, uint32_t size, uint32_t kind,
+                                  uint32_t max_length);
+void flash_alloc_stream_write(uint32_t position, const void *data, uint32_t length);
+void flash_alloc_stream_end(uint32_t length);
+void flash_alloc_stream_cancel(void);
 #endif // SD_CARD
 
 __attribute__((always_inline))
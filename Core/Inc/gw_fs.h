@@ -0,0 +1,47 @@
+#ifndef _GW_FS_H_
+#define _GW_FS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Read-only FAT32/exFAT driver. It only depends on the sector read callback
+// passed to fs_mount(), so it builds on the host as well as on the device
+// (e.g. with a callback reading from a disk image file).
+//
+// Files are resolved to a list of contiguous sector runs (extents) on open,
+// so reading them never touches the FAT again.
+
+#define FS_SECTOR_SIZE 512
+#define FS_MAX_EXTENTS 32
+
+typedef void (*fs_read_sectors_fn)(uint64_t lba, void *buffer, uint32_t count);
+
+struct fs_extent {
+    uint64_t lba;   /* First sector of the run */
+    uint32_t count; /* Sectors in the run */
+};
+
+struct fs_file {
+    uint64_t size;
+    uint32_t num_extents;
+    struct fs_extent extent[FS_MAX_EXTENTS];
+};
+
+// Mounts the first FAT32/exFAT volume, either a superfloppy or the first
+// MBR partition holding one
+bool fs_mount(fs_read_sectors_fn read_sectors);
+
+// Resolves the absolute path (e.g. "/roms/nes/game.nes"), names are
+// compared case insensitively. Returns false if the file is not found or
+// is too fragmented to fit FS_MAX_EXTENTS.
+bool fs_open(const char *path, struct fs_file *file);
+
+// Reads bytes at position of the opened file
+void fs_read(const struct fs_file *file, uint64_t pos, void *buffer, size_t size);
+
+// Returns the sector holding the position and the number of the contiguous
+// sectors starting from it, 0 if the position is out of the file
+uint64_t fs_file_lba(const struct fs_file *file, uint64_t pos, uint32_t *contiguous);
+
+#endif
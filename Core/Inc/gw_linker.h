@@ -62,3 +62,9 @@ extern uint8_t _GB_ROM_UNPACK_BUFFER_SIZE;
 
 extern uint8_t *_PCE_ROM_UNPACK_BUFFER;
 extern uint8_t _PCE_ROM_UNPACK_BUFFER_SIZE;
+
+extern uint8_t *_SMS_ROM_UNPACK_BUFFER;
+extern uint8_t _SMS_ROM_UNPACK_BUFFER_SIZE;
+
+extern uint8_t *_GW_ROM_UNPACK_BUFFER;
+extern uint8_t _GW_ROM_UNPACK_BUFFER_SIZE;
@@ -0,0 +1,71 @@
+#ifndef _GW_SD_H_
+#define _GW_SD_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Number of 512 bytes blocks cached in RAM, 0 to disable the cache
+#ifndef SD_CACHE_SECTORS
+#define SD_CACHE_SECTORS 16
+#endif
+
+// Number of blocks read at once on a sequential cache miss
+#ifndef SD_CACHE_READAHEAD
+#define SD_CACHE_READAHEAD (SD_CACHE_SECTORS / 4)
+#endif
+
+#if SD_CARD != 0
+#define SD_SECTOR_SIZE 512
+
+// Card layout in 512 bytes sectors, tools/sd_card.py writes it:
+//
+//   0                   MBR, the first partition (type 0xDA, no filesystem)
+//                       holds the image and the catalog
+//   SD_CALIBRATION_LBA  SoftSPI clock calibration, written by gw_sd.c
+//   SD_IMAGE_LBA        extflash image, the SdCtx.Read()/Write() addresses
+//   SD_CATALOG_LBA      rom_catalog.bin from parse_roms.py, see rom_catalog.h
+//
+// The optional second partition is the FAT32/exFAT volume of the SD_FS=1
+// builds, see gw_fs.h.
+#define SD_CALIBRATION_LBA 1ULL
+#define SD_IMAGE_LBA 2048ULL
+#define SD_IMAGE_MAX_SIZE (256 * 1024 * 1024ULL)
+#define SD_CATALOG_LBA (SD_IMAGE_LBA + SD_IMAGE_MAX_SIZE / SD_SECTOR_SIZE)
+
+// Keeps the shared pins switched to the sd card until the outermost session
+// ends. SD calls made inside of a session don't switch the pins back to ospi
+// after every call, flash calls still take the pins back when needed.
+void sd_session_begin(void);
+void sd_session_end(void);
+
+// Byte granular read starting at offset bytes from the given sector
+void sd_read(uint64_t lba, uint32_t offset, void *buffer, size_t buffer_size);
+
+// Converts the address of the data linked into the extflash region (the
+// SdCtx.Read() convention) to the card sector and offset in it
+uint64_t sd_address_to_lba(uint32_t address, uint32_t *offset);
+
+// Sequential read stream over READ_MULTIPLE_BLOCK starting at offset bytes
+// from the given sector. Only one stream might be opened at a time and no
+// other SD card operations are allowed until it is closed.
+void sd_read_stream_begin(uint64_t lba, uint32_t offset);
+void sd_read_stream(void *buffer, size_t buffer_size);
+void sd_read_stream_end(void);
+
+// Sequential write stream over WRITE_MULTIPLE_BLOCK. The address uses the
+// same convention as SdCtx.Write(). Size is the expected total number of
+// bytes to be written, used to pre-erase the blocks, 0 if unknown.
+void sd_write_stream_begin(uint32_t address, uint32_t size);
+void sd_write_stream(const void *buffer, size_t buffer_size);
+void sd_write_stream_end(void);
+
+struct sd_cache_stats {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t readahead; /* Blocks read ahead on sequential misses */
+};
+
+void sd_cache_get_stats(struct sd_cache_stats *stats);
+#endif // SD_CARD
+
+#endif
@@ -106,6 +106,9 @@ void BSOD(BSOD_t fault, uint32_t pc, uint32_t lr) __attribute__((noreturn));
 
 void store_erase(const uint8_t *flash_ptr, uint32_t size);
 void store_save(const uint8_t *flash_ptr, const uint8_t *data, size_t size);
+// Queues the save and returns, data must stay unchanged until store_flush()
+void store_save_async(const uint8_t *flash_ptr, const uint8_t *data, size_t size);
+void store_flush(void);
 void boot_magic_set(uint32_t magic);
 void uptime_inc(void);
 uint32_t uptime_get(void);
@@ -25,6 +25,10 @@ typedef struct {
     bool missing_cover;
     rom_region_t region;
     const rom_system_t *system;
+#if SD_CARD != 0
+    const char *path; // Loaded from the SD card filesystem when set
+    uint64_t lba;     // Otherwise the first card sector of the ROM data
+#endif
 } retro_emulator_file_t;
 
 typedef struct {
@@ -51,3 +55,9 @@ bool emulator_build_file_object(const char *path, retro_emulator_file_t *out_fil
 const char *emu_get_file_path(retro_emulator_file_t *file);
 retro_emulator_t *file_to_emu(retro_emulator_file_t *file);
 bool emulator_is_file_valid(retro_emulator_file_t *file);
+#if SD_CARD != 0
+// Copies the selected ROM and the recently started ones to the flash cache
+// in short steps, returns false if there is nothing to copy or the copy
+// waits for flash_alloc_pre_erase()
+bool emulator_prefetch_idle(retro_emulator_file_t *selected);
+#endif
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "rom_manager.h"
+
+// Binary ROM catalog generated by parse_roms.py for the SD card builds
+// (build/rom_catalog.bin). It is written to the card at SD_CATALOG_LBA,
+// separately from the image, and is followed by the ROM data:
+//
+//   sector 0        struct rom_catalog_header
+//   entries_offset  struct rom_catalog_entry[entries_count]
+//   names_offset    NUL terminated ROM names, each followed by the extension
+//                   and the path of the files on the filesystem
+//   rom_sector * N  ROM data, every ROM starts at the sector boundary
+//
+// All the offsets are relative to the start of the catalog. The ROMs with
+// a path are read from the FAT32/exFAT partition (see gw_fs.h) instead,
+// the catalog only lists them.
+
+#define ROM_CATALOG_MAGIC       0x54434752 /* "RGCT" */
+#define ROM_CATALOG_VERSION     2
+#define ROM_CATALOG_SECTOR_SIZE 512
+#define ROM_CATALOG_MAX_SYSTEMS 16
+
+// Number of the started ROMs that keep their file pointers valid across
+// the reboots, see rom_catalog_pin()
+#define ROM_CATALOG_PINNED 4
+
+struct rom_catalog_system {
+    char dirname[8];
+    uint32_t first_entry;
+    uint32_t entries_count;
+    uint32_t names_offset; /* Names of the system entries are contiguous */
+    uint32_t names_size;
+} __attribute__((packed));
+
+struct rom_catalog_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_size;
+    uint32_t entries_count;
+    uint32_t entries_offset;
+    uint32_t names_offset;
+    uint32_t names_size;
+    uint32_t systems_count;
+    uint32_t reserved;
+    struct rom_catalog_system systems[ROM_CATALOG_MAX_SYSTEMS];
+} __attribute__((packed));
+
+struct rom_catalog_entry {
+    uint32_t name_offset;
+    uint32_t rom_sector;
+    uint32_t rom_size;
+    uint32_t save_offset; /* Relative to __SAVEFLASH_START__ */
+    uint32_t save_size;
+    uint32_t crc32;
+    uint8_t region;
+    uint8_t reserved[3];
+    uint32_t path_offset; /* 0 if the ROM data follows the catalog */
+} __attribute__((packed));
+
+_Static_assert(sizeof(struct rom_catalog_header) <= ROM_CATALOG_SECTOR_SIZE,
+               "Catalog header must fit the sector");
+_Static_assert(sizeof(struct rom_catalog_entry) == 32, "Catalog entry size mismatch");
+
+// Returns the number of the catalog ROMs for the system, only the catalog
+// header is read on the first call
+uint32_t rom_catalog_count(const rom_system_t *system);
+
+// Maps the system entries from the catalog on the first call. They are
+// read a sector at a time into the heap, NULL if they don't fit.
+const retro_emulator_file_t *rom_catalog_files(const rom_system_t *system);
+
+// Returns the copy of the catalog file that stays at the same address
+// across the reboots, e.g. for the startup file. Only the last
+// ROM_CATALOG_PINNED pinned files are kept. Other files are returned as is.
+retro_emulator_file_t *rom_catalog_pin(retro_emulator_file_t *file);
+
+// Returns true if both point to the same ROM, e.g. the mapped catalog file
+// and its pinned copy
+bool rom_catalog_same_file(const retro_emulator_file_t *a, const retro_emulator_file_t *b);
+
+// Returns true if the file points to a mapped or pinned catalog entry,
+// reads the pinned entry back after a reboot
+bool rom_catalog_map_file(const retro_emulator_file_t *file);
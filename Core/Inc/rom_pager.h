@@ -0,0 +1,67 @@
+#ifndef _ROM_PAGER_H_
+#define _ROM_PAGER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Demand paging of the ROM banks from the SD card. The game starts right
+// away, the banks are read into the RAM bank cache when the mapper switches
+// to them and the ROM is copied to the SPI flash cache in the background.
+// Once the copy is done all the banks are served from the flash.
+//
+// With FLASH_CACHE_LZ4 the banks are packed to the flash one by one as LZ4
+// blocks instead, the misses are decoded from the flash to the bank cache.
+// The packed copy takes less of the flash cache but the bank cache stays
+// in use.
+
+#if SD_CARD != 0
+
+#ifndef ROM_PAGER_MAX_BANKS
+#define ROM_PAGER_MAX_BANKS 512
+#endif
+
+// Bytes copied to the flash per rom_pager_idle() call
+#ifndef ROM_PAGER_FILL_BYTES
+#define ROM_PAGER_FILL_BYTES 1024
+#endif
+
+// Returns the flash address right away if the ROM is already cached in
+// flash, otherwise NULL and the pager is active
+const uint8_t *rom_pager_open(uint64_t lba, uint32_t offset, uint32_t size, uint32_t bank_size,
+                              uint8_t *ram_buffer, uint32_t ram_length);
+void rom_pager_close(void);
+bool rom_pager_active(void);
+
+// Moves the start of the bank 0, e.g. to skip the ROM header
+void rom_pager_set_base(uint32_t base);
+
+// Returns the bank data, reads it from the SD card on a miss. Pinned
+// banks are never evicted, rom_pager_pin() returns the bank data too.
+const uint8_t *rom_pager_bank(uint32_t bank);
+const uint8_t *rom_pager_pin(uint32_t bank);
+void rom_pager_unpin(uint32_t bank);
+void rom_pager_unpin_all(void);
+
+// Reads the ROM bytes bypassing the bank cache
+void rom_pager_read(uint32_t offset, void *buffer, uint32_t size);
+
+// Advances the background copy to flash, returns true once the ROM is
+// served from flash (the previously returned bank pointers stay valid)
+bool rom_pager_idle(void);
+
+// Copies the ROM to flash as is even if FLASH_CACHE_LZ4 is set, for the
+// mappers that need the whole ROM mapped
+void rom_pager_flatten(void);
+
+struct rom_pager_stats {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+};
+
+// Counts of the running game, or of the last one in the launcher
+void rom_pager_get_stats(struct rom_pager_stats *stats);
+
+#endif // SD_CARD
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef _ROM_TIER_H_
+#define _ROM_TIER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// RAM tier in front of the ROM executed from the memory mapped flash. The
+// mapper switches are counted per bank and the most switched to banks are
+// copied to the free RAM of the emulator, so the fetches from them don't
+// pay the flash latency.
+
+#ifndef ROM_TIER_MAX_BANKS
+#define ROM_TIER_MAX_BANKS 512
+#endif
+
+#ifndef ROM_TIER_MAX_SLOTS
+#define ROM_TIER_MAX_SLOTS 128
+#endif
+
+// Enables the tier if the RAM holds at least one bank, rom is the flash
+// address of the ROM
+void rom_tier_init(const uint8_t *rom, uint32_t rom_size, uint32_t bank_size, uint8_t *ram,
+                   uint32_t ram_length);
+void rom_tier_close(void);
+bool rom_tier_active(void);
+
+// Called on the mapper switch: counts the switch and returns the bank data,
+// the RAM copy if the bank is in the tier
+const uint8_t *rom_tier_bank(uint32_t bank);
+
+// Returns the bank data without counting the switch
+const uint8_t *rom_tier_lookup(uint32_t bank);
+
+// Copies the hottest bank to RAM, evicting the coldest one if there is no
+// free slot. Returns true if the banks moved, the caller re-resolves the
+// mapped banks with rom_tier_lookup() then, the evicted bank pointers are
+// no longer valid.
+bool rom_tier_idle(void);
+
+struct rom_tier_stats {
+    uint32_t hits;   /* Switches to a bank in RAM */
+    uint32_t misses; /* Switches to a bank in flash */
+    uint32_t promotions;
+    uint32_t evictions;
+};
+
+// Counts of the running game, or of the last one in the launcher
+void rom_tier_get_stats(struct rom_tier_stats *stats);
+
+#endif
@@ -30,6 +30,7 @@ typedef struct {
 void sha256_init(SHA256_CTX *ctx);
 void sha256_update(SHA256_CTX *ctx, const BYTE data[], size_t len);
 void sha256_final(SHA256_CTX *ctx, BYTE hash[]);
+void sha256_final_to_string(SHA256_CTX *ctx, BYTE hash_str[65]);
 void sha256_to_string(BYTE hash_str[65], const BYTE data[], size_t len);
 
 #endif   // SHA256_H
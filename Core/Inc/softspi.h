@@ -5,6 +5,13 @@
 
 #include <stm32h7xx_hal.h>
 
+// Default SCK half-period of the fast transfer engine in pause loop
+// iterations, used when DelayUs is 0. Might be overridden at compile time
+// or tuned at runtime via the HalfPeriod field.
+#ifndef SOFTSPI_HALF_PERIOD
+#define SOFTSPI_HALF_PERIOD 2
+#endif
+
 typedef struct {
     GPIO_TypeDef *port;
     uint16_t pin;
@@ -15,10 +22,17 @@ typedef struct {
     SoftSPI_Pin mosi;
     SoftSPI_Pin miso;
     SoftSPI_Pin cs;
-    uint32_t DelayUs;
+    uint32_t DelayUs;       /* Slow HAL based transfers if not 0 */
+    uint32_t HalfPeriod;    /* Fast transfers SCK half-period */
     bool csIsInverted : 1;
 } SoftSPI;
 
 void SoftSpi_WriteRead(SoftSPI *spi, const uint8_t *txData, uint8_t *rxData, uint32_t len);
 void SoftSpi_WriteDummyRead(SoftSPI *spi, uint8_t *rxData, uint32_t len);
 void SoftSpi_WriteDummyReadCsLow(SoftSPI *spi, uint8_t *rxData, uint32_t len);
+
+#if SOFTSPI_BENCHMARK != 0
+// Clocks len dummy bytes with CS deasserted through the HAL based and the
+// fast transfer engines and prints the DWT cycle counts of both
+void SoftSpi_Benchmark(SoftSPI *spi, uint32_t len);
+#endif
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stdint.h>
+
+// Unrolled SoftSPI transfer kernels, mode 0, MSB first. They only touch
+// the pins through the SOFTSPI_PIN_* macros and don't depend on the HAL,
+// so a host test can define the macros to run them against a simulated
+// port before including this header.
+
+typedef struct {
+    volatile uint32_t *bsrr;
+    volatile uint32_t *idr;
+    uint32_t mask;
+} softspi_kernel_pin_t;
+
+typedef struct {
+    softspi_kernel_pin_t sck;
+    softspi_kernel_pin_t mosi;
+    softspi_kernel_pin_t miso;
+    uint32_t half_period;   /* SCK half-period in pause loop iterations */
+} softspi_kernel_t;
+
+#ifndef SOFTSPI_PIN_SET
+#define SOFTSPI_PIN_SET(p) (*(p)->bsrr = (p)->mask)
+#define SOFTSPI_PIN_RESET(p) (*(p)->bsrr = (p)->mask << 16)
+#define SOFTSPI_PIN_WRITE(p, v) (*(p)->bsrr = (p)->mask << ((v) ? 0 : 16))
+#define SOFTSPI_PIN_READ(p) ((*(p)->idr & (p)->mask) != 0)
+#endif // !SOFTSPI_PIN_SET
+
+__attribute__((always_inline))
+static inline void softspi_kernel_pause(uint32_t count) {
+    while (count--) {
+        __asm volatile("nop");
+    }
+}
+
+// The card samples MOSI on the rising edge and shifts out MISO on the
+// falling edge
+#define SOFTSPI_READ_BIT(k, byte) do {        \
+    SOFTSPI_PIN_SET(&(k)->sck);               \
+    softspi_kernel_pause((k)->half_period);   \
+    byte = (byte << 1) | SOFTSPI_PIN_READ(&(k)->miso); \
+    SOFTSPI_PIN_RESET(&(k)->sck);             \
+    softspi_kernel_pause((k)->half_period);   \
+} while (0)
+
+#define SOFTSPI_WRITE_BIT(k, byte, bit) do {  \
+    SOFTSPI_PIN_WRITE(&(k)->mosi, (byte) & (1 << (bit))); \
+    softspi_kernel_pause((k)->half_period);   \
+    SOFTSPI_PIN_SET(&(k)->sck);               \
+    softspi_kernel_pause((k)->half_period);   \
+    SOFTSPI_PIN_RESET(&(k)->sck);             \
+} while (0)
+
+#define SOFTSPI_WRITE_READ_BIT(k, txByte, rxByte, bit) do { \
+    SOFTSPI_PIN_WRITE(&(k)->mosi, (txByte) & (1 << (bit))); \
+    softspi_kernel_pause((k)->half_period);   \
+    SOFTSPI_PIN_SET(&(k)->sck);               \
+    softspi_kernel_pause((k)->half_period);   \
+    rxByte = (rxByte << 1) | SOFTSPI_PIN_READ(&(k)->miso); \
+    SOFTSPI_PIN_RESET(&(k)->sck);             \
+} while (0)
+
+// Clocks len bytes with MOSI high, the card expects 0xFF while sending
+// data. rxData may be NULL to drop them.
+static inline void softspi_kernel_read(const softspi_kernel_t *k, uint8_t *rxData, uint32_t len) {
+    SOFTSPI_PIN_SET(&k->mosi);
+
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t rxByte = 0;
+
+        SOFTSPI_READ_BIT(k, rxByte);
+        SOFTSPI_READ_BIT(k, rxByte);
+        SOFTSPI_READ_BIT(k, rxByte);
+        SOFTSPI_READ_BIT(k, rxByte);
+        SOFTSPI_READ_BIT(k, rxByte);
+        SOFTSPI_READ_BIT(k, rxByte);
+        SOFTSPI_READ_BIT(k, rxByte);
+        SOFTSPI_READ_BIT(k, rxByte);
+
+        if (rxData)
+            rxData[i] = rxByte;
+    }
+}
+
+static inline void softspi_kernel_write(const softspi_kernel_t *k, const uint8_t *txData, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        const uint8_t txByte = txData[i];
+
+        SOFTSPI_WRITE_BIT(k, txByte, 7);
+        SOFTSPI_WRITE_BIT(k, txByte, 6);
+        SOFTSPI_WRITE_BIT(k, txByte, 5);
+        SOFTSPI_WRITE_BIT(k, txByte, 4);
+        SOFTSPI_WRITE_BIT(k, txByte, 3);
+        SOFTSPI_WRITE_BIT(k, txByte, 2);
+        SOFTSPI_WRITE_BIT(k, txByte, 1);
+        SOFTSPI_WRITE_BIT(k, txByte, 0);
+        softspi_kernel_pause(k->half_period);
+    }
+}
+
+static inline void softspi_kernel_write_read(const softspi_kernel_t *k, const uint8_t *txData,
+                                             uint8_t *rxData, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        const uint8_t txByte = txData[i];
+        uint8_t rxByte = 0;
+
+        SOFTSPI_WRITE_READ_BIT(k, txByte, rxByte, 7);
+        SOFTSPI_WRITE_READ_BIT(k, txByte, rxByte, 6);
+        SOFTSPI_WRITE_READ_BIT(k, txByte, rxByte, 5);
+        SOFTSPI_WRITE_READ_BIT(k, txByte, rxByte, 4);
+        SOFTSPI_WRITE_READ_BIT(k, txByte, rxByte, 3);
+        SOFTSPI_WRITE_READ_BIT(k, txByte, rxByte, 2);
+        SOFTSPI_WRITE_READ_BIT(k, txByte, rxByte, 1);
+        SOFTSPI_WRITE_READ_BIT(k, txByte, rxByte, 0);
+        softspi_kernel_pause(k->half_period);
+
+        rxData[i] = rxByte;
+    }
+}
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -7,7 +8,9 @@
 #include "main.h"
 #include "porting.h"
 #include "gw_flash.h"
+#include "gw_fs.h"
 #include "gw_linker.h"
+#include "gw_sd.h"
 
 // Use the largest BLOCK size among:
 // 256 bytes - SPI flash page size
@@ -15,243 +18,1622 @@
 // 1024 bytes - SPI SRAM page size
 #define BLOCK_LENGTH 1024UL
 
+// Max time a background copy step polls the busy flash
+#define COPY_STEP_MS 2
+
+// Sequential reader over the list of the sd card sector runs, switches
+// the read stream to the next run when the current one is exhausted
+struct sd_reader {
+    const struct fs_extent *extents;
+    uint32_t num_extents;
+    uint32_t index;
+    uint64_t left;   /* Bytes left in the current run */
+    uint32_t start;  /* Offset of the data in the first run */
+    uint32_t pos;    /* Data bytes read */
+};
+
+static void reader_begin(struct sd_reader *reader, const struct fs_extent *extents,
+                         uint32_t num_extents, uint32_t offset)
+{
+    reader->extents = extents;
+    reader->num_extents = num_extents;
+    reader->index = 0;
+    reader->left = (uint64_t)extents[0].count * SD_SECTOR_SIZE - offset;
+    reader->start = offset;
+    reader->pos = 0;
+    sd_read_stream_begin(extents[0].lba, offset);
+}
+
+static void reader_read(struct sd_reader *reader, uint8_t *buffer, uint32_t len)
+{
+    while (len) {
+        if (!reader->left) {
+            sd_read_stream_end();
+            reader->index++;
+            assert(reader->index < reader->num_extents && "Read beyond the last extent");
+
+            const struct fs_extent *extent = &reader->extents[reader->index];
+            reader->left = (uint64_t)extent->count * SD_SECTOR_SIZE;
+            sd_read_stream_begin(extent->lba, 0);
+        }
+
+        const uint32_t bytes_to_read = reader->left < len ? reader->left : len;
+        sd_read_stream(buffer, bytes_to_read);
+        buffer += bytes_to_read;
+        len -= bytes_to_read;
+        reader->left -= bytes_to_read;
+        reader->pos += bytes_to_read;
+    }
+}
+
+static void reader_end(struct sd_reader *reader)
+{
+    sd_read_stream_end();
+}
+
+static void print_copy_stats(uint32_t size, uint32_t start_tick)
+{
+    const uint32_t elapsed_ms = HAL_GetTick() - start_tick;
+    printf("Copied %lu KB from SD to flash in %lu ms (%lu KB/s)\n",
+           size / 1024, elapsed_ms,
+           elapsed_ms ? (size / 1024) * 1000 / elapsed_ms : 0);
+}
+
 #if EXTFLASH_FORCE_SRAM == 0
 
 #define FLASH_MAGIC 0x46534C53UL
-#define FLASH_VERSION 1
-#define TOTAL_BLOCKS 126
+#define FLASH_VERSION 4
 #define ALIGN_BOUNDARY 4096UL
 
-// Align the store block size to 4096 bytes
-#define STORE_BLOCK_SIZE (((__SPI_FLASH_SIZE__ - ALIGN_BOUNDARY) / \
-                           TOTAL_BLOCKS) & (~(ALIGN_BOUNDARY - 1)))
+// Ring of the sectors at the end of the flash holding the metadata journal
+#define JOURNAL_SECTORS 16
+#define JOURNAL_SIZE (JOURNAL_SECTORS * ALIGN_BOUNDARY)
+
+// Tag of the entry that is being filled by the background copy
+#define TAG_PENDING 0xFFFFFFFFUL
+
+// The data area is split in the units. An allocation of N units is placed
+// at the boundary of the smallest power of two >= N like in the buddy
+// allocator, but takes exactly N units: the tail of the buddy stays free
+// for the smaller allocations. The free space is not stored, it is the
+// space between the entries, so the freed neighbours coalesce on their own.
+#ifndef FLASH_MAX_UNITS
+#define FLASH_MAX_UNITS 4096
+#endif
+#ifndef FLASH_MAX_ENTRIES
+#define FLASH_MAX_ENTRIES 1024
+#endif
+
+#define DATA_SIZE (__SPI_FLASH_SIZE__ - JOURNAL_SIZE)
+#define UNIT_FITS(size) (DATA_SIZE <= (size) * FLASH_MAX_UNITS)
+#define UNIT_SIZE (UNIT_FITS(0x1000UL) ? 0x1000UL : UNIT_FITS(0x2000UL) ? 0x2000UL : \
+                   UNIT_FITS(0x4000UL) ? 0x4000UL : UNIT_FITS(0x8000UL) ? 0x8000UL : 0x10000UL)
+#define TOTAL_UNITS (DATA_SIZE / UNIT_SIZE)
+
+static_assert(TOTAL_UNITS <= FLASH_MAX_UNITS, "SPI flash is too big for FLASH_MAX_UNITS");
+static_assert(FLASH_MAX_UNITS <= UINT16_MAX, "Unit numbers must fit 16 bits");
+
+// Residency is tracked per chunk: the eviction may take a part of the
+// entry, the chunks left around the freed range stay as the entries with
+// the chunk tags and a relaunch copies only the missing chunks to the
+// same place. The chunk tag is the data tag plus chunk * CHUNK_TAG_STEP,
+// so the chunk number is recovered from the tag with the inverse.
+#ifndef FLASH_CHUNK_SIZE
+#define FLASH_CHUNK_SIZE 0x10000UL
+#endif
+
+#define CHUNK_UNITS (FLASH_CHUNK_SIZE > UNIT_SIZE ? FLASH_CHUNK_SIZE / UNIT_SIZE : 1)
+#define CHUNK_TAG_STEP 0x9E3779B1UL
+#define CHUNK_TAG_INVERSE 0x0E8B2F51UL
+
+static_assert((uint32_t)(CHUNK_TAG_STEP * CHUNK_TAG_INVERSE) == 1, "Not an inverse");
+
+struct flash_entry {
+    uint32_t tag;      /* Unique data tag */
+    uint16_t unit;     /* Allocation start unit */
+    uint16_t count;    /* Count of units */
+    uint32_t last_use; /* Value of use_clock on the last load */
+    uint16_t hits;     /* Loads since the allocation */
+    uint16_t reserved;
+};
+
+#define ERASED_WORDS ((FLASH_MAX_UNITS + 31) / 32)
+
+struct flash_entries {
+    uint32_t num_entries;
+    uint32_t use_clock; /* Incremented on every load */
+    uint32_t erased[ERASED_WORDS]; /* Units erased ahead by flash_alloc_pre_erase() */
+    struct flash_entry entry[FLASH_MAX_ENTRIES]; /* Sorted by unit */
+};
+
+// Each journal sector starts with the header followed by the records:
+//   RECORD_ALLOC  - the entry, the entries it overlaps are dropped
+//   RECORD_FREE   - drops the entry starting at unit
+//   RECORD_ERASED - sets the word number unit of the erased bitmap to tag
+// The snapshot holds the records of all the entries and may take several
+// sectors, it starts the chain of the sectors that are replayed on init.
+// The header of its first sector is written last. A new snapshot is
+// written to the free sectors after the chain, the old chain stays valid
+// until then and its sectors are erased only when the ring reaches them.
+enum {
+    RECORD_ALLOC = 1,
+    RECORD_FREE,
+    RECORD_ERASED,
+};
+
+struct journal_header {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t snapshot;
+    uint8_t reserved;
+    uint32_t seq;
+    uint32_t check;
+};
+
+struct journal_record {
+    uint32_t tag;
+    uint32_t last_use;
+    uint16_t unit;
+    uint16_t count;
+    uint16_t hits;
+    uint8_t type;
+    uint8_t check;
+};
+
+#define JOURNAL_SLOTS (ALIGN_BOUNDARY / sizeof(struct journal_record))
+#define JOURNAL_PENDING 32
+
+static_assert(sizeof(struct journal_header) == sizeof(struct journal_record),
+              "Journal header must take a single record slot");
+// The chain is compacted before the free sectors get fewer than this
+#define SNAPSHOT_MAX_SECTORS ((FLASH_MAX_ENTRIES + ERASED_WORDS) / (JOURNAL_SLOTS - 1) + 1)
+
+static_assert(SNAPSHOT_MAX_SECTORS < JOURNAL_SECTORS / 2, "Snapshot must fit the journal ring");
+
+// Eviction policy picks the unit to place the allocation of count units
+// aligned to align, the entries overlapping it are evicted
+struct flash_evict_policy {
+    const char *name;
+    void (*select)(uint32_t count, uint32_t align, uint32_t *unit);
+};
+
+static struct flash_entries ram_entries[1];
+
+static struct {
+    uint32_t sector; /* Sector of the last record */
+    uint32_t slot;   /* Next free slot in it */
+    uint32_t seq;
+    uint32_t snapshot_sector;
+    bool broken;   /* Replay stopped at the broken record or the interrupted compaction */
+    bool overflow; /* Too many pending records, compact instead */
+    uint32_t num_pending;
+    struct journal_record pending[JOURNAL_PENDING];
+} journal;
+
+// The entry is reserved with TAG_PENDING on begin and gets the real tag
+// only after the last byte is copied, so the partially copied data is
+// never reported as loaded
+static struct {
+    bool active;
+    uint64_t lba;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t tag;
+    uint16_t unit;
+    uint16_t count;
+} bg_copy;
+
+// Entry written by the caller with flash_alloc_stream_write(), it is
+// pending until flash_alloc_stream_end()
+static struct {
+    bool active;
+    uint32_t tag;
+    uint16_t unit;
+    uint16_t count;
+    uint32_t erased; /* Bytes of the entry erased */
+    uint32_t blank[ERASED_WORDS];
+} stream;
+
+static inline uint32_t get_journal_off(uint32_t sector)
+{
+    return __SPI_FLASH_SIZE__ - JOURNAL_SIZE + sector * ALIGN_BOUNDARY;
+}
+
+static inline const void *get_journal_slot(uint32_t sector, uint32_t slot)
+{
+    return (const uint8_t *)(__SPI_FLASH_BASE__ + get_journal_off(sector)) +
+           slot * sizeof(struct journal_record);
+}
+
+static uint8_t record_check(const struct journal_record *record)
+{
+    // 0xFF is left for the erased slot
+    const uint8_t check = crc32_le(0, (const uint8_t *)record, offsetof(struct journal_record, check));
+    return check == 0xFF ? 0 : check;
+}
+
+static uint32_t header_check(const struct journal_header *header)
+{
+    return crc32_le(0, (const uint8_t *)header, offsetof(struct journal_header, check));
+}
+
+static bool slot_is_erased(uint32_t sector, uint32_t slot)
+{
+    const uint32_t *data = get_journal_slot(sector, slot);
+
+    for (uint32_t i = 0; i < sizeof(struct journal_record) / sizeof(*data); i++) {
+        if (data[i] != 0xFFFFFFFF)
+            return false;
+    }
+
+    return true;
+}
+
+static const struct journal_header *get_journal_header(uint32_t sector)
+{
+    const struct journal_header *header = get_journal_slot(sector, 0);
+
+    if (header->magic != FLASH_MAGIC || header->version != FLASH_VERSION ||
+        header->check != header_check(header))
+        return NULL;
+
+    return header;
+}
+
+// FlashCtx.Write() expects the page aligned address, the records and the
+// streams are not
+static void flash_program(uint32_t address, const void *data, uint32_t size)
+{
+    const uint8_t *buffer = data;
+
+    while (size) {
+        const uint32_t len = FlashCtx.ProgramAsync(address, buffer, size);
+
+        while (FlashCtx.IsBusy())
+            ;
+        address += len;
+        buffer += len;
+        size -= len;
+    }
+}
+
+static void ram_alloc_init(void)
+{
+    memset(ram_entries, 0, sizeof(*ram_entries));
+}
+
+static inline bool is_unit_erased(const uint32_t *erased, uint32_t unit)
+{
+    return erased[unit / 32] & (1UL << (unit % 32));
+}
+
+static uint32_t align_of(uint32_t count)
+{
+    uint32_t align = 1;
+
+    while (align < count)
+        align <<= 1;
+
+    return align;
+}
+
+// Index of the first entry ending after the unit
+static uint32_t lower_bound(const struct flash_entries *fe, uint32_t unit)
+{
+    uint32_t lo = 0, hi = fe->num_entries;
+
+    while (lo < hi) {
+        const uint32_t mid = (lo + hi) / 2;
+
+        if (fe->entry[mid].unit + fe->entry[mid].count <= unit)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// Replaces the entries overlapping the new one, returns NULL if the table
+// is full
+static struct flash_entry *insert_entry(struct flash_entries *fe, const struct flash_entry *entry)
+{
+    const uint32_t first = lower_bound(fe, entry->unit);
+    uint32_t last = first;
+
+    while (last < fe->num_entries && fe->entry[last].unit < entry->unit + entry->count)
+        last++;
+
+    if (first == last && fe->num_entries == FLASH_MAX_ENTRIES)
+        return NULL;
+
+    memmove(&fe->entry[first + 1], &fe->entry[last],
+            (fe->num_entries - last) * sizeof(fe->entry[0]));
+    fe->num_entries -= last - first - 1;
+    fe->entry[first] = *entry;
+    return &fe->entry[first];
+}
+
+static void remove_entry(struct flash_entries *fe, uint32_t index)
+{
+    memmove(&fe->entry[index], &fe->entry[index + 1],
+            (fe->num_entries - index - 1) * sizeof(fe->entry[0]));
+    fe->num_entries--;
+}
+
+static bool apply_record(struct flash_entries *fe, const struct journal_record *record)
+{
+    if ((int32_t)(record->last_use - fe->use_clock) > 0)
+        fe->use_clock = record->last_use;
+
+    switch (record->type) {
+    case RECORD_ALLOC: {
+        const struct flash_entry entry = {
+            .tag = record->tag,
+            .unit = record->unit,
+            .count = record->count,
+            .last_use = record->last_use,
+            .hits = record->hits,
+        };
+
+        if (!record->count || record->unit + record->count > TOTAL_UNITS)
+            return false;
+        return insert_entry(fe, &entry) != NULL;
+    }
+    case RECORD_FREE: {
+        const uint32_t index = lower_bound(fe, record->unit);
+
+        if (index < fe->num_entries && fe->entry[index].unit == record->unit)
+            remove_entry(fe, index);
+        return true;
+    }
+    case RECORD_ERASED:
+        if (record->unit >= ERASED_WORDS)
+            return false;
+        fe->erased[record->unit] = record->tag;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Returns false if the sector has a broken record, the records after it
+// are not applied
+static bool replay_sector(struct flash_entries *fe, uint32_t sector)
+{
+    for (uint32_t slot = 1; slot < JOURNAL_SLOTS; slot++) {
+        const struct journal_record *record = get_journal_slot(sector, slot);
+
+        if (slot_is_erased(sector, slot))
+            break;
+
+        journal.slot = slot + 1;
+        if (record->check != record_check(record) || !apply_record(fe, record)) {
+            printf("Flash journal: broken record %lu in sector %lu\n", slot, sector);
+            journal.broken = true;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool journal_replay(void)
+{
+    const struct journal_header *snapshot = NULL;
+
+    journal.seq = 0;
+    for (uint32_t i = 0; i < JOURNAL_SECTORS; i++) {
+        const struct journal_header *header = get_journal_header(i);
+
+        if (!header)
+            continue;
+
+        if ((int32_t)(header->seq - journal.seq) > 0)
+            journal.seq = header->seq;
+        if (header->snapshot && (!snapshot || (int32_t)(header->seq - snapshot->seq) > 0)) {
+            snapshot = header;
+            journal.snapshot_sector = i;
+        }
+    }
+
+    if (!snapshot)
+        return false;
+
+    // The chain continues in the following sectors with the increasing seq
+    ram_alloc_init();
+    for (uint32_t i = 0; i < JOURNAL_SECTORS; i++) {
+        const uint32_t sector = (journal.snapshot_sector + i) % JOURNAL_SECTORS;
+        const struct journal_header *header = get_journal_header(sector);
+
+        if (!header || header->seq != snapshot->seq + i || (i && header->snapshot))
+            break;
+
+        journal.sector = sector;
+        journal.slot = 1;
+        if (!replay_sector(ram_entries, sector))
+            break;
+    }
+
+    // The newer headers past the chain are left by an interrupted
+    // compaction, the next sector must not continue their seq
+    if (get_journal_header(journal.sector)->seq != journal.seq) {
+        printf("Flash journal: interrupted compaction\n");
+        journal.broken = true;
+    }
+
+    // The entries must be sorted and must not overlap
+    uint32_t unit = 0;
+    for (uint32_t i = 0; i < ram_entries->num_entries; i++) {
+        if (ram_entries->entry[i].unit < unit)
+            return false;
+        unit = ram_entries->entry[i].unit + ram_entries->entry[i].count;
+    }
+
+    return unit <= TOTAL_UNITS;
+}
+
+static void make_record(struct journal_record *record, const struct flash_entry *entry)
+{
+    record->type = RECORD_ALLOC;
+    record->tag = entry->tag;
+    record->last_use = entry->last_use;
+    record->unit = entry->unit;
+    record->count = entry->count;
+    record->hits = entry->hits;
+    record->check = record_check(record);
+}
+
+static void make_erased_record(struct journal_record *record, uint32_t word)
+{
+    memset(record, 0, sizeof(*record));
+    record->type = RECORD_ERASED;
+    record->tag = ram_entries->erased[word];
+    record->unit = word;
+    record->check = record_check(record);
+}
+
+static void journal_log(const struct journal_record *record)
+{
+    if (journal.num_pending == JOURNAL_PENDING) {
+        journal.overflow = true;
+        return;
+    }
+
+    journal.pending[journal.num_pending++] = *record;
+}
+
+static void log_entry(const struct flash_entry *entry)
+{
+    struct journal_record record;
+
+    make_record(&record, entry);
+    journal_log(&record);
+}
+
+static void log_free(const struct flash_entry *entry)
+{
+    struct journal_record record = {
+        .type = RECORD_FREE,
+        .unit = entry->unit,
+        .last_use = ram_entries->use_clock,
+    };
+
+    record.check = record_check(&record);
+    journal_log(&record);
+}
+
+static void log_erased(uint32_t word)
+{
+    struct journal_record record;
+
+    make_erased_record(&record, word);
+    journal_log(&record);
+}
+
+static void write_header(uint32_t sector, uint32_t seq, bool snapshot)
+{
+    struct journal_header header = {
+        .magic = FLASH_MAGIC,
+        .version = FLASH_VERSION,
+        .snapshot = snapshot,
+        .seq = seq,
+    };
+
+    header.check = header_check(&header);
+    flash_program(get_journal_off(sector), &header, sizeof(header));
+}
+
+// Sectors after the last one of the chain up to its snapshot
+static uint32_t journal_free_sectors(void)
+{
+    return (journal.snapshot_sector + JOURNAL_SECTORS - journal.sector - 1) % JOURNAL_SECTORS;
+}
+
+// Writes the records of all the entries to the free sectors following the
+// chain, the old chain is dropped once the new snapshot header is written
+static void journal_compact(void)
+{
+    struct journal_record records[16];
+    uint32_t num_words = 0;
+
+    for (uint32_t i = 0; i < ERASED_WORDS; i++)
+        num_words += ram_entries->erased[i] != 0;
+
+    const uint32_t total = ram_entries->num_entries + num_words;
+    const uint32_t num_sectors = total / (JOURNAL_SLOTS - 1) + 1;
+    const uint32_t first_sector = (journal.sector + 1) % JOURNAL_SECTORS;
+    uint32_t entry = 0, word = 0, count = 0;
+
+    for (uint32_t i = 0; i < num_sectors; i++)
+        FlashCtx.Erase(get_journal_off((first_sector + i) % JOURNAL_SECTORS), ALIGN_BOUNDARY);
+
+    for (uint32_t r = 0; r < total; r++) {
+        if (entry < ram_entries->num_entries) {
+            make_record(&records[count++], &ram_entries->entry[entry++]);
+        } else {
+            while (!ram_entries->erased[word])
+                word++;
+            make_erased_record(&records[count++], word++);
+        }
+
+        // Flush at the end of the buffer, the sector and the records
+        const uint32_t slot = r % (JOURNAL_SLOTS - 1) + 1;
+        if (count == sizeof(records) / sizeof(records[0]) || slot == JOURNAL_SLOTS - 1 || r + 1 == total) {
+            const uint32_t sector = (first_sector + r / (JOURNAL_SLOTS - 1)) % JOURNAL_SECTORS;
+
+            flash_program(get_journal_off(sector) + (slot + 1 - count) * sizeof(records[0]),
+                          records, count * sizeof(records[0]));
+            count = 0;
+        }
+    }
+
+    const uint32_t seq = journal.seq + 1;
+    for (uint32_t i = 1; i < num_sectors; i++)
+        write_header((first_sector + i) % JOURNAL_SECTORS, seq + i, false);
+    write_header(first_sector, seq, true);
+
+    journal.seq = seq + num_sectors - 1;
+    journal.sector = (first_sector + num_sectors - 1) % JOURNAL_SECTORS;
+    journal.snapshot_sector = first_sector;
+    journal.slot = 1 + total - (num_sectors - 1) * (JOURNAL_SLOTS - 1);
+    journal.num_pending = 0;
+    journal.overflow = false;
+}
+
+static void flash_alloc_init(void)
+{
+    static bool flash_alloc_initialized = false;
+    if (flash_alloc_initialized)
+        return;
+
+    if (!FlashCtx.Presented) {
+        printf("Unable to load data, no flash installed\n");
+        abort();
+    }
+
+    flash_alloc_initialized = true;
+    const bool valid = journal_replay();
+    if (valid && !journal.broken)
+        return;
+
+    // Don't append after the broken record, start a new chain instead
+    if (valid) {
+        printf("Flash journal: compacting the broken chain\n");
+    } else {
+        printf("Flash allocator is not initialized, initializing\n");
+        ram_alloc_init();
+    }
+    wdog_refresh();
+    FlashCtx.DisableMemoryMappedMode();
+    journal_compact();
+    FlashCtx.EnableMemoryMappedMode();
+}
+
+// Appends the logged records to the journal, usually as a single page
+// program. The sector is erased only when the journal moves to the next
+// one, the ring is compacted while it still has the free sectors for the
+// new snapshot.
+static void store_flash_entries(void)
+{
+    const uint32_t count = journal.num_pending;
+
+    if (count == 0 && !journal.overflow)
+        return;
+
+    wdog_refresh();
+    FlashCtx.DisableMemoryMappedMode();
+    if (journal.overflow) {
+        journal_compact();
+    } else if (journal.slot + count <= JOURNAL_SLOTS) {
+        flash_program(get_journal_off(journal.sector) + journal.slot * sizeof(journal.pending[0]),
+                      journal.pending, count * sizeof(journal.pending[0]));
+        journal.slot += count;
+    } else {
+        const uint32_t sector = (journal.sector + 1) % JOURNAL_SECTORS;
+
+        // Leave the room for the largest snapshot
+        if (journal_free_sectors() <= SNAPSHOT_MAX_SECTORS) {
+            journal_compact();
+        } else {
+            FlashCtx.Erase(get_journal_off(sector), ALIGN_BOUNDARY);
+            write_header(sector, ++journal.seq, false);
+            flash_program(get_journal_off(sector) + sizeof(journal.pending[0]), journal.pending,
+                          count * sizeof(journal.pending[0]));
+            journal.sector = sector;
+            journal.slot = 1 + count;
+        }
+    }
+    FlashCtx.EnableMemoryMappedMode();
+
+    journal.num_pending = 0;
+}
+
+static struct flash_entry *is_loaded(uint32_t units, uint32_t tag)
+{
+    for (uint32_t i = 0; i < ram_entries->num_entries; i++) {
+        struct flash_entry *entry = &ram_entries->entry[i];
+
+        if (entry->tag == tag && entry->count == units) {
+            entry->last_use = ++ram_entries->use_clock;
+            if (entry->hits < UINT16_MAX)
+                entry->hits++;
+            log_entry(entry);
+            store_flash_entries();
+            printf("Flash cache: tag=%08lx units=%lu hit\n", tag, units);
+            return entry;
+        }
+    }
+
+    // The hit/miss lines can be replayed by tools/flash_cache_sim.py
+    printf("Flash cache: tag=%08lx units=%lu miss\n", tag, units);
+    return NULL;
+}
+
+static bool overlaps_bg_copy(uint32_t unit, uint32_t count)
+{
+    return (bg_copy.active && unit < bg_copy.unit + bg_copy.count &&
+            bg_copy.unit < unit + count) ||
+           (stream.active && unit < stream.unit + stream.count && stream.unit < unit + count);
+}
+
+// Best fit: the aligned place in the smallest gap between the entries
+static bool find_free(uint32_t count, uint32_t *unit)
+{
+    const struct flash_entries *fe = ram_entries;
+    const uint32_t align = align_of(count);
+    uint32_t best_gap = UINT32_MAX;
+    uint32_t start = 0;
+
+    for (uint32_t i = 0; i <= fe->num_entries; i++) {
+        const uint32_t end = i < fe->num_entries ? fe->entry[i].unit : TOTAL_UNITS;
+        const uint32_t pos = (start + align - 1) & ~(align - 1);
+
+        if (pos + count <= end && end - start < best_gap) {
+            best_gap = end - start;
+            *unit = pos;
+        }
+
+        if (i < fe->num_entries)
+            start = fe->entry[i].unit + fe->entry[i].count;
+    }
+
+    return best_gap != UINT32_MAX;
+}
+
+static uint32_t round_robin_unit;
+
+static void select_round_robin(uint32_t count, uint32_t align, uint32_t *unit)
+{
+    uint32_t pos = (round_robin_unit + align - 1) & ~(align - 1);
+
+    for (uint32_t i = 0; i <= TOTAL_UNITS / align; i++) {
+        // If there is not enough space till end to free, start from the beginning
+        if (pos + count > TOTAL_UNITS)
+            pos = 0;
+        if (!overlaps_bg_copy(pos, count))
+            break;
+        pos += align;
+    }
+
+    round_robin_unit = pos + count;
+    *unit = pos;
+}
+
+// Cost of losing a unit of the entry: reload time weighted by the chance
+// it is loaded again, which grows with the hits and drops with the age
+static uint64_t unit_cost(const struct flash_entries *fe, const struct flash_entry *entry)
+{
+    if (entry->tag == TAG_PENDING)
+        return 0;
+
+    const uint64_t age = fe->use_clock - entry->last_use;
+    return ((uint64_t)(entry->hits + 1) << 16) / (age + 1);
+}
+
+static uint64_t entry_cost(const struct flash_entries *fe, const struct flash_entry *entry)
+{
+    return unit_cost(fe, entry) * entry->count;
+}
+
+// Offsets of the chunks of the entry overlapped by the range
+static void overlapped_chunks(const struct flash_entry *entry, uint32_t unit, uint32_t count,
+                              uint32_t *first, uint32_t *last)
+{
+    *first = unit > entry->unit ? (unit - entry->unit) / CHUNK_UNITS * CHUNK_UNITS : 0;
+    *last = unit + count > entry->unit ?
+            (unit + count - entry->unit + CHUNK_UNITS - 1) / CHUNK_UNITS * CHUNK_UNITS : 0;
+    if (*last > entry->count)
+        *last = entry->count;
+}
+
+static void select_cost(uint32_t count, uint32_t align, uint32_t *unit)
+{
+    const struct flash_entries *fe = ram_entries;
+    uint64_t best_cost = UINT64_MAX;
+    uint32_t first = 0;
+
+    // Every aligned place, the cost is the sum of the overlapped chunks
+    for (uint32_t pos = 0; pos + count <= TOTAL_UNITS; pos += align) {
+        uint64_t cost = 0;
+
+        // Never free the entry being filled by the background copy
+        if (overlaps_bg_copy(pos, count))
+            continue;
+
+        while (first < fe->num_entries && fe->entry[first].unit + fe->entry[first].count <= pos)
+            first++;
+
+        for (uint32_t i = first; i < fe->num_entries && fe->entry[i].unit < pos + count; i++) {
+            uint32_t lost_first, lost_last;
+
+            overlapped_chunks(&fe->entry[i], pos, count, &lost_first, &lost_last);
+            cost += unit_cost(fe, &fe->entry[i]) * (lost_last - lost_first);
+        }
+
+        if (cost < best_cost) {
+            best_cost = cost;
+            *unit = pos;
+        }
+    }
+
+    assert(best_cost != UINT64_MAX && "No place to free");
+}
+
+static const struct flash_evict_policy evict_round_robin = {
+    .name = "round-robin",
+    .select = select_round_robin,
+};
+
+static const struct flash_evict_policy evict_cost = {
+    .name = "cost",
+    .select = select_cost,
+};
+
+#if FLASH_EVICT_ROUND_ROBIN != 0
+static const struct flash_evict_policy *evict_policy = &evict_round_robin;
+#else
+static const struct flash_evict_policy *evict_policy = &evict_cost;
+#endif
+
+// Frees the range, the chunks of the entries outside of it are kept as
+// the separate entries. Returns the number of the entries it touched.
+static uint32_t evict_range(uint32_t unit, uint32_t count)
+{
+    struct flash_entries *fe = ram_entries;
+    const uint32_t first = lower_bound(fe, unit);
+    struct flash_entry pieces[2];
+    uint32_t evicted = 0, num_pieces = 0;
+
+    while (first < fe->num_entries && fe->entry[first].unit < unit + count) {
+        const struct flash_entry entry = fe->entry[first];
+        uint32_t lost_first, lost_last;
+
+        log_free(&entry);
+        remove_entry(fe, first);
+        evicted++;
+
+        // Only the first and the last entries can be partially overlapped
+        overlapped_chunks(&entry, unit, count, &lost_first, &lost_last);
+        if (entry.tag == TAG_PENDING)
+            continue;
+
+        if (lost_first) {
+            pieces[num_pieces] = entry;
+            pieces[num_pieces++].count = lost_first;
+        }
+        if (lost_last < entry.count) {
+            pieces[num_pieces] = entry;
+            pieces[num_pieces].unit = entry.unit + lost_last;
+            pieces[num_pieces].count = entry.count - lost_last;
+            pieces[num_pieces++].tag = entry.tag + lost_last / CHUNK_UNITS * CHUNK_TAG_STEP;
+        }
+    }
+
+    for (uint32_t i = 0; i < num_pieces && fe->num_entries < FLASH_MAX_ENTRIES; i++)
+        log_entry(insert_entry(fe, &pieces[i]));
+
+    return evicted;
+}
+
+// Units of the data left by the partial evictions, the resident bitmap
+// marks them and base is the place of the data. The pieces placed
+// elsewhere are ignored.
+static uint32_t find_pieces(uint32_t units, uint32_t tag, uint32_t *base,
+                            uint32_t resident[ERASED_WORDS])
+{
+    const struct flash_entries *fe = ram_entries;
+    const uint32_t num_chunks = (units + CHUNK_UNITS - 1) / CHUNK_UNITS;
+    uint32_t found = 0;
+
+    memset(resident, 0, ERASED_WORDS * sizeof(*resident));
+    for (uint32_t i = 0; i < fe->num_entries; i++) {
+        const struct flash_entry *entry = &fe->entry[i];
+        const uint32_t chunk = (entry->tag - tag) * CHUNK_TAG_INVERSE;
+
+        if (entry->tag == TAG_PENDING || chunk >= num_chunks || entry->unit < chunk * CHUNK_UNITS)
+            continue;
+
+        const uint32_t start = entry->unit - chunk * CHUNK_UNITS;
+        if (entry->unit + entry->count > start + units || (found && start != *base))
+            continue;
+
+        *base = start;
+        found += entry->count;
+        for (uint32_t u = entry->unit; u < entry->unit + entry->count; u++)
+            resident[u / 32] |= 1UL << (u % 32);
+    }
+
+    return found;
+}
+
+// Makes the room in the full entries table by freeing the cheapest entry
+static void evict_cheapest_entry(void)
+{
+    struct flash_entries *fe = ram_entries;
+    uint64_t best_cost = UINT64_MAX;
+    uint32_t best = 0;
+
+    for (uint32_t i = 0; i < fe->num_entries; i++) {
+        const uint64_t cost = entry_cost(fe, &fe->entry[i]);
+
+        if (cost < best_cost && !overlaps_bg_copy(fe->entry[i].unit, fe->entry[i].count)) {
+            best_cost = cost;
+            best = i;
+        }
+    }
+
+    log_free(&fe->entry[best]);
+    remove_entry(fe, best);
+}
+
+// Blank check of the pre-erased unit, the flash must be memory mapped
+static bool is_unit_blank(uint32_t unit)
+{
+    const uint32_t *data = (const uint32_t *)(__SPI_FLASH_BASE__ + unit * UNIT_SIZE);
+
+    for (uint32_t i = 0; i < UNIT_SIZE / sizeof(*data); i++) {
+        if (data[i] != 0xFFFFFFFF)
+            return false;
+    }
+
+    return true;
+}
+
+// Incremented on every allocation, the pre-erase restarts if it changes
+static uint32_t alloc_generation;
+
+// Allocates the units for the data, the pre-erased units of the
+// allocation that pass the blank check are returned in the blank bitmap.
+// If some chunks of the data survived the eviction they are reused and
+// returned in the resident bitmap, only the rest has to be copied. The
+// pieces are not looked for if resident is NULL.
+static struct flash_entry *allocate_flash(uint32_t units_needed, uint32_t tag, bool pending,
+                                          uint32_t blank[ERASED_WORDS],
+                                          uint32_t resident[ERASED_WORDS]) {
+    struct flash_entries *fe = ram_entries;
+    struct flash_entry *entry;
+    uint32_t unit;
+
+    if (units_needed > TOTAL_UNITS) {
+        printf("Flash is too small to load!\n");
+        abort();
+    }
+
+    if (fe->num_entries == FLASH_MAX_ENTRIES)
+        evict_cheapest_entry();
+
+    const uint32_t found = resident ? find_pieces(units_needed, tag, &unit, resident) : 0;
+    if (found && !overlaps_bg_copy(unit, units_needed)) {
+        printf("Flash cache: top-up of %lu/%lu units at unit %lu\n", units_needed - found,
+               units_needed, unit);
+        evict_range(unit, units_needed);
+    } else {
+        if (resident)
+            memset(resident, 0, ERASED_WORDS * sizeof(*resident));
+        if (!find_free(units_needed, &unit)) {
+            evict_policy->select(units_needed, align_of(units_needed), &unit);
+            printf("Flash cache: %s policy evicts %lu entries at unit %lu\n", evict_policy->name,
+                   evict_range(unit, units_needed), unit);
+        }
+    }
+
+    const struct flash_entry new_entry = {
+        .tag = pending ? TAG_PENDING : tag,
+        .unit = unit,
+        .count = units_needed,
+        .last_use = ++fe->use_clock,
+    };
+    entry = insert_entry(fe, &new_entry);
+    assert(entry && "Flash entries table is full");
+    log_entry(entry);
+
+    // The data is written to the units, so they are not erased anymore
+    memset(blank, 0, ERASED_WORDS * sizeof(*blank));
+    for (uint32_t u = unit; u < unit + units_needed; u++) {
+        if (!is_unit_erased(fe->erased, u))
+            continue;
+
+        fe->erased[u / 32] &= ~(1UL << (u % 32));
+        if (u % 32 == 31 || u + 1 == unit + units_needed || !is_unit_erased(fe->erased, u + 1))
+            log_erased(u / 32);
+        if (is_unit_blank(u))
+            blank[u / 32] |= 1UL << (u % 32);
+        else
+            printf("Flash cache: unit %lu failed the blank check\n", u);
+    }
+    alloc_generation++;
+
+    // Update flash with new entries
+    store_flash_entries();
+    return entry;
+}
+
+// Only the first run is used for the data part of the tag
+static uint32_t get_tag(const struct fs_extent *extent, uint32_t offset, uint32_t size,
+                        uint8_t *ram_buffer)
+{
+    const uint64_t lba = extent->lba;
+    const uint64_t extent_len = (uint64_t)extent->count * SD_SECTOR_SIZE - offset;
+    uint32_t len = size < BLOCK_LENGTH ? size : BLOCK_LENGTH;
+    if (len > extent_len)
+        len = extent_len;
+
+    uint32_t crc = crc32_le(0, (uint8_t *)&lba, sizeof(lba));
+    crc = crc32_le(crc, (uint8_t *)&offset, sizeof(offset));
+    crc = crc32_le(crc, (uint8_t *)&size, sizeof(size));
+    sd_read(lba, offset, ram_buffer, len);
+    crc = crc32_le(crc, ram_buffer, len);
+
+    // TAG_PENDING marks the entry being copied
+    if (crc == TAG_PENDING)
+        crc = 1;
+
+    return crc;
+}
 
-static_assert(STORE_BLOCK_SIZE >= ALIGN_BOUNDARY,
-              "Store block size is too small");
+void reset_flash_allocator(void)
+{
+    if (!FlashCtx.Presented)
+        return;
 
-struct flash_entry {
-    uint32_t tag;   /* Unique data tag */
-    uint16_t block; /* Allocation start block number */
-    uint16_t count; /* Count of blocks */
-};
+    flash_alloc_init();
+    ram_alloc_init();
+    wdog_refresh();
+    FlashCtx.DisableMemoryMappedMode();
+    journal_compact();
+    FlashCtx.EnableMemoryMappedMode();
+}
 
-struct flash_entries {
-    uint32_t magic;
-    uint16_t version;
-    uint16_t num_entries;
-    uint16_t next_free_index;
-    struct flash_entry entry[TOTAL_BLOCKS];
+// Double buffered copy: the next chunk is read from the SD card while the
+// flash programs or erases the previous one. The flash status is polled
+// only when there is nothing to read. The background copies never wait for
+// an erase: the step ends with the erase suspended, or on the chips that
+// can't suspend, the erases are left to flash_alloc_pre_erase().
+struct copy_engine {
+    uint32_t flash_addr;
+    uint32_t size;        /* Data bytes to copy */
+    uint32_t erase_size;  /* Bytes to erase from flash_addr */
+    uint32_t erase_chunk; /* Max bytes per erase command */
+    uint32_t erased;
+    uint32_t programmed;
+    uint32_t read;
+    uint32_t skipped;     /* Bytes already in flash */
+    uint32_t sd_ms;       /* Time spent reading the SD card */
+    uint32_t wait_ms;     /* Time spent waiting for the flash */
+    bool background;
+    bool blocked;         /* Waits for flash_alloc_pre_erase() */
+    struct flash_erase_stats erase_start;
+    void (*read_fn)(void *ctx, uint8_t *buffer, uint32_t offset, uint32_t len);
+    void *ctx;
+    uint32_t blank[ERASED_WORDS];    /* Units that don't need the erase */
+    uint32_t resident[ERASED_WORDS]; /* Units that hold the data already */
+    uint8_t buffer[2][BLOCK_LENGTH];
 };
 
-// Just a check to make sure the flash entries fits in 1KB,
-// adjust TOTAL_BLOCKS if new fields in struct flash_entries are added
-static_assert(sizeof(struct flash_entries) <= 1024,
-              "Flash entries size should be <= 1024");
-
-static struct flash_entries ram_entries[1];
+static void engine_begin(struct copy_engine *e, uint32_t flash_addr, uint32_t size,
+                         uint32_t max_size, uint32_t erase_chunk, bool background,
+                         void (*read_fn)(void *, uint8_t *, uint32_t, uint32_t), void *ctx)
+{
+    const uint32_t erase_unit = FlashCtx.GetSmallestEraseSize() ? FlashCtx.GetSmallestEraseSize() : 1;
 
-// Store the flash entries at the end of the flash memory
+    e->flash_addr = flash_addr;
+    e->size = size;
+    // Erase whole erase units, but never beyond the allocation
+    e->erase_size = (size + erase_unit - 1) / erase_unit * erase_unit;
+    if (e->erase_size > max_size)
+        e->erase_size = max_size;
+    e->erase_chunk = erase_chunk;
+    e->erased = 0;
+    e->programmed = 0;
+    e->read = 0;
+    e->skipped = 0;
+    e->sd_ms = 0;
+    e->wait_ms = 0;
+    e->background = background;
+    e->blocked = false;
+    flash_get_erase_stats(&e->erase_start);
+    e->read_fn = read_fn;
+    e->ctx = ctx;
+}
 
-static inline uint32_t get_flash_entries_off(void)
+static inline bool engine_is_resident(const struct copy_engine *e, uint32_t offset)
 {
-    return __SPI_FLASH_SIZE__ - ALIGN_BOUNDARY;
+    return is_unit_erased(e->resident, (e->flash_addr + offset) / UNIT_SIZE);
 }
 
-static inline const struct flash_entries *get_flash_entries(void)
+// Offset of the next unit, but not beyond the data
+static inline uint32_t engine_unit_end(const struct copy_engine *e, uint32_t offset)
 {
-    return (struct flash_entries *)(get_flash_entries_off() +
-                                    __SPI_FLASH_BASE__);
+    const uint32_t end = ((e->flash_addr + offset) / UNIT_SIZE + 1) * UNIT_SIZE - e->flash_addr;
+
+    return end < e->size ? end : e->size;
 }
 
-static void ram_alloc_init(void)
+// Issues the next flash command if the flash is idle, returns false if
+// there is nothing to do or the flash is busy
+static bool engine_flash_op(struct copy_engine *e)
 {
-    ram_entries->magic = FLASH_MAGIC;
-    ram_entries->version = FLASH_VERSION;
-    ram_entries->num_entries = 1;
-    ram_entries->next_free_index = 0;
+    if (FlashCtx.IsBusy())
+        return false;
+
+    if (e->programmed < e->size && engine_is_resident(e, e->programmed)) {
+        e->programmed = engine_unit_end(e, e->programmed);
+        return engine_flash_op(e);
+    }
+
+    // Programming goes first as it frees the buffers
+    if (e->programmed < e->read && e->programmed < e->erased) {
+        const uint32_t offset = e->programmed % BLOCK_LENGTH;
+        const uint8_t *data = e->buffer[(e->programmed / BLOCK_LENGTH) % 2] + offset;
+        uint32_t len = BLOCK_LENGTH - offset;
+
+        if (len > e->read - e->programmed)
+            len = e->read - e->programmed;
+        if (len > e->erased - e->programmed)
+            len = e->erased - e->programmed;
+
+        e->programmed += FlashCtx.ProgramAsync(e->flash_addr + e->programmed, data, len);
+        return true;
+    }
+
+    if (e->erased < e->erase_size) {
+        const uint32_t addr = e->flash_addr + e->erased;
+        uint32_t end = (addr / UNIT_SIZE + 1) * UNIT_SIZE - e->flash_addr;
+
+        // Skip the pre-erased unit and the unit with the data
+        if (is_unit_erased(e->blank, addr / UNIT_SIZE) || is_unit_erased(e->resident, addr / UNIT_SIZE)) {
+            e->erased = end < e->erase_size ? end : e->erase_size;
+            return engine_flash_op(e);
+        }
+
+        if (e->background && !FlashCtx.SuspendErase) {
+            // Waits for the pre-erase once the erased part is programmed
+            e->blocked = e->programmed >= e->erased;
+            return false;
+        }
+
+        // Erase the run of the units that are not blank at once
+        while (end < e->erase_size && !is_unit_erased(e->blank, (e->flash_addr + end) / UNIT_SIZE) &&
+               !is_unit_erased(e->resident, (e->flash_addr + end) / UNIT_SIZE))
+            end += UNIT_SIZE;
 
-    ram_entries->entry[0].block = 0;
-    ram_entries->entry[0].count = TOTAL_BLOCKS;
-    ram_entries->entry[0].tag = 0;
+        uint32_t len = (end < e->erase_size ? end : e->erase_size) - e->erased;
+        if (len > e->erase_chunk)
+            len = e->erase_chunk;
+        e->erased += FlashCtx.EraseAsync(addr, len);
+        return true;
+    }
+
+    return false;
 }
 
-static void flash_alloc_init(void)
+// Copies up to max_bytes more, returns true once all the data is in flash.
+// Must be called with the memory mapped mode disabled.
+static bool engine_run(struct copy_engine *e, uint32_t max_bytes)
 {
-    static bool flash_alloc_initialized = false;
-    if (flash_alloc_initialized)
-        return;
+    const uint32_t step_tick = HAL_GetTick();
 
-    if (!FlashCtx.Presented) {
-        printf("Unable to load data, no flash installed\n");
-        abort();
+    if (FlashCtx.ResumeErase)
+        FlashCtx.ResumeErase();
+
+    e->blocked = false;
+    while (e->programmed < e->size) {
+        engine_flash_op(e);
+        if (e->blocked)
+            break;
+
+        if (e->read < e->size && engine_is_resident(e, e->read)) {
+            const uint32_t end = engine_unit_end(e, e->read);
+
+            e->skipped += end - e->read;
+            e->read = end;
+            continue;
+        }
+
+        // The buffer of the chunk is free once the chunk before the
+        // previous one is programmed
+        if (e->read < e->size && e->read <= e->programmed + BLOCK_LENGTH && max_bytes) {
+            const uint32_t start_tick = HAL_GetTick();
+            const uint32_t left = e->size - e->read;
+            const uint32_t len = left < BLOCK_LENGTH ? left : BLOCK_LENGTH;
+
+            e->read_fn(e->ctx, e->buffer[(e->read / BLOCK_LENGTH) % 2], e->read, len);
+            e->read += len;
+            e->sd_ms += HAL_GetTick() - start_tick;
+            max_bytes = max_bytes > len ? max_bytes - len : 0;
+            continue;
+        }
+
+        if (!max_bytes && e->programmed == e->read)
+            break;
+
+        // Nothing to read, the background step polls the flash for a
+        // short while only
+        if (e->background) {
+            if (HAL_GetTick() - step_tick >= COPY_STEP_MS)
+                break;
+            continue;
+        }
+
+        const uint32_t start_tick = HAL_GetTick();
+        while (FlashCtx.IsBusy())
+            ;
+        e->wait_ms += HAL_GetTick() - start_tick;
     }
 
-    const struct flash_entries *flash = get_flash_entries();
-    if (flash->magic == FLASH_MAGIC && flash->version == FLASH_VERSION) {
-        memcpy(ram_entries, flash, sizeof(*ram_entries));
-        flash_alloc_initialized = true;
-        return;
+    // Memory mapped reads are not possible while the flash is busy. The
+    // erase is suspended until the next step, a page program is short.
+    if (!(e->background && FlashCtx.SuspendErase && FlashCtx.SuspendErase())) {
+        while (FlashCtx.IsBusy())
+            ;
     }
 
-    printf("Flash allocator is not initialized, initializing\n");
-    ram_alloc_init();
-    flash_alloc_initialized = true;
+    return e->programmed == e->size;
 }
 
-static void store_flash_entries(void)
+static void print_engine_stats(const struct copy_engine *e, uint32_t start_tick)
 {
-    wdog_refresh();
-    FlashCtx.DisableMemoryMappedMode();
-    FlashCtx.Erase(get_flash_entries_off(), ALIGN_BOUNDARY);
-    FlashCtx.Write(get_flash_entries_off(), ram_entries, sizeof(*ram_entries));
-    FlashCtx.EnableMemoryMappedMode();
+    struct flash_erase_stats erase;
+
+    flash_get_erase_stats(&erase);
+    print_copy_stats(e->size - e->skipped, start_tick);
+    printf("SD read %lu ms, flash wait %lu ms\n", e->sd_ms, e->wait_ms);
+    printf("Erase: %lu+%lu+%lu+%lu commands, %lu KB blank\n",
+           erase.ops[0] - e->erase_start.ops[0], erase.ops[1] - e->erase_start.ops[1],
+           erase.ops[2] - e->erase_start.ops[2], erase.ops[3] - e->erase_start.ops[3],
+           (erase.blank_bytes - e->erase_start.blank_bytes) / 1024);
 }
 
-static struct flash_entry *is_loaded(uint32_t blocks, uint32_t tag)
+// Restarts the stream at the data offset, skipping the resident chunks
+static void reader_seek(struct sd_reader *reader, uint32_t pos)
 {
-    for (uint32_t i = 0; i < ram_entries->num_entries; i++) {
-        if (ram_entries->entry[i].tag == tag &&
-            ram_entries->entry[i].count == blocks)
-            return &ram_entries->entry[i];
+    uint64_t offset = (uint64_t)reader->start + pos;
+    uint32_t index = 0;
+
+    sd_read_stream_end();
+    while (offset >= (uint64_t)reader->extents[index].count * SD_SECTOR_SIZE) {
+        offset -= (uint64_t)reader->extents[index].count * SD_SECTOR_SIZE;
+        index++;
+        assert(index < reader->num_extents && "Seek beyond the last extent");
     }
 
-    return NULL;
+    reader->index = index;
+    reader->left = (uint64_t)reader->extents[index].count * SD_SECTOR_SIZE - offset;
+    reader->pos = pos;
+    sd_read_stream_begin(reader->extents[index].lba + offset / SD_SECTOR_SIZE,
+                         offset % SD_SECTOR_SIZE);
 }
 
-static uint32_t free_flash_round_robin(uint32_t blocks_to_free) {
-    struct flash_entries *fe = ram_entries;
-    uint16_t index_to_free = fe->next_free_index % fe->num_entries;
+static void reader_fn(void *ctx, uint8_t *buffer, uint32_t offset, uint32_t len)
+{
+    struct sd_reader *reader = ctx;
 
-    // If there is not enough space till end to free, reset the free index
-    if (fe->entry[index_to_free].block + blocks_to_free > TOTAL_BLOCKS)
-        fe->next_free_index = 0;
+    if (offset != reader->pos)
+        reader_seek(reader, offset);
+    reader_read(reader, buffer, len);
+}
 
-    while (fe->num_entries > 0) {
-        index_to_free = fe->next_free_index % fe->num_entries;
-        fe->next_free_index = index_to_free + 1;
+static struct copy_engine copy_engine;
 
-        // Mark the entry as free
-        fe->entry[index_to_free].tag = 0;
+static uint32_t copy_to_flash(const struct fs_extent *extents, uint32_t num_extents,
+                              uint32_t offset, uint32_t size)
+{
+    struct flash_entry *entry;
+    struct sd_reader reader;
+    uint8_t ram_buffer[BLOCK_LENGTH];
 
-        // Combine with previous free block if possible
-        // by moving the index to the left and further combining
-        // with next (current) free block
-        if (index_to_free > 0 && fe->entry[index_to_free - 1].tag == 0) {
-            --index_to_free;
-            --fe->next_free_index;
-        }
+    flash_alloc_init();
 
-        // Combine with next free block if possible
-        if (index_to_free + 1 < fe->num_entries && fe->entry[index_to_free + 1].tag == 0) {
-            fe->entry[index_to_free].count += fe->entry[index_to_free + 1].count;
-            for (uint32_t j = index_to_free + 1; j < fe->num_entries - 1; j++)
-                fe->entry[j] = fe->entry[j + 1];
+    // Round up to the nearest unit size
+    const uint32_t units_needed = (size + UNIT_SIZE - 1) / UNIT_SIZE;
+    const uint32_t tag = get_tag(&extents[0], offset, size, ram_buffer);
+    entry = is_loaded(units_needed, tag);
+    if (entry) {
+        printf("Data is already loaded in flash\n");
+        return (__SPI_FLASH_BASE__ + entry->unit * UNIT_SIZE);
+    }
 
-            fe->num_entries--;
-        }
+    entry = allocate_flash(units_needed, tag, false, copy_engine.blank, copy_engine.resident);
+    const uint32_t flash_offset = entry->unit * UNIT_SIZE;
 
-        if (fe->entry[index_to_free].count >= blocks_to_free)
-            break;
-    }
+    const uint32_t start_tick = HAL_GetTick();
+    FlashCtx.DisableMemoryMappedMode();
+    sd_session_begin();
+    reader_begin(&reader, extents, num_extents, offset);
+    engine_begin(&copy_engine, flash_offset, size, units_needed * UNIT_SIZE, UINT32_MAX,
+                 false, reader_fn, &reader);
+    engine_run(&copy_engine, UINT32_MAX);
+    reader_end(&reader);
+    sd_session_end();
+    FlashCtx.EnableMemoryMappedMode();
+    print_engine_stats(&copy_engine, start_tick);
+    return (__SPI_FLASH_BASE__ + flash_offset);
+}
 
-    assert(fe->num_entries && "Unexpected zero num_entries\n");
-    return index_to_free;
+static void bg_read_fn(void *ctx, uint8_t *buffer, uint32_t offset, uint32_t len)
+{
+    sd_read(bg_copy.lba, bg_copy.offset + offset, buffer, len);
 }
 
-static struct flash_entry *allocate_flash(uint32_t blocks_needed, uint32_t tag) {
-    struct flash_entries *fe = ram_entries;
+static struct copy_engine bg_engine;
+
+bool copy_sd_to_flash_begin(uint64_t lba, uint32_t offset, uint32_t size,
+                            uint32_t *flash_address)
+{
+    uint8_t ram_buffer[BLOCK_LENGTH];
     struct flash_entry *entry;
-    uint32_t idx = fe->num_entries - 1;
 
-    if (blocks_needed > TOTAL_BLOCKS) {
-        printf("Flash is too small to load!\n");
-        abort();
-    }
+    assert(!bg_copy.active && "Background copy is already in progress");
+    flash_alloc_init();
 
-    // Check if there is a free unallocated block that fits the size
-    if (fe->entry[idx].tag == 0 && fe->entry[idx].count >= blocks_needed) {
-        entry = &fe->entry[idx];
-    } else {
-        idx = free_flash_round_robin(blocks_needed);
-        entry = &fe->entry[idx];
+    const struct fs_extent extent = {
+        .lba = lba + offset / SD_SECTOR_SIZE,
+        .count = (offset % SD_SECTOR_SIZE + size + SD_SECTOR_SIZE - 1) / SD_SECTOR_SIZE,
+    };
+    offset %= SD_SECTOR_SIZE;
+
+    const uint32_t units_needed = (size + UNIT_SIZE - 1) / UNIT_SIZE;
+    const uint32_t tag = get_tag(&extent, offset, size, ram_buffer);
+    entry = is_loaded(units_needed, tag);
+    if (entry) {
+        *flash_address = __SPI_FLASH_BASE__ + entry->unit * UNIT_SIZE;
+        return true;
     }
 
-    assert(entry->count >= blocks_needed &&
-           "Unexpected block size less then blocks needed\n");
+    entry = allocate_flash(units_needed, tag, true, bg_engine.blank, bg_engine.resident);
+    bg_copy.active = true;
+    bg_copy.lba = extent.lba;
+    bg_copy.offset = offset;
+    bg_copy.size = size;
+    bg_copy.tag = tag;
+    bg_copy.unit = entry->unit;
+    bg_copy.count = entry->count;
+    // Small erases keep the time spent in a single step short
+    engine_begin(&bg_engine, entry->unit * UNIT_SIZE, size, units_needed * UNIT_SIZE,
+                 FlashCtx.GetSmallestEraseSize(), true, bg_read_fn, NULL);
+    *flash_address = __SPI_FLASH_BASE__ + entry->unit * UNIT_SIZE;
+    return false;
+}
+
+bool copy_sd_to_flash_step(uint32_t max_bytes)
+{
+    if (!bg_copy.active)
+        return true;
+
+    FlashCtx.DisableMemoryMappedMode();
+    sd_session_begin();
+    const bool done = engine_run(&bg_engine, max_bytes);
+    sd_session_end();
+    FlashCtx.EnableMemoryMappedMode();
+    if (!done)
+        return false;
 
-    // Split the allocated block if it's too big
-    if (entry->count > blocks_needed) {
-        for (uint32_t i = fe->num_entries - 1; i > idx; i--)
-            fe->entry[i + 1] = fe->entry[i];
+    for (uint32_t i = 0; i < ram_entries->num_entries; i++) {
+        struct flash_entry *entry = &ram_entries->entry[i];
 
-        fe->entry[idx + 1].block = entry->block + blocks_needed;
-        fe->entry[idx + 1].count = entry->count - blocks_needed;
-        fe->entry[idx + 1].tag = 0;
-        fe->num_entries++;
+        if (entry->unit == bg_copy.unit && entry->tag == TAG_PENDING) {
+            entry->tag = bg_copy.tag;
+            log_entry(entry);
+            store_flash_entries();
+            break;
+        }
     }
 
-    entry->count = blocks_needed;
-    entry->tag = tag;
+    bg_copy.active = false;
+    return true;
+}
 
-    // Update flash with new entries
-    store_flash_entries();
-    return entry;
+void copy_sd_to_flash_finish(void)
+{
+    // Waits for the flash instead of ending the steps early
+    bg_engine.background = false;
+    while (!copy_sd_to_flash_step(0x10000))
+        wdog_refresh();
 }
 
-static uint32_t get_tag(uint32_t sd_address, uint32_t size, uint8_t *ram_buffer)
+bool copy_sd_to_flash_blocked(void)
 {
-    const uint32_t len = size < BLOCK_LENGTH ? size : BLOCK_LENGTH;
-    uint32_t crc = crc32_le(0, (uint8_t *)&sd_address, sizeof(sd_address));
-    crc = crc32_le(crc, (uint8_t *)&size, sizeof(size));
-    SdCtx.Read(sd_address, ram_buffer, len);
-    crc = crc32_le(crc, ram_buffer, len);
-    return crc;
+    return bg_copy.active && bg_engine.blocked;
 }
 
-void reset_flash_allocator(void)
+void copy_sd_to_flash_cancel(void)
+{
+    // The pending entry stays reserved until it is recycled
+    bg_copy.active = false;
+}
+
+static uint32_t get_stream_tag(uint64_t lba, uint32_t offset, uint32_t size, uint32_t kind)
+{
+    uint8_t ram_buffer[BLOCK_LENGTH];
+    const struct fs_extent extent = {
+        .lba = lba + offset / SD_SECTOR_SIZE,
+        .count = (offset % SD_SECTOR_SIZE + size + SD_SECTOR_SIZE - 1) / SD_SECTOR_SIZE,
+    };
+    const uint32_t tag = get_tag(&extent, offset % SD_SECTOR_SIZE, size, ram_buffer) ^ kind;
+
+    return tag == TAG_PENDING ? 1 : tag;
+}
+
+bool flash_alloc_find(uint64_t lba, uint32_t offset, uint32_t size, uint32_t kind,
+                      uint32_t *flash_address, uint32_t *length)
 {
     if (!FlashCtx.Presented)
+        return false;
+
+    flash_alloc_init();
+
+    const uint32_t tag = get_stream_tag(lba, offset, size, kind);
+    for (uint32_t i = 0; i < ram_entries->num_entries; i++) {
+        struct flash_entry *entry = &ram_entries->entry[i];
+
+        if (entry->tag == tag) {
+            entry->last_use = ++ram_entries->use_clock;
+            if (entry->hits < UINT16_MAX)
+                entry->hits++;
+            log_entry(entry);
+            store_flash_entries();
+            *flash_address = __SPI_FLASH_BASE__ + entry->unit * UNIT_SIZE;
+            *length = entry->count * UNIT_SIZE;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+uint32_t flash_alloc_stream_begin(uint64_t lba, uint32_t offset, uint32_t size, uint32_t kind,
+                                  uint32_t max_length)
+{
+    assert(!stream.active && "Stream is already in progress");
+    if (!FlashCtx.Presented || max_length > TOTAL_UNITS * UNIT_SIZE)
+        return 0;
+
+    flash_alloc_init();
+
+    const uint32_t tag = get_stream_tag(lba, offset, size, kind);
+    const struct flash_entry *entry = allocate_flash((max_length + UNIT_SIZE - 1) / UNIT_SIZE, tag,
+                                                     true, stream.blank, NULL);
+    stream.active = true;
+    stream.tag = tag;
+    stream.unit = entry->unit;
+    stream.count = entry->count;
+    stream.erased = 0;
+    return __SPI_FLASH_BASE__ + entry->unit * UNIT_SIZE;
+}
+
+void flash_alloc_stream_write(uint32_t position, const void *data, uint32_t length)
+{
+    const uint32_t base = stream.unit * UNIT_SIZE;
+    uint32_t erase_size = FlashCtx.GetSmallestEraseSize();
+
+    assert(stream.active && position + length <= stream.count * UNIT_SIZE);
+    if (!erase_size || UNIT_SIZE % erase_size)
+        erase_size = UNIT_SIZE;
+
+    wdog_refresh();
+    FlashCtx.DisableMemoryMappedMode();
+    // The flash is erased when the data reaches it, unless pre-erased. The
+    // small erases keep the time spent in a single write short.
+    while (stream.erased < position + length) {
+        if (is_unit_erased(stream.blank, (base + stream.erased) / UNIT_SIZE)) {
+            stream.erased += UNIT_SIZE - stream.erased % UNIT_SIZE;
+            continue;
+        }
+        FlashCtx.Erase(base + stream.erased, erase_size);
+        stream.erased += erase_size;
+    }
+    flash_program(base + position, data, length);
+    FlashCtx.EnableMemoryMappedMode();
+}
+
+void flash_alloc_stream_end(uint32_t length)
+{
+    struct flash_entries *fe = ram_entries;
+    const uint32_t index = lower_bound(fe, stream.unit);
+
+    assert(stream.active && length <= stream.count * UNIT_SIZE);
+    stream.active = false;
+    if (index == fe->num_entries || fe->entry[index].unit != stream.unit)
         return;
 
-    ram_alloc_init();
+    // The units after the data are free again
+    struct flash_entry *entry = &fe->entry[index];
+    entry->tag = stream.tag;
+    entry->count = length ? (length + UNIT_SIZE - 1) / UNIT_SIZE : 1;
+    log_entry(entry);
     store_flash_entries();
 }
 
-uint32_t copy_sd_to_flash(uint32_t sd_address, uint32_t size)
+void flash_alloc_stream_cancel(void)
 {
-    int64_t copy_left = size;
-    struct flash_entry *entry;
-    uint32_t flash_addr;
-    uint8_t ram_buffer[BLOCK_LENGTH];
+    // The pending entry stays reserved until it is recycled
+    stream.active = false;
+}
 
-    flash_alloc_init();
+static struct {
+    bool active;
+    uint32_t unit;
+    uint32_t done;       /* Bytes of the unit erased */
+    uint32_t generation; /* alloc_generation at the start */
+} pre_erase;
 
-    // Round up to the nearest block size
-    const uint32_t blocks_needed = (size + STORE_BLOCK_SIZE - 1) / STORE_BLOCK_SIZE;
-    const uint32_t tag = get_tag(sd_address, size, ram_buffer);
-    entry = is_loaded(blocks_needed, tag);
-    if (entry) {
-        printf("Data is already loaded in flash\n");
-        return (__SPI_FLASH_BASE__ + entry->block * STORE_BLOCK_SIZE);
+static bool find_unerased(uint32_t start, uint32_t end, uint32_t *unit)
+{
+    for (uint32_t u = start; u < end; u++) {
+        if (!is_unit_erased(ram_entries->erased, u)) {
+            *unit = u;
+            return true;
+        }
     }
 
-    entry = allocate_flash(blocks_needed, tag);
+    return false;
+}
 
-    flash_addr = entry->block * STORE_BLOCK_SIZE;
-    FlashCtx.DisableMemoryMappedMode();
-    while (copy_left > 0) {
-        if (flash_addr % ALIGN_BOUNDARY == 0)
-            FlashCtx.Erase(flash_addr, ALIGN_BOUNDARY);
+// Free units go first, then the stale pending entries left by the
+// cancelled copies
+static bool find_pre_erase_unit(uint32_t *unit)
+{
+    const struct flash_entries *fe = ram_entries;
+    uint32_t start = 0;
 
-        SdCtx.Read(sd_address, ram_buffer, BLOCK_LENGTH);
-        FlashCtx.Write(flash_addr, ram_buffer, BLOCK_LENGTH);
-        sd_address += BLOCK_LENGTH;
-        flash_addr += BLOCK_LENGTH;
-        copy_left -= BLOCK_LENGTH;
+    for (uint32_t i = 0; i <= fe->num_entries; i++) {
+        const uint32_t end = i < fe->num_entries ? fe->entry[i].unit : TOTAL_UNITS;
+
+        if (find_unerased(start, end, unit))
+            return true;
+        if (i < fe->num_entries)
+            start = fe->entry[i].unit + fe->entry[i].count;
+    }
+
+    for (uint32_t i = 0; i < fe->num_entries && !bg_copy.active && !stream.active; i++) {
+        const struct flash_entry *entry = &fe->entry[i];
+
+        if (entry->tag == TAG_PENDING && find_unerased(entry->unit, entry->unit + entry->count, unit))
+            return true;
+    }
+
+    return false;
+}
+
+bool flash_alloc_pre_erase(void)
+{
+    const uint32_t erase_size = FlashCtx.GetSmallestEraseSize();
+
+    if (!FlashCtx.Presented || stream.active || !erase_size || UNIT_SIZE % erase_size)
+        return false;
+
+    if (bg_copy.active) {
+        if (!bg_engine.blocked)
+            return false;
+
+        // Erases for the background copy on the chips that can't suspend
+        const uint32_t len = bg_engine.erase_size - bg_engine.erased < erase_size ?
+                             bg_engine.erase_size - bg_engine.erased : erase_size;
+
+        wdog_refresh();
+        FlashCtx.DisableMemoryMappedMode();
+        FlashCtx.Erase(bg_engine.flash_addr + bg_engine.erased, len);
+        FlashCtx.EnableMemoryMappedMode();
+        bg_engine.erased += len;
+        bg_engine.blocked = false;
+        return true;
     }
 
+    flash_alloc_init();
+
+    // The unit could be allocated since the last call
+    if (!pre_erase.active || pre_erase.generation != alloc_generation) {
+        pre_erase.active = find_pre_erase_unit(&pre_erase.unit);
+        pre_erase.done = 0;
+        pre_erase.generation = alloc_generation;
+        if (!pre_erase.active)
+            return false;
+    }
+
+    wdog_refresh();
+    FlashCtx.DisableMemoryMappedMode();
+    FlashCtx.Erase(pre_erase.unit * UNIT_SIZE + pre_erase.done, erase_size);
     FlashCtx.EnableMemoryMappedMode();
-    return (__SPI_FLASH_BASE__ + entry->block * STORE_BLOCK_SIZE);
+
+    pre_erase.done += erase_size;
+    if (pre_erase.done >= UNIT_SIZE) {
+        ram_entries->erased[pre_erase.unit / 32] |= 1UL << (pre_erase.unit % 32);
+        log_erased(pre_erase.unit / 32);
+        store_flash_entries();
+        pre_erase.active = false;
+    }
+
+    return true;
+}
+
+// Largest allocation that fits the gap without the eviction
+static uint32_t largest_fit(uint32_t start, uint32_t end)
+{
+    uint32_t best = 0;
+
+    for (uint32_t align = 1; align <= end - start; align <<= 1) {
+        const uint32_t pos = (start + align - 1) & ~(align - 1);
+        const uint32_t count = pos + align <= end ? align : (pos < end ? end - pos : 0);
+
+        if (count > best)
+            best = count;
+    }
+
+    return best;
+}
+
+void flash_alloc_get_stats(struct flash_alloc_stats *stats)
+{
+    const struct flash_entries *fe = ram_entries;
+    uint32_t start = 0, free_units = 0, largest = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!FlashCtx.Presented)
+        return;
+
+    flash_alloc_init();
+    for (uint32_t i = 0; i <= fe->num_entries; i++) {
+        const uint32_t end = i < fe->num_entries ? fe->entry[i].unit : TOTAL_UNITS;
+
+        if (end > start) {
+            const uint32_t fit = largest_fit(start, end);
+
+            stats->free_gaps++;
+            free_units += end - start;
+            if (fit > largest)
+                largest = fit;
+        }
+        if (i < fe->num_entries)
+            start = fe->entry[i].unit + fe->entry[i].count;
+    }
+
+    stats->entries = fe->num_entries;
+    stats->unit_size = UNIT_SIZE;
+    stats->total_kb = TOTAL_UNITS * (UNIT_SIZE / 1024);
+    stats->free_kb = free_units * (UNIT_SIZE / 1024);
+    stats->largest_free_kb = largest * (UNIT_SIZE / 1024);
+    stats->fragmentation = free_units ? 100 - largest * 100 / free_units : 0;
 }
 
 #else
@@ -261,23 +1643,107 @@ void reset_flash_allocator(void)
     return;
 }
 
-uint32_t copy_sd_to_flash(uint32_t sd_address, uint32_t size)
+static uint32_t copy_to_flash(const struct fs_extent *extents, uint32_t num_extents,
+                              uint32_t offset, uint32_t size)
 {
     int64_t copy_left = size;
+    struct sd_reader reader;
     uint32_t flash_addr = 0;
     uint8_t ram_buffer[BLOCK_LENGTH];
 
+    const uint32_t start_tick = HAL_GetTick();
     FlashCtx.DisableMemoryMappedMode();
+    sd_session_begin();
+    reader_begin(&reader, extents, num_extents, offset);
     while (copy_left > 0) {
-        SdCtx.Read(sd_address, ram_buffer, BLOCK_LENGTH);
+        reader_read(&reader, ram_buffer, copy_left < BLOCK_LENGTH ? copy_left : BLOCK_LENGTH);
         FlashCtx.Write(flash_addr, ram_buffer, BLOCK_LENGTH);
-        sd_address += BLOCK_LENGTH;
         flash_addr += BLOCK_LENGTH;
         copy_left -= BLOCK_LENGTH;
     }
 
+    reader_end(&reader);
+    sd_session_end();
     FlashCtx.EnableMemoryMappedMode();
+    print_copy_stats(size, start_tick);
     return __SPI_FLASH_BASE__;
 }
 
+bool copy_sd_to_flash_begin(uint64_t lba, uint32_t offset, uint32_t size,
+                            uint32_t *flash_address)
+{
+    // SPI SRAM is not persistent, just copy it at once
+    *flash_address = copy_sd_to_flash(lba, offset, size);
+    return true;
+}
+
+bool copy_sd_to_flash_step(uint32_t max_bytes)
+{
+    return true;
+}
+
+void copy_sd_to_flash_finish(void)
+{
+}
+
+bool copy_sd_to_flash_blocked(void)
+{
+    return false;
+}
+
+void copy_sd_to_flash_cancel(void)
+{
+}
+
+bool flash_alloc_pre_erase(void)
+{
+    return false;
+}
+
+void flash_alloc_get_stats(struct flash_alloc_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+bool flash_alloc_find(uint64_t lba, uint32_t offset, uint32_t size, uint32_t kind,
+                      uint32_t *flash_address, uint32_t *length)
+{
+    return false;
+}
+
+uint32_t flash_alloc_stream_begin(uint64_t lba, uint32_t offset, uint32_t size, uint32_t kind,
+                                  uint32_t max_length)
+{
+    // SPI SRAM is not persistent, there is nothing to keep
+    return 0;
+}
+
+void flash_alloc_stream_write(uint32_t position, const void *data, uint32_t length)
+{
+}
+
+void flash_alloc_stream_end(uint32_t length)
+{
+}
+
+void flash_alloc_stream_cancel(void)
+{
+}
+
 #endif // !EXTFLASH_FORCE_SRAM
+
+uint32_t copy_sd_to_flash(uint64_t lba, uint32_t offset, uint32_t size)
+{
+    const struct fs_extent extent = {
+        .lba = lba + offset / SD_SECTOR_SIZE,
+        .count = (offset % SD_SECTOR_SIZE + size + SD_SECTOR_SIZE - 1) / SD_SECTOR_SIZE,
+    };
+
+    return copy_to_flash(&extent, 1, offset % SD_SECTOR_SIZE, size);
+}
+
+uint32_t copy_extents_to_flash(const struct fs_extent *extents, uint32_t num_extents,
+                               uint32_t size)
+{
+    return copy_to_flash(extents, num_extents, 0, size);
+}
@@ -13,11 +13,13 @@
 #include "gw_flash.h"
 #include "gw_lcd.h"
 #include "gw_linker.h"
+#include "gw_sd.h"
 #include "main.h"
 #include "rg_emulators.h"
 #include "rg_favorites.h"
 #include "utils.h"
 #include "sha256.h"
+#include "crc32.h"
 
 #define DBG(...) printf(__VA_ARGS__)
 // #define DBG(...)
@@ -42,6 +44,22 @@ static const int font_width = 8; //odroid_overlay_get_font_width();
 #define PROGRESS_WIDTH    (4 * (PROGRESS_X_OFFSET * 2))
 #define PROGRESS_HEIGHT   (2 * LIST_LINE_HEIGHT)
 
+// Sector size of the differential flashing, see FLASHAPP_HASH
+#define DIFF_SECTOR_SIZE 4096
+
+// The staging RAM is split in slots, the host loads the next chunk to a
+// free slot while the previous one is checked and programmed. A chunk
+// larger than a slot takes the following slots too.
+#define FLASHAPP_SLOTS     2
+#define FLASHAPP_SLOT_SIZE (416 * 1024)
+
+// Bytes of the RAM hashed per step, the next chunk is hashed in the steps
+// while the flash is busy with the current one
+#define HASH_STEP_SIZE     1024
+
+// Bytes of the flash hashed per step of the check after programming
+#define VERIFY_STEP_SIZE   (16 * 1024)
+
 #if SD_CARD == 0
 #  define EXT_FLASH_BASE 0x90000000UL
 #  define BLOCK_SIZE 256
@@ -71,25 +89,67 @@ typedef enum {
 
     FLASHAPP_FINAL                  = 0x0D,
     FLASHAPP_ERROR                  = 0x0E,
+
+    FLASHAPP_HASH                   = 0x0F,
+    FLASHAPP_DIFF_NEXT              = 0x10,
+    FLASHAPP_DIFF                   = 0x11,
 } flashapp_state_t;
 
 typedef enum {
     FLASHAPP_STATUS_BAD_HASH_RAM    = 0xbad00001,
     FLASHAPP_STATUS_BAD_HAS_FLASH   = 0xbad00002,
     FLASHAPP_STATUS_NOT_ALIGNED     = 0xbad00003,
+    FLASHAPP_STATUS_BAD_SLOT        = 0xbad00004,
 
     FLASHAPP_STATUS_IDLE            = 0xcafe0000,
     FLASHAPP_STATUS_DONE            = 0xcafe0001,
     FLASHAPP_STATUS_BUSY            = 0xcafe0002,
 } flashapp_status_t;
 
+typedef enum {
+    FLASHAPP_PHASE_HASH_RAM,
+    FLASHAPP_PHASE_ERASE,
+    FLASHAPP_PHASE_PROGRAM,
+    FLASHAPP_PHASE_HASH_FLASH,
+    FLASHAPP_PHASE_WAIT,
+    FLASHAPP_PHASE_COUNT,
+} flashapp_phase_t;
+
+// A chunk loaded by the host, the program_* values are copied when it is
+// queued so the host can load the next one
+typedef struct {
+    uint8_t *buf;
+    uint32_t slots;       // Mask of the slots holding the data
+    uint32_t size;
+    uint32_t address;
+    uint32_t erase;
+    int32_t  erase_bytes;
+    uint32_t diff;
+    uint32_t chunk_idx;
+    uint32_t chunk_count;
+    uint8_t  expected_sha256[65];
+    SHA256_CTX sha256;    // Of the RAM, hashed up to hashed bytes
+    uint32_t hashed;
+} flashapp_job_t;
+
 typedef struct {
     tab_t    tab;
+    flashapp_job_t jobs[FLASHAPP_SLOTS];
+    uint32_t job_head;
+    uint32_t job_count;
+    uint32_t chunk_idx;
+    uint32_t chunk_count;
+    flashapp_phase_t phase;
+    uint32_t phase_start;
+    uint32_t chunk_time_ms[FLASHAPP_PHASE_COUNT];
+    SHA256_CTX flash_sha256;
+    uint32_t flash_hashed;
     uint32_t erase_address;
     uint32_t erase_bytes_left;
     uint32_t current_program_address;
     uint32_t program_bytes_left;
     uint8_t* program_buf;
+    uint32_t changed_sectors;
     uint32_t progress_max;
     uint32_t progress_value;
 } flashapp_t;
@@ -98,12 +158,19 @@ typedef struct {
 // framebuffer2 and onwards is used as a buffer for the flash.
 static uint8_t *flash_buffer = (uint8_t *) framebuffer2;
 
+#if SD_CARD != 0
+// The flash buffer covers the emulator framebuffer
+static uint8_t sector_buffer[DIFF_SECTOR_SIZE];
+#endif // SD_CARD
+
 // Values below are read or written by the debugger
 
 // Store state in a uint32_t
 uint32_t flashapp_state;
 
-// Set to non-zero to start programming
+// Set to non-zero to start programming: 1 queues the loaded chunk, 2 tests
+// the flash, 3 hashes its sectors and 4 finishes without a chunk, when the
+// last one was unchanged
 uint32_t program_start;
 
 // Status register
@@ -130,6 +197,21 @@ uint32_t program_chunk_count;
 // The expected sha256 of the loaded binary
 uint8_t program_expected_sha256[65];
 
+// Set to non-zero to program only the sectors that differ from the flash
+uint32_t program_diff;
+
+// Number of sectors programmed by the last differential flashing
+uint32_t program_changed_sectors;
+
+// Slot the chunk was loaded to, at framebuffer2 + slot * FLASHAPP_SLOT_SIZE
+uint32_t program_slot;
+
+// Bit n is set while slot n holds a chunk not programmed yet
+uint32_t program_slots_busy;
+
+// Milliseconds spent in each flashapp_phase_t since the start
+uint32_t program_time_ms[FLASHAPP_PHASE_COUNT];
+
 // TODO: Expose properly
 int odroid_overlay_draw_text_line(uint16_t x_pos,
                                   uint16_t y_pos,
@@ -335,6 +417,36 @@ static void test_flash(flashapp_t *flashapp)
     redraw(flashapp);
 }
 
+static const uint8_t *read_sector(uint32_t address, uint32_t size)
+{
+#if SD_CARD == 0
+    return (const uint8_t *) (EXT_FLASH_BASE + address);
+#else
+    get_flash_ctx()->Read(address, sector_buffer, size);
+    return sector_buffer;
+#endif // !SD_CARD
+}
+
+static void hash_sectors(flashapp_t *flashapp)
+{
+    // The CRC32 of every sector of the range goes to the start of the
+    // buffer, the host reads them back and sends only the changed chunks
+    uint32_t *crc = (uint32_t *) flash_buffer;
+    uint32_t count = 0;
+
+    sprintf(flashapp->tab.name, "Hashing %ld bytes...", program_size);
+    lcd_swap();
+    lcd_wait_for_vblank();
+    redraw(flashapp);
+
+    for (uint32_t offset = 0; offset < program_size; offset += DIFF_SECTOR_SIZE) {
+        uint32_t len = program_size - offset > DIFF_SECTOR_SIZE ? DIFF_SECTOR_SIZE : program_size - offset;
+
+        wdog_refresh();
+        crc[count++] = crc32_le(0, read_sector(program_address + offset, len), len);
+    }
+}
+
 static void state_set(flashapp_state_t state_next)
 {
     printf("State: %ld -> %d\n", flashapp_state, state_next);
@@ -347,9 +459,153 @@ static void state_inc(void)
     state_set(flashapp_state + 1);
 }
 
+static void phase_set(flashapp_t *flashapp, flashapp_phase_t phase)
+{
+    uint32_t now = HAL_GetTick();
+
+    program_time_ms[flashapp->phase] += now - flashapp->phase_start;
+    flashapp->chunk_time_ms[flashapp->phase] += now - flashapp->phase_start;
+    flashapp->phase = phase;
+    flashapp->phase_start = now;
+}
+
+static flashapp_job_t *job_current(flashapp_t *flashapp)
+{
+    return &flashapp->jobs[flashapp->job_head];
+}
+
+static flashapp_job_t *job_next(flashapp_t *flashapp)
+{
+    if (flashapp->job_count < 2)
+        return NULL;
+
+    return &flashapp->jobs[(flashapp->job_head + 1) % FLASHAPP_SLOTS];
+}
+
+static void job_queue(flashapp_t *flashapp)
+{
+    // Queues the chunk the host loaded, the host waits for program_start
+    // to be cleared before it loads another one
+    if (program_start != 1 || flashapp->job_count == FLASHAPP_SLOTS)
+        return;
+
+    uint32_t num_slots = (program_size + FLASHAPP_SLOT_SIZE - 1) / FLASHAPP_SLOT_SIZE;
+    if (num_slots == 0 || program_slot + num_slots > FLASHAPP_SLOTS) {
+        sprintf(flashapp->tab.name, "** Chunk doesn't fit the slot! **");
+        program_status = FLASHAPP_STATUS_BAD_SLOT;
+        state_set(FLASHAPP_ERROR);
+        return;
+    }
+
+    uint32_t slots = ((1 << num_slots) - 1) << program_slot;
+    if (program_slots_busy & slots)
+        return;
+
+    flashapp_job_t *job = &flashapp->jobs[(flashapp->job_head + flashapp->job_count) % FLASHAPP_SLOTS];
+    job->buf = flash_buffer + program_slot * FLASHAPP_SLOT_SIZE;
+    job->slots = slots;
+    job->size = program_size;
+    job->address = program_address;
+    job->erase = program_erase;
+    job->erase_bytes = program_erase_bytes;
+    job->diff = program_diff;
+    job->chunk_idx = program_chunk_idx;
+    job->chunk_count = program_chunk_count;
+    memcpy(job->expected_sha256, program_expected_sha256, sizeof(job->expected_sha256));
+    sha256_init(&job->sha256);
+    job->hashed = 0;
+
+    DBG("Chunk %ld/%ld queued in slot %ld\n", job->chunk_idx, job->chunk_count, program_slot);
+
+    flashapp->job_count++;
+    program_slots_busy |= slots;
+    program_start = 0;
+}
+
+static void job_done(flashapp_t *flashapp)
+{
+    flashapp_job_t *job = job_current(flashapp);
+
+    phase_set(flashapp, FLASHAPP_PHASE_WAIT);
+    DBG("Chunk %ld/%ld: hash %ld ms, erase %ld ms, program %ld ms, verify %ld ms, wait %ld ms\n",
+        job->chunk_idx, job->chunk_count,
+        flashapp->chunk_time_ms[FLASHAPP_PHASE_HASH_RAM],
+        flashapp->chunk_time_ms[FLASHAPP_PHASE_ERASE],
+        flashapp->chunk_time_ms[FLASHAPP_PHASE_PROGRAM],
+        flashapp->chunk_time_ms[FLASHAPP_PHASE_HASH_FLASH],
+        flashapp->chunk_time_ms[FLASHAPP_PHASE_WAIT]);
+    memset(flashapp->chunk_time_ms, 0, sizeof(flashapp->chunk_time_ms));
+
+    program_slots_busy &= ~job->slots;
+    flashapp->job_head = (flashapp->job_head + 1) % FLASHAPP_SLOTS;
+    flashapp->job_count--;
+}
+
+static void program_done(flashapp_t *flashapp)
+{
+    phase_set(flashapp, FLASHAPP_PHASE_WAIT);
+    sprintf(flashapp->tab.name, "Programming done!");
+    DBG("Total: hash %ld ms, erase %ld ms, program %ld ms, verify %ld ms, wait %ld ms\n",
+        program_time_ms[FLASHAPP_PHASE_HASH_RAM],
+        program_time_ms[FLASHAPP_PHASE_ERASE],
+        program_time_ms[FLASHAPP_PHASE_PROGRAM],
+        program_time_ms[FLASHAPP_PHASE_HASH_FLASH],
+        program_time_ms[FLASHAPP_PHASE_WAIT]);
+    program_status = FLASHAPP_STATUS_DONE;
+    state_set(FLASHAPP_FINAL);
+}
+
+static void job_error(flashapp_t *flashapp, flashapp_status_t status)
+{
+    // Tells the host which chunk failed, it may have queued the next one
+    program_chunk_idx = job_current(flashapp)->chunk_idx;
+    program_status = status;
+    state_set(FLASHAPP_ERROR);
+}
+
+static bool hash_ram_step(flashapp_job_t *job)
+{
+    // Returns true if the RAM of the job is hashed
+    uint32_t len = job->size - job->hashed;
+
+    if (len > HASH_STEP_SIZE)
+        len = HASH_STEP_SIZE;
+    sha256_update(&job->sha256, job->buf + job->hashed, len);
+    job->hashed += len;
+
+    return job->hashed == job->size;
+}
+
+static void hash_next_job(flashapp_t *flashapp)
+{
+    flashapp_job_t *job = job_next(flashapp);
+
+    if (job != NULL && job->hashed < job->size)
+        hash_ram_step(job);
+}
+
+static bool flash_busy(void)
+{
+    return get_flash_ctx()->IsBusy != NULL && get_flash_ctx()->IsBusy();
+}
+
 static void flashapp_run(flashapp_t *flashapp)
 {
     uint8_t program_calculated_sha256[65];
+    flashapp_job_t *job = job_current(flashapp);
+
+    switch (flashapp_state) {
+    case FLASHAPP_INIT:
+    case FLASHAPP_HASH:
+    case FLASHAPP_TEST_NEXT:
+    case FLASHAPP_TEST:
+    case FLASHAPP_FINAL:
+    case FLASHAPP_ERROR:
+        break;
+    default:
+        job_queue(flashapp);
+        break;
+    }
 
     switch (flashapp_state) {
     case FLASHAPP_INIT:
@@ -358,14 +614,23 @@ static void flashapp_run(flashapp_t *flashapp)
         program_address = 0;
         program_status = 0;
         program_erase = 0;
+        program_diff = 0;
+        program_changed_sectors = 0;
+        program_slot = 0;
+        program_slots_busy = 0;
         program_erase_bytes = 0;
         program_chunk_idx = 1;
         program_chunk_count = 1;
+        memset(program_time_ms, 0, sizeof(program_time_ms));
         memset(program_expected_sha256, 0, sizeof(program_expected_sha256));
         memset(program_calculated_sha256, 0, sizeof(program_calculated_sha256));
 
         flashapp->progress_value = 0;
         flashapp->progress_max = 0;
+        flashapp->chunk_idx = 1;
+        flashapp->chunk_count = 1;
+        flashapp->phase = FLASHAPP_PHASE_WAIT;
+        flashapp->phase_start = HAL_GetTick();
 
         state_inc();
         break;
@@ -377,16 +642,24 @@ static void flashapp_run(flashapp_t *flashapp)
         flashapp->progress_value = 0;
         flashapp->progress_max = 0;
 
-        // program_start is set by the flash script
-        switch (program_start) {
-        case 1: // Normal flash operation
-            program_start = 0;
+        if (flashapp->job_count > 0) {
             state_inc();
             break;
+        }
+
+        // program_start is set by the flash script, 1 is queued above
+        switch (program_start) {
         case 2: // Test flash
             program_start = 0;
             state_set(FLASHAPP_TEST_NEXT);
             break;
+        case 3: // Hash the sectors of the flash, clears program_start when done
+            state_set(FLASHAPP_HASH);
+            break;
+        case 4: // Finish, the last chunk was unchanged
+            program_start = 0;
+            program_done(flashapp);
+            break;
         default:
             break;
         }
@@ -394,21 +667,32 @@ static void flashapp_run(flashapp_t *flashapp)
         break;
     case FLASHAPP_START:
         program_status = FLASHAPP_STATUS_BUSY;
+        flashapp->chunk_idx = job->chunk_idx;
+        flashapp->chunk_count = job->chunk_count;
         state_inc();
         break;
     case FLASHAPP_CHECK_HASH_RAM_NEXT:
-        sprintf(flashapp->tab.name, "2. Checking hash in RAM (%ld bytes)", program_size);
+        sprintf(flashapp->tab.name, "2. Checking hash in RAM (%ld bytes)", job->size);
+        phase_set(flashapp, FLASHAPP_PHASE_HASH_RAM);
+        flashapp->progress_value = job->hashed;
+        flashapp->progress_max = job->size;
         state_inc();
         break;
     case FLASHAPP_CHECK_HASH_RAM:
-        // Calculate sha256 hash of the RAM first
-        sha256_to_string(program_calculated_sha256, (const BYTE*) flash_buffer, program_size);
+        // Calculate sha256 hash of the RAM first, the part not hashed
+        // while the previous chunk was programmed
+        if (job->hashed < job->size) {
+            hash_ram_step(job);
+            flashapp->progress_value = job->hashed;
+            break;
+        }
+
+        sha256_final_to_string(&job->sha256, program_calculated_sha256);
 
-        if (strncmp((char *)program_calculated_sha256, (char *)program_expected_sha256, 64) != 0) {
+        if (strncmp((char *)program_calculated_sha256, (char *)job->expected_sha256, 64) != 0) {
             // Hashes don't match even in RAM, openocd loading failed.
             sprintf(flashapp->tab.name, "*** Hash mismatch in RAM ***");
-            program_status = FLASHAPP_STATUS_BAD_HASH_RAM;
-            state_set(FLASHAPP_ERROR);
+            job_error(flashapp, FLASHAPP_STATUS_BAD_HASH_RAM);
             break;
         } else {
             sprintf(flashapp->tab.name, "3. Hash OK in RAM");
@@ -416,21 +700,28 @@ static void flashapp_run(flashapp_t *flashapp)
         }
         break;
     case FLASHAPP_ERASE_NEXT:
+        phase_set(flashapp, FLASHAPP_PHASE_ERASE);
+
+        if (job->diff) {
+            // Erases the sectors as they are programmed
+            state_set(FLASHAPP_DIFF_NEXT);
+            break;
+        }
+
         get_flash_ctx()->DisableMemoryMappedMode();
 
-        if (program_erase) {
-            if (program_erase_bytes == 0) {
+        if (job->erase) {
+            if (job->erase_bytes == 0) {
                 sprintf(flashapp->tab.name, "4. Performing Chip Erase (takes time)");
             } else {
-                flashapp->erase_address = program_address;
-                flashapp->erase_bytes_left = program_erase_bytes;
+                flashapp->erase_address = job->address;
+                flashapp->erase_bytes_left = job->erase_bytes;
 
                 uint32_t smallest_erase = get_flash_ctx()->GetSmallestEraseSize();
 
                 if (flashapp->erase_address & (smallest_erase - 1)) {
                     sprintf(flashapp->tab.name, "** Address not aligned to smallest erase size! **");
-                    program_status = FLASHAPP_STATUS_NOT_ALIGNED;
-                    state_set(FLASHAPP_ERROR);
+                    job_error(flashapp, FLASHAPP_STATUS_NOT_ALIGNED);
                     break;
                 }
 
@@ -441,7 +732,7 @@ static void flashapp_run(flashapp_t *flashapp)
 
                 sprintf(flashapp->tab.name, "4. Erasing %ld bytes...", flashapp->erase_bytes_left);
                 printf("Erasing %ld bytes at 0x%08lx\n", flashapp->erase_bytes_left, flashapp->erase_address);
-                flashapp->progress_max = program_erase_bytes;
+                flashapp->progress_max = flashapp->erase_bytes_left;
                 flashapp->progress_value = 0;
             }
             state_inc();
@@ -450,70 +741,176 @@ static void flashapp_run(flashapp_t *flashapp)
         }
         break;
     case FLASHAPP_ERASE:
-        if (program_erase_bytes == 0) {
+        if (job->erase_bytes == 0) {
             get_flash_ctx()->Format();
             state_inc();
+        } else if (get_flash_ctx()->EraseAsync != NULL) {
+            // Hash the next chunk while the erase runs
+            if (flash_busy()) {
+                hash_next_job(flashapp);
+                break;
+            }
+
+            if (flashapp->erase_bytes_left == 0) {
+                state_inc();
+                break;
+            }
+
+            uint32_t erased = get_flash_ctx()->EraseAsync(flashapp->erase_address, flashapp->erase_bytes_left);
+            flashapp->erase_address += erased;
+            flashapp->erase_bytes_left -= erased;
+            flashapp->progress_value = flashapp->progress_max - flashapp->erase_bytes_left;
         } else {
             get_flash_ctx()->Erase(flashapp->erase_address, flashapp->erase_bytes_left);
-            flashapp->progress_max = 0;
+            flashapp->erase_bytes_left = 0;
+            flashapp->progress_value = flashapp->progress_max;
             state_inc();
-            flashapp->progress_value = flashapp->progress_max - flashapp->erase_bytes_left;
         }
         break;
     case FLASHAPP_PROGRAM_NEXT:
         sprintf(flashapp->tab.name, "5. Programming...");
+        phase_set(flashapp, FLASHAPP_PHASE_PROGRAM);
         flashapp->progress_value = 0;
-        flashapp->progress_max = program_size;
-        flashapp->current_program_address = program_address;
-        flashapp->program_bytes_left = program_size;
-        flashapp->program_buf = flash_buffer;
+        flashapp->progress_max = job->size;
+        flashapp->current_program_address = job->address;
+        flashapp->program_bytes_left = job->size;
+        flashapp->program_buf = job->buf;
+#if SD_CARD != 0
+        // Keep the whole image in a single multiple block write transaction
+        sd_write_stream_begin(job->address, job->size);
+#endif // SD_CARD
         state_inc();
         break;
     case FLASHAPP_PROGRAM:
+#if SD_CARD == 0
+        // Hash the next chunk while the page is programmed
+        if (flash_busy()) {
+            hash_next_job(flashapp);
+            break;
+        }
+#endif // !SD_CARD
         if (flashapp->program_bytes_left > 0) {
-            uint32_t dest_page = flashapp->current_program_address / BLOCK_SIZE;
             uint32_t bytes_to_write = flashapp->program_bytes_left > BLOCK_SIZE ? BLOCK_SIZE : flashapp->program_bytes_left;
-            get_flash_ctx()->Write(dest_page * BLOCK_SIZE, flashapp->program_buf, bytes_to_write);
+#if SD_CARD == 0
+            if (get_flash_ctx()->ProgramAsync != NULL) {
+                bytes_to_write = get_flash_ctx()->ProgramAsync(flashapp->current_program_address,
+                                                               flashapp->program_buf, bytes_to_write);
+            } else {
+                uint32_t dest_page = flashapp->current_program_address / BLOCK_SIZE;
+                get_flash_ctx()->Write(dest_page * BLOCK_SIZE, flashapp->program_buf, bytes_to_write);
+            }
+#else
+            sd_write_stream(flashapp->program_buf, bytes_to_write);
+            hash_next_job(flashapp);
+#endif // !SD_CARD
             flashapp->current_program_address += bytes_to_write;
             flashapp->program_buf += bytes_to_write;
             flashapp->program_bytes_left -= bytes_to_write;
-            flashapp->progress_value = program_size - flashapp->program_bytes_left;
+            flashapp->progress_value = job->size - flashapp->program_bytes_left;
         } else {
+#if SD_CARD != 0
+            sd_write_stream_end();
+#endif // SD_CARD
             state_inc();
         }
         break;
     case FLASHAPP_CHECK_HASH_FLASH_NEXT:
         sprintf(flashapp->tab.name, "6. Checking hash in FLASH");
+        phase_set(flashapp, FLASHAPP_PHASE_HASH_FLASH);
         get_flash_ctx()->EnableMemoryMappedMode();
+        sha256_init(&flashapp->flash_sha256);
+        flashapp->flash_hashed = 0;
+        flashapp->progress_value = 0;
+        flashapp->progress_max = job->size;
         state_inc();
         break;
     case FLASHAPP_CHECK_HASH_FLASH:
-        // Calculate sha256 hash of the FLASH.
+        // Calculate sha256 hash of the FLASH in steps.
 #if SD_CARD == 0
-        sha256_to_string(program_calculated_sha256,
-                         (const BYTE*) (EXT_FLASH_BASE + program_address),
-                         program_size);
+        if (flashapp->flash_hashed < job->size) {
+            uint32_t len = job->size - flashapp->flash_hashed;
+
+            if (len > VERIFY_STEP_SIZE)
+                len = VERIFY_STEP_SIZE;
+            sha256_update(&flashapp->flash_sha256,
+                          (const BYTE*) (EXT_FLASH_BASE + job->address + flashapp->flash_hashed), len);
+            flashapp->flash_hashed += len;
+            flashapp->progress_value = flashapp->flash_hashed;
+            break;
+        }
+
+        sha256_final_to_string(&flashapp->flash_sha256, program_calculated_sha256);
 
-        if (strncmp((char *)program_calculated_sha256, (char *)program_expected_sha256, 64) != 0) {
+        if (strncmp((char *)program_calculated_sha256, (char *)job->expected_sha256, 64) != 0) {
             // Hashes don't match in FLASH, programming failed.
             sprintf(flashapp->tab.name, "*** Hash mismatch in FLASH ***");
-            program_status = FLASHAPP_STATUS_BAD_HAS_FLASH;
-            state_set(FLASHAPP_ERROR);
+            job_error(flashapp, FLASHAPP_STATUS_BAD_HAS_FLASH);
+            break;
         }
 
         sprintf(flashapp->tab.name, "7. Hash OK in FLASH.");
 #endif // !SD_CARD
 
-        if (program_chunk_idx != program_chunk_count) {
+        if (job->chunk_idx != job->chunk_count) {
             // More chunks will be programmed, skip the init state.
-            program_chunk_idx++;
-            state_set(FLASHAPP_IDLE);
+            job_done(flashapp);
+            state_set(flashapp->job_count > 0 ? FLASHAPP_START : FLASHAPP_IDLE);
         } else {
-            sprintf(flashapp->tab.name, "Programming done!");
-            program_status = FLASHAPP_STATUS_DONE;
-            state_set(FLASHAPP_FINAL);
+            job_done(flashapp);
+            program_done(flashapp);
         }
         break;
+    case FLASHAPP_DIFF_NEXT:
+        if (job->address & (DIFF_SECTOR_SIZE - 1)) {
+            sprintf(flashapp->tab.name, "** Address not aligned to sector size! **");
+            job_error(flashapp, FLASHAPP_STATUS_NOT_ALIGNED);
+            break;
+        }
+
+        sprintf(flashapp->tab.name, "4. Programming changed sectors...");
+        phase_set(flashapp, FLASHAPP_PHASE_PROGRAM);
+        flashapp->progress_value = 0;
+        flashapp->progress_max = job->size;
+        flashapp->current_program_address = job->address;
+        flashapp->program_bytes_left = job->size;
+        flashapp->program_buf = job->buf;
+        flashapp->changed_sectors = 0;
+        state_inc();
+        break;
+    case FLASHAPP_DIFF:
+        if (flashapp->program_bytes_left > 0) {
+            const uint32_t address = flashapp->current_program_address;
+            uint32_t len = flashapp->program_bytes_left > DIFF_SECTOR_SIZE ? DIFF_SECTOR_SIZE : flashapp->program_bytes_left;
+
+            if (memcmp(read_sector(address, len), flashapp->program_buf, len) != 0) {
+                get_flash_ctx()->DisableMemoryMappedMode();
+#if SD_CARD == 0
+                get_flash_ctx()->Erase(address, DIFF_SECTOR_SIZE);
+#endif // !SD_CARD
+                get_flash_ctx()->Write(address, flashapp->program_buf, len);
+                get_flash_ctx()->EnableMemoryMappedMode();
+                flashapp->changed_sectors++;
+            }
+            hash_next_job(flashapp);
+
+            flashapp->current_program_address += len;
+            flashapp->program_buf += len;
+            flashapp->program_bytes_left -= len;
+            flashapp->progress_value = job->size - flashapp->program_bytes_left;
+        } else {
+            printf("%ld of %ld sectors changed\n", flashapp->changed_sectors,
+                   (job->size + DIFF_SECTOR_SIZE - 1) / DIFF_SECTOR_SIZE);
+            program_changed_sectors = flashapp->changed_sectors;
+            // The hash check turns the memory mapped mode back on
+            get_flash_ctx()->DisableMemoryMappedMode();
+            state_set(FLASHAPP_CHECK_HASH_FLASH_NEXT);
+        }
+        break;
+    case FLASHAPP_HASH:
+        hash_sectors(flashapp);
+        program_start = 0;
+        state_set(FLASHAPP_IDLE);
+        break;
     case FLASHAPP_TEST_NEXT:
         test_flash(flashapp);
         state_inc();
@@ -538,18 +935,22 @@ void flashapp_main(void)
     lcd_set_buffers(framebuffer1, framebuffer1);
 
     while (true) {
-        if (program_chunk_count == 1) {
+        if (flashapp.chunk_count <= 1) {
             sprintf(flashapp.tab.status, " Game and Watch Flash App");
         } else {
             sprintf(flashapp.tab.status, " Game and Watch Flash App (%ld/%ld)",
-                    program_chunk_idx, program_chunk_count);
+                    flashapp.chunk_idx, flashapp.chunk_count);
         }
 
         // Run multiple times to skip rendering when programming
         for (int i = 0; i < 128; i++) {
             wdog_refresh();
             flashapp_run(&flashapp);
-            if (flashapp_state != FLASHAPP_PROGRAM) {
+            if (flashapp_state != FLASHAPP_CHECK_HASH_RAM &&
+                flashapp_state != FLASHAPP_CHECK_HASH_FLASH &&
+                flashapp_state != FLASHAPP_ERASE &&
+                flashapp_state != FLASHAPP_PROGRAM &&
+                flashapp_state != FLASHAPP_DIFF) {
                 break;
             }
         }
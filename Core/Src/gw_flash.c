@@ -6,6 +6,7 @@
 #include <string.h>
 
 #include "gw_flash.h"
+#include "gw_linker.h"
 #include "main.h"
 #include "utils.h"
 
@@ -154,6 +155,8 @@ enum {
     CMD_ERASE2,     // Usually 32kB 52h
     CMD_ERASE3,     // Usually 64kB d8h
     CMD_ERASE4,     // Usually unsupported
+    CMD_ESUS,       // Erase Suspend
+    CMD_ERES,       // Erase Resume
 
     CMD_PP,         // Page Program
     CMD_READ,       // Read Data Bytes
@@ -207,6 +210,8 @@ const flash_cmd_t cmds_spi_24b[CMD_COUNT] = {
     [CMD_ERASE2] = CMD_DEF(0x52, LINES_1, LINES_1, ADDR_SIZE_24B, LINES_0,    0), // BE32K Block Erase 32K
     [CMD_ERASE3] = CMD_DEF(0xD8, LINES_1, LINES_1, ADDR_SIZE_24B, LINES_0,    0), // BE    Block Erase 64K
     [CMD_ERASE4] = { },
+    [CMD_ESUS]   = { },
+    [CMD_ERES]   = { },
     [CMD_PP]     = CMD_DEF(0x02, LINES_1, LINES_1, ADDR_SIZE_24B, LINES_1,    0), // PP
     [CMD_READ]   = CMD_DEF(0x0B, LINES_1, LINES_1, ADDR_SIZE_24B, LINES_1,    8), // FAST_READ dummy=8
 };
@@ -225,6 +230,8 @@ const flash_cmd_t cmds_quad_24b_mx[CMD_COUNT] = {
     [CMD_ERASE2] = CMD_DEF(0x52, LINES_1, LINES_1, ADDR_SIZE_24B, LINES_0,    0), // BE32K Block Erase 32K
     [CMD_ERASE3] = CMD_DEF(0xD8, LINES_1, LINES_1, ADDR_SIZE_24B, LINES_0,    0), // BE    Block Erase 64K
     [CMD_ERASE4] = { },
+    [CMD_ESUS]   = CMD_DEF(0xB0, LINES_1, LINES_0, ADDR_SIZE_24B, LINES_0,    0), // ESUS  Erase Suspend
+    [CMD_ERES]   = CMD_DEF(0x30, LINES_1, LINES_0, ADDR_SIZE_24B, LINES_0,    0), // ERES  Erase Resume
     [CMD_PP]     = CMD_DEF(0x38, LINES_1, LINES_4, ADDR_SIZE_24B, LINES_4,    0), // 4PP
     [CMD_READ]   = CMD_DEF(0xEB, LINES_1, LINES_4, ADDR_SIZE_24B, LINES_4,    6), // 4READ dummy=6
 };
@@ -248,6 +255,8 @@ const flash_cmd_t cmds_apmem_24b[CMD_COUNT] = {
     [CMD_ERASE2]     = CMD_NO_DEF,
     [CMD_ERASE3]     = CMD_NO_DEF,
     [CMD_ERASE4]     = CMD_NO_DEF,
+    [CMD_ESUS]       = CMD_NO_DEF,
+    [CMD_ERES]       = CMD_NO_DEF,
 };
 
 const flash_cmd_t cmds_quad_apmem_24b[CMD_COUNT] = {
@@ -269,6 +278,8 @@ const flash_cmd_t cmds_quad_apmem_24b[CMD_COUNT] = {
     [CMD_ERASE2]     = CMD_NO_DEF,
     [CMD_ERASE3]     = CMD_NO_DEF,
     [CMD_ERASE4]     = CMD_NO_DEF,
+    [CMD_ESUS]       = CMD_NO_DEF,
+    [CMD_ERES]       = CMD_NO_DEF,
 };
 
 const flash_cmd_t cmds_quad_32b_mx[CMD_COUNT] = {
@@ -285,6 +296,8 @@ const flash_cmd_t cmds_quad_32b_mx[CMD_COUNT] = {
     [CMD_ERASE2] = CMD_DEF(0x5C, LINES_1, LINES_1, ADDR_SIZE_32B, LINES_0,    0), // BE32K Block Erase 32K
     [CMD_ERASE3] = CMD_DEF(0xDC, LINES_1, LINES_1, ADDR_SIZE_32B, LINES_0,    0), // BE    Block Erase 64K
     [CMD_ERASE4] = { },
+    [CMD_ESUS]   = CMD_DEF(0xB0, LINES_1, LINES_0, ADDR_SIZE_24B, LINES_0,    0), // ESUS  Erase Suspend
+    [CMD_ERES]   = CMD_DEF(0x30, LINES_1, LINES_0, ADDR_SIZE_24B, LINES_0,    0), // ERES  Erase Resume
     [CMD_PP]     = CMD_DEF(0x3E, LINES_1, LINES_4, ADDR_SIZE_32B, LINES_4,    0), // 4PP4B
     [CMD_READ]   = CMD_DEF(0xEC, LINES_1, LINES_4, ADDR_SIZE_32B, LINES_4,    6), // 4READ4B dummy=6
 };
@@ -303,6 +316,8 @@ const flash_cmd_t cmds_quad_32b_mx54[CMD_COUNT] = {
     [CMD_ERASE2] = CMD_DEF(0x52, LINES_1, LINES_1, ADDR_SIZE_32B, LINES_0,    0), // BE32K Block Erase 32K
     [CMD_ERASE3] = CMD_DEF(0xD8, LINES_1, LINES_1, ADDR_SIZE_32B, LINES_0,    0), // BE    Block Erase 64K
     [CMD_ERASE4] = { },
+    [CMD_ESUS]   = CMD_DEF(0xB0, LINES_1, LINES_0, ADDR_SIZE_24B, LINES_0,    0), // ESUS  Erase Suspend
+    [CMD_ERES]   = CMD_DEF(0x30, LINES_1, LINES_0, ADDR_SIZE_24B, LINES_0,    0), // ERES  Erase Resume
     [CMD_PP]     = CMD_DEF(0x38, LINES_1, LINES_4, ADDR_SIZE_32B, LINES_4,    0), // 4PP
     [CMD_READ]   = CMD_DEF(0xEB, LINES_1, LINES_4, ADDR_SIZE_32B, LINES_4,   10), // 4READ dummy=10
 };
@@ -322,6 +337,8 @@ const flash_cmd_t cmds_quad_32b_s[CMD_COUNT] = {
     [CMD_ERASE2] = { },
     [CMD_ERASE3] = { },
     [CMD_ERASE4] = { },
+    [CMD_ESUS]   = CMD_DEF(0x75, LINES_1, LINES_0, ADDR_SIZE_24B, LINES_0,     0), // ERS   Erase Suspend
+    [CMD_ERES]   = CMD_DEF(0x7A, LINES_1, LINES_0, ADDR_SIZE_24B, LINES_0,     0), // ERR   Erase Resume
     [CMD_PP]     = CMD_DEF(0x12, LINES_1, LINES_1, ADDR_SIZE_32B, LINES_1,     0), // 4PP (no 4PP4B)
     [CMD_READ]   = CMD_DEF(0xEC, LINES_1, LINES_4, ADDR_SIZE_32B, LINES_4, 2 + 8), // 4QIOR
 };
@@ -340,6 +357,8 @@ const flash_cmd_t cmds_quad_24b_issi[CMD_COUNT] = {
     [CMD_ERASE2] = CMD_DEF(0x52, LINES_1, LINES_1, ADDR_SIZE_24B, LINES_0,    0), // BE32K Block Erase 32K
     [CMD_ERASE3] = CMD_DEF(0xD8, LINES_1, LINES_1, ADDR_SIZE_24B, LINES_0,    0), // BE    Block Erase 64K
     [CMD_ERASE4] = { },
+    [CMD_ESUS]   = CMD_DEF(0x75, LINES_1, LINES_0, ADDR_SIZE_24B, LINES_0,    0), // PERSUS Program/Erase Suspend
+    [CMD_ERES]   = CMD_DEF(0x7A, LINES_1, LINES_0, ADDR_SIZE_24B, LINES_0,    0), // PERRSM Program/Erase Resume
     [CMD_PP]     = CMD_DEF(0x38, LINES_1, LINES_1, ADDR_SIZE_24B, LINES_4,    0), // PPQ
     [CMD_READ]   = CMD_DEF(0xEB, LINES_1, LINES_4, ADDR_SIZE_24B, LINES_4,    6), // FRQIO dummy=6
 };
@@ -358,6 +377,8 @@ const flash_cmd_t cmds_quad_24b_wb[CMD_COUNT] = {
     [CMD_ERASE2] = CMD_DEF(0x52, LINES_1, LINES_1, ADDR_SIZE_24B, LINES_0,    0), // Block Erase 32KB
     [CMD_ERASE3] = CMD_DEF(0xD8, LINES_1, LINES_1, ADDR_SIZE_24B, LINES_0,    0), // Block Erase 64KB
     [CMD_ERASE4] = { },
+    [CMD_ESUS]   = CMD_DEF(0x75, LINES_1, LINES_0, ADDR_SIZE_24B, LINES_0,    0), // Erase Suspend
+    [CMD_ERES]   = CMD_DEF(0x7A, LINES_1, LINES_0, ADDR_SIZE_24B, LINES_0,    0), // Erase Resume
     [CMD_PP]     = CMD_DEF(0x32, LINES_1, LINES_1, ADDR_SIZE_24B, LINES_4,    0), // Quad Input Page Program
     [CMD_READ]   = CMD_DEF(0xEB, LINES_1, LINES_4, ADDR_SIZE_24B, LINES_4,    6), // Fast Read Quad I/O
 };
@@ -376,6 +397,8 @@ const flash_cmd_t cmds_quad_32b_wb[CMD_COUNT] = {
     [CMD_ERASE2] = CMD_DEF(0xDC, LINES_1, LINES_1, ADDR_SIZE_32B, LINES_0,    0), // Block Erase 64KB with 4-Byte Address
     [CMD_ERASE3] = { },
     [CMD_ERASE4] = { },
+    [CMD_ESUS]   = CMD_DEF(0x75, LINES_1, LINES_0, ADDR_SIZE_24B, LINES_0,    0), // Erase Suspend
+    [CMD_ERES]   = CMD_DEF(0x7A, LINES_1, LINES_0, ADDR_SIZE_24B, LINES_0,    0), // Erase Resume
     [CMD_PP]     = CMD_DEF(0x34, LINES_1, LINES_1, ADDR_SIZE_32B, LINES_4,    0), // Quad Page Program with 4-Byte Address
     [CMD_READ]   = CMD_DEF(0xEC, LINES_1, LINES_4, ADDR_SIZE_32B, LINES_4,    6), // Fast Read Quad I/O with 4-Byte Address
 };
@@ -642,9 +665,12 @@ static void OSPI_NOR_WriteEnable(void)
     wait_for_status(STATUS_WEL_Msk, STATUS_WEL_Msk, TMO_DEFAULT);
 }
 
+static void job_drain(void);
+
 static void OSPI_ChipErase(void)
 {
     DBG("CE\n");
+    job_drain();
     if (CMD_SUPPORTED(CE) == false)
         return;
 
@@ -652,68 +678,176 @@ static void OSPI_ChipErase(void)
     _OSPI_Erase(CMD(CE), 0); // Chip Erase
 }
 
-static bool OSPI_Erase(uint32_t *address, uint32_t *size)
-{
-    // Performs one erase command per call with the largest size possible.
-    // Sets *address and *size to values that should be passed to
-    // OSPI_Erase in the next iteration.
-    // Returns true when done.
-
-    assert(address != NULL);
-    assert(size != NULL);
-
-    if (CMD_SUPPORTED(ERASE1) == false)
-        return true;
+static struct flash_erase_stats erase_stats;
 
-    uint32_t req_address = *address;
-    uint32_t req_size = *size;
+// Last command issued by OSPI_EraseAsync() or OSPI_ProgramAsync(), shared
+// by the job queue and the FlashCtx users of the async commands
+static struct {
+    bool erasing;   // Was an erase
+    bool suspended; // Erase suspended so the flash can be read
+} async;
 
-    DBG("E 0x%lx %ld\n", req_address, req_size);
+static bool OSPI_IsBlank(uint32_t address, uint32_t size)
+{
+    // Reads the flash with the memory mapped mode off, the flash must be idle
+    uint32_t buffer[64];
+
+    for (uint32_t offset = 0; offset < size; offset += sizeof(buffer)) {
+        OSPI_ReadBytes(CMD(READ), address + offset, (uint8_t *) buffer, sizeof(buffer));
+        for (int i = 0; i < ARRAY_SIZE(buffer); i++) {
+            if (buffer[i] != 0xFFFFFFFF)
+                return false;
+        }
+    }
+    return true;
+}
 
+static uint32_t OSPI_PlanErase(uint32_t address, uint32_t size, bool full, int *index)
+{
+    // Plans the next erase of the range: the largest aligned erase that
+    // fits, unless most of its sectors are blank already, then a smaller one
+    // is used. Returns the bytes covered and sets *index to the erase
+    // command, or to -1 if the bytes are blank and need no erase.
+    //
+    // Without full, only the first sector is checked to keep the async
+    // slices short: it's skipped if blank, otherwise the largest erase is
+    // used.
+    //
     // Assumes that erase sizes are sorted: 4 > 3 > 2 > 1.
     // Assumes that erase sizes are powers of two.
-
     const flash_cmd_t * erase_cmd[] = {
         CMD(ERASE1),
         CMD(ERASE2),
         CMD(ERASE3),
         CMD(ERASE4),
     };
+    const uint32_t sector_size = flash.config->erase_sizes[0];
+    uint32_t dirty = 0;
+    int top = -1;
 
     for (int i = 3; i >= 0; i--) {
         uint32_t erase_size = flash.config->erase_sizes[i];
 
-        if (erase_size == 0) {
+        if (erase_size == 0 || erase_cmd[i]->instr_lines == LINES_0)
             continue;
+
+        if ((size >= erase_size) && ((address & (erase_size - 1)) == 0)) {
+            top = i;
+            break;
         }
+    }
+
+    if (top < 0) {
+        DBG("No suitable erase command found for addr=%08lx size=%ld!\n", address, size);
+        assert(!"Unsupported erase operation!");
+        *index = -1;
+        return size;
+    }
 
-        if ((req_size >= erase_size) && ((req_address & (erase_size - 1)) == 0)) {
-            *size = req_size - erase_size;
-            *address = req_address + erase_size;
+    // Sectors of the largest erase that hold data, 32 at most
+    uint32_t sectors = flash.config->erase_sizes[top] / sector_size;
+    if (sectors > 32)
+        sectors = 32;
+    if (!full)
+        sectors = 1;
+    for (uint32_t i = 0; i < sectors; i++) {
+        if (!OSPI_IsBlank(address + i * sector_size, sector_size))
+            dirty |= 1UL << i;
+    }
 
-            DBG("Erasing block (%ld): 0x%08lx (%ld left)\n", erase_size, req_address, *size);
+    for (int i = top; i > 0; i--) {
+        const uint32_t erase_size = flash.config->erase_sizes[i];
+        const uint32_t count = erase_size / sector_size < sectors ? erase_size / sector_size : sectors;
+        const uint32_t mask = count < 32 ? (1UL << count) - 1 : UINT32_MAX;
 
-            OSPI_NOR_WriteEnable();
-            _OSPI_Erase(erase_cmd[i], req_address);
+        if (erase_size == 0 || erase_cmd[i]->instr_lines == LINES_0)
+            continue;
 
-            return (*size == 0);
+        if (2 * __builtin_popcount(dirty & mask) > count) {
+            *index = i;
+            return erase_size;
         }
     }
 
-    DBG("No suitable erase command found for addr=%08lx size=%ld!\n", *address, *size);
+    if (!(dirty & 1)) {
+        // Skip the blank sectors up to the first one with data
+        uint32_t blank = 1;
+        while (blank < sectors && !(dirty & (1UL << blank)))
+            blank++;
+        *index = -1;
+        return blank * sector_size;
+    }
 
-    assert(!"Unsupported erase operation!");
+    *index = 0;
+    return sector_size;
+}
 
-    return false;
+static uint32_t OSPI_IssueErase(uint32_t address, uint32_t size, bool wait)
+{
+    // Erases the next part of the range, returns the bytes done
+    const flash_cmd_t * erase_cmd[] = {
+        CMD(ERASE1),
+        CMD(ERASE2),
+        CMD(ERASE3),
+        CMD(ERASE4),
+    };
+    int index;
+    uint32_t len = OSPI_PlanErase(address, size, wait, &index);
+
+    if (len > size)
+        len = size;
+
+    if (index < 0) {
+        erase_stats.blank_bytes += len;
+        return len;
+    }
+
+    DBG("Erasing block (%ld): 0x%08lx (%ld left)\n", len, address, size - len);
+
+    erase_stats.ops[index]++;
+    OSPI_NOR_WriteEnable();
+    if (wait) {
+        _OSPI_Erase(erase_cmd[index], address);
+    } else {
+        OSPI_WriteBytes(erase_cmd[index], address, NULL, 0);
+        async.erasing = true;
+    }
+
+    return len;
 }
 
 static void OSPI_EraseSync(uint32_t address, uint32_t size)
 {
-    bool ret;
+    const struct flash_erase_stats start = erase_stats;
 
-    do {
-        ret = OSPI_Erase(&address, &size);
-    } while (ret == false);
+    job_drain();
+
+    if (CMD_SUPPORTED(ERASE1) == false)
+        return;
+
+    DBG("E 0x%lx %ld\n", address, size);
+
+    if (address == 0 && size >= __SPI_FLASH_SIZE__ && CMD_SUPPORTED(CE)) {
+        OSPI_ChipErase();
+        erase_stats.chip_erases++;
+        return;
+    }
+
+    while (size > 0) {
+        uint32_t len = OSPI_IssueErase(address, size, true);
+        address += len;
+        size -= len;
+    }
+
+    DBG("Erase: %ld+%ld+%ld+%ld commands, %ld KB blank\n",
+        erase_stats.ops[0] - start.ops[0], erase_stats.ops[1] - start.ops[1],
+        erase_stats.ops[2] - start.ops[2], erase_stats.ops[3] - start.ops[3],
+        (erase_stats.blank_bytes - start.blank_bytes) / 1024);
+}
+
+void flash_get_erase_stats(struct flash_erase_stats *stats)
+{
+    *stats = erase_stats;
 }
 
 static void OSPI_PageProgram(uint32_t address,
@@ -744,6 +878,8 @@ static void OSPI_Program(uint32_t address,
 
     assert((address & 0xff) == 0);
 
+    job_drain();
+
     for (int i = 0; i < iterations; i++) {
         OSPI_NOR_WriteEnable();
         OSPI_PageProgram((i + dest_page) * page_size,
@@ -753,6 +889,237 @@ static void OSPI_Program(uint32_t address,
     }
 }
 
+static bool OSPI_IsBusy(void)
+{
+    uint8_t status;
+
+    if (CMD_SUPPORTED(RDSR) == false)
+        return false;
+
+    OSPI_ReadBytes(CMD(RDSR), 0, &status, 1);
+    return (status & STATUS_WIP_Msk) != 0;
+}
+
+static bool erase_can_suspend(void)
+{
+    return CMD_SUPPORTED(ESUS) && CMD_SUPPORTED(ERES) && CMD_SUPPORTED(RDSR);
+}
+
+static bool OSPI_SuspendErase(void)
+{
+    // Suspends the async erase if it's still running. Returns false if the
+    // last async command was a program or the chip can't suspend, the
+    // caller waits for it then.
+    if (!async.erasing)
+        return false;
+    if (async.suspended)
+        return true;
+    if (!OSPI_IsBusy()) {
+        async.erasing = false;
+        return true;
+    }
+    if (!erase_can_suspend())
+        return false;
+
+    // Suspending an erase that just ended is ignored, the resume too then
+    OSPI_WriteBytes(CMD(ESUS), 0, NULL, 0);
+    wait_for_status(STATUS_WIP_Msk, 0, TMO_DEFAULT);
+    async.suspended = true;
+    return true;
+}
+
+static bool OSPI_ResumeErase(void)
+{
+    if (!async.suspended)
+        return false;
+
+    OSPI_WriteBytes(CMD(ERES), 0, NULL, 0);
+    async.suspended = false;
+    return true;
+}
+
+static void OSPI_FinishErase(void)
+{
+    // Completes a suspended erase before a command that doesn't expect one
+    if (OSPI_ResumeErase())
+        wait_for_status(STATUS_WIP_Msk, 0, 0);
+    async.erasing = false;
+}
+
+static uint32_t OSPI_EraseAsync(uint32_t address, uint32_t size)
+{
+    // Issues the next erase of the range without waiting for it to
+    // complete, or none if the start is blank. Returns the size done.
+    if (CMD_SUPPORTED(ERASE1) == false)
+        return size;
+
+    OSPI_FinishErase();
+    return OSPI_IssueErase(address, size, false);
+}
+
+static size_t OSPI_ProgramAsync(uint32_t address, const void *buffer, size_t buffer_size)
+{
+    // Programs up to the end of the page without waiting for it to
+    // complete. Returns the programmed size.
+    const uint32_t page_size = flash.config->page_size;
+    const size_t page_left = page_size - (address % page_size);
+    const size_t len = buffer_size < page_left ? buffer_size : page_left;
+
+    OSPI_FinishErase();
+    OSPI_NOR_WriteEnable();
+    OSPI_WriteBytes(CMD(PP), address, buffer, len);
+    return len;
+}
+
+// Erases and programs queued by flash_job_*() and advanced in time slices,
+// the memory mapped mode is back on between the slices. An erase still
+// running at the end of a slice is suspended if the chip supports it,
+// otherwise the slice waits for it and the erases are done in the smallest
+// size to keep the wait short.
+#define JOB_MAX      8
+#define JOB_SLICE_MS 2
+
+typedef struct {
+    bool           erase;
+    uint32_t       start;   // Range of the whole job, for the overlap check
+    uint32_t       address; // Left to do
+
+    const uint8_t *data;
+    uint32_t       size;
+} flash_job_t;
+
+static struct {
+    flash_job_t queue[JOB_MAX];
+    uint32_t    head;
+    uint32_t    count;
+    bool        busy;      // Last command not known to be done
+} jobs;
+
+static void job_issue(flash_job_t *job)
+{
+    uint32_t len;
+
+    if (job->erase) {
+        const uint32_t smallest = flash.config->erase_sizes[0];
+        uint32_t size = job->size;
+
+        if (!erase_can_suspend() && smallest != 0 && size > smallest)
+            size = smallest;
+        len = OSPI_EraseAsync(job->address, size);
+    } else {
+        len = OSPI_ProgramAsync(job->address, job->data, job->size);
+        job->data += len;
+    }
+
+    job->address += len;
+    job->size -= len;
+    jobs.busy = true;
+}
+
+static bool job_run(uint32_t slice_ms)
+{
+    // Runs the queue for slice_ms, or until it's empty with 0. The memory
+    // mapped mode must be off. Returns true if jobs are left.
+    const uint32_t t0 = HAL_GetTick();
+
+    if (OSPI_ResumeErase())
+        jobs.busy = true;
+
+    do {
+        if (jobs.busy) {
+            if (OSPI_IsBusy())
+                continue;
+            jobs.busy = false;
+        }
+
+        while (jobs.count > 0 && jobs.queue[jobs.head].size == 0) {
+            jobs.head = (jobs.head + 1) % JOB_MAX;
+            jobs.count--;
+        }
+        if (jobs.count == 0)
+            return false;
+
+        job_issue(&jobs.queue[jobs.head]);
+    } while (slice_ms == 0 || HAL_GetTick() - t0 < slice_ms);
+
+    // Leave the chip readable for the memory mapped mode
+    if (jobs.busy && !OSPI_SuspendErase()) {
+        wait_for_status(STATUS_WIP_Msk, 0, 0);
+        jobs.busy = false;
+    }
+
+    return true;
+}
+
+static void job_drain(void)
+{
+    if (jobs.count > 0)
+        job_run(0);
+    OSPI_FinishErase();
+}
+
+static void job_add(bool erase, uint32_t address, const void *data, uint32_t size)
+{
+    if (size == 0)
+        return;
+
+    if (jobs.count == JOB_MAX)
+        flash_job_flush();
+
+    jobs.queue[(jobs.head + jobs.count) % JOB_MAX] = (flash_job_t) {
+        .erase = erase,
+        .start = address,
+        .address = address,
+        .data = data,
+        .size = size,
+    };
+    jobs.count++;
+}
+
+void flash_job_erase(uint32_t address, uint32_t size)
+{
+    job_add(true, address, NULL, size);
+}
+
+void flash_job_program(uint32_t address, const void *data, uint32_t size)
+{
+    job_add(false, address, data, size);
+}
+
+bool flash_job_pending(uint32_t address, uint32_t size)
+{
+    for (uint32_t i = 0; i < jobs.count; i++) {
+        const flash_job_t *job = &jobs.queue[(jobs.head + i) % JOB_MAX];
+
+        if (address < job->address + job->size && job->start < address + size)
+            return true;
+    }
+    return false;
+}
+
+bool flash_job_step(void)
+{
+    bool pending;
+
+    if (jobs.count == 0)
+        return false;
+
+    OSPI_DisableMemoryMappedMode();
+    pending = job_run(JOB_SLICE_MS);
+    OSPI_EnableMemoryMappedMode();
+    return pending;
+}
+
+void flash_job_flush(void)
+{
+    if (jobs.count == 0)
+        return;
+
+    OSPI_DisableMemoryMappedMode();
+    job_drain();
+    OSPI_EnableMemoryMappedMode();
+}
+
 static void OSPI_ReadJedecId(uint8_t dest[3])
 {
     uint8_t id[8];
@@ -987,12 +1354,20 @@ static void OSPI_Init(OSPI_HandleTypeDef *hospi)
         flash.config->init_fn();
     }
 
+    if (!erase_can_suspend()) {
+        FlashCtx.SuspendErase = NULL;
+        FlashCtx.ResumeErase = NULL;
+    }
+
     OSPI_EnableMemoryMappedMode();
 }
 
 static void OSPI_Read(uint32_t address, void *buffer, size_t buffer_size)
 {
     assert(flash.mem_mapped_enabled == true);
+    // The queued writes are done before reading them back
+    if (flash_job_pending(address - (uint32_t) &__EXTFLASH_BASE__, buffer_size))
+        flash_job_flush();
     memcpy(buffer, (void *)address, buffer_size);
 }
 
@@ -1009,5 +1384,10 @@ struct FlashCtx FlashCtx = {
     .ReadCR = OSPI_ReadCR,
     .GetSmallestEraseSize = OSPI_GetSmallestEraseSize,
     .GetName = OSPI_GetFlashName,
+    .IsBusy = OSPI_IsBusy,
+    .EraseAsync = OSPI_EraseAsync,
+    .ProgramAsync = OSPI_ProgramAsync,
+    .SuspendErase = OSPI_SuspendErase,
+    .ResumeErase = OSPI_ResumeErase,
     .Presented = true,
 };
@@ -0,0 +1,526 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "gw_fs.h"
+
+// NOTE Keep this file free of the HAL and board dependencies, so it could
+// be built on the host against disk images.
+
+#define FS_DIR_ENTRY_SIZE 32
+#define FS_MAX_NAME 255
+#define FS_NO_SECTOR UINT64_MAX
+
+#define MBR_PARTITION_TABLE 446
+#define MBR_PARTITION_ENTRY_SIZE 16
+#define MBR_PARTITIONS 4
+#define MBR_PARTITION_TYPE 4
+#define MBR_PARTITION_LBA 8
+#define BOOT_SIGNATURE 0xAA55
+
+#define FAT32_ATTR_VOLUME_ID 0x08
+#define FAT32_ATTR_DIRECTORY 0x10
+#define FAT32_ATTR_LFN 0x0F
+#define FAT32_ENTRY_FREE 0xE5
+#define FAT32_LFN_LAST 0x40
+#define FAT32_LFN_CHARS 13
+
+#define EXFAT_ENTRY_FILE 0x85
+#define EXFAT_ENTRY_STREAM 0xC0
+#define EXFAT_ENTRY_NAME 0xC1
+#define EXFAT_ENTRY_SECONDARY 0xC0
+#define EXFAT_ATTR_DIRECTORY 0x10
+#define EXFAT_FLAG_NO_FAT_CHAIN 0x02
+#define EXFAT_NAME_CHARS 15
+
+enum fs_type {
+    FS_NONE = 0,
+    FS_FAT32,
+    FS_EXFAT,
+};
+
+static struct {
+    fs_read_sectors_fn read;
+    enum fs_type type;
+    uint64_t fat_lba;
+    uint64_t data_lba;      /* First sector of the cluster 2 */
+    uint32_t cluster_shift; /* log2 of sectors per cluster */
+    uint32_t cluster_count;
+    uint32_t root_cluster;
+    uint64_t fat_cached_lba;
+    uint64_t dir_cached_lba;
+    uint8_t fat_sector[FS_SECTOR_SIZE];
+    uint8_t dir_sector[FS_SECTOR_SIZE];
+    uint8_t bounce[FS_SECTOR_SIZE];
+} fs;
+
+struct fs_entry {
+    uint32_t first_cluster;
+    uint64_t size;
+    bool is_dir;
+    bool no_fat_chain;
+};
+
+static uint16_t rd16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t rd32(const uint8_t *p) {
+    return rd16(p) | ((uint32_t)rd16(p + 2) << 16);
+}
+
+static uint64_t rd64(const uint8_t *p) {
+    return rd32(p) | ((uint64_t)rd32(p + 4) << 32);
+}
+
+static char fs_upper(char c) {
+    return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
+
+static bool name_equal(const uint16_t *name, size_t name_len, const char *str, size_t len) {
+    if (name_len != len)
+        return false;
+
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] > 0x7F || fs_upper(name[i]) != fs_upper(str[i]))
+            return false;
+    }
+
+    return true;
+}
+
+// =============================================================================
+// Mount
+// =============================================================================
+
+static bool parse_boot_sector(const uint8_t *bs, uint64_t part_lba) {
+    if (!memcmp(&bs[3], "EXFAT   ", 8)) {
+        // Only 512 bytes sectors are supported
+        if (bs[108] != 9) {
+            printf("FS: Unsupported exFAT sector size\n");
+            return false;
+        }
+
+        fs.type = FS_EXFAT;
+        fs.fat_lba = part_lba + rd32(&bs[80]);
+        fs.data_lba = part_lba + rd32(&bs[88]);
+        fs.cluster_count = rd32(&bs[92]);
+        fs.root_cluster = rd32(&bs[96]);
+        fs.cluster_shift = bs[109];
+        return true;
+    }
+
+    if (rd16(&bs[510]) != BOOT_SIGNATURE || memcmp(&bs[82], "FAT32", 5))
+        return false;
+
+    const uint32_t sector_size = rd16(&bs[11]);
+    const uint32_t cluster_sectors = bs[13];
+    const uint32_t reserved = rd16(&bs[14]);
+    const uint32_t num_fats = bs[16];
+    const uint32_t total_sectors = rd32(&bs[32]);
+    const uint32_t fat_size = rd32(&bs[36]);
+
+    if (sector_size != FS_SECTOR_SIZE || !cluster_sectors ||
+        (cluster_sectors & (cluster_sectors - 1)) || !num_fats || !fat_size) {
+        printf("FS: Unsupported FAT32 geometry\n");
+        return false;
+    }
+
+    fs.type = FS_FAT32;
+    fs.fat_lba = part_lba + reserved;
+    fs.data_lba = fs.fat_lba + (uint64_t)num_fats * fat_size;
+    fs.cluster_shift = __builtin_ctz(cluster_sectors);
+    fs.cluster_count = (total_sectors - (fs.data_lba - part_lba)) >> fs.cluster_shift;
+    fs.root_cluster = rd32(&bs[44]);
+    return true;
+}
+
+bool fs_mount(fs_read_sectors_fn read_sectors) {
+    uint8_t *sector = fs.bounce;
+
+    memset(&fs, 0, sizeof(fs));
+    fs.read = read_sectors;
+    fs.fat_cached_lba = FS_NO_SECTOR;
+    fs.dir_cached_lba = FS_NO_SECTOR;
+
+    // Superfloppy, no partition table
+    fs.read(0, sector, 1);
+    if (parse_boot_sector(sector, 0))
+        return true;
+
+    if (rd16(&sector[510]) != BOOT_SIGNATURE) {
+        printf("FS: No boot signature\n");
+        return false;
+    }
+
+    // The first partition of the G&W cards is the raw image (see gw_sd.h),
+    // the volume is the first one with a FAT32/exFAT boot sector
+    uint64_t part_lba[MBR_PARTITIONS];
+    for (int i = 0; i < MBR_PARTITIONS; i++) {
+        const uint8_t *part = &sector[MBR_PARTITION_TABLE + i * MBR_PARTITION_ENTRY_SIZE];
+        part_lba[i] = part[MBR_PARTITION_TYPE] ? rd32(&part[MBR_PARTITION_LBA]) : 0;
+    }
+
+    for (int i = 0; i < MBR_PARTITIONS; i++) {
+        if (!part_lba[i])
+            continue;
+
+        fs.read(part_lba[i], sector, 1);
+        if (parse_boot_sector(sector, part_lba[i]))
+            return true;
+    }
+
+    printf("FS: No FAT32/exFAT volume found\n");
+    fs.type = FS_NONE;
+    return false;
+}
+
+// =============================================================================
+// Cluster chains
+// =============================================================================
+
+static bool is_valid_cluster(uint32_t cluster) {
+    return cluster >= 2 && cluster - 2 < fs.cluster_count;
+}
+
+static uint64_t cluster_lba(uint32_t cluster) {
+    return fs.data_lba + ((uint64_t)(cluster - 2) << fs.cluster_shift);
+}
+
+static uint32_t next_cluster(uint32_t cluster) {
+    const uint32_t per_sector = FS_SECTOR_SIZE / sizeof(uint32_t);
+    const uint64_t lba = fs.fat_lba + cluster / per_sector;
+
+    if (lba != fs.fat_cached_lba) {
+        fs.read(lba, fs.fat_sector, 1);
+        fs.fat_cached_lba = lba;
+    }
+
+    const uint32_t next = rd32(&fs.fat_sector[(cluster % per_sector) * sizeof(uint32_t)]);
+    return fs.type == FS_FAT32 ? next & 0x0FFFFFFF : next;
+}
+
+static bool add_extent(struct fs_file *file, uint64_t lba, uint32_t count) {
+    if (file->num_extents) {
+        struct fs_extent *last = &file->extent[file->num_extents - 1];
+        if (last->lba + last->count == lba) {
+            last->count += count;
+            return true;
+        }
+    }
+
+    if (file->num_extents == FS_MAX_EXTENTS)
+        return false;
+
+    file->extent[file->num_extents].lba = lba;
+    file->extent[file->num_extents].count = count;
+    file->num_extents++;
+    return true;
+}
+
+// Directories without the size (FAT32) follow the chain to its end
+static bool build_extents(const struct fs_entry *entry, struct fs_file *file) {
+    const uint32_t cluster_sectors = 1UL << fs.cluster_shift;
+    const uint64_t cluster_bytes = (uint64_t)cluster_sectors * FS_SECTOR_SIZE;
+    const bool sized = !entry->is_dir || entry->size;
+    const uint64_t clusters = (entry->size + cluster_bytes - 1) / cluster_bytes;
+    uint32_t cluster = entry->first_cluster;
+
+    file->size = entry->size;
+    file->num_extents = 0;
+    if (sized && !clusters)
+        return true;
+
+    if (entry->no_fat_chain) {
+        if (!is_valid_cluster(cluster) || clusters > fs.cluster_count) {
+            printf("FS: Invalid contiguous allocation\n");
+            return false;
+        }
+
+        return add_extent(file, cluster_lba(cluster), clusters << fs.cluster_shift);
+    }
+
+    for (uint64_t i = 0; !sized || i < clusters; i++) {
+        if (!is_valid_cluster(cluster)) {
+            if (sized) {
+                printf("FS: Broken cluster chain\n");
+                return false;
+            }
+            break;
+        }
+
+        if (!add_extent(file, cluster_lba(cluster), cluster_sectors)) {
+            printf("FS: File is too fragmented\n");
+            return false;
+        }
+
+        cluster = next_cluster(cluster);
+    }
+
+    if (!sized) {
+        for (uint32_t i = 0; i < file->num_extents; i++)
+            file->size += (uint64_t)file->extent[i].count * FS_SECTOR_SIZE;
+    }
+
+    return true;
+}
+
+// =============================================================================
+// Directories
+// =============================================================================
+
+static const uint8_t *dir_entry(const struct fs_file *dir, uint32_t index) {
+    uint32_t contiguous;
+    const uint64_t pos = (uint64_t)index * FS_DIR_ENTRY_SIZE;
+    const uint64_t lba = fs_file_lba(dir, pos, &contiguous);
+
+    if (!contiguous)
+        return NULL;
+
+    if (lba != fs.dir_cached_lba) {
+        fs.read(lba, fs.dir_sector, 1);
+        fs.dir_cached_lba = lba;
+    }
+
+    return &fs.dir_sector[pos % FS_SECTOR_SIZE];
+}
+
+static uint8_t sfn_checksum(const uint8_t *e) {
+    uint8_t sum = 0;
+
+    for (int i = 0; i < 11; i++)
+        sum = ((sum & 1) << 7) + (sum >> 1) + e[i];
+
+    return sum;
+}
+
+static bool sfn_equal(const uint8_t *e, const char *name, size_t len) {
+    uint16_t sfn[12];
+    size_t n = 0;
+
+    for (int i = 0; i < 8 && e[i] != ' '; i++)
+        sfn[n++] = (i == 0 && e[i] == 0x05) ? FAT32_ENTRY_FREE : e[i];
+
+    if (e[8] != ' ') {
+        sfn[n++] = '.';
+        for (int i = 8; i < 11 && e[i] != ' '; i++)
+            sfn[n++] = e[i];
+    }
+
+    return name_equal(sfn, n, name, len);
+}
+
+static bool fat32_find(const struct fs_file *dir, const char *name, size_t len,
+                       struct fs_entry *out) {
+    static const uint8_t lfn_offsets[FAT32_LFN_CHARS] = {
+        1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30
+    };
+    uint16_t lfn[FAT32_LFN_CHARS * 20];
+    size_t lfn_len = 0;
+    uint8_t lfn_checksum = 0;
+    bool lfn_valid = false;
+
+    for (uint32_t i = 0;; i++) {
+        const uint8_t *e = dir_entry(dir, i);
+        if (!e || e[0] == 0x00)
+            return false;
+
+        if (e[0] == FAT32_ENTRY_FREE) {
+            lfn_valid = false;
+            continue;
+        }
+
+        if (e[11] == FAT32_ATTR_LFN) {
+            const uint32_t ord = e[0] & 0x1F;
+
+            if (e[0] & FAT32_LFN_LAST) {
+                lfn_valid = ord && ord * FAT32_LFN_CHARS <= sizeof(lfn) / sizeof(lfn[0]);
+                lfn_len = ord * FAT32_LFN_CHARS;
+                lfn_checksum = e[13];
+            }
+
+            if (!lfn_valid || !ord || e[13] != lfn_checksum) {
+                lfn_valid = false;
+                continue;
+            }
+
+            for (int k = 0; k < FAT32_LFN_CHARS; k++) {
+                const size_t pos = (ord - 1) * FAT32_LFN_CHARS + k;
+                const uint16_t c = rd16(&e[lfn_offsets[k]]);
+
+                if (c == 0x0000 && pos < lfn_len)
+                    lfn_len = pos;
+                if (pos < lfn_len)
+                    lfn[pos] = c;
+            }
+            continue;
+        }
+
+        if (e[11] & FAT32_ATTR_VOLUME_ID) {
+            lfn_valid = false;
+            continue;
+        }
+
+        const bool use_lfn = lfn_valid && lfn_checksum == sfn_checksum(e);
+        lfn_valid = false;
+
+        if ((use_lfn && name_equal(lfn, lfn_len, name, len)) || sfn_equal(e, name, len)) {
+            out->first_cluster = ((uint32_t)rd16(&e[20]) << 16) | rd16(&e[26]);
+            out->is_dir = e[11] & FAT32_ATTR_DIRECTORY;
+            out->size = out->is_dir ? 0 : rd32(&e[28]);
+            out->no_fat_chain = false;
+            return true;
+        }
+    }
+}
+
+static bool exfat_find(const struct fs_file *dir, const char *name, size_t len,
+                       struct fs_entry *out) {
+    uint16_t entry_name[FS_MAX_NAME];
+    struct fs_entry entry = {};
+    uint32_t secondary = 0;
+    size_t name_len = 0;
+    size_t got = 0;
+
+    for (uint32_t i = 0;; i++) {
+        const uint8_t *e = dir_entry(dir, i);
+        if (!e || e[0] == 0x00)
+            return false;
+
+        switch (e[0]) {
+        case EXFAT_ENTRY_FILE:
+            secondary = e[1];
+            entry.is_dir = rd16(&e[4]) & EXFAT_ATTR_DIRECTORY;
+            name_len = 0;
+            got = 0;
+            break;
+        case EXFAT_ENTRY_STREAM:
+            if (!secondary)
+                break;
+
+            secondary--;
+            entry.no_fat_chain = e[1] & EXFAT_FLAG_NO_FAT_CHAIN;
+            entry.first_cluster = rd32(&e[20]);
+            entry.size = rd64(&e[24]);
+            name_len = e[3];
+            break;
+        case EXFAT_ENTRY_NAME:
+            if (!secondary)
+                break;
+
+            secondary--;
+            for (int k = 0; k < EXFAT_NAME_CHARS && got < name_len && got < FS_MAX_NAME; k++)
+                entry_name[got++] = rd16(&e[2 + 2 * k]);
+
+            if (got == name_len && name_equal(entry_name, got, name, len)) {
+                *out = entry;
+                return true;
+            }
+            break;
+        default:
+            // Skip unknown secondary entries of the set, e.g. vendor ones
+            if (secondary && (e[0] & EXFAT_ENTRY_SECONDARY) == EXFAT_ENTRY_SECONDARY)
+                secondary--;
+            else
+                secondary = 0;
+            break;
+        }
+    }
+}
+
+// =============================================================================
+// Files
+// =============================================================================
+
+bool fs_open(const char *path, struct fs_file *file) {
+    struct fs_entry entry = {
+        .first_cluster = fs.root_cluster,
+        .is_dir = true,
+    };
+
+    if (fs.type == FS_NONE)
+        return false;
+
+    while (*path) {
+        while (*path == '/')
+            path++;
+
+        if (!*path)
+            break;
+
+        const char *end = strchr(path, '/');
+        const size_t len = end ? (size_t)(end - path) : strlen(path);
+
+        // The file is used to hold the directory being searched
+        if (!entry.is_dir || !build_extents(&entry, file))
+            return false;
+
+        const bool found = fs.type == FS_EXFAT ? exfat_find(file, path, len, &entry) :
+                                                 fat32_find(file, path, len, &entry);
+        if (!found)
+            return false;
+
+        path += len;
+    }
+
+    if (entry.is_dir)
+        return false;
+
+    return build_extents(&entry, file);
+}
+
+uint64_t fs_file_lba(const struct fs_file *file, uint64_t pos, uint32_t *contiguous) {
+    uint64_t sector = pos / FS_SECTOR_SIZE;
+
+    *contiguous = 0;
+    if (pos >= file->size)
+        return 0;
+
+    for (uint32_t i = 0; i < file->num_extents; i++) {
+        if (sector < file->extent[i].count) {
+            *contiguous = file->extent[i].count - sector;
+            return file->extent[i].lba + sector;
+        }
+
+        sector -= file->extent[i].count;
+    }
+
+    return 0;
+}
+
+void fs_read(const struct fs_file *file, uint64_t pos, void *pbuffer, size_t size) {
+    uint8_t *buffer = (uint8_t *)pbuffer;
+
+    while (size) {
+        uint32_t contiguous;
+        const uint64_t lba = fs_file_lba(file, pos, &contiguous);
+        const uint32_t offset = pos % FS_SECTOR_SIZE;
+        size_t bytes_read;
+
+        if (!contiguous) {
+            printf("FS: Read beyond the end of file\n");
+            return;
+        }
+
+        if (offset || size < FS_SECTOR_SIZE) {
+            // Partial sector
+            bytes_read = FS_SECTOR_SIZE - offset;
+            if (bytes_read > size)
+                bytes_read = size;
+
+            fs.read(lba, fs.bounce, 1);
+            memcpy(buffer, &fs.bounce[offset], bytes_read);
+        } else {
+            // Whole sectors of the contiguous run at once
+            uint64_t sectors = size / FS_SECTOR_SIZE;
+            if (sectors > contiguous)
+                sectors = contiguous;
+
+            fs.read(lba, buffer, sectors);
+            bytes_read = sectors * FS_SECTOR_SIZE;
+        }
+
+        buffer += bytes_read;
+        pos += bytes_read;
+        size -= bytes_read;
+    }
+}
@@ -5,14 +5,17 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "crc32.h"
 #include "gw_flash.h"
+#include "gw_sd.h"
 #include "softspi.h"
 #include "main.h"
 #include "utils.h"
 
-// NOTE Use switch_ospi_gpio() in every exported function that uses sd card
-// and swtich back to ospi before exit. This is needed since flash memory
-// is memory-mmaped and should always be ready to be used, so it is more
+// NOTE Use sd_session_begin() in every exported function that uses sd card
+// and sd_session_end() before exit. When the last session is closed the pins
+// are switched back to ospi. This is needed since flash memory is
+// memory-mmaped and should always be ready to be used, so it is more
 // prioritised.
 
 #define DBG(...) printf(__VA_ARGS__)
@@ -25,11 +28,22 @@
 
 #include "gw_linker.h"
 static const uint32_t SD_BASE_ADDRESS = (uint32_t)&__EXTFLASH_START__;
+#define SD_IMAGE_OFFSET (SD_IMAGE_LBA * BLOCK_SIZE)
 
 static struct {
     SoftSPI spi[1];
     bool isSdV2 : 1;
     bool ccs : 1;
+    struct {
+        bool active : 1;
+        uint32_t block_offset; /* Bytes already consumed from the current block */
+    } read_stream;
+    struct {
+        bool active : 1;
+        uint32_t block_offset; /* Bytes already sent to the current block */
+        uint32_t block;        /* Current card block number */
+    } write_stream;
+    uint32_t session_refs;
 } sd = {
     .spi[0] = {
         .sck = { .port = GPIO_FLASH_CLK_GPIO_Port, .pin = GPIO_FLASH_CLK_Pin },
@@ -37,18 +51,51 @@ static struct {
         .miso = { .port = GPIO_FLASH_MISO_GPIO_Port, .pin = GPIO_FLASH_MISO_Pin },
         .cs = { .port = GPIO_FLASH_NCS_GPIO_Port, .pin = GPIO_FLASH_NCS_Pin },
         .DelayUs = 20,
+        .HalfPeriod = SOFTSPI_HALF_PERIOD,
         .csIsInverted = true
     }
 };
 
+// =============================================================================
+// Sessions
+//
+// The pins are only switched back to the ospi when the outermost session
+// ends, so batched sd work pays for the switch once. Flash accesses inside
+// of a session take the pins back to ospi on their own, so the pins
+// are (re)taken on every sd_session_begin() call.
+// =============================================================================
+
+void sd_session_begin(void) {
+    switch_ospi_gpio(false);
+    sd.session_refs++;
+}
+
+void sd_session_end(void) {
+    assert(sd.session_refs && "Unbalanced SD session end");
+
+    if (--sd.session_refs == 0)
+        switch_ospi_gpio(true);
+}
+
 // =============================================================================
 // SD card responses
 // =============================================================================
 
 #define START_BLOCK_TOKEN 0xFE
+#define START_MULTI_BLOCK_TOKEN 0xFC
+#define STOP_TRAN_TOKEN 0xFD
 
 typedef bool (*response_fn)(uint8_t *r);
 
+static void wait_not_busy(void) {
+    uint8_t rbyte;
+
+    // We would fail on watchdog if something is wrong here
+    do {
+        SoftSpi_WriteDummyRead(sd.spi, &rbyte, 1);
+    } while (rbyte == 0x00);
+}
+
 #define R1_IDLE 0ULL
 #define R1_ERASE_RESET 1ULL
 #define R1_ILLEGAL_COMMAND 2ULL
@@ -66,6 +113,24 @@ static bool responseR1(uint8_t *r) {
     return *r != 0xFF;
 }
 
+// R1b is used by STOP_TRANSMISSION. The byte following the command is
+// a stuff byte, the card might still clock out data bytes until the
+// response is ready, so only the msb is reliable to detect the response.
+static bool responseR1b(uint8_t *r) {
+    // Skip stuff byte
+    SoftSpi_WriteDummyRead(sd.spi, NULL, 1);
+
+    *r = 0xFF;
+    for (int i = 0; i < 10 && (*r & 0x80); ++i)
+        SoftSpi_WriteDummyRead(sd.spi, r, sizeof(*r));
+
+    if (*r & 0x80)
+        return false;
+
+    wait_not_busy();
+    return true;
+}
+
 #define R2_CARD_LOCKED 0ULL
 #define R2_WP_ERASE_SKIP 1ULL
 #define R2_ERROR 2ULL
@@ -134,9 +199,16 @@ struct response {
 
 #define SD_GO_IDLE_STATE_CMD 0
 #define SD_SEND_OP_COND_CMD 1
+#define SD_SWITCH_FUNC_CMD 6
 #define SD_SEND_INTERFACE_COND_CMD 8
+#define SD_SEND_CSD_CMD 9
+#define SD_SEND_CID_CMD 10
+#define SD_STOP_TRANSMISSION_CMD 12
 #define SD_READ_SINGLE_BLOCK_CMD 17
+#define SD_READ_MULTIPLE_BLOCK_CMD 18
+#define SD_SET_WR_BLK_ERASE_COUNT_ACMD 23
 #define SD_WRITE_SINGLE_BLOCK_CMD 24
+#define SD_WRITE_MULTIPLE_BLOCK_CMD 25
 #define SD_SEND_OP_COND_ACMD 41
 #define SD_APP_CMD 55
 #define SD_READ_OCR_CMD 58
@@ -144,9 +216,16 @@ struct response {
 enum cmd_list {
     GO_IDLE_STATE = 0,
     SEND_OP_COND,
+    SWITCH_FUNC,
     SEND_INTERFACE_COND,
+    SEND_CSD,
+    SEND_CID,
+    STOP_TRANSMISSION,
     READ_SINGLE_BLOCK,
+    READ_MULTIPLE_BLOCK,
+    SET_WR_BLK_ERASE_COUNT_ACMD,
     WRITE_SINGLE_BLOCK,
+    WRITE_MULTIPLE_BLOCK,
     SEND_OP_COND_ACMD,
     APP_CMD,
     READ_OCR,
@@ -159,9 +238,16 @@ static struct sd_cmd {
 } sd_cmds[] = {
     [GO_IDLE_STATE] = { SD_GO_IDLE_STATE_CMD, 0x95, responseR1 },
     [SEND_OP_COND] = { SD_SEND_OP_COND_CMD, 0x0, responseR1 },
+    [SWITCH_FUNC] = { SD_SWITCH_FUNC_CMD, 0x0, responseR1 },
     [SEND_INTERFACE_COND] = { SD_SEND_INTERFACE_COND_CMD, 0x86, responseCMD8 },
+    [SEND_CSD] = { SD_SEND_CSD_CMD, 0x0, responseR1 },
+    [SEND_CID] = { SD_SEND_CID_CMD, 0x0, responseR1 },
+    [STOP_TRANSMISSION] = { SD_STOP_TRANSMISSION_CMD, 0x0, responseR1b },
     [READ_SINGLE_BLOCK] = { SD_READ_SINGLE_BLOCK_CMD, 0x0, responseR1 },
+    [READ_MULTIPLE_BLOCK] = { SD_READ_MULTIPLE_BLOCK_CMD, 0x0, responseR1 },
+    [SET_WR_BLK_ERASE_COUNT_ACMD] = { SD_SET_WR_BLK_ERASE_COUNT_ACMD, 0x0, responseR1 },
     [WRITE_SINGLE_BLOCK] = { SD_WRITE_SINGLE_BLOCK_CMD, 0x0, responseR1 },
+    [WRITE_MULTIPLE_BLOCK] = { SD_WRITE_MULTIPLE_BLOCK_CMD, 0x0, responseR1 },
     [SEND_OP_COND_ACMD] = { SD_SEND_OP_COND_ACMD, 0x0, responseR1 },
     [APP_CMD] = { SD_APP_CMD, 0x0, responseR1 },
     [READ_OCR] = { SD_READ_OCR_CMD, 0x0, responseR3R7 },
@@ -206,46 +292,504 @@ static struct response send_cmd(enum cmd_list cmd, uint32_t arg) {
     abort();
 }
 
-static void send_read_cmd(uint32_t addr) {
-    uint8_t ret;
+// =============================================================================
+// Clock calibration
+//
+// The card is switched to the high speed mode if supported, then the SoftSPI
+// half-period is stepped down while the first blocks of the card are read
+// and verified against the data CRC16 sent by the card. The clock used is
+// CALIBRATION_MARGIN steps slower than the fastest passing one, as the data
+// reads don't check the CRC. The result is keyed by the CID and kept in the
+// persistent RAM for boots from standby and in the SD_CALIBRATION_LBA sector
+// of the card for cold boots. A stored clock is verified once on every boot
+// and the card is calibrated again if it fails.
+// =============================================================================
 
-    addr -= SD_BASE_ADDRESS;
-    assert((addr & (BLOCK_SIZE - 1)) == 0 && "Address is not aligned");
-    if (sd.ccs)
-        addr /= BLOCK_SIZE;
+#define CALIBRATION_MAGIC 0x53444341UL
+#define CALIBRATION_START_HALF_PERIOD 16
+#define CALIBRATION_BLOCKS 4
+#define CALIBRATION_PASSES 4
+#define CALIBRATION_MARGIN 1
+#define START_TOKEN_TIMEOUT 10000
+
+#define CSD_TRAN_SPEED(csd) ((csd)[3])
+#define CSD_CCC_SWITCH(csd) ((csd)[4] & 0x40)
+#define TRAN_SPEED_25MHZ 0x32
+#define TRAN_SPEED_50MHZ 0x5A
+
+// CMD6 argument, function group 1 (access mode), other groups unchanged
+#define SWITCH_FUNC_CHECK 0x00FFFFF1UL
+#define SWITCH_FUNC_SET 0x80FFFFF1UL
+#define SWITCH_FUNC_STATUS_SIZE 64
+#define SWITCH_FUNC_HS_SUPPORTED(st) ((st)[13] & 0x02)
+#define SWITCH_FUNC_GROUP1_RESULT(st) ((st)[16] & 0x0F)
+
+struct calibration {
+    uint32_t magic;
+    uint32_t card_id;       /* crc32 of the CID register */
+    uint32_t half_period;
+    uint32_t check;
+};
 
-    if (send_cmd(READ_SINGLE_BLOCK, addr).r0) {
-        printf("SD: Failed to send read cmd\n");
-        abort();
+PERSISTENT static struct calibration sd_calibration;
+
+static void sd_card_write_sectors(uint64_t lba, const void *buffer, uint32_t count);
+
+static uint16_t crc16_ccitt(const uint8_t *data, size_t len) {
+    uint16_t crc = 0;
+
+    while (len--) {
+        crc ^= (uint16_t)*data++ << 8;
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+
+    return crc;
+}
+
+// Unlike wait_start_block_token() it does not hang on the garbage
+// received with a too short clock period
+static bool read_data_block(uint8_t *buffer, size_t len) {
+    uint8_t token = 0xFF;
+    uint8_t crc[2];
+
+    for (int i = 0; i < START_TOKEN_TIMEOUT && token == 0xFF; i++)
+        SoftSpi_WriteDummyRead(sd.spi, &token, 1);
+
+    if (token != START_BLOCK_TOKEN)
+        return false;
+
+    SoftSpi_WriteDummyRead(sd.spi, buffer, len);
+    SoftSpi_WriteDummyRead(sd.spi, crc, sizeof(crc));
+    return crc16_ccitt(buffer, len) == ((crc[0] << 8) | crc[1]);
+}
+
+static bool read_data_cmd(enum cmd_list cmd, uint32_t arg, uint8_t *buffer, size_t len) {
+    struct response response = {};
+
+    if (!__send_cmd(cmd, arg, &response) || response.r0)
+        return false;
+
+    return read_data_block(buffer, len);
+}
+
+static bool switch_high_speed(const uint8_t csd[16]) {
+    uint8_t status[SWITCH_FUNC_STATUS_SIZE];
+
+    if (CSD_TRAN_SPEED(csd) == TRAN_SPEED_50MHZ)
+        return true;
+
+    if (!CSD_CCC_SWITCH(csd))
+        return false;
+
+    if (!read_data_cmd(SWITCH_FUNC, SWITCH_FUNC_CHECK, status, sizeof(status)) ||
+        !SWITCH_FUNC_HS_SUPPORTED(status))
+        return false;
+
+    if (!read_data_cmd(SWITCH_FUNC, SWITCH_FUNC_SET, status, sizeof(status)))
+        return false;
+
+    // The card needs 8 clocks to switch to the new mode
+    SoftSpi_WriteDummyRead(sd.spi, NULL, 1);
+    return SWITCH_FUNC_GROUP1_RESULT(status) == 1;
+}
+
+static bool verify_clock(void) {
+    uint8_t block[BLOCK_SIZE];
+
+    for (int pass = 0; pass < CALIBRATION_PASSES; pass++) {
+        for (uint32_t i = 0; i < CALIBRATION_BLOCKS; i++) {
+            const uint32_t addr = sd.ccs ? i : i * BLOCK_SIZE;
+            if (!read_data_cmd(READ_SINGLE_BLOCK, addr, block, sizeof(block)))
+                return false;
+        }
     }
 
+    return true;
+}
+
+// Lets the card finish whatever it was sending at a failed period
+static void flush_failed_read(void) {
+    SoftSpi_WriteDummyRead(sd.spi, NULL, BLOCK_SIZE + 2);
+}
+
+// False if the card fails even at the calibration start clock, the
+// default clock is used then
+static bool calibrate_clock(uint32_t *half_period) {
+    bool passed = false;
+    uint32_t best = 0;
+
+    for (uint32_t half = CALIBRATION_START_HALF_PERIOD;; half--) {
+        sd.spi->HalfPeriod = half;
+        if (!verify_clock())
+            break;
+
+        passed = true;
+        best = half;
+        if (half == 0)
+            break;
+    }
+
+    if (passed)
+        sd.spi->HalfPeriod = MIN(best + CALIBRATION_MARGIN, CALIBRATION_START_HALF_PERIOD);
+    else
+        sd.spi->HalfPeriod = SOFTSPI_HALF_PERIOD;
+
+    flush_failed_read();
+    *half_period = sd.spi->HalfPeriod;
+    return passed;
+}
+
+static bool calibration_valid(const struct calibration *calibration, uint32_t card_id) {
+    return calibration->magic == CALIBRATION_MAGIC &&
+           calibration->card_id == card_id &&
+           calibration->half_period <= CALIBRATION_START_HALF_PERIOD &&
+           calibration->check == (card_id ^ calibration->half_period ^ CALIBRATION_MAGIC);
+}
+
+static bool load_calibration(uint32_t card_id) {
+    uint8_t block[BLOCK_SIZE];
+    struct calibration stored;
+
+    if (calibration_valid(&sd_calibration, card_id))
+        return true;
+
+    // Cold boot, read at the calibration start clock which always works
+    const uint32_t addr = sd.ccs ? SD_CALIBRATION_LBA : SD_CALIBRATION_LBA * BLOCK_SIZE;
+    if (!read_data_cmd(READ_SINGLE_BLOCK, addr, block, sizeof(block)))
+        return false;
+
+    memcpy(&stored, block, sizeof(stored));
+    if (!calibration_valid(&stored, card_id))
+        return false;
+
+    sd_calibration = stored;
+    return true;
+}
+
+static void store_calibration(uint32_t card_id, uint32_t half_period) {
+    uint8_t block[BLOCK_SIZE] = {};
+
+    sd_calibration.magic = CALIBRATION_MAGIC;
+    sd_calibration.card_id = card_id;
+    sd_calibration.half_period = half_period;
+    sd_calibration.check = card_id ^ half_period ^ CALIBRATION_MAGIC;
+
+    memcpy(block, &sd_calibration, sizeof(sd_calibration));
+    sd_card_write_sectors(SD_CALIBRATION_LBA, block, 1);
+}
+
+static void setup_clock(void) {
+    uint8_t cid[16], csd[16];
+    uint32_t half_period;
+    bool high_speed;
+
+    sd.spi->HalfPeriod = CALIBRATION_START_HALF_PERIOD;
+    if (!read_data_cmd(SEND_CID, 0, cid, sizeof(cid)) ||
+        !read_data_cmd(SEND_CSD, 0, csd, sizeof(csd))) {
+        printf("SD: Failed to read CID/CSD, using default clock\n");
+        sd.spi->HalfPeriod = SOFTSPI_HALF_PERIOD;
+        return;
+    }
+
+    high_speed = switch_high_speed(csd);
+    printf("SD: TRAN_SPEED 0x%02x, high speed %s\n", CSD_TRAN_SPEED(csd),
+           high_speed ? "on" : "off");
+
+    // The stored clock may not hold if the card ended up in another mode
+    const uint32_t card_id = crc32_le(0, cid, sizeof(cid));
+    if (load_calibration(card_id)) {
+        sd.spi->HalfPeriod = sd_calibration.half_period;
+        if (verify_clock()) {
+            printf("SD: Using stored half period %lu\n", sd.spi->HalfPeriod);
+            return;
+        }
+
+        printf("SD: Stored half period %lu failed, calibrating\n", sd.spi->HalfPeriod);
+        sd.spi->HalfPeriod = CALIBRATION_START_HALF_PERIOD;
+        flush_failed_read();
+    }
+
+    sd_calibration.magic = 0;
+    if (!calibrate_clock(&half_period)) {
+        printf("SD: Calibration failed, using default clock\n");
+        return;
+    }
+
+    printf("SD: Calibrated half period %lu\n", half_period);
+    store_calibration(card_id, half_period);
+}
+
+static void wait_start_block_token(void) {
+    uint8_t ret;
+
     // We would fail on watchdog if somthing is wrong here
     do {
         SoftSpi_WriteDummyRead(sd.spi, &ret, 1);
     } while(ret != START_BLOCK_TOKEN);
 }
 
+// All internal functions take 64-bit byte offsets from the start of the card
+static uint32_t to_card_address(uint64_t offset) {
+    assert((offset & (BLOCK_SIZE - 1)) == 0 && "Address is not aligned");
+    if (sd.ccs)
+        return offset / BLOCK_SIZE;
+
+    // Standard capacity cards use byte addresses, they are 2GB at most
+    assert(offset <= UINT32_MAX && "Address is out of range");
+    return offset;
+}
+
+static void send_read_cmd(uint64_t offset) {
+    if (send_cmd(READ_SINGLE_BLOCK, to_card_address(offset)).r0) {
+        printf("SD: Failed to send read cmd\n");
+        abort();
+    }
+
+    wait_start_block_token();
+}
+
 static void finish_read_cmd(void) {
     // Skip checksum reading
     SoftSpi_WriteDummyRead(sd.spi, NULL, 2);
 }
 
-static void send_write_cmd(uint32_t addr) {
-    struct response response;
-    const uint8_t start_block_token = START_BLOCK_TOKEN;
+// =============================================================================
+// Multi-block read stream
+//
+// READ_MULTIPLE_BLOCK makes the card send consecutive data blocks until
+// STOP_TRANSMISSION is received, so the command frame, response poll and
+// start token search are paid once per transaction instead of once per block.
+// The card only advances when clocked, so the stream can be left open while
+// the bus is handed over to the SPI flash between calls.
+// =============================================================================
 
-    assert((addr & (BLOCK_SIZE - 1)) == 0 && "Address is not aligned");
-    if (sd.ccs)
-        addr /= BLOCK_SIZE;
+static void __read_stream(uint8_t *buffer, size_t buffer_size);
+
+static void __read_stream_begin(uint64_t address) {
+    const uint64_t start_address = address & ~(BLOCK_SIZE - 1);
+
+    assert(!sd.read_stream.active && "SD read stream is already active");
+
+    if (send_cmd(READ_MULTIPLE_BLOCK, to_card_address(start_address)).r0) {
+        printf("SD: Failed to send multiple read cmd\n");
+        abort();
+    }
+
+    sd.read_stream.active = true;
+    sd.read_stream.block_offset = 0;
+
+    // Skip bytes before target address
+    if (address != start_address)
+        __read_stream(NULL, address - start_address);
+}
+
+static void __read_stream(uint8_t *buffer, size_t buffer_size) {
+    assert(sd.read_stream.active && "SD read stream is not active");
+
+    while (buffer_size) {
+        if (sd.read_stream.block_offset == 0) {
+            wait_start_block_token();
+            wdog_refresh();
+        }
+
+        const uint32_t bytes_to_read = MIN(buffer_size,
+                                           BLOCK_SIZE - sd.read_stream.block_offset);
+        SoftSpi_WriteDummyRead(sd.spi, buffer, bytes_to_read);
+        if (buffer)
+            buffer += bytes_to_read;
+
+        buffer_size -= bytes_to_read;
+        sd.read_stream.block_offset += bytes_to_read;
+        if (sd.read_stream.block_offset == BLOCK_SIZE) {
+            finish_read_cmd();
+            sd.read_stream.block_offset = 0;
+        }
+    }
+}
+
+static void __read_stream_end(void) {
+    assert(sd.read_stream.active && "SD read stream is not active");
+
+    // Drain the current block, the card is allowed to be stopped only
+    // between the data blocks
+    if (sd.read_stream.block_offset) {
+        SoftSpi_WriteDummyRead(sd.spi, NULL, BLOCK_SIZE - sd.read_stream.block_offset);
+        finish_read_cmd();
+    }
+
+    send_cmd(STOP_TRANSMISSION, 0);
+    sd.read_stream.active = false;
+    sd.read_stream.block_offset = 0;
+}
+
+void sd_read_stream_begin(uint64_t lba, uint32_t offset) {
+    sd_session_begin();
+    __read_stream_begin(lba * BLOCK_SIZE + offset);
+    sd_session_end();
+}
+
+void sd_read_stream(void *buffer, size_t buffer_size) {
+    sd_session_begin();
+    __read_stream((uint8_t *)buffer, buffer_size);
+    sd_session_end();
+}
+
+void sd_read_stream_end(void) {
+    sd_session_begin();
+    __read_stream_end();
+    sd_session_end();
+}
+
+// =============================================================================
+// Sector cache
+//
+// Small reads (allocator tags, settings, save states headers) are served from
+// a LRU cache of whole blocks. A miss right after the previous block was
+// accessed is treated as a sequential pattern and reads SD_CACHE_READAHEAD
+// blocks at once. Writes go straight to the card and invalidate the cached
+// blocks. Large reads bypass the cache so a ROM load doesn't wipe it out.
+// =============================================================================
+
+#if SD_CACHE_SECTORS != 0
+
+#define SD_CACHE_MAX_READ_BLOCKS (SD_CACHE_SECTORS / 2)
+
+static_assert(SD_CACHE_READAHEAD <= SD_CACHE_SECTORS,
+              "Read-ahead should fit in the cache");
+
+static struct sd_cache_entry {
+    uint32_t block;
+    uint32_t last_use;
+    bool valid;
+    uint8_t data[BLOCK_SIZE];
+} sd_cache[SD_CACHE_SECTORS];
+
+static struct {
+    uint32_t tick;
+    uint32_t last_block;
+    struct sd_cache_stats stats;
+} sd_cache_state;
+
+static struct sd_cache_entry *cache_lookup(uint32_t block) {
+    for (int i = 0; i < SD_CACHE_SECTORS; i++) {
+        if (sd_cache[i].valid && sd_cache[i].block == block)
+            return &sd_cache[i];
+    }
+
+    return NULL;
+}
+
+static struct sd_cache_entry *cache_victim(void) {
+    struct sd_cache_entry *victim = &sd_cache[0];
+
+    for (int i = 0; i < SD_CACHE_SECTORS; i++) {
+        if (!sd_cache[i].valid)
+            return &sd_cache[i];
+
+        if (sd_cache[i].last_use < victim->last_use)
+            victim = &sd_cache[i];
+    }
+
+    return victim;
+}
+
+static void cache_invalidate(uint32_t block, uint32_t count) {
+    for (int i = 0; i < SD_CACHE_SECTORS; i++) {
+        if (sd_cache[i].valid && sd_cache[i].block - block < count)
+            sd_cache[i].valid = false;
+    }
+}
+
+static void cache_fill(uint32_t block, uint32_t count) {
+    struct sd_cache_entry *entry;
+
+    if (count == 1) {
+        entry = cache_victim();
+        entry->valid = false;
+        send_read_cmd((uint64_t)block * BLOCK_SIZE);
+        SoftSpi_WriteDummyRead(sd.spi, entry->data, BLOCK_SIZE);
+        finish_read_cmd();
+        entry->block = block;
+        entry->last_use = ++sd_cache_state.tick;
+        entry->valid = true;
+        return;
+    }
+
+    __read_stream_begin((uint64_t)block * BLOCK_SIZE);
+    for (uint32_t i = 0; i < count; i++) {
+        // Read-ahead blocks might be already cached
+        entry = cache_lookup(block + i);
+        if (!entry)
+            entry = cache_victim();
+
+        entry->valid = false;
+        __read_stream(entry->data, BLOCK_SIZE);
+        entry->block = block + i;
+        entry->last_use = ++sd_cache_state.tick;
+        entry->valid = true;
+    }
+
+    __read_stream_end();
+    sd_cache_state.stats.readahead += count - 1;
+}
+
+static void cache_read(uint64_t offset, uint8_t *buffer, size_t buffer_size) {
+    while (buffer_size) {
+        const uint32_t block = offset / BLOCK_SIZE;
+        const uint32_t block_offset = offset % BLOCK_SIZE;
+        const uint32_t bytes_to_read = MIN(buffer_size, BLOCK_SIZE - block_offset);
+        const bool sequential = block == sd_cache_state.last_block + 1;
+        struct sd_cache_entry *entry = cache_lookup(block);
+
+        if (entry) {
+            sd_cache_state.stats.hits++;
+        } else {
+            sd_cache_state.stats.misses++;
+            cache_fill(block, sequential && SD_CACHE_READAHEAD > 1 ? SD_CACHE_READAHEAD : 1);
+            entry = cache_lookup(block);
+        }
+
+        entry->last_use = ++sd_cache_state.tick;
+        sd_cache_state.last_block = block;
+        memcpy(buffer, &entry->data[block_offset], bytes_to_read);
+
+        buffer += bytes_to_read;
+        buffer_size -= bytes_to_read;
+        offset += bytes_to_read;
+    }
+}
+
+void sd_cache_get_stats(struct sd_cache_stats *stats) {
+    *stats = sd_cache_state.stats;
+}
+
+#else
+
+static void cache_invalidate(uint32_t block, uint32_t count) {}
+
+void sd_cache_get_stats(struct sd_cache_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+#endif // SD_CACHE_SECTORS
+
+static void send_block_token(uint8_t token) {
+    // Send dummy pre-send byte and block token
+    SoftSpi_WriteDummyRead(sd.spi, NULL, 1);
+    SoftSpi_WriteRead(sd.spi, &token, NULL, 1);
+}
+
+static void send_write_cmd(uint64_t offset) {
+    struct response response;
+    const uint32_t addr = to_card_address(offset);
 
     // We would fail on watchdog if something is wrong here
     do {
         response = send_cmd(WRITE_SINGLE_BLOCK, addr);
     } while (response.r0);
 
-    // Send dummy pre-send byte and start block token
-    SoftSpi_WriteDummyRead(sd.spi, NULL, 1);
-    SoftSpi_WriteRead(sd.spi, &start_block_token, NULL, 1);
+    send_block_token(START_BLOCK_TOKEN);
 }
 
 static void finish_write_cmd(void) {
@@ -266,19 +810,149 @@ static void finish_write_cmd(void) {
     }
 
     // Wait for data to be written
+    wait_not_busy();
+}
+
+// =============================================================================
+// Multi-block write stream
+//
+// WRITE_MULTIPLE_BLOCK keeps the card in the receive state until the stop
+// token, SET_WR_BLK_ERASE_COUNT lets it erase the whole range upfront
+// instead of doing read-modify-erase-program cycle for every single block.
+// Unlike the reads the address is the offset in the image, same as SdCtx.Write().
+// As with the single block writes the unaligned head and tail of the
+// range are filled with 0xFF.
+// =============================================================================
+
+static void __write_stream(const uint8_t *buffer, size_t buffer_size);
+
+static void __write_stream_begin(uint64_t address, uint32_t size) {
+    const uint64_t start_address = address & ~(BLOCK_SIZE - 1);
+    struct response response;
+
+    assert(!sd.write_stream.active && "SD write stream is already active");
+
+    // Pre-erase is only a hint for the card, ignore failures
+    if (size) {
+        const uint32_t blocks = (address - start_address + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        response = send_cmd(APP_CMD, 0);
+        if (!response.r0)
+            send_cmd(SET_WR_BLK_ERASE_COUNT_ACMD, blocks);
+    }
+
+    // We would fail on watchdog if something is wrong here
     do {
-        SoftSpi_WriteDummyRead(sd.spi, &rbyte, 1);
-    } while (rbyte == 0x00);
+        response = send_cmd(WRITE_MULTIPLE_BLOCK, to_card_address(start_address));
+    } while (response.r0);
+
+    sd.write_stream.active = true;
+    sd.write_stream.block_offset = 0;
+    sd.write_stream.block = start_address / BLOCK_SIZE;
+
+    // Fill bytes before target address
+    if (address != start_address)
+        __write_stream(NULL, address - start_address);
+}
+
+static void __write_stream(const uint8_t *buffer, size_t buffer_size) {
+    assert(sd.write_stream.active && "SD write stream is not active");
+
+    while (buffer_size) {
+        if (sd.write_stream.block_offset == 0) {
+            cache_invalidate(sd.write_stream.block, 1);
+            send_block_token(START_MULTI_BLOCK_TOKEN);
+            wdog_refresh();
+        }
+
+        const uint32_t bytes_to_write = MIN(buffer_size,
+                                            BLOCK_SIZE - sd.write_stream.block_offset);
+        if (buffer) {
+            SoftSpi_WriteRead(sd.spi, buffer, NULL, bytes_to_write);
+            buffer += bytes_to_write;
+        } else {
+            SoftSpi_WriteDummyRead(sd.spi, NULL, bytes_to_write);
+        }
+
+        buffer_size -= bytes_to_write;
+        sd.write_stream.block_offset += bytes_to_write;
+        if (sd.write_stream.block_offset == BLOCK_SIZE) {
+            finish_write_cmd();
+            sd.write_stream.block_offset = 0;
+            sd.write_stream.block++;
+        }
+    }
+}
+
+static void __write_stream_end(void) {
+    assert(sd.write_stream.active && "SD write stream is not active");
+
+    // Fill the rest of the last block
+    if (sd.write_stream.block_offset)
+        __write_stream(NULL, BLOCK_SIZE - sd.write_stream.block_offset);
+
+    send_block_token(STOP_TRAN_TOKEN);
+
+    // Skip the byte before busy signal and wait for the card to finish
+    SoftSpi_WriteDummyRead(sd.spi, NULL, 1);
+    wait_not_busy();
+
+    sd.write_stream.active = false;
 }
 
-static void sd_card_read_write(uint32_t address, void *pbuffer, size_t buffer_size, bool is_read) {
+void sd_write_stream_begin(uint32_t address, uint32_t size) {
+    sd_session_begin();
+    __write_stream_begin(SD_IMAGE_OFFSET + address, size);
+    sd_session_end();
+}
+
+void sd_write_stream(const void *buffer, size_t buffer_size) {
+    sd_session_begin();
+    __write_stream((const uint8_t *)buffer, buffer_size);
+    sd_session_end();
+}
+
+void sd_write_stream_end(void) {
+    sd_session_begin();
+    __write_stream_end();
+    sd_session_end();
+}
+
+static void sd_card_read_write(uint64_t address, void *pbuffer, size_t buffer_size, bool is_read) {
     uint8_t *buffer = (uint8_t *)pbuffer;
-    const uint32_t start_address = address & ~(BLOCK_SIZE - 1);
+    const uint64_t start_address = address & ~(BLOCK_SIZE - 1);
 
     if (!buffer_size)
         return;
 
-    switch_ospi_gpio(false);
+    sd_session_begin();
+
+    const uint32_t blocks = (address + buffer_size - start_address + BLOCK_SIZE - 1) / BLOCK_SIZE;
+#if SD_CACHE_SECTORS != 0
+    if (is_read && blocks <= SD_CACHE_MAX_READ_BLOCKS) {
+        cache_read(address, buffer, buffer_size);
+        sd_session_end();
+        return;
+    }
+#endif // SD_CACHE_SECTORS
+
+    if (!is_read)
+        cache_invalidate(start_address / BLOCK_SIZE, blocks);
+
+    // Use single transaction if the request spans over multiple blocks
+    if (blocks > 1) {
+        if (is_read) {
+            __read_stream_begin(address);
+            __read_stream(buffer, buffer_size);
+            __read_stream_end();
+        } else {
+            __write_stream_begin(address, buffer_size);
+            __write_stream(buffer, buffer_size);
+            __write_stream_end();
+        }
+
+        sd_session_end();
+        return;
+    }
 
     // Read/write first unaligned block
     if (address != start_address) {
@@ -291,7 +965,7 @@ static void sd_card_read_write(uint32_t address, void *pbuffer, size_t buffer_si
         SoftSpi_WriteDummyRead(sd.spi, NULL, address - start_address);
 
         // Read/write buffer size or remaining bytes in block
-        const uint32_t next_block = start_address + BLOCK_SIZE;
+        const uint64_t next_block = start_address + BLOCK_SIZE;
         const uint32_t bytes_to_rw = MIN(buffer_size, next_block - address);
         if (is_read)
             SoftSpi_WriteDummyRead(sd.spi, buffer, bytes_to_rw);
@@ -331,7 +1005,7 @@ static void sd_card_read_write(uint32_t address, void *pbuffer, size_t buffer_si
 
     // Read/write remaining bytes
     if (buffer_size) {
-        const uint32_t next_block = address + BLOCK_SIZE;
+        const uint64_t next_block = address + BLOCK_SIZE;
 
         if (is_read) {
             send_read_cmd(address);
@@ -352,24 +1026,48 @@ static void sd_card_read_write(uint32_t address, void *pbuffer, size_t buffer_si
             finish_write_cmd();
     }
 
-    switch_ospi_gpio(true);
+    sd_session_end();
 }
 
+// Reads take linked extflash addresses, writes take offsets in the image
 static void sd_card_read(uint32_t address, void *pbuffer, size_t buffer_size)
 {
-    sd_card_read_write(address, pbuffer, buffer_size, true);
+    sd_card_read_write(SD_IMAGE_OFFSET + (address - SD_BASE_ADDRESS), pbuffer, buffer_size, true);
 }
 
 static void sd_card_write(uint32_t address, const void *pbuffer, size_t buffer_size)
 {
-    sd_card_read_write(address, (void *)pbuffer, buffer_size, false);
+    sd_card_read_write(SD_IMAGE_OFFSET + address, (void *)pbuffer, buffer_size, false);
+}
+
+static void sd_card_read_sectors(uint64_t lba, void *buffer, uint32_t count)
+{
+    sd_card_read_write(lba * BLOCK_SIZE, buffer, count * BLOCK_SIZE, true);
+}
+
+static void sd_card_write_sectors(uint64_t lba, const void *buffer, uint32_t count)
+{
+    sd_card_read_write(lba * BLOCK_SIZE, (void *)buffer, count * BLOCK_SIZE, false);
+}
+
+void sd_read(uint64_t lba, uint32_t offset, void *buffer, size_t buffer_size)
+{
+    sd_card_read_write(lba * BLOCK_SIZE + offset, buffer, buffer_size, true);
+}
+
+uint64_t sd_address_to_lba(uint32_t address, uint32_t *offset)
+{
+    const uint32_t image_offset = address - SD_BASE_ADDRESS;
+
+    *offset = image_offset % BLOCK_SIZE;
+    return SD_IMAGE_LBA + image_offset / BLOCK_SIZE;
 }
 
 static void Init(OSPI_HandleTypeDef *hospi) {
     struct response response;
     int i;
 
-    switch_ospi_gpio(false);
+    sd_session_begin();
 
     SoftSpi_WriteDummyReadCsLow(sd.spi, NULL, 10);
 
@@ -419,14 +1117,21 @@ static void Init(OSPI_HandleTypeDef *hospi) {
     }
 
     sd.spi->DelayUs = 0;
+    setup_clock();
+
+#if SOFTSPI_BENCHMARK != 0
+    SoftSpi_Benchmark(sd.spi, 4096);
+#endif
 
-    switch_ospi_gpio(true);
+    sd_session_end();
 }
 
 struct FlashCtx SdCtx = {
     .Init = Init,
     .Write = sd_card_write,
     .Read = sd_card_read,
+    .ReadSectors = sd_card_read_sectors,
+    .WriteSectors = sd_card_write_sectors,
     .EnableMemoryMappedMode = EnableMemoryMappedMode,
     .DisableMemoryMappedMode = DisableMemoryMappedMode,
     .Format = Format,
@@ -262,6 +262,8 @@ void store_save(const uint8_t *flash_ptr, const uint8_t *data, size_t size)
   assert((save_address & (4*1024 - 1)) == 0);
 
 #if SD_CARD == 0
+  store_flush();
+
   int diff = memcmp((void*)flash_ptr, data, size);
   if (diff == 0) {
     return;
@@ -275,6 +277,45 @@ void store_save(const uint8_t *flash_ptr, const uint8_t *data, size_t size)
   get_flash_ctx()->EnableMemoryMappedMode();
 }
 
+void store_save_async(const uint8_t *flash_ptr, const uint8_t *data, size_t size)
+{
+#if SD_CARD != 0
+  // The saves go to the SD card
+  store_save(flash_ptr, data, size);
+#else
+  printf(__FUNCTION__);
+
+#if defined(DISABLE_STORE)
+  return;
+#endif
+
+  assert(
+    ((flash_ptr >= &__SAVEFLASH_START__)   && ((flash_ptr + size) <= &__SAVEFLASH_END__)) ||
+    ((flash_ptr >= &__configflash_start__) && ((flash_ptr + size) <= &__configflash_end__)) ||
+    ((flash_ptr >= &__fbflash_start__) && ((flash_ptr + size) <= &__fbflash_end__))
+  );
+
+  uint32_t save_address = flash_ptr - &__EXTFLASH_BASE__;
+  assert((save_address & (4*1024 - 1)) == 0);
+
+  // Keeps the saves in order, the compare reads the flash too
+  flash_job_flush();
+
+  int diff = memcmp((void*)flash_ptr, data, size);
+  if (diff == 0) {
+    return;
+  }
+
+  flash_job_erase(save_address, (size + 0xfff) & ~0xfff);
+  flash_job_program(save_address, data, size);
+#endif // SD_CARD
+}
+
+void store_flush(void)
+{
+  flash_job_flush();
+}
+
 void boot_magic_set(uint32_t magic)
 {
   boot_magic = magic;
@@ -292,6 +333,8 @@ uint32_t uptime_get(void)
 
 void GW_EnterDeepSleep(void)
 {
+  store_flush();
+
   // Stop SAI DMA (audio)
   HAL_SAI_DMAStop(&hsai_BlockA1);
 
@@ -342,16 +385,53 @@ void wdog_refresh()
   }
 }
 
+// Only MODER and PUPDR are changed, AFR keeps the OSPI alternate functions
+// MODER: 0 - input, 1 - output, 2 - alternate function
+static void gpio_set_mode_fast(GPIO_TypeDef *port, uint16_t pin, uint32_t mode, uint32_t pull)
+{
+  const uint32_t pos = __builtin_ctz(pin) * 2;
+
+  MODIFY_REG(port->MODER, 0x3UL << pos, mode << pos);
+  MODIFY_REG(port->PUPDR, 0x3UL << pos, pull << pos);
+}
+
+static void ospi_gpio_remux(uint8_t ToOspi)
+{
+  const uint32_t out_mode = ToOspi ? 2 : 1;
+
+  if (!ToOspi) {
+    HAL_GPIO_WritePin(GPIOE, GPIO_FLASH_NCS_Pin, GPIO_PIN_RESET);
+    HAL_GPIO_WritePin(GPIOB, GPIO_FLASH_MOSI_Pin|GPIO_FLASH_CLK_Pin, GPIO_PIN_RESET);
+  }
+
+  gpio_set_mode_fast(GPIO_FLASH_NCS_GPIO_Port, GPIO_FLASH_NCS_Pin, out_mode, GPIO_NOPULL);
+  gpio_set_mode_fast(GPIO_FLASH_MOSI_GPIO_Port, GPIO_FLASH_MOSI_Pin, out_mode, GPIO_NOPULL);
+  gpio_set_mode_fast(GPIO_FLASH_CLK_GPIO_Port, GPIO_FLASH_CLK_Pin, out_mode, GPIO_NOPULL);
+  gpio_set_mode_fast(GPIO_FLASH_MISO_GPIO_Port, GPIO_FLASH_MISO_Pin,
+                     ToOspi ? 2 : 0, ToOspi ? GPIO_NOPULL : GPIO_PULLUP);
+}
+
 void switch_ospi_gpio(uint8_t ToOspi) {
   static uint8_t IsOspi = true;
+  // Set if the pins were taken by re-muxing only, OSPI is still configured
+  static uint8_t IsRemuxed = false;
   GPIO_InitTypeDef GPIO_InitStruct = {0};
 
   if (IsOspi == ToOspi)
     return;
 
   if (ToOspi) {
-    if (HAL_OSPI_Init(&hospi1) != HAL_OK)
+    if (IsRemuxed) {
+      ospi_gpio_remux(true);
+      IsRemuxed = false;
+    } else if (HAL_OSPI_Init(&hospi1) != HAL_OK) {
       Error_Handler();
+    }
+  } else if (hospi1.State == HAL_OSPI_STATE_READY) {
+    // OSPI is idle, it is enough to switch the pins away from it. In
+    // memory mapped mode the OSPI keeps NCS asserted, so it must be stopped.
+    ospi_gpio_remux(false);
+    IsRemuxed = true;
   } else {
     HAL_OSPI_DeInit(&hospi1);
 
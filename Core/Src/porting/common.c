@@ -11,6 +11,7 @@
 #include <osd.h>
 #include "main.h"
 #include "gw_buttons.h"
+#include "gw_flash.h"
 #include "gw_lcd.h"
 #include "gw_linker.h"
 
@@ -294,7 +295,8 @@ static void cpumon_common(bool sleep){
     else{
         cpumon_stats.busy_ms = 0;
     }
-    if(sleep) __WFI();
+    // The queued flash writes use the frame slack before the sleep
+    if(sleep && !flash_job_step()) __WFI();
     uint t1 = get_elapsed_time();
     cpumon_stats.last_busy = t1;
     cpumon_stats.sleep_ms += t1 - t0;
@@ -37,9 +37,11 @@ static bool gw_system_SaveState(char *pathName)
 {
     printf("Saving state...\n");
 
+    // The previous save may still be reading the buffer
+    store_flush();
     memset(state_save_buffer, '\x00', sizeof(state_save_buffer));
     gw_state_save(state_save_buffer);
-    store_save(ACTIVE_FILE->save_address, state_save_buffer, sizeof(state_save_buffer));
+    store_save_async(ACTIVE_FILE->save_address, state_save_buffer, sizeof(state_save_buffer));
     printf("Saving state done!\n");
     return false;
 }
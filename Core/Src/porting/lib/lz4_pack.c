@@ -0,0 +1,127 @@
+#include <string.h>
+
+#include "lz4_pack.h"
+
+/* Greedy single pass compressor: the hash of the next 4 bytes gives the
+last position with the same hash, the match is taken if the bytes are
+equal. The block restrictions of the LZ4 format are kept: the last 5 bytes
+are literals and the last match starts at least 12 bytes before the end. */
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MF_LIMIT 12
+#define MAX_OFFSET 65535
+
+static unsigned int read32(const unsigned char *p)
+{
+	unsigned int value;
+
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static unsigned int hash32(unsigned int value, unsigned int hash_bits)
+{
+	return (value * 2654435761U) >> (32 - hash_bits);
+}
+
+static unsigned char *put_length(unsigned char *op, unsigned long len)
+{
+	while (len >= 255)
+	{
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (unsigned char)len;
+	return op;
+}
+
+/* Writes the sequence, returns NULL if it doesn't fit */
+static unsigned char *put_sequence(unsigned char *op, unsigned char *op_end,
+                                   const unsigned char *literals, unsigned long lit_len,
+                                   unsigned long offset, unsigned long match_len)
+{
+	unsigned char *token;
+
+	/* Worst case of the token, the lengths and the offset */
+	if (op + lit_len + lit_len / 255 + match_len / 255 + 5 > op_end)
+	{
+		return NULL;
+	}
+
+	token = op++;
+
+	*token = (lit_len >= 15 ? 15 : lit_len) << 4;
+	if (lit_len >= 15)
+	{
+		op = put_length(op, lit_len - 15);
+	}
+	memcpy(op, literals, lit_len);
+	op += lit_len;
+
+	/* The last sequence has the literals only */
+	if (!match_len)
+	{
+		return op;
+	}
+
+	*op++ = (unsigned char)offset;
+	*op++ = (unsigned char)(offset >> 8);
+	match_len -= MIN_MATCH;
+	*token |= match_len >= 15 ? 15 : match_len;
+	if (match_len >= 15)
+	{
+		op = put_length(op, match_len - 15);
+	}
+
+	return op;
+}
+
+unsigned long
+lz4_pack(const void *src, void *dst, unsigned long src_size, unsigned long dst_capacity,
+         unsigned short *hash_table, unsigned int hash_bits)
+{
+	const unsigned char *in = (const unsigned char *)src;
+	unsigned char *out = (unsigned char *)dst;
+	unsigned char *op = out;
+	unsigned char *const op_end = out + dst_capacity;
+	unsigned long anchor = 0;
+	unsigned long pos = 1;
+
+	if (src_size > 0x10000)
+	{
+		return 0;
+	}
+
+	memset(hash_table, 0, sizeof(*hash_table) << hash_bits);
+	while (src_size > MF_LIMIT && pos < src_size - MF_LIMIT)
+	{
+		const unsigned int h = hash32(read32(in + pos), hash_bits);
+		const unsigned long ref = hash_table[h];
+		unsigned long len = MIN_MATCH;
+
+		hash_table[h] = (unsigned short)pos;
+		if (ref >= pos || pos - ref > MAX_OFFSET || read32(in + ref) != read32(in + pos))
+		{
+			pos++;
+			continue;
+		}
+
+		while (pos + len < src_size - LAST_LITERALS && in[ref + len] == in[pos + len])
+		{
+			len++;
+		}
+
+		op = put_sequence(op, op_end, in + anchor, pos - anchor, pos - ref, len);
+		if (!op)
+		{
+			return 0;
+		}
+
+		pos += len;
+		anchor = pos;
+	}
+
+	op = put_sequence(op, op_end, in + anchor, src_size - anchor, 0, 0);
+	return op ? (unsigned long)(op - out) : 0;
+}
@@ -0,0 +1,18 @@
+#ifndef DEF_LZ4PACK
+#define DEF_LZ4PACK
+
+/* LZ4 block compression function, the output is a raw LZ4 block (no frame)
+that can be decoded by lz4_depack()
+*src 			: pointer on source buffer, at most 64KB
+*dst 			: pointer on destination buffer
+src_size 		: size of source buffer
+dst_capacity 	: size of destination buffer
+*hash_table 	: work memory of (1 << hash_bits) entries
+return the compressed size
+return 0 if it doesn't fit the destination buffer
+ */
+unsigned long lz4_pack(const void *src, void *dst, unsigned long src_size,
+                       unsigned long dst_capacity, unsigned short *hash_table,
+                       unsigned int hash_bits);
+
+#endif /* DEF_LZ4PACK */
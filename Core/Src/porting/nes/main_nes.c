@@ -40,9 +40,11 @@ static bool SaveState(char *pathName)
 {
     printf("Saving state...\n");
 
+    // The previous save may still be reading the buffer
+    store_flush();
     nes_state_save(nes_save_buffer, sizeof(nes_save_buffer));
-    store_save((uint8_t *) ACTIVE_FILE->save_address, nes_save_buffer,
-               sizeof(nes_save_buffer));
+    store_save_async((uint8_t *) ACTIVE_FILE->save_address, nes_save_buffer,
+                     sizeof(nes_save_buffer));
 
     return 0;
 }
@@ -80,6 +80,7 @@ static const persistent_config_t persistent_config_default = {
 
 __attribute__((section (".configflash"))) __attribute__((aligned(4096))) persistent_config_t persistent_config_flash;
 persistent_config_t persistent_config_ram;
+static persistent_config_t persistent_config_commit;
 
 void odroid_settings_init()
 {
@@ -116,7 +117,11 @@ void odroid_settings_commit()
     persistent_config_ram.crc32 = 0;
     persistent_config_ram.crc32 = crc32_le(0, (unsigned char *) &persistent_config_ram, sizeof(persistent_config_t));
 
-    store_save((const uint8_t *) &persistent_config_flash, (const uint8_t *) &persistent_config_ram, sizeof(persistent_config_t));
+    // Written in the background from a copy, the RAM settings may change
+    // before it's done
+    store_flush();
+    memcpy(&persistent_config_commit, &persistent_config_ram, sizeof(persistent_config_t));
+    store_save_async((const uint8_t *) &persistent_config_flash, (const uint8_t *) &persistent_config_commit, sizeof(persistent_config_t));
 }
 
 void odroid_settings_reset()
@@ -108,6 +108,7 @@ void odroid_system_switch_app(int app)
         *((uint32_t *)0x2001FFF8) = 0x544F4F42; // "BOOT"
         *((uint32_t *)0x2001FFFC) = (uint32_t) &__INTFLASH__; // vector table
 
+        store_flush();
         NVIC_SystemReset();
         break;
     default:
@@ -20,6 +20,8 @@
 #include "gw_linker.h"
 #include "gw_buttons.h"
 #include "rom_manager.h"
+#include "rom_pager.h"
+#include "rom_tier.h"
 #include "common.h"
 #include "sound_pce.h"
 #include "appid.h"
@@ -190,6 +192,11 @@ static bool LoadState(char *pathName) {
             pos++;
         }
     }
+#if SD_CARD != 0
+    if (rom_pager_active()) {
+        pce_pager_refresh();
+    } else
+#endif
     for(int i = 0; i < 8; i++) {
         pce_bank_set(i, PCE.MMR[i]);
     }
@@ -198,6 +205,96 @@ static bool LoadState(char *pathName) {
     return true;
 }
 
+// ROM bank of the logical page for the demand paged ROM or the ROM in the
+// hot bank tier, -1 if the page is not a ROM one
+static int16_t pce_rom_page[0x100];
+
+void __real_pce_bank_set(uint8_t P, uint8_t V);
+
+// Linked with --wrap=pce_bank_set, so the mapper writes from the core land
+// here. The banks mapped to the MMRs are pinned in the pager cache.
+void __wrap_pce_bank_set(uint8_t P, uint8_t V)
+{
+#if SD_CARD != 0
+    if (rom_pager_active()) {
+        const int16_t old_bank = pce_rom_page[PCE.MMR[P]];
+        const int16_t new_bank = pce_rom_page[V];
+
+        if (new_bank >= 0)
+            MemoryMapR[V] = (uchar *)rom_pager_pin(new_bank);
+        if (old_bank >= 0)
+            rom_pager_unpin(old_bank);
+    } else
+#endif
+    if (rom_tier_active() && pce_rom_page[V] >= 0) {
+        MemoryMapR[V] = (uchar *)rom_tier_bank(pce_rom_page[V]);
+    }
+
+    __real_pce_bank_set(P, V);
+}
+
+// Moves the mapped banks to where the tier keeps them now
+static void pce_tier_idle(void)
+{
+    if (!rom_tier_idle())
+        return;
+
+    for (int i = 0; i < 0x100; i++) {
+        if (pce_rom_page[i] >= 0)
+            MemoryMapR[i] = (uchar *)rom_tier_lookup(pce_rom_page[i]);
+    }
+    for (int i = 0; i < 8; i++)
+        __real_pce_bank_set(i, PCE.MMR[i]);
+}
+
+#if SD_CARD != 0
+
+// Re-resolves the banks of all the MMRs, e.g. after the state load or
+// when the ROM moved to flash
+static void pce_pager_refresh(void)
+{
+    rom_pager_unpin_all();
+    for (int i = 0; i < 8; i++) {
+        const int16_t bank = pce_rom_page[PCE.MMR[i]];
+
+        if (bank >= 0)
+            MemoryMapR[PCE.MMR[i]] = (uchar *)rom_pager_pin(bank);
+        __real_pce_bank_set(i, PCE.MMR[i]);
+    }
+}
+
+static void pce_pager_idle(void)
+{
+    static bool in_flash;
+
+    if (!rom_pager_active() || in_flash)
+        return;
+
+    in_flash = rom_pager_idle();
+    if (in_flash)
+        pce_pager_refresh();
+}
+
+static uint32_t pce_pager_crc32(uint32_t size)
+{
+    uint8_t buffer[1024];
+    uint32_t crc = 0;
+
+    // Catalog ROMs come with the CRC
+    if (ACTIVE_FILE->checksum)
+        return ACTIVE_FILE->checksum;
+
+    for (uint32_t offset = 0; offset < size; offset += sizeof(buffer)) {
+        const uint32_t len = MIN(size - offset, sizeof(buffer));
+
+        rom_pager_read(offset, buffer, len);
+        crc = crc32_le(crc, buffer, len);
+    }
+
+    return crc;
+}
+#endif // SD_CARD
+
 size_t
 pce_osd_getromdata(unsigned char **data)
 {
@@ -262,8 +359,36 @@ void LoadCartPCE() {
     size_t rom_length = pce_osd_getromdata(&PCE.ROM);
     offset = rom_length & 0x1fff;
     PCE.ROM_SIZE = (rom_length - offset) / 0x2000;
+
+    // The ROM executed from flash gets the free RAM as the hot bank tier,
+    // the SF2 mapper switches the banks bypassing pce_bank_set
+    const uint8_t *ram = (const uint8_t *)&_PCE_ROM_UNPACK_BUFFER;
+    const uint32_t ram_length = (uint32_t)&_PCE_ROM_UNPACK_BUFFER_SIZE;
+    bool tiered = PCE.ROM_SIZE < 192 && (PCE.ROM < ram || PCE.ROM >= ram + ram_length);
+
+    for (int i = 0; i < 0x100; i++)
+        pce_rom_page[i] = -1;
+#if SD_CARD != 0
+    const bool paged = rom_pager_active();
+    tiered = tiered && !paged;
+
+    // SF2 mapper switches the banks bypassing pce_bank_set, so such ROMs
+    // are copied to flash before the start
+    if (paged && PCE.ROM_SIZE >= 192) {
+        rom_pager_flatten();
+        while (!rom_pager_idle())
+            wdog_refresh();
+    }
+
+    if (paged) {
+        rom_pager_set_base(offset);
+        PCE.ROM_CRC = pce_pager_crc32(rom_length);
+    } else
+#endif
+    {
      PCE.ROM_DATA = PCE.ROM + offset;
        PCE.ROM_CRC = crc32_le(0, PCE.ROM, rom_length);
+    }
        uint IDX = 0;
        uint ROM_MASK = 1;
 
@@ -285,6 +410,10 @@ void LoadCartPCE() {
        printf("Game Region: %s\n", (pceRomFlags[IDX].Flags & JAP) ? "Japan" : "USA");
 
        // US Encrypted
+#if SD_CARD != 0
+    if (paged)
+        PCE.ROM_DATA = (uchar *)rom_pager_bank(0);
+#endif
     if ((pceRomFlags[IDX].Flags & US_ENCODED) || PCE.ROM_DATA[0x1FFF] < 0xE0) {
         printf("This rom is probably US encrypted, Not supported!!!\n");
         assert(0);
@@ -294,28 +423,39 @@ void LoadCartPCE() {
 
     // Game ROM
     for (int i = 0; i < 0x80; i++) {
+        int rom_bank = 0;
         if (PCE.ROM_SIZE == 0x30) {
             switch (i & 0x70) {
             case 0x00:
             case 0x10:
             case 0x50:
-                MemoryMapR[i] = PCE.ROM_DATA + (i & ROM_MASK) * 0x2000;
+                rom_bank = i & ROM_MASK;
                 break;
             case 0x20:
             case 0x60:
-                MemoryMapR[i] = PCE.ROM_DATA + ((i - 0x20) & ROM_MASK) * 0x2000;
+                rom_bank = (i - 0x20) & ROM_MASK;
                 break;
             case 0x30:
             case 0x70:
-                MemoryMapR[i] = PCE.ROM_DATA + ((i - 0x10) & ROM_MASK) * 0x2000;
+                rom_bank = (i - 0x10) & ROM_MASK;
                 break;
             case 0x40:
-                MemoryMapR[i] = PCE.ROM_DATA + ((i - 0x20) & ROM_MASK) * 0x2000;
+                rom_bank = (i - 0x20) & ROM_MASK;
                 break;
             }
         } else {
-            MemoryMapR[i] = PCE.ROM_DATA + (i & ROM_MASK) * 0x2000;
+            rom_bank = i & ROM_MASK;
+        }
+        MemoryMapR[i] = PCE.ROM_DATA + rom_bank * 0x2000;
+#if SD_CARD != 0
+        // Resolved by the pager on the bank switch
+        if (paged) {
+            MemoryMapR[i] = PCE.NULLRAM;
+            pce_rom_page[i] = rom_bank;
         }
+#endif
+        if (tiered)
+            pce_rom_page[i] = rom_bank;
         MemoryMapW[i] = PCE.NULLRAM;
     }
 
@@ -326,8 +466,15 @@ void LoadCartPCE() {
         MemoryMapR[0x41] = MemoryMapW[0x41] = PCE.ExRAM + 0x2000;
         MemoryMapR[0x42] = MemoryMapW[0x42] = PCE.ExRAM + 0x4000;
         MemoryMapR[0x43] = MemoryMapW[0x43] = PCE.ExRAM + 0x6000;
+        for (int i = 0x40; i < 0x44; i++)
+            pce_rom_page[i] = -1;
     }
 
+    if (tiered)
+        rom_tier_init(PCE.ROM_DATA, rom_length - offset, 0x2000, (uint8_t *)ram, ram_length);
+    else
+        rom_tier_close();
+
     // Mapper for roms >= 1.5MB (SF2, homebrews)
     if (PCE.ROM_SIZE >= 192)
         MemoryMapW[0x00] = PCE.IOAREA;
@@ -525,6 +672,10 @@ int app_main_pce(uint8_t load_state, uint8_t start_paused) {
     pce_init();
     LoadCartPCE();
     ResetPCE();
+#if SD_CARD != 0
+    if (rom_pager_active())
+        pce_pager_refresh();
+#endif
     printf("PCE Core initialized\n");
 
     // If user select "RESUME" in main menu
@@ -557,6 +708,11 @@ int app_main_pce(uint8_t load_state, uint8_t start_paused) {
         pce_osd_gfx_blit(drawFrame);
         if(drawFrame) pce_pcm_submit();
 
+#if SD_CARD != 0
+        pce_pager_idle();
+#endif
+        pce_tier_idle();
+
         if(!common_emu_state.skip_frames){
             dma_transfer_state_t last_dma_state = DMA_TRANSFER_STATE_HF;
             for(uint8_t p = 0; p < common_emu_state.pause_frames + 1; p++) {
@@ -4,12 +4,16 @@
 #include <stdio.h>
 
 #include "gw_flash.h"
+#include "gw_fs.h"
 #include "gw_linker.h"
+#include "gw_sd.h"
 #include "rg_emulators.h"
+#include "rom_catalog.h"
 // #include "rg_favorites.h"
 #include "bitmaps.h"
 #include "gui.h"
 #include "rom_manager.h"
+#include "rom_pager.h"
 #include "gw_lcd.h"
 #include "main.h"
 #include "main_gb.h"
@@ -40,6 +44,15 @@ static void event_handler(gui_event_t event, tab_t *tab)
     {
         emulator_init(emu);
 
+#if SD_CARD != 0
+        // Catalog entries are only mapped when the tab is opened
+        if (emu->roms.count > 0 && !emu->roms.files) {
+            emu->roms.files = rom_catalog_files(emu->system);
+            if (!emu->roms.files)
+                emu->roms.count = 0;
+        }
+#endif
+
         if (emu->roms.count > 0)
         {
             sprintf(tab->status, " Games: %d", emu->roms.count);
@@ -133,6 +146,10 @@ void emulator_init(retro_emulator_t *emu)
         emu->system = system;
         emu->roms.files = system->roms;
         emu->roms.count = system->roms_count;
+#if SD_CARD != 0
+        if (!emu->roms.count)
+            emu->roms.count = rom_catalog_count(system);
+#endif
     } else {
         while(1) {
             lcd_backlight_on();
@@ -383,29 +400,244 @@ static void load_overlay(void *overlay_ram, void *overlay_rom, uint32_t overlay_
     SCB_CleanDCache_by_Addr((uint32_t *)overlay_ram, overlay_size);
 }
 
-static void load_rom(retro_emulator_file_t *file, uint8_t *ram_buffer, uint32_t ram_length)
+#if SD_CARD != 0
+static uint8_t *load_rom_from_fs(retro_emulator_file_t *file, uint8_t *ram_buffer,
+                                 uint32_t ram_length)
+{
+    static bool fs_mounted;
+    static struct fs_file fs_file;
+
+    if (!fs_mounted) {
+        sd_session_begin();
+        fs_mounted = fs_mount(SdCtx.ReadSectors);
+        sd_session_end();
+        if (!fs_mounted) {
+            printf("SD: No FAT32/exFAT volume found\n");
+            abort();
+        }
+    }
+
+    sd_session_begin();
+    const bool found = fs_open(file->path, &fs_file);
+    sd_session_end();
+    if (!found) {
+        printf("SD: Can't open %s\n", file->path);
+        abort();
+    }
+
+    if (ram_length >= fs_file.size) {
+        const uint32_t start_tick = HAL_GetTick();
+        sd_session_begin();
+        fs_read(&fs_file, 0, ram_buffer, fs_file.size);
+        sd_session_end();
+        printf("Loaded %lu KB from %s to RAM in %lu ms\n", (uint32_t)fs_file.size / 1024,
+               file->path, HAL_GetTick() - start_tick);
+        return ram_buffer;
+    }
+
+    return (uint8_t *)copy_extents_to_flash(fs_file.extent, fs_file.num_extents, fs_file.size);
+}
+#endif //SD_CARD
+
+// ROMs that don't fit the RAM are demand paged in the bank_size banks if
+// bank_size is not 0, ROM_DATA is NULL in this case (see rom_pager.h)
+static void load_rom(retro_emulator_file_t *file, uint8_t *ram_buffer, uint32_t ram_length,
+                     uint32_t bank_size)
 {
     uint8_t *rom_address = (uint8_t *)file->address;
 
 #if SD_CARD != 0
-    uint32_t src = (uint32_t)rom_address;
+    if (file->path) {
+        rom_address = load_rom_from_fs(file, ram_buffer, ram_length);
+        rom_manager_set_active_file(file, rom_address);
+        return;
+    }
+
+    uint32_t offset = 0;
+    const uint64_t lba = file->lba ? file->lba : sd_address_to_lba((uint32_t)rom_address, &offset);
     int rom_size = file->size;
 
     if (ram_length >= rom_size) {
-        SdCtx.Read(src, ram_buffer, rom_size);
+        const uint32_t start_tick = HAL_GetTick();
+        sd_read(lba, offset, ram_buffer, rom_size);
         rom_address = ram_buffer;
+        printf("Loaded %d KB from SD to RAM in %lu ms\n", rom_size / 1024,
+               HAL_GetTick() - start_tick);
+    } else if (bank_size) {
+        rom_pager_close();
+        rom_address = (uint8_t *)rom_pager_open(lba, offset, rom_size, bank_size,
+                                                ram_buffer, ram_length);
     } else {
-        rom_address = (uint8_t *)copy_sd_to_flash(src, rom_size);
+        rom_address = (uint8_t *)copy_sd_to_flash(lba, offset, rom_size);
     }
 #endif //SD_CARD
 
     rom_manager_set_active_file(file, rom_address);
 }
 
+#if SD_CARD != 0
+#define RECENT_MAGIC 0x52434E54UL
+// The recent files are pinned, see rom_catalog_pin()
+#define RECENT_FILES ROM_CATALOG_PINNED
+#define PREFETCH_CHECKED 16
+// Bytes copied per step and time spent per launcher loop iteration, so
+// the input is still read every ~30ms
+#define PREFETCH_STEP_BYTES 1024
+#define PREFETCH_SLICE_MS 10
+
+// Recently started ROMs, kept over the reset back to the launcher
+PERSISTENT static struct {
+    uint32_t magic;
+    retro_emulator_file_t *files[RECENT_FILES];
+    uint32_t check;
+} recent;
+
+static struct {
+    retro_emulator_file_t *file; /* Copy in progress */
+    retro_emulator_file_t *checked[PREFETCH_CHECKED];
+    uint32_t next_checked;
+} prefetch;
+
+static uint32_t recent_check(void)
+{
+    uint32_t check = recent.magic;
+
+    for (int i = 0; i < RECENT_FILES; i++)
+        check ^= (uint32_t)recent.files[i] * (i + 1);
+    return check;
+}
+
+static void recent_add(retro_emulator_file_t *file)
+{
+    int i;
+
+    if (recent.magic != RECENT_MAGIC || recent.check != recent_check()) {
+        memset(&recent, 0, sizeof(recent));
+        recent.magic = RECENT_MAGIC;
+    }
+
+    for (i = 0; i < RECENT_FILES - 1 && recent.files[i] != file; i++)
+        ;
+    memmove(&recent.files[1], &recent.files[0], i * sizeof(recent.files[0]));
+    recent.files[0] = file;
+    recent.check = recent_check();
+}
+
+// RAM the ROM is loaded to if it fits, see emulator_start()
+static uint32_t rom_ram_length(retro_emulator_t *emu)
+{
+#ifdef ENABLE_EMULATOR_NES
+    if (strcmp(emu->system_name, "Nintendo Entertainment System") == 0)
+        return (uint32_t)&_NES_ROM_UNPACK_BUFFER_SIZE;
+#endif
+#if defined(ENABLE_EMULATOR_SMS) || defined(ENABLE_EMULATOR_GG) || defined(ENABLE_EMULATOR_COL) || defined(ENABLE_EMULATOR_SG1000)
+    if (strcmp(emu->system_name, "Sega Master System") == 0 ||
+        strcmp(emu->system_name, "Sega Game Gear") == 0 ||
+        strcmp(emu->system_name, "Sega SG-1000") == 0 ||
+        strcmp(emu->system_name, "Colecovision") == 0)
+        return (uint32_t)&_SMS_ROM_UNPACK_BUFFER_SIZE;
+#endif
+#ifdef ENABLE_EMULATOR_PCE
+    if (strcmp(emu->system_name, "PC Engine") == 0)
+        return (uint32_t)&_PCE_ROM_UNPACK_BUFFER_SIZE;
+#endif
+#ifdef ENABLE_EMULATOR_GW
+    if (strcmp(emu->system_name, "Game & Watch") == 0)
+        return (uint32_t)&_GW_ROM_UNPACK_BUFFER_SIZE;
+#endif
+    return 0;
+}
+
+static bool prefetch_begin(retro_emulator_file_t *file)
+{
+    uint32_t offset;
+    uint32_t flash_address;
+
+    // The filesystem ROMs are copied by extents, only at the start
+    if (!file || file->path || !emulator_is_file_valid(file))
+        return false;
+
+    for (int i = 0; i < PREFETCH_CHECKED; i++) {
+        if (prefetch.checked[i] == file)
+            return false;
+    }
+    prefetch.checked[prefetch.next_checked++ % PREFETCH_CHECKED] = file;
+
+    if (file->size <= rom_ram_length(file_to_emu(file)))
+        return false;
+
+    offset = 0;
+    const uint64_t lba = file->lba ? file->lba : sd_address_to_lba((uint32_t)file->address, &offset);
+    if (copy_sd_to_flash_begin(lba, offset, file->size, &flash_address))
+        return false;
+
+    printf("Prefetch: copying %s to flash\n", file->name);
+    prefetch.file = file;
+    return true;
+}
+
+bool emulator_prefetch_idle(retro_emulator_file_t *selected)
+{
+#if EXTFLASH_FORCE_SRAM == 0
+    if (!FlashCtx.Presented)
+        return false;
+
+    if (!prefetch.file) {
+        bool started = prefetch_begin(selected);
+
+        if (recent.magic == RECENT_MAGIC && recent.check == recent_check()) {
+            for (int i = 0; i < RECENT_FILES && !started; i++)
+                started = prefetch_begin(recent.files[i]);
+        }
+        if (!started)
+            return false;
+    }
+
+    const uint32_t start_tick = HAL_GetTick();
+    do {
+        if (copy_sd_to_flash_step(PREFETCH_STEP_BYTES)) {
+            printf("Prefetch: %s is in flash\n", prefetch.file->name);
+            prefetch.file = NULL;
+            break;
+        }
+        // The idle pre-erase job does the erases it waits for
+        if (copy_sd_to_flash_blocked())
+            return false;
+    } while (HAL_GetTick() - start_tick < PREFETCH_SLICE_MS);
+    return true;
+#else
+    // SPI SRAM holds just the running game
+    return false;
+#endif
+}
+
+static void prefetch_stop(retro_emulator_file_t *file)
+{
+    if (!prefetch.file)
+        return;
+
+    // The file may be the pinned copy of the prefetched one
+    if (rom_catalog_same_file(prefetch.file, file)) {
+        // The rest of the game being started is copied right away
+        copy_sd_to_flash_finish();
+    } else {
+        copy_sd_to_flash_cancel();
+    }
+    prefetch.file = NULL;
+}
+#endif // SD_CARD
+
 void emulator_start(retro_emulator_file_t *file, bool load_state, bool start_paused)
 {
     printf("Retro-Go: Starting game: %s\n", file->name);
 
+#if SD_CARD != 0
+    // The startup file and the recent ones must stay valid over the reset
+    file = rom_catalog_pin(file);
+    prefetch_stop(file);
+    recent_add(file);
+#endif
+
     // odroid_settings_StartAction_set(load_state ? ODROID_START_ACTION_RESUME : ODROID_START_ACTION_NEWGAME);
     // odroid_settings_RomFilePath_set(path);
     // odroid_settings_commit();
@@ -416,14 +648,15 @@ void emulator_start(retro_emulator_file_t *file, bool load_state, bool start_pau
 #ifdef ENABLE_EMULATOR_GB
         load_overlay(&__RAM_EMU_START__, &_OVERLAY_GB_LOAD_START, (size_t)&_OVERLAY_GB_SIZE,
                      &_OVERLAY_GB_BSS_START, (size_t)&_OVERLAY_GB_BSS_SIZE);
-        load_rom(file, NULL, 0);
+        // The RAM after the overlay is the bank cache of the loader
+        load_rom(file, NULL, 0, 0);
         app_main_gb(load_state, start_paused);
 #endif
     } else if(strcmp(emu->system_name, "Nintendo Entertainment System") == 0) {
 #ifdef ENABLE_EMULATOR_NES
         load_overlay(&__RAM_EMU_START__, &_OVERLAY_NES_LOAD_START, (size_t)&_OVERLAY_NES_SIZE,
                      &_OVERLAY_NES_BSS_START, (size_t)&_OVERLAY_NES_BSS_SIZE);
-        load_rom(file, (unsigned char *)&_NES_ROM_UNPACK_BUFFER, (uint32_t)&_NES_ROM_UNPACK_BUFFER_SIZE);
+        load_rom(file, (unsigned char *)&_NES_ROM_UNPACK_BUFFER, (uint32_t)&_NES_ROM_UNPACK_BUFFER_SIZE, 0);
         app_main_nes(load_state, start_paused);
 #endif
     } else if(strcmp(emu->system_name, "Sega Master System") == 0 ||
@@ -433,7 +666,7 @@ void emulator_start(retro_emulator_file_t *file, bool load_state, bool start_pau
 #if defined(ENABLE_EMULATOR_SMS) || defined(ENABLE_EMULATOR_GG) || defined(ENABLE_EMULATOR_COL) || defined(ENABLE_EMULATOR_SG1000)
         load_overlay(&__RAM_EMU_START__, &_OVERLAY_SMS_LOAD_START, (size_t)&_OVERLAY_SMS_SIZE,
                      &_OVERLAY_SMS_BSS_START, (size_t)&_OVERLAY_SMS_BSS_SIZE);
-        load_rom(file, NULL, 0);
+        load_rom(file, (unsigned char *)&_SMS_ROM_UNPACK_BUFFER, (uint32_t)&_SMS_ROM_UNPACK_BUFFER_SIZE, 0);
         if (! strcmp(emu->system_name, "Colecovision")) app_main_smsplusgx(load_state, start_paused, SMSPLUSGX_ENGINE_COLECO);
         else
         if (! strcmp(emu->system_name, "Sega SG-1000")) app_main_smsplusgx(load_state, start_paused, SMSPLUSGX_ENGINE_SG1000);
@@ -443,14 +676,15 @@ void emulator_start(retro_emulator_file_t *file, bool load_state, bool start_pau
 #ifdef ENABLE_EMULATOR_GW
         load_overlay(&__RAM_EMU_START__, &_OVERLAY_GW_LOAD_START, (size_t)&_OVERLAY_GW_SIZE,
                      &_OVERLAY_GW_BSS_START, (size_t)&_OVERLAY_GW_BSS_SIZE);
-        load_rom(file, NULL, 0);
+        load_rom(file, (unsigned char *)&_GW_ROM_UNPACK_BUFFER, (uint32_t)&_GW_ROM_UNPACK_BUFFER_SIZE, 0);
         app_main_gw(load_state);
 #endif
     } else if(strcmp(emu->system_name, "PC Engine") == 0) {
 #ifdef ENABLE_EMULATOR_PCE
       load_overlay(&__RAM_EMU_START__, &_OVERLAY_PCE_LOAD_START, (size_t)&_OVERLAY_PCE_SIZE,
                    &_OVERLAY_PCE_BSS_START, (size_t)&_OVERLAY_PCE_BSS_SIZE);
-      load_rom(file, (unsigned char *)&_PCE_ROM_UNPACK_BUFFER, (uint32_t)&_PCE_ROM_UNPACK_BUFFER_SIZE);
+      load_rom(file, (unsigned char *)&_PCE_ROM_UNPACK_BUFFER, (uint32_t)&_PCE_ROM_UNPACK_BUFFER_SIZE,
+               0x2000);
       app_main_pce(load_state, start_paused);
 #endif
   }
@@ -500,6 +734,11 @@ void emulators_init()
 
 bool emulator_is_file_valid(retro_emulator_file_t *file)
 {
+#if SD_CARD != 0
+    if (rom_catalog_map_file(file))
+        return true;
+#endif
+
     for (int i = 0; i < emulators_count; i++) {
         for (int j = 0; j < emulators[i].roms.count; j++) {
             if (&emulators[i].roms.files[j] == file) {
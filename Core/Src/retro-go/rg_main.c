@@ -14,6 +14,9 @@
 #include "main.h"
 #include "gw_buttons.h"
 #include "gw_flash.h"
+#include "gw_sd.h"
+#include "rom_pager.h"
+#include "rom_tier.h"
 #include "rg_rtc.h"
 
 #if 0
@@ -220,6 +223,15 @@ void retro_loop()
         {
             gui_event(TAB_IDLE, tab);
 
+#if SD_CARD != 0
+            listbox_item_t *item = gui_get_selected_item(tab);
+
+            // Take the SD copies and the flash erases off the game loading
+            // path, the copies first
+            if (!emulator_prefetch_idle(item ? (retro_emulator_file_t *)item->arg : NULL))
+                flash_alloc_pre_erase();
+#endif // SD_CARD
+
             if (idle_s % 10 == 0)
                 gui_draw_status(tab);
         }
@@ -259,6 +271,38 @@ void retro_loop()
                     char erase_size_str[32];
                     char dbgmcu_id_str[16];
                     char dbgmcu_cr_str[16];
+#if SD_CARD != 0
+                    char sd_cache_str[32];
+                    struct sd_cache_stats sd_stats;
+
+                    sd_cache_get_stats(&sd_stats);
+                    snprintf(sd_cache_str, sizeof(sd_cache_str), "%ld/%ld (+%ld)",
+                             sd_stats.hits, sd_stats.misses, sd_stats.readahead);
+
+                    char flash_cache_str[32];
+                    char flash_frag_str[32];
+                    struct flash_alloc_stats flash_stats;
+
+                    flash_alloc_get_stats(&flash_stats);
+                    snprintf(flash_cache_str, sizeof(flash_cache_str), "%ld/%ld kB",
+                             flash_stats.total_kb - flash_stats.free_kb, flash_stats.total_kb);
+                    snprintf(flash_frag_str, sizeof(flash_frag_str), "%ld%% (%ld gaps)",
+                             flash_stats.fragmentation, flash_stats.free_gaps);
+
+                    // The pager and tier counts are of the last game
+                    char rom_pager_str[32];
+                    struct rom_pager_stats pager_stats;
+
+                    rom_pager_get_stats(&pager_stats);
+                    snprintf(rom_pager_str, sizeof(rom_pager_str), "%ld/%ld",
+                             pager_stats.hits, pager_stats.misses);
+#endif // SD_CARD
+                    char rom_tier_str[32];
+                    struct rom_tier_stats tier_stats;
+
+                    rom_tier_get_stats(&tier_stats);
+                    snprintf(rom_tier_str, sizeof(rom_tier_str), "%ld/%ld",
+                             tier_stats.hits, tier_stats.misses);
 
                     if (FlashCtx.Presented) {
                         // Read jedec id and status register from the external flash
@@ -279,7 +323,12 @@ void retro_loop()
                     odroid_dialog_choice_t debuginfo[] = {
 #if SD_CARD != 0
                         {0, "SD card used", "", 1, NULL},
+                        {0, "SD cache hit/miss", sd_cache_str, 1, NULL},
+                        {0, "Flash cache used", flash_cache_str, 1, NULL},
+                        {0, "Flash cache frag", flash_frag_str, 1, NULL},
+                        {0, "ROM pager hit/miss", rom_pager_str, 1, NULL},
 #endif // SD_CARD
+                        {0, "ROM tier hit/miss", rom_tier_str, 1, NULL},
                         {0, "Flash JEDEC ID", (char *) jedec_id_str, 1, NULL},
                         {0, "Flash Name", (char*) FlashCtx.GetName(), 1, NULL},
                         {0, "Flash SR", (char *) status_str, 1, NULL},
@@ -295,6 +344,10 @@ void retro_loop()
 
                     odroid_dialog_choice_t debuginfoSdOnly[] = {
                         {0, "SD card used only", "", 1, NULL},
+#if SD_CARD != 0
+                        {0, "SD cache hit/miss", sd_cache_str, 1, NULL},
+                        {0, "ROM pager hit/miss", rom_pager_str, 1, NULL},
+#endif // SD_CARD
                         ODROID_DIALOG_CHOICE_LAST
                     };
 
@@ -443,6 +496,7 @@ void retro_loop()
         }
 
         gui_redraw();
+        flash_job_step();
         HAL_Delay(20);
     }
 }
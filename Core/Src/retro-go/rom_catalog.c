@@ -0,0 +1,276 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "gw_linker.h"
+#include "gw_sd.h"
+#include "main.h"
+#include "rom_catalog.h"
+#include "utils.h"
+
+#define PINNED_MAGIC 0x50494E44UL
+#define NO_ENTRY UINT32_MAX
+
+static struct {
+    bool initialized;
+    bool valid;
+    struct rom_catalog_header header;
+    // Heap copies of the opened systems, NULL until mapped
+    retro_emulator_file_t *files[ROM_CATALOG_MAX_SYSTEMS];
+    char *names[ROM_CATALOG_MAX_SYSTEMS];
+} catalog;
+
+// The catalog entries of the pinned files, kept over the reset. The files
+// are read back from the catalog when first used after it.
+PERSISTENT static struct {
+    uint32_t magic;
+    uint32_t entry[ROM_CATALOG_PINNED];
+    uint32_t last_use[ROM_CATALOG_PINNED];
+    uint32_t tick;
+    uint32_t check;
+} pinned;
+
+static retro_emulator_file_t pinned_files[ROM_CATALOG_PINNED];
+static bool pinned_loaded[ROM_CATALOG_PINNED];
+
+static void catalog_read(uint32_t offset, void *buffer, size_t size)
+{
+    sd_read(SD_CATALOG_LBA + offset / ROM_CATALOG_SECTOR_SIZE,
+            offset % ROM_CATALOG_SECTOR_SIZE, buffer, size);
+}
+
+static bool catalog_init(void)
+{
+    struct rom_catalog_header *header = &catalog.header;
+
+    if (catalog.initialized)
+        return catalog.valid;
+
+    catalog.initialized = true;
+    catalog_read(0, header, sizeof(*header));
+    if (header->magic != ROM_CATALOG_MAGIC || header->version != ROM_CATALOG_VERSION ||
+        header->entry_size != sizeof(struct rom_catalog_entry) ||
+        header->systems_count > ROM_CATALOG_MAX_SYSTEMS) {
+        printf("Catalog: No catalog at sector %llu\n", SD_CATALOG_LBA);
+        return false;
+    }
+
+    catalog.valid = true;
+    printf("Catalog: %lu ROMs in %lu systems\n", header->entries_count, header->systems_count);
+    return true;
+}
+
+static int find_system(const rom_system_t *system)
+{
+    if (!catalog_init())
+        return -1;
+
+    for (int i = 0; i < catalog.header.systems_count; i++) {
+        if (strncmp(catalog.header.systems[i].dirname, system->extension,
+                    sizeof(catalog.header.systems[i].dirname)) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+static const rom_system_t *index_to_system(int index)
+{
+    const struct rom_catalog_system *catalog_system = &catalog.header.systems[index];
+
+    for (int i = 0; i < rom_mgr.systems_count; i++) {
+        if (strncmp(catalog_system->dirname, rom_mgr.systems[i]->extension,
+                    sizeof(catalog_system->dirname)) == 0)
+            return rom_mgr.systems[i];
+    }
+
+    return NULL;
+}
+
+static int entry_to_system(uint32_t entry_index)
+{
+    for (int i = 0; i < catalog.header.systems_count; i++) {
+        const struct rom_catalog_system *catalog_system = &catalog.header.systems[i];
+
+        if (entry_index >= catalog_system->first_entry &&
+            entry_index < catalog_system->first_entry + catalog_system->entries_count)
+            return i;
+    }
+
+    return -1;
+}
+
+static bool map_system(int index, const rom_system_t *system)
+{
+    const struct rom_catalog_system *catalog_system = &catalog.header.systems[index];
+    struct rom_catalog_entry entries[ROM_CATALOG_SECTOR_SIZE / sizeof(struct rom_catalog_entry)];
+
+    if (catalog.files[index])
+        return true;
+
+    retro_emulator_file_t *files = calloc(catalog_system->entries_count, sizeof(*files));
+    char *names = malloc(catalog_system->names_size);
+    if (!files || !names) {
+        printf("Catalog: Not enough memory for %lu %s ROMs\n", catalog_system->entries_count,
+               system->extension);
+        free(files);
+        free(names);
+        return false;
+    }
+
+    catalog_read(catalog_system->names_offset, names, catalog_system->names_size);
+
+    for (uint32_t i = 0; i < catalog_system->entries_count; i += ARRAY_SIZE(entries)) {
+        const uint32_t left = catalog_system->entries_count - i;
+        const uint32_t count = left < ARRAY_SIZE(entries) ? left : ARRAY_SIZE(entries);
+        const uint32_t entry_index = catalog_system->first_entry + i;
+
+        catalog_read(catalog.header.entries_offset + entry_index * sizeof(entries[0]),
+                     entries, count * sizeof(entries[0]));
+        for (uint32_t j = 0; j < count; j++) {
+            const struct rom_catalog_entry *entry = &entries[j];
+            retro_emulator_file_t *file = &files[i + j];
+
+            file->name = names + (entry->name_offset - catalog_system->names_offset);
+            file->ext = file->name + strlen(file->name) + 1;
+            file->path = entry->path_offset ?
+                             names + (entry->path_offset - catalog_system->names_offset) : NULL;
+            file->lba = file->path ? 0 : SD_CATALOG_LBA + entry->rom_sector;
+            file->size = entry->rom_size;
+            file->save_address = entry->save_size ? &__SAVEFLASH_START__ + entry->save_offset : NULL;
+            file->save_size = entry->save_size;
+            file->checksum = entry->crc32;
+            file->region = entry->region;
+            file->system = system;
+        }
+    }
+
+    catalog.files[index] = files;
+    catalog.names[index] = names;
+    return true;
+}
+
+// Returns the catalog entry of the mapped file, NO_ENTRY if it's not one
+static uint32_t file_to_entry(const retro_emulator_file_t *file)
+{
+    for (int i = 0; i < catalog.header.systems_count; i++) {
+        const struct rom_catalog_system *catalog_system = &catalog.header.systems[i];
+        const retro_emulator_file_t *files = catalog.files[i];
+
+        if (files && file >= files && file < files + catalog_system->entries_count)
+            return catalog_system->first_entry + (file - files);
+    }
+
+    return NO_ENTRY;
+}
+
+uint32_t rom_catalog_count(const rom_system_t *system)
+{
+    const int index = find_system(system);
+
+    return index < 0 ? 0 : catalog.header.systems[index].entries_count;
+}
+
+const retro_emulator_file_t *rom_catalog_files(const rom_system_t *system)
+{
+    const int index = find_system(system);
+
+    if (index < 0 || !map_system(index, system))
+        return NULL;
+
+    return catalog.files[index];
+}
+
+static uint32_t pinned_check(void)
+{
+    return crc32_le(0, (const unsigned char *)&pinned, offsetof(typeof(pinned), check));
+}
+
+static bool pinned_valid(void)
+{
+    return pinned.magic == PINNED_MAGIC && pinned.check == pinned_check();
+}
+
+// Catalog entry of the mapped or the pinned file, NO_ENTRY if it's not one
+static uint32_t any_file_to_entry(const retro_emulator_file_t *file)
+{
+    if (file >= pinned_files && file < &pinned_files[ROM_CATALOG_PINNED])
+        return pinned_valid() ? pinned.entry[file - pinned_files] : NO_ENTRY;
+
+    return file_to_entry(file);
+}
+
+retro_emulator_file_t *rom_catalog_pin(retro_emulator_file_t *file)
+{
+    const uint32_t entry_index = any_file_to_entry(file);
+    int slot = 0;
+
+    if (entry_index == NO_ENTRY)
+        return file;
+
+    if (!pinned_valid()) {
+        memset(&pinned, 0, sizeof(pinned));
+        pinned.magic = PINNED_MAGIC;
+        for (int i = 0; i < ROM_CATALOG_PINNED; i++)
+            pinned.entry[i] = NO_ENTRY;
+    }
+
+    // Same entry or the least recently used slot
+    for (int i = 0; i < ROM_CATALOG_PINNED; i++) {
+        if (pinned.entry[i] == entry_index) {
+            slot = i;
+            break;
+        }
+        if (pinned.last_use[i] < pinned.last_use[slot])
+            slot = i;
+    }
+
+    pinned.entry[slot] = entry_index;
+    pinned.last_use[slot] = ++pinned.tick;
+    pinned.check = pinned_check();
+
+    if (&pinned_files[slot] != file)
+        pinned_files[slot] = *file;
+    pinned_loaded[slot] = true;
+    return &pinned_files[slot];
+}
+
+static bool map_pinned(int slot)
+{
+    if (pinned_loaded[slot])
+        return true;
+
+    if (!pinned_valid() || pinned.entry[slot] == NO_ENTRY || !catalog_init())
+        return false;
+
+    const int index = entry_to_system(pinned.entry[slot]);
+    if (index < 0)
+        return false;
+
+    const rom_system_t *system = index_to_system(index);
+    if (!system || !map_system(index, system))
+        return false;
+
+    pinned_files[slot] = catalog.files[index][pinned.entry[slot] - catalog.header.systems[index].first_entry];
+    pinned_loaded[slot] = true;
+    return true;
+}
+
+bool rom_catalog_same_file(const retro_emulator_file_t *a, const retro_emulator_file_t *b)
+{
+    if (a == b)
+        return true;
+
+    const uint32_t entry_index = any_file_to_entry(a);
+    return entry_index != NO_ENTRY && entry_index == any_file_to_entry(b);
+}
+
+bool rom_catalog_map_file(const retro_emulator_file_t *file)
+{
+    if (file >= pinned_files && file < &pinned_files[ROM_CATALOG_PINNED])
+        return map_pinned(file - pinned_files);
+
+    return file_to_entry(file) != NO_ENTRY;
+}
@@ -11,8 +11,8 @@
                * http://csrc.nist.gov/publications/fips/fips180-2/fips180-2withchangenotice.pdf
               This implementation uses little endian byte order.
 *********************************************************************/
-
 /*************************** HEADER FILES ***************************/
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -22,13 +22,37 @@
 #define ROTLEFT(a,b) (((a) << (b)) | ((a) >> (32-(b))))
 #define ROTRIGHT(a,b) (((a) >> (b)) | ((a) << (32-(b))))
 
-#define CH(x,y,z) (((x) & (y)) ^ (~(x) & (z)))
-#define MAJ(x,y,z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define CH(x,y,z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x,y,z) (((x) & (y)) | ((z) & ((x) | (y))))
 #define EP0(x) (ROTRIGHT(x,2) ^ ROTRIGHT(x,13) ^ ROTRIGHT(x,22))
 #define EP1(x) (ROTRIGHT(x,6) ^ ROTRIGHT(x,11) ^ ROTRIGHT(x,25))
 #define SIG0(x) (ROTRIGHT(x,7) ^ ROTRIGHT(x,18) ^ ((x) >> 3))
 #define SIG1(x) (ROTRIGHT(x,17) ^ ROTRIGHT(x,19) ^ ((x) >> 10))
 
+// The message schedule is kept in a 16 word ring, m[i] is replaced by
+// the word 16 rounds later once the rounds before are done with it
+#define MESSAGE(i) (m[i])
+#define SCHEDULE(i) (m[i] += SIG1(m[((i) - 2) & 15]) + m[((i) - 7) & 15] + SIG0(m[((i) - 15) & 15]))
+
+// A round without the register rotation, the callers rotate the names
+#define ROUND(a,b,c,d,e,f,g,h,k,w) do { \
+	WORD t1 = (h) + EP1(e) + CH(e,f,g) + (k) + (w); \
+	(d) += t1; \
+	(h) = t1 + EP0(a) + MAJ(a,b,c); \
+} while (0)
+
+// 8 rounds from ring position i, kp are the constants of the 16 rounds
+#define ROUNDS8(kp,i,W) do { \
+	ROUND(a,b,c,d,e,f,g,h,kp[(i) + 0],W((i) + 0)); \
+	ROUND(h,a,b,c,d,e,f,g,kp[(i) + 1],W((i) + 1)); \
+	ROUND(g,h,a,b,c,d,e,f,kp[(i) + 2],W((i) + 2)); \
+	ROUND(f,g,h,a,b,c,d,e,kp[(i) + 3],W((i) + 3)); \
+	ROUND(e,f,g,h,a,b,c,d,kp[(i) + 4],W((i) + 4)); \
+	ROUND(d,e,f,g,h,a,b,c,kp[(i) + 5],W((i) + 5)); \
+	ROUND(c,d,e,f,g,h,a,b,kp[(i) + 6],W((i) + 6)); \
+	ROUND(b,c,d,e,f,g,h,a,kp[(i) + 7],W((i) + 7)); \
+} while (0)
+
 /**************************** VARIABLES *****************************/
 static const WORD k[64] = {
 	0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
@@ -42,45 +66,60 @@ static const WORD k[64] = {
 };
 
 /*********************** FUNCTION DEFINITIONS ***********************/
-void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
+static inline WORD load_be32(const BYTE *p)
 {
-	WORD a, b, c, d, e, f, g, h, i, j, t1, t2, m[64];
-
-	for (i = 0, j = 0; i < 16; ++i, j += 4)
-		m[i] = (data[j] << 24) | (data[j + 1] << 16) | (data[j + 2] << 8) | (data[j + 3]);
-	for ( ; i < 64; ++i)
-		m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
-
-	a = ctx->state[0];
-	b = ctx->state[1];
-	c = ctx->state[2];
-	d = ctx->state[3];
-	e = ctx->state[4];
-	f = ctx->state[5];
-	g = ctx->state[6];
-	h = ctx->state[7];
-
-	for (i = 0; i < 64; ++i) {
-		t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[i];
-		t2 = EP0(a) + MAJ(a,b,c);
-		h = g;
-		g = f;
-		f = e;
-		e = d + t1;
-		d = c;
-		c = b;
-		b = a;
-		a = t1 + t2;
-	}
+	// A single load where the core allows unaligned accesses
+	uint32_t w;
+
+	memcpy(&w, p, sizeof(w));
+	return __builtin_bswap32(w);
+}
+
+// Transforms blocks of 64 bytes, the state stays in the registers from
+// one block to the next
+static void sha256_blocks(WORD state[8], const BYTE data[], size_t blocks)
+{
+	WORD a, b, c, d, e, f, g, h, i, m[16];
+	const WORD *kp;
+
+	while (blocks--) {
+		if (((uintptr_t) data & 3) == 0) {
+			const uint32_t *words = (const uint32_t *) data;
+
+			for (i = 0; i < 16; ++i)
+				m[i] = __builtin_bswap32(words[i]);
+		} else {
+			for (i = 0; i < 16; ++i)
+				m[i] = load_be32(&data[i * 4]);
+		}
+
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+		e = state[4];
+		f = state[5];
+		g = state[6];
+		h = state[7];
+
+		ROUNDS8(k, 0, MESSAGE);
+		ROUNDS8(k, 8, MESSAGE);
+		for (kp = k + 16; kp < k + 64; kp += 16) {
+			ROUNDS8(kp, 0, SCHEDULE);
+			ROUNDS8(kp, 8, SCHEDULE);
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
 
-	ctx->state[0] += a;
-	ctx->state[1] += b;
-	ctx->state[2] += c;
-	ctx->state[3] += d;
-	ctx->state[4] += e;
-	ctx->state[5] += f;
-	ctx->state[6] += g;
-	ctx->state[7] += h;
+		data += 64;
+	}
 }
 
 void sha256_init(SHA256_CTX *ctx)
@@ -99,17 +138,35 @@ void sha256_init(SHA256_CTX *ctx)
 
 void sha256_update(SHA256_CTX *ctx, const BYTE data[], size_t len)
 {
-	WORD i;
+	size_t n;
+
+	// Top up a partial block first
+	if (ctx->datalen > 0) {
+		n = 64 - ctx->datalen;
+		if (n > len)
+			n = len;
+		memcpy(&ctx->data[ctx->datalen], data, n);
+		ctx->datalen += n;
+		data += n;
+		len -= n;
+		if (ctx->datalen < 64)
+			return;
+		sha256_blocks(ctx->state, ctx->data, 1);
+		ctx->bitlen += 512;
+		ctx->datalen = 0;
+	}
 
-	for (i = 0; i < len; ++i) {
-		ctx->data[ctx->datalen] = data[i];
-		ctx->datalen++;
-		if (ctx->datalen == 64) {
-			sha256_transform(ctx, ctx->data);
-			ctx->bitlen += 512;
-			ctx->datalen = 0;
-		}
+	// The whole blocks are hashed in place
+	n = len / 64;
+	if (n > 0) {
+		sha256_blocks(ctx->state, data, n);
+		ctx->bitlen += (unsigned long long) n * 512;
+		data += n * 64;
+		len -= n * 64;
 	}
+
+	memcpy(ctx->data, data, len);
+	ctx->datalen = len;
 }
 
 void sha256_final(SHA256_CTX *ctx, BYTE hash[])
@@ -128,7 +185,7 @@ void sha256_final(SHA256_CTX *ctx, BYTE hash[])
 		ctx->data[i++] = 0x80;
 		while (i < 64)
 			ctx->data[i++] = 0x00;
-		sha256_transform(ctx, ctx->data);
+		sha256_blocks(ctx->state, ctx->data, 1);
 		memset(ctx->data, 0, 56);
 	}
 
@@ -142,7 +199,7 @@ void sha256_final(SHA256_CTX *ctx, BYTE hash[])
 	ctx->data[58] = ctx->bitlen >> 40;
 	ctx->data[57] = ctx->bitlen >> 48;
 	ctx->data[56] = ctx->bitlen >> 56;
-	sha256_transform(ctx, ctx->data);
+	sha256_blocks(ctx->state, ctx->data, 1);
 
 	// Since this implementation uses little endian byte ordering and SHA uses big endian,
 	// reverse all the bytes when copying the final state to the output hash.
@@ -158,14 +215,19 @@ void sha256_final(SHA256_CTX *ctx, BYTE hash[])
 	}
 }
 
-void sha256_to_string(BYTE hash_str[65], const BYTE data[], size_t len)
+void sha256_final_to_string(SHA256_CTX *ctx, BYTE hash_str[65])
 {
   BYTE hash[32] = {0};
-  SHA256_CTX sha256 = {0};
-  sha256_init(&sha256);
-  sha256_update(&sha256, data, len);
-  sha256_final(&sha256, hash);
+  sha256_final(ctx, hash);
   for (int i = 0; i < 32; i++) {
     sprintf((char *) &hash_str[i * 2], "%02x", hash[i]);
   }
-}
\ No newline at end of file
+}
+
+void sha256_to_string(BYTE hash_str[65], const BYTE data[], size_t len)
+{
+  SHA256_CTX sha256 = {0};
+  sha256_init(&sha256);
+  sha256_update(&sha256, data, len);
+  sha256_final_to_string(&sha256, hash_str);
+}
@@ -0,0 +1,465 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "gw_flash.h"
+#include "gw_sd.h"
+#include "rom_pager.h"
+#if FLASH_CACHE_LZ4 != 0
+#include "lz4_depack.h"
+#include "lz4_pack.h"
+#endif
+
+#define NO_SLOT 0xFFFF
+#define MIN(a,b) ({__typeof__(a) _a = (a); __typeof__(b) _b = (b);_a < _b ? _a : _b; })
+
+#if FLASH_CACHE_LZ4 != 0
+// The packed ROM entry starts with the index of the banks, every bank is an
+// LZ4 block decoded on its own or the raw bank if it doesn't compress
+#define PACKED_MAGIC 0x5A344C50 /* "PL4Z" */
+#define LZ4_KIND 0x4C5A3400
+// Slots used as the input, output and hash table of the compressor, the
+// offsets of the packed banks follow the hash table
+#define LZ4_WORK_SLOTS 3
+
+enum lz4_state {
+    LZ4_NONE,    /* Raw copy to flash */
+    LZ4_START,   /* Packed copy is looked up on the first use */
+    LZ4_PACKING, /* Banks are packed to flash in the background */
+    LZ4_DONE,    /* Banks are decoded from flash */
+};
+
+struct lz4_index {
+    uint32_t magic;
+    uint32_t bank_size;
+    uint32_t num_banks;
+    uint32_t length;
+    uint32_t offset[]; /* num_banks + 1 offsets from the start of the index */
+};
+#endif
+
+struct slot {
+    uint16_t bank;   /* NO_SLOT if the slot is free */
+    uint16_t pinned; /* Pin count */
+    uint32_t last_use;
+};
+
+static struct {
+    bool active;
+    bool in_flash;
+    uint64_t lba;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t base;
+    uint32_t bank_size;
+    uint8_t *ram;
+    uint32_t num_slots;
+    uint32_t use_counter;
+    const uint8_t *flash;
+#if FLASH_CACHE_LZ4 != 0
+    enum lz4_state lz4_state;
+    uint32_t num_banks;
+    const uint8_t *packed;   /* Start of the index in flash */
+    const uint32_t *bank_offset; /* Offsets of the packed banks */
+    uint32_t packed_banks;   /* Banks decoded from flash */
+    uint32_t fill_bank;
+    uint32_t fill_pos;       /* Bytes of the bank read */
+    uint32_t fill_len;       /* Packed length, 0 if the bank is raw */
+    uint32_t fill_written;   /* Bytes of the bank written */
+    uint32_t stream_pos;     /* Position of the next bank in the entry */
+#endif
+    uint16_t bank_slot[ROM_PAGER_MAX_BANKS];
+    struct slot slots[ROM_PAGER_MAX_BANKS];
+} pager;
+
+// The counts are kept over the reset back to the launcher, which shows the
+// ones of the last game
+#define STATS_MAGIC 0x50414745UL
+
+PERSISTENT static struct {
+    uint32_t magic;
+    struct rom_pager_stats counts;
+} last;
+
+#if FLASH_CACHE_LZ4 != 0
+static uint8_t *work_slot(uint32_t index)
+{
+    return pager.ram + (pager.num_slots + index) * pager.bank_size;
+}
+
+static void lz4_release_work_slots(void)
+{
+    for (uint32_t i = 0; i < LZ4_WORK_SLOTS; i++)
+        pager.slots[pager.num_slots++].bank = NO_SLOT;
+}
+
+static void lz4_begin(void)
+{
+    const uint32_t kind = LZ4_KIND + pager.base;
+    uint32_t flash_address;
+    uint32_t length;
+
+    pager.lz4_state = LZ4_NONE;
+    pager.num_banks = (pager.size - pager.base + pager.bank_size - 1) / pager.bank_size;
+    const uint32_t index_size = sizeof(struct lz4_index) + (pager.num_banks + 1) * sizeof(uint32_t);
+    if (flash_alloc_find(pager.lba, pager.offset, pager.size, kind, &flash_address, &length)) {
+        const struct lz4_index *index = (const struct lz4_index *)flash_address;
+
+        if (index->magic == PACKED_MAGIC && index->bank_size == pager.bank_size &&
+            index->num_banks == pager.num_banks && index->length <= length) {
+            printf("Pager: %lu KB ROM packed to %lu KB in flash\n", pager.size / 1024,
+                   index->length / 1024);
+            pager.packed = (const uint8_t *)flash_address;
+            pager.bank_offset = index->offset;
+            pager.packed_banks = pager.num_banks;
+            pager.lz4_state = LZ4_DONE;
+            return;
+        }
+    }
+
+    // The offsets share the slot with the hash table
+    if (pager.num_slots < LZ4_WORK_SLOTS + 2 || pager.bank_size > 0x10000 ||
+        (pager.num_banks + 1) * sizeof(uint32_t) > pager.bank_size / 2)
+        flash_address = 0;
+    else
+        flash_address = flash_alloc_stream_begin(pager.lba, pager.offset, pager.size, kind,
+                                                 index_size + pager.num_banks * pager.bank_size);
+
+    if (!flash_address) {
+        pager.in_flash = copy_sd_to_flash_begin(pager.lba, pager.offset, pager.size, &flash_address);
+        pager.flash = (const uint8_t *)flash_address;
+        return;
+    }
+
+    pager.num_slots -= LZ4_WORK_SLOTS;
+    pager.packed = (const uint8_t *)flash_address;
+    pager.bank_offset = (const uint32_t *)(work_slot(2) + pager.bank_size / 2);
+    pager.packed_banks = 0;
+    pager.fill_bank = 0;
+    pager.fill_pos = 0;
+    pager.fill_written = 0;
+    pager.stream_pos = index_size;
+    pager.lz4_state = LZ4_PACKING;
+}
+
+static void lz4_cancel(void)
+{
+    if (pager.lz4_state == LZ4_PACKING) {
+        flash_alloc_stream_cancel();
+        lz4_release_work_slots();
+    }
+    pager.packed_banks = 0;
+}
+
+static bool lz4_step(void)
+{
+    const uint32_t bank_size = pager.bank_size;
+    uint8_t *in = work_slot(0);
+    uint8_t *out = work_slot(1);
+
+    if (pager.fill_pos < bank_size) {
+        const uint32_t offset = pager.base + pager.fill_bank * bank_size + pager.fill_pos;
+        const uint32_t len = MIN(ROM_PAGER_FILL_BYTES, bank_size - pager.fill_pos);
+        const uint32_t avail = offset < pager.size ? MIN(len, pager.size - offset) : 0;
+
+        if (avail)
+            rom_pager_read(offset, in + pager.fill_pos, avail);
+        memset(in + pager.fill_pos + avail, 0xFF, len - avail);
+        pager.fill_pos += len;
+        if (pager.fill_pos == bank_size) {
+            // Packed banks are always shorter than the raw ones
+            pager.fill_len = lz4_pack(in, out, bank_size, bank_size - 1, (uint16_t *)work_slot(2),
+                                      __builtin_ctz(bank_size / 4));
+        }
+        return false;
+    }
+
+    const uint8_t *data = pager.fill_len ? out : in;
+    const uint32_t data_len = pager.fill_len ? pager.fill_len : bank_size;
+    const uint32_t len = MIN(ROM_PAGER_FILL_BYTES, data_len - pager.fill_written);
+    uint32_t *offset = (uint32_t *)pager.bank_offset;
+
+    flash_alloc_stream_write(pager.stream_pos + pager.fill_written, data + pager.fill_written, len);
+    pager.fill_written += len;
+    if (pager.fill_written < data_len)
+        return false;
+
+    offset[pager.fill_bank] = pager.stream_pos;
+    pager.stream_pos += data_len;
+    offset[++pager.fill_bank] = pager.stream_pos;
+    pager.packed_banks = pager.fill_bank;
+    pager.fill_pos = 0;
+    pager.fill_written = 0;
+    if (pager.fill_bank < pager.num_banks)
+        return false;
+
+    // The header is the last write, the index is valid only with it
+    const struct lz4_index header = {
+        .magic = PACKED_MAGIC,
+        .bank_size = bank_size,
+        .num_banks = pager.num_banks,
+        .length = pager.stream_pos,
+    };
+    flash_alloc_stream_write(sizeof(header), offset, (pager.num_banks + 1) * sizeof(uint32_t));
+    flash_alloc_stream_write(0, &header, sizeof(header));
+    flash_alloc_stream_end(pager.stream_pos);
+
+    pager.bank_offset = ((const struct lz4_index *)pager.packed)->offset;
+    lz4_release_work_slots();
+    pager.lz4_state = LZ4_DONE;
+    printf("Pager: %lu KB ROM is packed to %lu KB in flash\n", pager.size / 1024,
+           pager.stream_pos / 1024);
+    return true;
+}
+
+// Decodes the bank from flash, returns false if it's not there yet
+static bool lz4_bank(uint32_t bank, uint8_t *data)
+{
+    if (bank >= pager.packed_banks)
+        return false;
+
+    const uint32_t start = pager.bank_offset[bank];
+    const uint32_t len = pager.bank_offset[bank + 1] - start;
+    if (len == pager.bank_size)
+        memcpy(data, pager.packed + start, len);
+    else
+        lz4_depack(pager.packed + start, data, len);
+    return true;
+}
+#endif
+
+const uint8_t *rom_pager_open(uint64_t lba, uint32_t offset, uint32_t size, uint32_t bank_size,
+                              uint8_t *ram_buffer, uint32_t ram_length)
+{
+    uint32_t flash_address;
+
+    assert(!pager.active);
+    memset(&last.counts, 0, sizeof(last.counts));
+    last.magic = STATS_MAGIC;
+#if FLASH_CACHE_LZ4 != 0
+    uint32_t length;
+
+    // The packed copy is looked up once the base is known
+    if (flash_alloc_find(lba, offset, size, 0, &flash_address, &length) && length >= size)
+        return (const uint8_t *)flash_address;
+    flash_address = 0;
+#else
+    if (copy_sd_to_flash_begin(lba, offset, size, &flash_address))
+        return (const uint8_t *)flash_address;
+#endif
+
+    memset(&pager, 0, sizeof(pager));
+    pager.active = true;
+    pager.lba = lba;
+    pager.offset = offset;
+    pager.size = size;
+    pager.bank_size = bank_size;
+    pager.ram = ram_buffer;
+    pager.num_slots = ram_length / bank_size;
+    pager.flash = (const uint8_t *)flash_address;
+    if (pager.num_slots > ROM_PAGER_MAX_BANKS)
+        pager.num_slots = ROM_PAGER_MAX_BANKS;
+
+    if ((size + bank_size - 1) / bank_size > ROM_PAGER_MAX_BANKS || pager.num_slots < 2) {
+        printf("Pager: ROM is too big for %lu slots\n", pager.num_slots);
+        abort();
+    }
+
+    for (uint32_t i = 0; i < ROM_PAGER_MAX_BANKS; i++)
+        pager.bank_slot[i] = NO_SLOT;
+    for (uint32_t i = 0; i < pager.num_slots; i++)
+        pager.slots[i].bank = NO_SLOT;
+#if FLASH_CACHE_LZ4 != 0
+    pager.lz4_state = LZ4_START;
+#endif
+
+    printf("Pager: %lu KB ROM, %lu slots of %lu KB\n", size / 1024, pager.num_slots,
+           bank_size / 1024);
+    return NULL;
+}
+
+void rom_pager_close(void)
+{
+#if FLASH_CACHE_LZ4 != 0
+    if (pager.active)
+        lz4_cancel();
+#endif
+    if (pager.active && !pager.in_flash)
+        copy_sd_to_flash_cancel();
+
+    pager.active = false;
+}
+
+bool rom_pager_active(void)
+{
+    return pager.active;
+}
+
+void rom_pager_set_base(uint32_t base)
+{
+#if FLASH_CACHE_LZ4 != 0
+    // So is the packed copy
+    if (pager.lz4_state != LZ4_NONE) {
+        lz4_cancel();
+        pager.lz4_state = LZ4_START;
+    }
+#endif
+
+    // Cached banks are relative to the old base
+    for (uint32_t i = 0; i < pager.num_slots; i++) {
+        assert(!pager.slots[i].pinned);
+        if (pager.slots[i].bank != NO_SLOT)
+            pager.bank_slot[pager.slots[i].bank] = NO_SLOT;
+        pager.slots[i].bank = NO_SLOT;
+    }
+
+    pager.base = base;
+}
+
+void rom_pager_read(uint32_t offset, void *buffer, uint32_t size)
+{
+    sd_read(pager.lba, pager.offset + offset, buffer, size);
+}
+
+static uint32_t find_victim(void)
+{
+    uint32_t victim = NO_SLOT;
+
+    for (uint32_t i = 0; i < pager.num_slots; i++) {
+        const struct slot *slot = &pager.slots[i];
+
+        if (slot->bank == NO_SLOT)
+            return i;
+
+        if (slot->pinned)
+            continue;
+
+        if (victim == NO_SLOT || slot->last_use < pager.slots[victim].last_use)
+            victim = i;
+    }
+
+    assert(victim != NO_SLOT && "All the pager slots are pinned");
+    return victim;
+}
+
+const uint8_t *rom_pager_bank(uint32_t bank)
+{
+    const uint32_t bank_offset = pager.base + bank * pager.bank_size;
+
+    assert(bank < ROM_PAGER_MAX_BANKS);
+#if FLASH_CACHE_LZ4 != 0
+    if (pager.lz4_state == LZ4_START)
+        lz4_begin();
+#endif
+    if (pager.in_flash)
+        return pager.flash + bank_offset;
+
+    uint32_t index = pager.bank_slot[bank];
+    if (index != NO_SLOT) {
+        last.counts.hits++;
+        pager.slots[index].last_use = ++pager.use_counter;
+        return pager.ram + index * pager.bank_size;
+    }
+
+    last.counts.misses++;
+    index = find_victim();
+
+    struct slot *slot = &pager.slots[index];
+    if (slot->bank != NO_SLOT) {
+        last.counts.evictions++;
+        pager.bank_slot[slot->bank] = NO_SLOT;
+    }
+
+    uint8_t *data = pager.ram + index * pager.bank_size;
+    uint32_t len = 0;
+    if (bank_offset < pager.size)
+        len = pager.size - bank_offset < pager.bank_size ? pager.size - bank_offset : pager.bank_size;
+
+#if FLASH_CACHE_LZ4 != 0
+    if (!lz4_bank(bank, data))
+#endif
+    {
+        rom_pager_read(bank_offset, data, len);
+        memset(data + len, 0xFF, pager.bank_size - len);
+    }
+
+    slot->bank = bank;
+    slot->pinned = 0;
+    slot->last_use = ++pager.use_counter;
+    pager.bank_slot[bank] = index;
+    return data;
+}
+
+const uint8_t *rom_pager_pin(uint32_t bank)
+{
+    const uint8_t *data = rom_pager_bank(bank);
+
+    if (!pager.in_flash)
+        pager.slots[pager.bank_slot[bank]].pinned++;
+    return data;
+}
+
+void rom_pager_unpin(uint32_t bank)
+{
+    if (pager.in_flash || pager.bank_slot[bank] == NO_SLOT)
+        return;
+
+    struct slot *slot = &pager.slots[pager.bank_slot[bank]];
+    if (slot->pinned)
+        slot->pinned--;
+}
+
+void rom_pager_unpin_all(void)
+{
+    for (uint32_t i = 0; i < pager.num_slots; i++)
+        pager.slots[i].pinned = 0;
+}
+
+bool rom_pager_idle(void)
+{
+    if (!pager.active || pager.in_flash)
+        return pager.in_flash;
+
+#if FLASH_CACHE_LZ4 != 0
+    if (pager.lz4_state == LZ4_START)
+        lz4_begin();
+    if (pager.lz4_state == LZ4_PACKING)
+        return lz4_step();
+    if (pager.lz4_state == LZ4_DONE || pager.in_flash)
+        return true;
+#endif
+
+    if (!copy_sd_to_flash_step(ROM_PAGER_FILL_BYTES))
+        return false;
+
+    printf("Pager: ROM is copied to flash, %lu hits %lu misses %lu evictions\n",
+           last.counts.hits, last.counts.misses, last.counts.evictions);
+    pager.in_flash = true;
+    return true;
+}
+
+void rom_pager_flatten(void)
+{
+#if FLASH_CACHE_LZ4 != 0
+    uint32_t flash_address;
+
+    if (!pager.active || pager.lz4_state == LZ4_NONE)
+        return;
+
+    // The packed copy may be evicted by the raw one
+    lz4_cancel();
+    pager.lz4_state = LZ4_NONE;
+    pager.in_flash = copy_sd_to_flash_begin(pager.lba, pager.offset, pager.size, &flash_address);
+    pager.flash = (const uint8_t *)flash_address;
+#endif
+}
+
+void rom_pager_get_stats(struct rom_pager_stats *stats)
+{
+    if (last.magic == STATS_MAGIC)
+        *stats = last.counts;
+    else
+        memset(stats, 0, sizeof(*stats));
+}
@@ -0,0 +1,160 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "main.h"
+#include "rom_tier.h"
+
+#define NO_SLOT 0xFFFF
+
+// The switch counts are halved every DECAY_SWITCHES switches, so the tier
+// follows the game from one level to another
+#define DECAY_SWITCHES 4096
+
+static struct {
+    bool active;
+    const uint8_t *rom;
+    uint32_t rom_size;
+    uint32_t bank_size;
+    uint32_t num_banks; /* Banks that may be in the tier */
+    uint8_t *ram;
+    uint32_t num_slots;
+    uint32_t switches;
+    uint16_t count[ROM_TIER_MAX_BANKS];
+    uint16_t bank_slot[ROM_TIER_MAX_BANKS];
+    uint16_t slot_bank[ROM_TIER_MAX_SLOTS];
+} tier;
+
+// The counts are kept over the reset back to the launcher, which shows the
+// ones of the last game
+#define STATS_MAGIC 0x54494552UL
+
+PERSISTENT static struct {
+    uint32_t magic;
+    struct rom_tier_stats counts;
+} last;
+
+void rom_tier_init(const uint8_t *rom, uint32_t rom_size, uint32_t bank_size, uint8_t *ram,
+                   uint32_t ram_length)
+{
+    memset(&tier, 0, sizeof(tier));
+    memset(&last.counts, 0, sizeof(last.counts));
+    last.magic = STATS_MAGIC;
+    tier.rom = rom;
+    tier.rom_size = rom_size;
+    tier.bank_size = bank_size;
+    tier.num_banks = (rom_size + bank_size - 1) / bank_size;
+    tier.ram = ram;
+    tier.num_slots = ram_length / bank_size;
+    if (tier.num_banks > ROM_TIER_MAX_BANKS)
+        tier.num_banks = ROM_TIER_MAX_BANKS;
+    if (tier.num_slots > ROM_TIER_MAX_SLOTS)
+        tier.num_slots = ROM_TIER_MAX_SLOTS;
+    if (tier.num_slots > tier.num_banks)
+        tier.num_slots = tier.num_banks;
+
+    for (uint32_t i = 0; i < ROM_TIER_MAX_BANKS; i++)
+        tier.bank_slot[i] = NO_SLOT;
+    for (uint32_t i = 0; i < ROM_TIER_MAX_SLOTS; i++)
+        tier.slot_bank[i] = NO_SLOT;
+
+    tier.active = tier.num_slots > 0;
+    if (tier.active)
+        printf("ROM tier: %lu slots of %lu KB for %lu banks\n", tier.num_slots, bank_size / 1024,
+               tier.num_banks);
+}
+
+void rom_tier_close(void)
+{
+    tier.active = false;
+}
+
+bool rom_tier_active(void)
+{
+    return tier.active;
+}
+
+const uint8_t *rom_tier_lookup(uint32_t bank)
+{
+    if (bank < tier.num_banks && tier.bank_slot[bank] != NO_SLOT)
+        return tier.ram + tier.bank_slot[bank] * tier.bank_size;
+
+    return tier.rom + bank * tier.bank_size;
+}
+
+const uint8_t *rom_tier_bank(uint32_t bank)
+{
+    if (++tier.switches % DECAY_SWITCHES == 0) {
+        for (uint32_t i = 0; i < tier.num_banks; i++)
+            tier.count[i] >>= 1;
+    }
+
+    if (bank < tier.num_banks) {
+        if (tier.count[bank] < UINT16_MAX)
+            tier.count[bank]++;
+
+        if (tier.bank_slot[bank] != NO_SLOT)
+            last.counts.hits++;
+        else
+            last.counts.misses++;
+    }
+
+    return rom_tier_lookup(bank);
+}
+
+bool rom_tier_idle(void)
+{
+    uint32_t hot = NO_SLOT;
+    uint32_t slot = NO_SLOT;
+
+    if (!tier.active)
+        return false;
+
+    for (uint32_t i = 0; i < tier.num_banks; i++) {
+        if (tier.bank_slot[i] == NO_SLOT && tier.count[i] &&
+            (hot == NO_SLOT || tier.count[i] > tier.count[hot]))
+            hot = i;
+    }
+    if (hot == NO_SLOT)
+        return false;
+
+    // Free slot or the coldest bank
+    for (uint32_t i = 0; i < tier.num_slots; i++) {
+        if (tier.slot_bank[i] == NO_SLOT) {
+            slot = i;
+            break;
+        }
+        if (slot == NO_SLOT || tier.count[tier.slot_bank[i]] < tier.count[tier.slot_bank[slot]])
+            slot = i;
+    }
+
+    const uint16_t cold = tier.slot_bank[slot];
+    if (cold != NO_SLOT) {
+        // Keeps the close banks from trading places on every call
+        if (tier.count[hot] <= 2 * tier.count[cold] + 1)
+            return false;
+
+        tier.bank_slot[cold] = NO_SLOT;
+        last.counts.evictions++;
+    }
+
+    const uint32_t offset = hot * tier.bank_size;
+    const uint32_t len = tier.rom_size - offset < tier.bank_size ? tier.rom_size - offset : tier.bank_size;
+    uint8_t *data = tier.ram + slot * tier.bank_size;
+
+    memcpy(data, tier.rom + offset, len);
+    memset(data + len, 0xFF, tier.bank_size - len);
+    tier.slot_bank[slot] = hot;
+    tier.bank_slot[hot] = slot;
+    if (++last.counts.promotions == tier.num_slots)
+        printf("ROM tier: full, %lu hits %lu misses\n", last.counts.hits, last.counts.misses);
+    return true;
+}
+
+void rom_tier_get_stats(struct rom_tier_stats *stats)
+{
+    if (last.magic == STATS_MAGIC)
+        *stats = last.counts;
+    else
+        memset(stats, 0, sizeof(*stats));
+}
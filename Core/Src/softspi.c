@@ -1,6 +1,9 @@
+#include <assert.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 #include "softspi.h"
+#include "softspi_kernel.h"
 #include "main.h"
 
 __attribute__((always_inline))
@@ -32,22 +35,37 @@ static void delay_us(uint32_t usec) {
     }
 }
 
-static void __SoftSpi_WriteRead(SoftSPI *spi, const uint8_t *txData, uint8_t *rxData,
-                                uint32_t len, bool txDummy, bool csEnable) {
-    int i, j;
-    uint8_t txBit, rxBit;
-    uint8_t txByte, rxByte;
+static softspi_kernel_pin_t kernel_pin(const SoftSPI_Pin *pin) {
+    return (softspi_kernel_pin_t) {
+        .bsrr = &pin->port->BSRR,
+        .idr = &pin->port->IDR,
+        .mask = pin->pin,
+    };
+}
 
-    if (!len)
+static void cs_set(SoftSPI *spi, bool csEnable) {
+    if (!spi->cs.port)
         return;
 
-    HAL_GPIO_WritePin(spi->sck.port, spi->sck.pin, GPIO_PIN_RESET);
+    // Active low unless inverted, released when not enabled
+    softspi_kernel_pin_t cs = kernel_pin(&spi->cs);
+    SOFTSPI_PIN_WRITE(&cs, csEnable == spi->csIsInverted);
+}
+
+static void cs_release(SoftSPI *spi, bool csEnable) {
     if (csEnable)
-        HAL_GPIO_WritePin(spi->cs.port, spi->cs.pin,
-                          spi->csIsInverted ? GPIO_PIN_SET : GPIO_PIN_RESET);
-    else if (spi->cs.port)
-        HAL_GPIO_WritePin(spi->cs.port, spi->cs.pin,
-                          spi->csIsInverted ? GPIO_PIN_RESET : GPIO_PIN_SET);
+        cs_set(spi, false);
+}
+
+// =============================================================================
+// HAL based transfers, used for the slow clock (e.g. SD card initialization)
+// =============================================================================
+
+static void __SoftSpi_WriteRead_Hal(SoftSPI *spi, const uint8_t *txData, uint8_t *rxData,
+                                    uint32_t len, bool txDummy) {
+    int i, j;
+    uint8_t txBit, rxBit;
+    uint8_t txByte, rxByte;
 
     for (i = 0; i < len; i++) {
         txByte = txDummy ? txData[0] : txData[i];
@@ -59,23 +77,58 @@ static void __SoftSpi_WriteRead(SoftSPI *spi, const uint8_t *txData, uint8_t *rx
             HAL_GPIO_WritePin(spi->mosi.port, spi->mosi.pin, txBit ? GPIO_PIN_SET : GPIO_PIN_RESET);
             gpio_pause();
             HAL_GPIO_WritePin(spi->sck.port, spi->sck.pin, GPIO_PIN_SET);
-            delay_us(spi->DelayUs);
+            if (spi->DelayUs)
+                delay_us(spi->DelayUs);
 
             rxBit = HAL_GPIO_ReadPin(spi->miso.port, spi->miso.pin) == GPIO_PIN_SET ? 1 : 0;
             rxByte <<= 1;
             rxByte |= rxBit;
 
             HAL_GPIO_WritePin(spi->sck.port, spi->sck.pin, GPIO_PIN_RESET);
-            delay_us(spi->DelayUs);
+            if (spi->DelayUs)
+                delay_us(spi->DelayUs);
         }
 
         if (rxData)
             rxData[i] = rxByte;
     }
+}
 
-     if (csEnable)
-        HAL_GPIO_WritePin(spi->cs.port, spi->cs.pin,
-                          spi->csIsInverted ? GPIO_PIN_RESET : GPIO_PIN_SET);
+// =============================================================================
+// Fast transfers, see softspi_kernel.h
+// =============================================================================
+
+static softspi_kernel_t kernel_of(const SoftSPI *spi) {
+    return (softspi_kernel_t) {
+        .sck = kernel_pin(&spi->sck),
+        .mosi = kernel_pin(&spi->mosi),
+        .miso = kernel_pin(&spi->miso),
+        .half_period = spi->HalfPeriod,
+    };
+}
+
+static void __SoftSpi_WriteRead(SoftSPI *spi, const uint8_t *txData, uint8_t *rxData,
+                                uint32_t len, bool txDummy, bool csEnable) {
+    if (!len)
+        return;
+
+    const softspi_kernel_t kernel = kernel_of(spi);
+
+    SOFTSPI_PIN_RESET(&kernel.sck);
+    cs_set(spi, csEnable);
+
+    if (spi->DelayUs) {
+        __SoftSpi_WriteRead_Hal(spi, txData, rxData, len, txDummy);
+    } else if (txDummy) {
+        assert(txData[0] == 0xFF && "Only 0xFF dummy bytes are supported");
+        softspi_kernel_read(&kernel, rxData, len);
+    } else if (!rxData) {
+        softspi_kernel_write(&kernel, txData, len);
+    } else {
+        softspi_kernel_write_read(&kernel, txData, rxData, len);
+    }
+
+    cs_release(spi, csEnable);
 }
 
 void SoftSpi_WriteRead(SoftSPI *spi, const uint8_t *txData, uint8_t *rxData, uint32_t len) {
@@ -91,3 +144,31 @@ void SoftSpi_WriteDummyReadCsLow(SoftSPI *spi, uint8_t *rxData, uint32_t len) {
     uint8_t dummy = 0xFF;
     __SoftSpi_WriteRead(spi, &dummy, rxData, len, true, false);
 }
+
+#if SOFTSPI_BENCHMARK != 0
+void SoftSpi_Benchmark(SoftSPI *spi, uint32_t len) {
+    const uint32_t delay_us = spi->DelayUs;
+    uint32_t hal_cycles, fast_cycles;
+    uint8_t dummy = 0xFF;
+
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    // Keep the device deselected, only the clocking overhead is measured
+    cs_set(spi, false);
+
+    spi->DelayUs = 0;
+    DWT->CYCCNT = 0;
+    __SoftSpi_WriteRead_Hal(spi, &dummy, NULL, len, true);
+    hal_cycles = DWT->CYCCNT;
+
+    const softspi_kernel_t kernel = kernel_of(spi);
+    DWT->CYCCNT = 0;
+    softspi_kernel_read(&kernel, NULL, len);
+    fast_cycles = DWT->CYCCNT;
+    spi->DelayUs = delay_us;
+
+    printf("SoftSPI: %lu bytes, HAL %lu cycles, fast %lu cycles (half period %lu)\n",
+           len, hal_cycles, fast_cycles, spi->HalfPeriod);
+}
+#endif // SOFTSPI_BENCHMARK
@@ -2,7 +2,9 @@
 import argparse
 import os
 import shutil
+import struct
 import subprocess
+import zlib
 from pathlib import Path
 from tempfile import TemporaryDirectory
 from typing import List
@@ -39,6 +41,24 @@ ROM_ENTRY_TEMPLATE_NO_SAVE = """\t{{
 \t\t.region = {region},
 \t}},"""
 
+SYSTEM_TEMPLATE_CATALOG = """
+const rom_system_t {name} = {{
+\t.system_name = "{system_name}",
+\t.roms = NULL,
+\t.extension = "{extension}",
+\t.roms_count = 0,
+}};
+"""
+
+# Must match Core/Inc/retro-go/rom_catalog.h
+CATALOG_MAGIC = 0x54434752
+CATALOG_VERSION = 2
+CATALOG_SECTOR_SIZE = 512
+CATALOG_MAX_SYSTEMS = 16
+CATALOG_HEADER_FORMAT = "<IHHIIIIII"
+CATALOG_SYSTEM_FORMAT = "<8sIIII"
+CATALOG_ENTRY_FORMAT = "<IIIIIIB3xI"
+
 SYSTEM_PROTO_TEMPLATE = """
 extern const rom_system_t {name};
 """
@@ -279,6 +299,127 @@ class ROM:
     def ext(self):
         return self.path.suffix[1:].lower()
 
+    @property
+    def is_pal(self):
+        return any(
+            substring in self.name
+            for substring in [
+                "(E)",
+                "(Europe)",
+                "(Sweden)",
+                "(Germany)",
+                "(Italy)",
+                "(France)",
+                "(A)",
+                "(Australia)",
+            ]
+        )
+
+
+class ROMCatalog:
+    """Binary ROM catalog written to the SD card at a fixed offset, separately
+    from the image (SD_CATALOG_LBA in Core/Inc/gw_sd.h).
+
+    The firmware reads only the header on boot and maps the entries of a
+    system when it is opened, see Core/Inc/retro-go/rom_catalog.h.
+    """
+
+    CHUNK_SIZE = 1024 * 1024
+
+    def __init__(self, use_fs: bool = False):
+        # With use_fs the ROMs are read from the FAT32/exFAT partition of the
+        # card, under the same path as in the repo (/roms/<system>/<file>)
+        self.use_fs = use_fs
+        self.systems = []  # (folder, [(rom, save_offset, save_size)])
+
+    def add_system(self, folder: str, entries):
+        if entries:
+            self.systems.append((folder, entries))
+
+    def write(self, path: Path):
+        """Streams the ROMs to the file, only the index is kept in memory."""
+        assert len(self.systems) <= CATALOG_MAX_SYSTEMS
+
+        def align(size):
+            return (size + CATALOG_SECTOR_SIZE - 1) // CATALOG_SECTOR_SIZE * CATALOG_SECTOR_SIZE
+
+        entries_count = sum(len(entries) for _, entries in self.systems)
+        entries_offset = CATALOG_SECTOR_SIZE
+        names_offset = entries_offset + entries_count * struct.calcsize(CATALOG_ENTRY_FORMAT)
+
+        names = bytearray()
+        system_records = []
+        rom_list = []
+        for folder, entries in self.systems:
+            system_names_offset = names_offset + len(names)
+            for rom, save_offset, save_size in entries:
+                name = rom.name.encode() + b"\0" + rom.ext.encode() + b"\0"
+                path_offset = names_offset + len(names) + len(name) if self.use_fs else 0
+                rom_list.append((rom, names_offset + len(names), path_offset, save_offset, save_size))
+                names += name
+                if self.use_fs:
+                    names += f"/roms/{folder}/{rom.path.name}".encode() + b"\0"
+            system_records.append(
+                struct.pack(
+                    CATALOG_SYSTEM_FORMAT,
+                    folder.encode(),
+                    len(rom_list) - len(entries),
+                    len(entries),
+                    system_names_offset,
+                    names_offset + len(names) - system_names_offset,
+                )
+            )
+
+        rom_sector = align(names_offset + len(names)) // CATALOG_SECTOR_SIZE
+        entries = bytearray()
+        with open(path, "wb") as f:
+            f.seek(rom_sector * CATALOG_SECTOR_SIZE)
+            for rom, name_offset, path_offset, save_offset, save_size in rom_list:
+                crc = 0
+                size = 0
+                with open(rom.path, "rb") as rom_file:
+                    while chunk := rom_file.read(self.CHUNK_SIZE):
+                        crc = zlib.crc32(chunk, crc)
+                        size += len(chunk)
+                        if not path_offset:
+                            f.write(chunk)
+                if path_offset:
+                    size_on_card = 0
+                else:
+                    size_on_card = align(size)
+                    f.write(bytes(size_on_card - size))
+
+                entries += struct.pack(
+                    CATALOG_ENTRY_FORMAT,
+                    name_offset,
+                    0 if path_offset else rom_sector,
+                    size,
+                    save_offset,
+                    save_size,
+                    crc,
+                    1 if rom.is_pal else 0,
+                    path_offset,
+                )
+                rom_sector += size_on_card // CATALOG_SECTOR_SIZE
+
+            header = struct.pack(
+                CATALOG_HEADER_FORMAT,
+                CATALOG_MAGIC,
+                CATALOG_VERSION,
+                struct.calcsize(CATALOG_ENTRY_FORMAT),
+                entries_count,
+                entries_offset,
+                names_offset,
+                len(names),
+                len(system_records),
+                0,
+            ) + b"".join(system_records)
+
+            f.seek(0)
+            f.write(header + bytes(entries_offset - len(header)) + entries + names)
+            # Pads the index up to the first ROM if there are none
+            f.truncate(max(f.seek(0, 2), align(names_offset + len(names))))
+
 
 class ROMParser:
     def find_roms(self, system_name: str, folder: str, extension: str) -> [ROM]:
@@ -305,20 +446,7 @@ class ROMParser:
         body = ""
         for i in range(len(roms)):
             rom = roms[i]
-            is_pal = any(
-                substring in rom.name
-                for substring in [
-                    "(E)",
-                    "(Europe)",
-                    "(Sweden)",
-                    "(Germany)",
-                    "(Italy)",
-                    "(France)",
-                    "(A)",
-                    "(Australia)",
-                ]
-            )
-            region = "REGION_PAL" if is_pal else "REGION_NTSC"
+            region = "REGION_PAL" if rom.is_pal else "REGION_NTSC"
             if args.save:
                 body += ROM_ENTRY_TEMPLATE.format(
                     name=rom.name,
@@ -555,6 +683,7 @@ class ROMParser:
 
         save_size = SAVE_SIZES.get(folder, 0)
 
+        catalog_entries = []
         with open(file, "w") as f:
             f.write(SYSTEM_PROTO_TEMPLATE.format(name=variable_name))
 
@@ -562,31 +691,53 @@ class ROMParser:
                 if folder == "gb":
                     save_size = self.get_gameboy_save_size(rom.path)
 
+                if args.sd:
+                    # ROMs go to the catalog, save offsets are relative to
+                    # the start of the save area
+                    catalog_entries.append(
+                        (rom, self.save_offset, save_size if args.save else 0)
+                    )
+
                 # Aligned
                 aligned_size = 4 * 1024
-                total_save_size += (
+                aligned_save_size = (
                     (save_size + aligned_size - 1) // (aligned_size)
                 ) * aligned_size
+                total_save_size += aligned_save_size
                 total_rom_size += rom.size
+                if args.sd:
+                    if args.save:
+                        self.save_offset += aligned_save_size
+                    continue
 
                 f.write(self.generate_object_file(rom))
                 if args.save:
                     f.write(self.generate_save_entry(save_prefix + str(i), save_size))
 
-            rom_entries = self.generate_rom_entries(
-                folder + "_roms", roms, save_prefix, variable_name
-            )
-            f.write(rom_entries)
-
-            f.write(
-                SYSTEM_TEMPLATE.format(
-                    name=variable_name,
-                    system_name=system_name,
-                    variable_name=folder + "_roms",
-                    extension=folder,
-                    roms_count=len(roms),
+            if args.sd:
+                self.catalog.add_system(folder, catalog_entries)
+                f.write(
+                    SYSTEM_TEMPLATE_CATALOG.format(
+                        name=variable_name,
+                        system_name=system_name,
+                        extension=folder,
+                    )
+                )
+            else:
+                rom_entries = self.generate_rom_entries(
+                    folder + "_roms", roms, save_prefix, variable_name
+                )
+                f.write(rom_entries)
+
+                f.write(
+                    SYSTEM_TEMPLATE.format(
+                        name=variable_name,
+                        system_name=system_name,
+                        variable_name=folder + "_roms",
+                        extension=folder,
+                        roms_count=len(roms),
+                    )
                 )
-            )
 
         if args.save:
             return total_save_size, total_rom_size
@@ -601,10 +752,21 @@ class ROMParser:
         if data != old_data:
             path.write_text(data)
 
+    def generate_catalog(self):
+        """In the SD card builds writes build/rom_catalog.bin with all the
+        ROMs, it goes to the card separately from the image."""
+
+        if not args.sd:
+            return
+
+        self.catalog.write(Path("build/rom_catalog.bin"))
+
     def parse(self, args):
         total_save_size = 0
         total_rom_size = 0
         build_config = ""
+        self.catalog = ROMCatalog(args.sd_fs)
+        self.save_offset = 0
 
         save_size, rom_size = self.generate_system(
             "Core/Src/retro-go/gb_roms.c",
@@ -707,6 +869,8 @@ class ROMParser:
         total_rom_size += rom_size
         build_config += "#define ENABLE_EMULATOR_GW\n" if rom_size > 0 else ""
 
+        self.generate_catalog()
+
         total_size = total_save_size + total_rom_size
 
         if total_size == 0:
@@ -778,6 +942,12 @@ if __name__ == "__main__":
         default=False,
         help="Rom stored on sd card",
     )
+    parser.add_argument(
+        "--sd-fs",
+        action="store_true",
+        help="Read the ROMs from the FAT32/exFAT partition of the sd card, "
+        "the catalog only lists them",
+    )
     args = parser.parse_args()
 
     if args.compress and "." + args.compress not in COMPRESSIONS:
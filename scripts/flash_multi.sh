@@ -18,7 +18,9 @@ if [[ $# -lt 1 ]]; then
     echo "chip_erase: Forces the use of chip erase. Will erase the whole chip,"
     echo "            but may be faster for large flash chips."
     echo ""
-    echo "Note! This will cut the binary in 832kB chunks and flash them to address and onwards"
+    echo "Note! This will cut the binary in 416kB chunks and flash them to address and onwards,"
+    echo "      each chunk is loaded while the previous one is programmed"
+    echo "Set DIFF=1 to only program the changed sectors, chip_erase is ignored then."
     exit
 fi
 
@@ -40,16 +42,28 @@ else
     FILESIZE=$(stat -c%s "${IMAGE}")
 fi
 
-DEFAULT_CHUNK_SIZE_KB=$(( 832 ))
+# One staging slot of the flash app, see FLASHAPP_SLOT_SIZE in flashapp.sh
+DEFAULT_CHUNK_SIZE_KB=$(( 416 ))
 DEFAULT_CHUNK_SIZE=$(( DEFAULT_CHUNK_SIZE_KB * 1024 ))
 CHUNKS=$(( (FILESIZE + DEFAULT_CHUNK_SIZE - 1) / (DEFAULT_CHUNK_SIZE) ))
-SIZE=$((FILESIZE))
 SECTOR_SIZE=$(( 4 * 1024 ))
-ERASE_BYTES=0
 
+FAILED_CHUNK_FILE=$(mktemp /tmp/flash_failed_chunk.XXXXXX)
+if [[ ! -e $FAILED_CHUNK_FILE ]]; then
+    echo "Can't create tempfile!"
+    exit 1
+fi
+
+# The first chunk erases the flash for all of them. After an error the flash
+# app is restarted and the failed chunk erases the rest of the flash again.
 ERASE=1
+RESTART=0
+# Try to flash 10 times, give up after that.
+COUNT=10
+RETRY_COUNT=0
 i=0
-while [[ $SIZE -gt 0 ]]; do
+while [[ $i -lt $CHUNKS ]]; do
+    SIZE=$(( FILESIZE - i * DEFAULT_CHUNK_SIZE ))
     ADDRESS_HEX=$(printf "0x%08x" $(( ADDRESS + i * DEFAULT_CHUNK_SIZE )))
     if [[ $SIZE -gt $(( DEFAULT_CHUNK_SIZE )) ]]; then
         CHUNK_SIZE=$(( DEFAULT_CHUNK_SIZE ))
@@ -73,56 +87,69 @@ while [[ $SIZE -gt 0 ]]; do
     fi
 
     echo_green "Flashing!"
-    if [[ $CHIP_ERASE == 1 ]]; then
-        ERASE_BYTES=0
-    else
+    # The chip erase would lose the chunks already programmed on a resume
+    if [[ $ERASE == 1 && ( $CHIP_ERASE != 1 || $i -gt 0 ) ]]; then
         ERASE_BYTES=$(( (( SIZE + SECTOR_SIZE - 1 ) / SECTOR_SIZE) * SECTOR_SIZE ))
+    else
+        ERASE_BYTES=0
     fi
 
-    # Try to flash 10 times, give up after that.
-    COUNT=10
-    for RETRY_COUNT in $(seq $COUNT); do
-        if [[ $RETRY_COUNT -gt 1 ]]; then
-            echo_red "Flashing chunk $i failed... power cycle unit and retry? (y/n)"
-            read -n 1 -r
-            if [[ ! $REPLY =~ ^[Yy]$ ]]; then
-                echo "Aborted."
-                exit 1
-            fi
-
-            echo ""
-            echo "Retry count $RETRY_COUNT/10"
-        fi
-
-        ${DIR}/flashapp.sh ${TMPFILE} ${ADDRESS_HEX} ${SIZE_HEX} ${ERASE} ${ERASE_BYTES} $((i + 1)) ${CHUNKS} && break
-    done
-
-    if [[ $RETRY_COUNT -eq 10 ]]; then
+    : > ${FAILED_CHUNK_FILE}
+    if FAILED_CHUNK_FILE=${FAILED_CHUNK_FILE} RESTART=${RESTART} \
+        ${DIR}/flashapp.sh ${TMPFILE} ${ADDRESS_HEX} ${SIZE_HEX} ${ERASE} ${ERASE_BYTES} $((i + 1)) ${CHUNKS}; then
         echo ""
         echo ""
-        echo_red "Programming of the external flash FAILED after 3 tries."
-        echo_red "Please check your debugger and wires connecting to the target."
+        echo_green "Transfer of chunk $((i + 1)) / ${CHUNKS} succeeded."
         echo ""
         echo ""
-        exit 1
-    else
+
+        # Skip erase the following iterations
+        ERASE=0
+        RESTART=0
+
+        rm -f ${TMPFILE}
+        i=$(( i + 1 ))
+        continue
+    fi
+
+    rm -f ${TMPFILE}
+
+    # The chunks are programmed in the background, the error may be of the
+    # previous one. The device stays in the error state until restarted.
+    FAILED_CHUNK=$(cat ${FAILED_CHUNK_FILE})
+    if [[ -n "$FAILED_CHUNK" && $FAILED_CHUNK -ge 1 && $FAILED_CHUNK -le $(( i + 1 )) ]]; then
+        i=$(( FAILED_CHUNK - 1 ))
+    fi
+
+    RETRY_COUNT=$(( RETRY_COUNT + 1 ))
+    if [[ $RETRY_COUNT -ge $COUNT ]]; then
+        rm -f ${FAILED_CHUNK_FILE}
         echo ""
         echo ""
-        echo_green "Programming of chunk $((i + 1)) / ${CHUNKS} succeeded."
+        echo_red "Programming of the external flash FAILED after ${COUNT} tries."
+        echo_red "Please check your debugger and wires connecting to the target."
         echo ""
         echo ""
+        exit 1
     fi
 
-    # Skip erase the following iterations
-    ERASE=0
-    ERASE_BYTES=0
+    echo_red "Flashing chunk $((i + 1)) failed... restart the flash app and retry from it? (y/n)"
+    read -n 1 -r
+    if [[ ! $REPLY =~ ^[Yy]$ ]]; then
+        rm -f ${FAILED_CHUNK_FILE}
+        echo "Aborted."
+        exit 1
+    fi
 
-    rm -f ${TMPFILE}
+    echo ""
+    echo "Retry count $(( RETRY_COUNT + 1 ))/${COUNT}"
 
-    SIZE=$(( SIZE - CHUNK_SIZE ))
-    i=$(( i + 1 ))
+    ERASE=1
+    RESTART=1
 done
 
+rm -f ${FAILED_CHUNK_FILE}
+
 echo_green "Programming of the external flash succeeded."
 echo ""
 echo ""
@@ -22,6 +22,7 @@ FLASHAPP_ERROR="0000000e"
 STATUS_BAD_HASH_RAM="bad00001"
 STATUS_BAD_HAS_FLASH="bad00002"
 STATUS_NOT_ALIGNED="bad00003"
+STATUS_BAD_SLOT="bad00004"
 STATUS_IDLE="cafe0000"
 STATUS_DONE="cafe0001"
 STATUS_BUSY="cafe0002"
@@ -38,6 +39,28 @@ VAR_program_erase_bytes=$(     printf '0x%08x\n' $(get_symbol "program_erase_byt
 VAR_program_chunk_idx=$(       printf '0x%08x\n' $(get_symbol "program_chunk_idx"))
 VAR_program_chunk_count=$(     printf '0x%08x\n' $(get_symbol "program_chunk_count"))
 VAR_program_expected_sha256=$( printf '0x%08x\n' $(get_symbol "program_expected_sha256"))
+VAR_program_diff=$(            printf '0x%08x\n' $(get_symbol "program_diff"))
+VAR_program_slot=$(            printf '0x%08x\n' $(get_symbol "program_slot"))
+VAR_program_slots_busy=$(      printf '0x%08x\n' $(get_symbol "program_slots_busy"))
+VAR_program_time_ms=$(         printf '0x%08x\n' $(get_symbol "program_time_ms"))
+
+# The chunks are loaded to alternating slots of the staging RAM, so the
+# next chunk is loaded while the previous one is programmed. Keep in sync
+# with FLASHAPP_SLOTS and FLASHAPP_SLOT_SIZE in flashapp.c.
+FLASHAPP_SLOTS=2
+FLASHAPP_SLOT_SIZE=$(( 416 * 1024 ))
+
+# Set DIFF=1 to program only the 4kB sectors that changed
+DIFF=${DIFF:-0}
+
+# Set RESTART=1 to reset the device and start the flash app before loading
+# a chunk other than the first one, e.g. to resume after an error
+RESTART=${RESTART:-0}
+
+# The index of the failed chunk is written to FAILED_CHUNK_FILE if set. The
+# chunks are programmed in the background, so it may be the previous one.
+FAILED_CHUNK_FILE=${FAILED_CHUNK_FILE:-}
+DIFF_SECTOR_SIZE=4096
 
 INTFLASH_BANK=${INTFLASH_BANK:-1}
 if [ $INTFLASH_BANK -eq 2 ]; then
@@ -66,6 +89,16 @@ function read_word() {
     ${OPENOCD} -f ${DIR}/interface_${ADAPTER}.cfg -c "init; mdw $1" -c "exit;" 2>&1 | grep $1 | cut -d" " -f2
 }
 
+# $1: address
+# $2: number of words
+function read_words() {
+    ${OPENOCD} -f ${DIR}/interface_${ADAPTER}.cfg -c "init; mdw $1 $2" -c "exit;" 2>&1 | grep $1 | cut -d" " -f2-$(( $2 + 1 ))
+}
+
+function now_ms() {
+    ${PYTHON3:-python3} -c "import time; print(int(time.time() * 1000))"
+}
+
 function state_to_string() {
     if   [[ "$1" == "00000000" ]]; then echo "FLASHAPP_INIT"
     elif [[ "$1" == "00000001" ]]; then echo "FLASHAPP_IDLE"
@@ -82,10 +115,62 @@ function state_to_string() {
     elif [[ "$1" == "0000000c" ]]; then echo "FLASHAPP_TEST"
     elif [[ "$1" == "0000000d" ]]; then echo "FLASHAPP_FINAL"
     elif [[ "$1" == "0000000e" ]]; then echo "FLASHAPP_ERROR"
+    elif [[ "$1" == "0000000f" ]]; then echo "FLASHAPP_HASH"
+    elif [[ "$1" == "00000010" ]]; then echo "FLASHAPP_DIFF_NEXT"
+    elif [[ "$1" == "00000011" ]]; then echo "FLASHAPP_DIFF"
     else echo "UNKNOWN"
     fi
 }
 
+function report_error() {
+    STATUS_REG=$(read_word ${VAR_program_status})
+    FAILED_CHUNK=$(( 16#$(read_word ${VAR_program_chunk_idx}) ))
+    if [[ -n "${FAILED_CHUNK_FILE}" ]]; then
+        echo ${FAILED_CHUNK} > "${FAILED_CHUNK_FILE}"
+    fi
+    if [[ "$STATUS_REG" == "$STATUS_BAD_HASH_RAM" ]]; then
+        echo_red "Hash mismatch in RAM of chunk ${FAILED_CHUNK}. Flashing failed."
+        exit 3
+    elif [[ "$STATUS_REG" == "$STATUS_BAD_HAS_FLASH" ]]; then
+        echo_red "Hash mismatch in FLASH of chunk ${FAILED_CHUNK}. Flashing failed."
+        exit 3
+    elif [[ "$STATUS_REG" == "$STATUS_NOT_ALIGNED" ]]; then
+        echo_red "Address not 4k aligned. Flashing failed."
+        exit 4
+    elif [[ "$STATUS_REG" == "$STATUS_BAD_SLOT" ]]; then
+        echo_red "Chunk too large for the staging RAM. Flashing failed."
+        exit 4
+    else
+        echo_red "Unknown error. Flashing failed. Status: $STATUS_REG"
+        exit 5
+    fi
+}
+
+# $1: mask of the slots to load to
+function wait_for_slots() {
+    # The previous chunks may still be programmed, wait until they are out
+    # of the slots and the last one is queued
+    while true; do
+        STATE_REG=$(read_word ${VAR_flashapp_state})
+        if [[ "$STATE_REG" == "$FLASHAPP_ERROR" ]]; then
+            report_error
+        fi
+        START_REG=$(read_word ${VAR_program_start})
+        BUSY_REG=$(read_word ${VAR_program_slots_busy})
+        if [[ "$START_REG" == "00000000" && $(( 16#${BUSY_REG} & $1 )) -eq 0 ]]; then
+            break
+        fi
+        echo "State: $(state_to_string $STATE_REG)"
+        sleep 0.5
+    done
+}
+
+function print_timings() {
+    TIMES=($(read_words ${VAR_program_time_ms} 5))
+    echo "Device time: hash RAM $(( 16#${TIMES[0]} )) ms, erase $(( 16#${TIMES[1]} )) ms," \
+         "program $(( 16#${TIMES[2]} )) ms, verify $(( 16#${TIMES[3]} )) ms, waiting for data $(( 16#${TIMES[4]} )) ms"
+}
+
 function wait_for_idle() {
     # Wait for the idle state
     while true; do
@@ -100,15 +185,38 @@ function wait_for_idle() {
     done
 }
 
+function wait_for_final() {
+    # Wait for the final or error state
+    while true; do
+        STATE_REG=$(read_word ${VAR_flashapp_state})
+        if [[ "$STATE_REG" == "$FLASHAPP_FINAL" ]]; then
+            print_timings
+            echo_green "Done!"
+            exit 0
+        elif [[ "$STATE_REG" == "$FLASHAPP_ERROR" ]]; then
+            report_error
+        else
+            echo "State: $(state_to_string $STATE_REG)"
+        fi
+        sleep 1
+    done
+}
+
 if [[ $# -lt 1 ]]; then
     echo "Usage: flashapp.sh <binary to flash> [address in flash] [size] [erase=1] [erase_bytes=0] [chunk_idx] [chunk_count]"
     echo "       flashapp.sh --test"
     echo "Note! Destination address must be aligned to 256 bytes."
+    echo "The chunks of up to $(( FLASHAPP_SLOT_SIZE / 1024 ))kB are loaded while the previous one is programmed,"
+    echo "and up to $(( FLASHAPP_SLOTS * FLASHAPP_SLOT_SIZE / 1024 ))kB when it's done."
     echo "'address in flash': Where to program to. 0x000000 is the start of the flash. "
     echo "'size': Size of the binary to flash. Should be aligned to 256 bytes."
     echo "'erase': If '0', chip erase will be skipped. Default '1'."
     echo "'erase_bytes': Number of bytes to erase, all if '0'. Default '0'."
     echo "--test: Performs a erase/write/read test"
+    echo "Set DIFF=1 to only program the 4k sectors that differ from the flash. The chunk"
+    echo "is skipped if it is unchanged, and the erase arguments are ignored."
+    echo "Set RESTART=1 to restart the flash app before loading a chunk other than the first."
+    echo "Set FAILED_CHUNK_FILE to a file to get the index of the chunk that failed."
     exit
 fi
 
@@ -177,7 +285,21 @@ dd if="${IMAGE}" of="${HASH_FILE}" bs=1 count=$(( SIZE )) 2> /dev/null
 calc_sha256sum "${HASH_FILE}" "${HASH_HEX_FILE}"
 rm -f "${HASH_FILE}"
 
-if [[ ${CHUNK_IDX} -eq "1" ]]; then
+if [[ $(( SIZE )) -gt $(( FLASHAPP_SLOTS * FLASHAPP_SLOT_SIZE )) ]]; then
+    echo_red "Size larger than the staging RAM of $(( FLASHAPP_SLOTS * FLASHAPP_SLOT_SIZE )) bytes."
+    exit 1
+fi
+
+# A chunk larger than a slot takes the following ones
+SLOT=$(( (CHUNK_IDX - 1) % FLASHAPP_SLOTS ))
+SLOT_COUNT=$(( (SIZE + FLASHAPP_SLOT_SIZE - 1) / FLASHAPP_SLOT_SIZE ))
+if [[ $(( SLOT + SLOT_COUNT )) -gt ${FLASHAPP_SLOTS} ]]; then
+    SLOT=0
+fi
+SLOT_MASK=$(( ((1 << SLOT_COUNT) - 1) << SLOT ))
+SLOT_ADDRESS=$(printf '0x%08x' $(( VAR_framebuffer2 + SLOT * FLASHAPP_SLOT_SIZE )))
+
+if [[ ${CHUNK_IDX} -eq "1" || "$RESTART" == "1" ]]; then
     ${OPENOCD} -f ${DIR}/interface_${ADAPTER}.cfg \
         -c "init; reset halt;" \
         -c "set MSP 0x[string range [mdw $INTFLASH_ADDRESS] 12 19]" \
@@ -192,55 +314,110 @@ if [[ ${CHUNK_IDX} -eq "1" ]]; then
         -c "exit;"
 fi
 
-wait_for_idle
+if [[ ${CHUNK_IDX} -eq "1" || "$RESTART" == "1" || "$DIFF" == "1" ]]; then
+    # The sector hashes need the previous chunks to be done
+    wait_for_idle
+else
+    wait_for_slots ${SLOT_MASK}
+fi
+
+if [[ "$DIFF" == "1" ]]; then
+    # Ask the device for the CRC32 of every sector and compare them with the image
+    SECTORS=$(( (SIZE + DIFF_SECTOR_SIZE - 1) / DIFF_SECTOR_SIZE ))
+    CRC_FILE=$(mktemp /tmp/sector_crc.XXXXXX)
+    if [[ ! -e "${CRC_FILE}" ]]; then
+        echo "Can't create tempfile!"
+        exit 1
+    fi
+
+    ${OPENOCD} -f ${DIR}/interface_${ADAPTER}.cfg \
+        -c "init; halt;" \
+        -c "mww ${VAR_program_size} ${SIZE}" \
+        -c "mww ${VAR_program_address} ${ADDRESS}" \
+        -c "mww ${VAR_program_start} 3" \
+        -c "resume; exit;"
+
+    while [[ "$(read_word ${VAR_program_start})" != "00000000" ]]; do
+        echo "State: $(state_to_string $(read_word ${VAR_flashapp_state}))"
+        sleep 1
+    done
 
+    ${OPENOCD} -f ${DIR}/interface_${ADAPTER}.cfg \
+        -c "init; halt;" \
+        -c "dump_image ${CRC_FILE} ${VAR_framebuffer2} $(( SECTORS * 4 ))" \
+        -c "resume; exit;"
+
+    CHANGED=$(${PYTHON3:-python3} - "${IMAGE}" "${CRC_FILE}" $(( SIZE )) ${DIFF_SECTOR_SIZE} <<'EOF'
+import struct
+import sys
+import zlib
+
+image, crc_file, size, sector_size = sys.argv[1], sys.argv[2], int(sys.argv[3]), int(sys.argv[4])
+with open(image, "rb") as f:
+    data = f.read(size)
+with open(crc_file, "rb") as f:
+    crcs = f.read()
+changed = 0
+for i in range(0, size, sector_size):
+    (crc,) = struct.unpack_from("<I", crcs, i // sector_size * 4)
+    if zlib.crc32(data[i:i + sector_size]) != crc:
+        changed += 1
+print(changed)
+EOF
+)
+    rm -f "${CRC_FILE}"
+
+    echo "${CHANGED} of ${SECTORS} sectors changed"
+    if [[ ${CHANGED} -eq 0 ]]; then
+        rm -f "${HASH_HEX_FILE}"
+        if [[ ${CHUNK_IDX} -ne ${CHUNK_COUNT} ]]; then
+            echo_green "Unchanged, skipped!"
+            exit 0
+        fi
+
+        # The last chunk still takes the device to the final state
+        ${OPENOCD} -f ${DIR}/interface_${ADAPTER}.cfg \
+            -c "init;" \
+            -c "mww ${VAR_program_start} 4" \
+            -c "exit;"
+        wait_for_final
+    fi
+
+    # The device erases the changed sectors itself
+    ERASE=0
+    ERASE_BYTES=0
+fi
+
+# The device keeps running, it programs the previous chunk meanwhile
 echo "Loading data"
+LOAD_START=$(now_ms)
     ${OPENOCD} -f ${DIR}/interface_${ADAPTER}.cfg \
-    -c "init; halt;" \
+    -c "init;" \
     -c "echo \"Loading image into RAM\";" \
-    -c "load_image ${IMAGE} ${VAR_framebuffer2};" \
+    -c "load_image ${IMAGE} ${SLOT_ADDRESS};" \
     -c "mww ${VAR_program_size} ${SIZE}" \
     -c "mww ${VAR_program_address} ${ADDRESS}" \
     -c "mww ${VAR_program_erase} ${ERASE}" \
     -c "mww ${VAR_program_erase_bytes} ${ERASE_BYTES}" \
+    -c "mww ${VAR_program_diff} ${DIFF}" \
+    -c "mww ${VAR_program_slot} ${SLOT}" \
     -c "mww ${VAR_program_chunk_idx} ${CHUNK_IDX}" \
     -c "mww ${VAR_program_chunk_count} ${CHUNK_COUNT}" \
     -c "load_image ${HASH_HEX_FILE} ${VAR_program_expected_sha256};" \
     -c "echo \"Starting flash process\";" \
     -c "mww ${VAR_program_start} 1" \
-    -c "resume; exit;"
+    -c "exit;"
+LOAD_MS=$(( $(now_ms) - LOAD_START ))
+echo "Loaded $(( SIZE )) bytes in ${LOAD_MS} ms"
 
 # Remove the temporary hash files
 rm -f "${HASH_HEX_FILE}"
 
+if [[ ${CHUNK_IDX} -ne ${CHUNK_COUNT} ]]; then
+    echo_green "Done, chunk ${CHUNK_IDX} queued!"
+    exit 0
+fi
+
 echo "Please see the LCD for interactive status."
 
-# Wait for the final or error state
-while true; do
-    STATE_REG=$(read_word ${VAR_flashapp_state})
-    if [[ "$STATE_REG" == "$FLASHAPP_FINAL" ]]; then
-        echo_green "Done!"
-        exit 0
-    elif [[ "$STATE_REG" == "$FLASHAPP_IDLE" ]]; then
-        echo_green "Done, more chunks left!"
-        exit 0
-    elif [[ "$STATE_REG" == "$FLASHAPP_ERROR" ]]; then
-        STATUS_REG=$(read_word ${VAR_program_status})
-        if [[ "$STATUS_REG" == "$STATUS_BAD_HASH_RAM" ]]; then
-            echo_red "Hash mismatch in RAM. Flashing failed."
-            exit 3
-        elif [[ "$STATUS_REG" == "$STATUS_BAD_HAS_FLASH" ]]; then
-            echo_red "Hash mismatch in FLASH. Flashing failed."
-            exit 3
-        elif [[ "$STATUS_REG" == "$STATUS_NOT_ALIGNED" ]]; then
-            echo_red "Address not 4k aligned. Flashing failed."
-            exit 4
-        else
-            echo_red "Unknown error. Flashing failed. Status: $STATUS_REG"
-            exit 5
-        fi
-    else
-        echo "State: $(state_to_string $STATE_REG)"
-    fi
-    sleep 1
-done
+wait_for_final
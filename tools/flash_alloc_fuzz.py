@@ -0,0 +1,547 @@
+#!/usr/bin/env python3
+
+# Host fuzzer and benchmark of the SPI flash ROM cache allocator. Builds
+# Core/Src/flash_alloc.c with the host gcc against a RAM backed flash and
+# a fake SD card, then runs random foreground/background copies, cancels,
+# pre-erases, reboots (journal replays) and power cuts in the middle of
+# the journal compaction, with or without the erase suspend. Partially evicted data is
+# topped up in place, so the data check covers the surviving chunks too. Every step checks the allocator
+# invariants and the data, the summary shows the hit ratio, the
+# fragmentation and the time spent in the allocator.
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+STUB_HAL = """
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+typedef struct { int unused; } OSPI_HandleTypeDef;
+uint32_t HAL_GetTick(void);
+"""
+
+STUB_MAIN = """
+#pragma once
+#include "stm32h7xx_hal.h"
+void wdog_refresh(void);
+"""
+
+STUB_PORTING = """
+#pragma once
+unsigned int crc32_le(unsigned int crc, unsigned char const *buf, unsigned int len);
+"""
+
+# The allocator on a RAM backed flash and a fake SD card, also used by
+# tools/flash_cache_sim.py
+FLASH_HARNESS = r"""
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint8_t fake_flash[FLASH_SIZE];
+
+#define __SPI_FLASH_BASE__ ((uintptr_t)fake_flash)
+#define __SPI_FLASH_SIZE__ ((uint32_t)FLASH_SIZE)
+
+#include "flash_alloc.c"
+
+struct FlashCtx FlashCtx, SdCtx;
+
+static int busy, suspended;
+static bool erasing;
+static jmp_buf power_jmp;
+static int power_countdown; /* Flash commands left before the power cut */
+static uint64_t erased_bytes, programmed_bytes;
+
+static void fail(const char *msg)
+{
+    printf("FAIL: %s\n", msg);
+    exit(1);
+}
+
+static void f_write(uint32_t a, const void *b, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        fake_flash[a + i] &= ((const uint8_t *)b)[i];
+}
+
+static void power_check(void)
+{
+    if (power_countdown && --power_countdown == 0)
+        longjmp(power_jmp, 1);
+}
+
+static void f_erase(uint32_t a, uint32_t n)
+{
+    power_check();
+    // A suspended erase is completed first
+    suspended = 0;
+    if (busy || a % 4096 || n % 4096)
+        fail("bad erase");
+    memset(fake_flash + a, 0xFF, n);
+    erased_bytes += n;
+}
+
+static bool f_busy(void)
+{
+    if (busy) {
+        busy--;
+        return true;
+    }
+    return false;
+}
+
+static uint32_t f_erase_async(uint32_t a, uint32_t n)
+{
+    const uint32_t size = (n >= 65536 && a % 65536 == 0) ? 65536 : 4096;
+
+    if (n < 4096)
+        fail("erase shorter than a sector");
+    f_erase(a, size);
+    busy = 4;
+    erasing = true;
+    return size;
+}
+
+static size_t f_program_async(uint32_t a, const void *b, size_t n)
+{
+    size_t len = 256 - a % 256;
+
+    power_check();
+    suspended = 0;
+    if (busy)
+        fail("program while busy");
+    if (len > n)
+        len = n;
+    for (size_t i = 0; i < len; i++) {
+        if (fake_flash[a + i] != 0xFF)
+            fail("program of not erased flash");
+        fake_flash[a + i] = ((const uint8_t *)b)[i];
+    }
+    programmed_bytes += len;
+    busy = 1;
+    erasing = false;
+    return len;
+}
+
+static bool f_suspend(void)
+{
+    if (!erasing)
+        return false;
+    suspended += busy;
+    busy = 0;
+    return true;
+}
+
+static bool f_resume(void)
+{
+    if (!suspended)
+        return false;
+    busy = suspended;
+    suspended = 0;
+    return true;
+}
+
+void flash_get_erase_stats(struct flash_erase_stats *stats) { memset(stats, 0, sizeof(*stats)); }
+
+static uint32_t f_smallest(void) { return 4096; }
+static void nop(void) {}
+
+void wdog_refresh(void) {}
+// Every call is a millisecond, the background steps end on time
+uint32_t HAL_GetTick(void)
+{
+    static uint32_t tick;
+    return tick++;
+}
+
+unsigned int crc32_le(unsigned int crc, unsigned char const *p, unsigned int len)
+{
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static uint64_t sd_pos;
+
+static uint8_t sd_byte(uint64_t pos)
+{
+    return (uint8_t)((pos * 2654435761u) >> 13);
+}
+
+void sd_read(uint64_t lba, uint32_t offset, void *buffer, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        ((uint8_t *)buffer)[i] = sd_byte(lba * 512 + offset + i);
+}
+
+void sd_read_stream_begin(uint64_t lba, uint32_t offset) { sd_pos = lba * 512 + offset; }
+void sd_read_stream(void *buffer, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        ((uint8_t *)buffer)[i] = sd_byte(sd_pos++);
+}
+void sd_read_stream_end(void) {}
+void sd_session_begin(void) {}
+void sd_session_end(void) {}
+
+static uint8_t *host_ptr(uint32_t address)
+{
+    return fake_flash + (uint32_t)(address - (uint32_t)(uintptr_t)fake_flash);
+}
+
+static void verify(uint32_t address, uint64_t lba, uint32_t size)
+{
+    const uint8_t *p = host_ptr(address);
+
+    for (uint32_t i = 0; i < size; i++) {
+        if (p[i] != sd_byte(lba * 512 + i))
+            fail("data mismatch");
+    }
+}
+
+static bool is_cached(uint64_t lba, uint32_t size)
+{
+    const struct fs_extent extent = { .lba = lba, .count = (size + 511) / 512 };
+    const uint32_t units = (size + UNIT_SIZE - 1) / UNIT_SIZE;
+    uint8_t buffer[BLOCK_LENGTH];
+    const uint32_t tag = get_tag(&extent, 0, size, buffer);
+
+    for (uint32_t i = 0; i < ram_entries->num_entries; i++) {
+        if (ram_entries->entry[i].tag == tag && ram_entries->entry[i].count == units)
+            return true;
+    }
+    return false;
+}
+
+static void flash_setup(bool suspend)
+{
+    FlashCtx.Presented = 1;
+    FlashCtx.Write = f_write;
+    FlashCtx.Erase = f_erase;
+    FlashCtx.IsBusy = f_busy;
+    FlashCtx.EraseAsync = f_erase_async;
+    FlashCtx.ProgramAsync = f_program_async;
+    if (suspend) {
+        FlashCtx.SuspendErase = f_suspend;
+        FlashCtx.ResumeErase = f_resume;
+    }
+    FlashCtx.GetSmallestEraseSize = f_smallest;
+    FlashCtx.DisableMemoryMappedMode = nop;
+    FlashCtx.EnableMemoryMappedMode = nop;
+    memset(fake_flash, 0xA5, sizeof(fake_flash));
+    flash_alloc_init();
+}
+"""
+
+HARNESS = FLASH_HARNESS + r"""
+static void check_invariants(void)
+{
+    const struct flash_entries *fe = ram_entries;
+    uint32_t unit = 0;
+
+    if (fe->num_entries > FLASH_MAX_ENTRIES)
+        fail("too many entries");
+    for (uint32_t i = 0; i < fe->num_entries; i++) {
+        const struct flash_entry *entry = &fe->entry[i];
+
+        if (entry->unit < unit || !entry->count)
+            fail("entries overlap");
+        unit = entry->unit + entry->count;
+    }
+    if (unit > TOTAL_UNITS)
+        fail("entry beyond the data area");
+}
+
+static void reboot(bool power_cut)
+{
+    struct flash_entries saved = *ram_entries;
+
+    memset(ram_entries, 0, sizeof(*ram_entries));
+    memset(&journal, 0, sizeof(journal));
+    memset(&pre_erase, 0, sizeof(pre_erase));
+    memset(&bg_copy, 0, sizeof(bg_copy));
+    memset(&stream, 0, sizeof(stream));
+    if (!journal_replay() || (journal.broken && !power_cut))
+        fail("journal replay");
+    // As on init, the interrupted compaction is redone
+    if (journal.broken)
+        journal_compact();
+    if (saved.num_entries != ram_entries->num_entries ||
+        memcmp(saved.entry, ram_entries->entry, saved.num_entries * sizeof(saved.entry[0])) ||
+        memcmp(saved.erased, ram_entries->erased, sizeof(saved.erased)))
+        fail("replayed table differs");
+}
+
+// Cuts the power in the middle of a compaction, the replay must still
+// find the table. The chain is grown first by logging the entries again,
+// so the compaction starts at any chain length.
+static void power_cut(uint32_t records, uint32_t commands)
+{
+    for (uint32_t i = 0; i < records && ram_entries->num_entries; i++) {
+        log_entry(&ram_entries->entry[i % ram_entries->num_entries]);
+        if (journal.num_pending == JOURNAL_PENDING)
+            store_flash_entries();
+    }
+    store_flash_entries();
+
+    power_countdown = commands;
+    if (!setjmp(power_jmp))
+        journal_compact();
+    power_countdown = 0;
+    busy = 0;
+    suspended = 0;
+    reboot(true);
+}
+
+static uint32_t rnd_state = SEED;
+
+static uint32_t rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+struct rom {
+    uint64_t lba;
+    uint32_t size;
+};
+
+static struct rom roms[NUM_ROMS];
+
+// Zipf-like popularity: a few favourites and a long tail of small ROMs
+static const struct rom *pick_rom(void)
+{
+    double total = 0, x;
+
+    for (int i = 0; i < NUM_ROMS; i++)
+        total += 1.0 / (i + 1);
+    x = (rnd() / 4294967296.0) * total;
+    for (int i = 0; i < NUM_ROMS; i++) {
+        x -= 1.0 / (i + 1);
+        if (x <= 0)
+            return &roms[i];
+    }
+    return &roms[NUM_ROMS - 1];
+}
+
+// Streamed entries hold the ROM data in another format, here it's XORed
+// with the kind and shorter
+static uint8_t stream_byte(const struct rom *rom, uint32_t kind, uint32_t i)
+{
+    return sd_byte(rom->lba * 512 + i) ^ kind;
+}
+
+static void stream_rom(const struct rom *rom, uint32_t *pre_erases)
+{
+    const uint32_t kind = 1 + rnd() % 3;
+    const uint32_t len = rom->size / (kind + 1);
+    uint8_t buffer[4096];
+    uint32_t address, length;
+
+    if (flash_alloc_find(rom->lba, 0, rom->size, kind, &address, &length)) {
+        // A piece left by the eviction holds the start of the data
+        const uint8_t *p = host_ptr(address);
+
+        for (uint32_t i = 0; i < len && i < length; i++) {
+            if (p[i] != stream_byte(rom, kind, i))
+                fail("stream data mismatch");
+        }
+        return;
+    }
+
+    address = flash_alloc_stream_begin(rom->lba, 0, rom->size, kind, rom->size);
+    if (!address)
+        fail("stream doesn't fit");
+    for (uint32_t pos = 0; pos < len;) {
+        uint32_t n = 1 + rnd() % sizeof(buffer);
+
+        if (n > len - pos)
+            n = len - pos;
+
+        for (uint32_t i = 0; i < n; i++)
+            buffer[i] = stream_byte(rom, kind, pos + i);
+        flash_alloc_stream_write(pos, buffer, n);
+        pos += n;
+        if (rnd() % 8 == 0)
+            *pre_erases += flash_alloc_pre_erase();
+        if (rnd() % 64 == 0) {
+            flash_alloc_stream_cancel();
+            return;
+        }
+    }
+    flash_alloc_stream_end(len);
+    if (!flash_alloc_find(rom->lba, 0, rom->size, kind, &address, &length) || length < len)
+        fail("stream is not found");
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(void)
+{
+    static const uint32_t sizes[] = { 8, 16, 32, 32, 64, 128, 256, 512, 1024, 2048, 4096 };
+    uint32_t loads = 0, hits = 0, top_ups = 0, pre_erases = 0, frag_sum = 0, frag_samples = 0;
+    uint64_t copied = 0;
+    double lookup_time = 0, place_time = 0;
+
+    flash_setup(!NO_SUSPEND);
+
+    // Many small ROMs as on the 8-bit systems, a few large ones
+    for (int i = 0; i < NUM_ROMS; i++) {
+        uint32_t kb = sizes[rnd() % (sizeof(sizes) / sizeof(sizes[0]))];
+
+        while (kb > MAX_ROM_KB || kb * 1024 > DATA_SIZE / 2)
+            kb /= 2;
+        roms[i].lba = (uint64_t)i * 16384;
+        roms[i].size = kb * 1024 - rnd() % 512;
+    }
+
+    for (uint32_t op = 0; op < OPS; op++) {
+        const uint32_t action = rnd() % 100;
+
+        if (action < 60) {
+            const struct rom *rom = pick_rom();
+            const bool hit = is_cached(rom->lba, rom->size);
+            const double start = now();
+            const uint32_t address = copy_sd_to_flash(rom->lba, 0, rom->size);
+
+            if (hit)
+                lookup_time += now() - start;
+            verify(address, rom->lba, rom->size);
+            loads++;
+            hits += hit;
+            if (!hit) {
+                copied += copy_engine.size - copy_engine.skipped;
+                top_ups += copy_engine.skipped != 0;
+            }
+        } else if (action < 80) {
+            const struct rom *rom = pick_rom();
+            uint32_t address;
+
+            if (!copy_sd_to_flash_begin(rom->lba, 0, rom->size, &address)) {
+                // Sometimes the game is closed before the copy is done
+                if (rnd() % 4 == 0) {
+                    copy_sd_to_flash_step(rnd() % rom->size);
+                    copy_sd_to_flash_cancel();
+                    continue;
+                }
+                // Or started while the copy is still in progress
+                if (rnd() % 4 == 0)
+                    copy_sd_to_flash_finish();
+                while (!copy_sd_to_flash_step(1 + rnd() % 65536)) {
+                    if (copy_sd_to_flash_blocked())
+                        pre_erases += flash_alloc_pre_erase();
+                }
+            }
+            verify(address, rom->lba, rom->size);
+        } else if (action < 88) {
+            stream_rom(pick_rom(), &pre_erases);
+        } else if (action < 95) {
+            for (uint32_t n = rnd() % 64; n; n--)
+                pre_erases += flash_alloc_pre_erase();
+        } else if (action < 98) {
+            reboot(false);
+        } else {
+            power_cut(rnd() % (JOURNAL_SECTORS * JOURNAL_SLOTS), 1 + rnd() % 16);
+        }
+
+        check_invariants();
+        if (op % 16 == 0) {
+            struct flash_alloc_stats stats;
+
+            flash_alloc_get_stats(&stats);
+            frag_sum += stats.fragmentation;
+            frag_samples++;
+        }
+    }
+
+    // Placement cost on the final table: the free space search and the
+    // eviction window selection
+    const double start = now();
+    for (uint32_t i = 0; i < 1000; i++) {
+        const uint32_t units = 1 + rnd() % (TOTAL_UNITS / 8);
+        uint32_t unit;
+
+        if (!find_free(units, &unit))
+            evict_policy->select(units, align_of(units), &unit);
+    }
+    place_time = now() - start;
+
+    struct flash_alloc_stats stats;
+    flash_alloc_get_stats(&stats);
+    printf("%u ops, %u KB units, %u loads, hit ratio %.1f%%, %u top-ups, %.1f MB copied\n", OPS,
+           stats.unit_size / 1024, loads, loads ? 100.0 * hits / loads : 0, top_ups,
+           copied / 1048576.0);
+    printf("%u entries, %u/%u KB free in %u gaps, largest fit %u KB\n", stats.entries,
+           stats.free_kb, stats.total_kb, stats.free_gaps, stats.largest_free_kb);
+    printf("fragmentation %u%% now, %.1f%% average\n", stats.fragmentation,
+           frag_samples ? (double)frag_sum / frag_samples : 0);
+    printf("%u pre-erases, %.1f MB erased, %.1f MB programmed\n", pre_erases,
+           erased_bytes / 1048576.0, programmed_bytes / 1048576.0);
+    printf("hit %.2f us, placement %.2f us (host, with the sanitizers)\n",
+           hits ? lookup_time * 1e6 / hits : 0, place_time * 1e3);
+    return 0;
+}
+"""
+
+
+def build(tmp, harness, cc, flash_size_mb, defines, sanitize=True):
+    """Builds the harness with flash_alloc.c in tmp, returns the binary"""
+    for name, text in (("stm32h7xx_hal.h", STUB_HAL), ("main.h", STUB_MAIN), ("porting.h", STUB_PORTING)):
+        with open(os.path.join(tmp, name), "w") as f:
+            f.write(text)
+    source = os.path.join(tmp, "harness.c")
+    with open(source, "w") as f:
+        f.write(harness)
+
+    binary = os.path.join(tmp, "harness")
+    cmd = [cc, "-O2", "-std=gnu11", "-w",
+           "-I", tmp, "-I", os.path.join(REPO, "Core", "Inc"), "-I", os.path.join(REPO, "Core", "Src"),
+           "-DSD_CARD=1", "-DEXTFLASH_FORCE_SRAM=0",
+           f"-DFLASH_SIZE={flash_size_mb * 1024 * 1024}"] + defines + [source, "-o", binary]
+    if sanitize:
+        cmd.insert(1, "-fsanitize=address,undefined")
+    subprocess.run(cmd, check=True)
+    return binary
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Fuzz and benchmark Core/Src/flash_alloc.c on the host")
+    parser.add_argument("--spi-flash-size-mb", type=int, default=16, help="SPI flash size (default: 16)")
+    parser.add_argument("--ops", type=int, default=5000, help="random operations to run")
+    parser.add_argument("--roms", type=int, default=300, help="ROM library size")
+    parser.add_argument("--max-rom-kb", type=int, default=4096, help="largest ROM in the library")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--no-suspend", action="store_true", help="flash that can't suspend an erase")
+    parser.add_argument("--cc", default="gcc")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        binary = build(tmp, HARNESS, args.cc, args.spi_flash_size_mb,
+                       [f"-DOPS={args.ops}", f"-DNUM_ROMS={args.roms}", f"-DMAX_ROM_KB={args.max_rom_kb}",
+                        f"-DSEED={args.seed or 1}", f"-DNO_SUSPEND={int(args.no_suspend)}"])
+        return subprocess.run([binary]).returncode
+
+if __name__ == "__main__":
+    sys.exit(main())
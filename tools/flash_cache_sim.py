@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+
+# Replays the SD -> SPI flash ROM cache accesses against the eviction
+# policies of Core/Src/flash_alloc.c and reports the hit ratio and the
+# amount of data copied from the SD card. The allocator itself is built
+# with the host gcc on the RAM backed flash of tools/flash_alloc_fuzz.py,
+# once with FLASH_EVICT_ROUND_ROBIN=1 and once with the default cost policy.
+#
+# The trace is either the firmware log (the "Flash cache: tag=... units=..."
+# lines) or a text file with a "<tag> <units>" pair per line.
+
+import argparse
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+
+from flash_alloc_fuzz import FLASH_HARNESS, build
+
+TRACE_RE = re.compile(r"Flash cache: tag=([0-9a-fA-F]+) units=(\d+)")
+
+# Every tag of the trace is a ROM of its own on the fake SD card
+HARNESS = FLASH_HARNESS + r"""
+#define MAX_TAGS 65536
+#define ROM_SECTORS ((uint64_t)FLASH_SIZE / 512)
+
+static uint32_t tags[MAX_TAGS];
+static uint32_t num_tags;
+
+static uint64_t tag_lba(uint32_t tag)
+{
+    uint32_t i;
+
+    for (i = 0; i < num_tags && tags[i] != tag; i++)
+        ;
+    if (i == num_tags) {
+        if (num_tags == MAX_TAGS)
+            fail("too many ROMs in the trace");
+        tags[num_tags++] = tag;
+    }
+    return i * ROM_SECTORS;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t tag, units, loads = 0, hits = 0;
+    uint64_t copied = 0;
+
+    // Only the layout for the synthetic trace
+    if (argc > 1) {
+        printf("%lu %lu\n", (unsigned long)UNIT_SIZE, (unsigned long)TOTAL_UNITS);
+        return 0;
+    }
+
+    flash_setup(true);
+    while (scanf("%x %u", &tag, &units) == 2) {
+        const uint64_t lba = tag_lba(tag);
+        const uint32_t size = units * UNIT_SIZE;
+        const bool hit = is_cached(lba, size);
+        const uint32_t address = copy_sd_to_flash(lba, 0, size);
+
+        verify(address, lba, size);
+        loads++;
+        hits += hit;
+        if (!hit)
+            copied += copy_engine.size - copy_engine.skipped;
+    }
+
+    printf("%u %u %llu\n", loads, hits, (unsigned long long)copied);
+    return 0;
+}
+"""
+
+
+def read_trace(path):
+    trace = []
+    with open(path) as f:
+        for line in f:
+            m = TRACE_RE.search(line)
+            if m:
+                trace.append((int(m.group(1), 16), int(m.group(2))))
+                continue
+
+            fields = line.split()
+            if len(fields) == 2 and not line.startswith("#"):
+                trace.append((int(fields[0], 16), int(fields[1])))
+    return trace
+
+
+def synthetic_trace(count, roms, seed, unit):
+    # A few favourite games are played most of the time with an occasional
+    # large game in between, which is what pushes them out of round-robin
+    rnd = random.Random(seed)
+    sizes_kb = [32, 64, 128, 256, 512, 1024, 2048, 4096]
+    library = [(i + 1, (rnd.choice(sizes_kb) * 1024 + unit - 1) // unit) for i in range(roms)]
+    weights = [1.0 / (i + 1) for i in range(roms)]
+    return [rnd.choices(library, weights)[0] for _ in range(count)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Replay the flash cache trace against the eviction policies")
+    parser.add_argument("trace", nargs="?", help="firmware log or '<tag> <units>' trace, synthetic if omitted")
+    parser.add_argument("--spi-flash-size-mb", type=int, default=16, help="SPI flash size (default: 16)")
+    parser.add_argument("--loads", type=int, default=2000, help="synthetic trace length")
+    parser.add_argument("--roms", type=int, default=40, help="synthetic trace library size")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--cc", default="gcc")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        binaries = {}
+        for policy, round_robin in (("round-robin", 1), ("cost", 0)):
+            os.mkdir(os.path.join(tmp, policy))
+            binaries[policy] = build(os.path.join(tmp, policy), HARNESS, args.cc, args.spi_flash_size_mb,
+                                     [f"-DFLASH_EVICT_ROUND_ROBIN={round_robin}"], sanitize=False)
+
+        unit, total_units = map(int, subprocess.run([binaries["cost"], "--layout"], check=True,
+                                                    capture_output=True, text=True).stdout.split())
+
+        if args.trace:
+            trace = read_trace(args.trace)
+        else:
+            trace = synthetic_trace(args.loads, args.roms, args.seed, unit)
+        trace = [(tag, units) for tag, units in trace if 0 < units <= total_units]
+
+        if not trace:
+            print("No loads in the trace", file=sys.stderr)
+            return 1
+
+        print(f"{len(trace)} loads, {unit // 1024} KB units")
+        lines = "".join(f"{tag:08x} {units}\n" for tag, units in trace)
+        for policy, binary in binaries.items():
+            result = subprocess.run([binary], input=lines, capture_output=True, text=True)
+            if result.returncode != 0:
+                sys.stdout.write(result.stdout[-1000:])
+                return result.returncode
+
+            loads, hits, copied = map(int, result.stdout.splitlines()[-1].split())
+            print(f"{policy:>12}: hit ratio {100 * hits / loads:5.1f}%, "
+                  f"{copied / (1024 * 1024):9.1f} MB copied from SD")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,694 @@
+#!/usr/bin/env python3
+
+# Host test of the FAT32/exFAT driver in Core/Src/gw_fs.c. Formats volumes
+# with mkfs.vfat and mkfs.exfat (or with the minimal formatters below when
+# the tools are missing), writes a ROM tree to them with files split in
+# many fragments, reversed cluster chains, long names and directories
+# spanning several fragments, places them behind the card layout written by
+# tools/sd_card.py or as a superfloppy, then builds gw_fs.c with the host
+# gcc and reads every file back through it.
+
+import argparse
+import os
+import random
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+from array import array
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+SECTOR = 512
+MAX_EXTENTS = 32  # FS_MAX_EXTENTS in Core/Inc/gw_fs.h
+
+HARNESS = r"""
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gw_fs.c"
+
+static FILE *image;
+static uint64_t image_sectors;
+
+static void read_sectors(uint64_t lba, void *buffer, uint32_t count)
+{
+    if (lba + count > image_sectors) {
+        printf("FAIL: read of sectors %llu+%u beyond the image\n", (unsigned long long)lba, count);
+        exit(1);
+    }
+    fseeko(image, lba * FS_SECTOR_SIZE, SEEK_SET);
+    if (fread(buffer, FS_SECTOR_SIZE, count, image) != count)
+        exit(2);
+}
+
+static uint64_t random_len(uint64_t max)
+{
+    uint64_t len = rand() % 3 ? 1 + rand() % 1500 : 1 + rand() % (64 * 1024);
+    return len < max ? len : max;
+}
+
+int main(int argc, char **argv)
+{
+    char line[1024];
+
+    image = fopen(argv[1], "rb");
+    fseeko(image, 0, SEEK_END);
+    image_sectors = ftello(image) / FS_SECTOR_SIZE;
+    srand(atoi(argv[2]));
+
+    if (!fs_mount(read_sectors)) {
+        printf("FAIL: mount\n");
+        return 1;
+    }
+
+    // "path<TAB>output" per line, prints the size and the extents or
+    // "missing" and writes the data read to the output
+    while (fgets(line, sizeof(line), stdin)) {
+        struct fs_file file;
+        char *out = strchr(line, '\t');
+
+        line[strcspn(line, "\n")] = 0;
+        *out++ = 0;
+        if (!fs_open(line, &file)) {
+            printf("missing\n");
+            fflush(stdout);
+            continue;
+        }
+
+        // Sequential reads of random sizes, then random windows
+        uint8_t *data = malloc(file.size + 1);
+        uint8_t *window = malloc(64 * 1024);
+        for (uint64_t pos = 0; pos < file.size;) {
+            uint64_t len = random_len(file.size - pos);
+            fs_read(&file, pos, data + pos, len);
+            pos += len;
+        }
+        for (int i = 0; i < 64 && file.size; i++) {
+            uint64_t pos = rand() % file.size;
+            uint64_t len = random_len(file.size - pos);
+            fs_read(&file, pos, window, len);
+            if (memcmp(window, data + pos, len))
+                printf("FAIL: %s window %llu+%llu differs\n", line, (unsigned long long)pos,
+                       (unsigned long long)len);
+        }
+
+        uint32_t contiguous;
+        fs_file_lba(&file, file.size, &contiguous);
+        if (contiguous)
+            printf("FAIL: %s has sectors past the end\n", line);
+
+        FILE *f = fopen(out, "wb");
+        fwrite(data, 1, file.size, f);
+        fclose(f);
+        free(data);
+        free(window);
+
+        printf("%llu %lu\n", (unsigned long long)file.size, (unsigned long)file.num_extents);
+        fflush(stdout);
+    }
+
+    return 0;
+}
+"""
+
+
+def div_up(a, b):
+    return (a + b - 1) // b
+
+
+# =============================================================================
+# Tree to write
+# =============================================================================
+
+
+class File:
+    def __init__(self, name, size=0, runs=1, reverse=False, chain=False, deleted=False):
+        self.name = name
+        self.size = size
+        self.runs = runs
+        self.reverse = reverse
+        self.chain = chain  # exFAT: FAT chain even if contiguous
+        self.deleted = deleted
+        self.data = b""
+        self.clusters = []
+
+
+class Dir:
+    def __init__(self, name, children, runs=1, reverse=False):
+        self.name = name
+        self.children = children
+        self.runs = runs
+        self.reverse = reverse
+
+
+def rom_tree(rng):
+    nes = [
+        File("Super Game (USA).nes", 300 * 1024),
+        File("SMALL.NES", 20000),
+        File("empty.nes"),
+        File("tiny.nes", 100),
+        File("Fragmented Game (Europe) (Rev 1).nes", 200 * 1024, runs=20),
+        File("reverse.nes", 96 * 1024 + 7, runs=10, reverse=True),
+        File("chained.nes", 40 * 1024, chain=True),
+        File("big.nes", 1536 * 1024 + 333, runs=3),
+        File("too fragmented.nes", 200 * 1024, runs=MAX_EXTENTS + 8),
+        File("A very long name that takes several of the long name entries of FAT32 and exFAT.nes", 5000),
+        File("deleted.nes", deleted=True),
+    ]
+    # Enough entries for the directory to take several clusters
+    gb = [File(f"Game number {i:03} with a long name (World).gb", rng.randrange(1, 64 * 1024), runs=1 + i % 3)
+          for i in range(60)]
+    pce = [File("game.pce", 512 * 1024, runs=MAX_EXTENTS)]
+    return [Dir("roms", [Dir("nes", nes), Dir("gb", gb, runs=3, reverse=True), Dir("pce", pce)])]
+
+
+def walk(entries, path=""):
+    for entry in entries:
+        full = path + "/" + entry.name
+        if isinstance(entry, Dir):
+            yield full, entry
+            yield from walk(entry.children, full)
+        else:
+            yield full, entry
+
+
+# =============================================================================
+# Volumes
+# =============================================================================
+
+
+class Volume:
+    """Writes files to a formatted volume. Clusters are handed out from a
+    cursor that only moves forward, skipping one free cluster between the
+    runs of a file, so a file of N runs gets exactly N fragments."""
+
+    def __init__(self, data):
+        self.data = data
+        self.cursor = 2
+
+    def cluster_offset(self, cluster):
+        return self.heap_offset + (cluster - 2) * self.cluster_bytes
+
+    def alloc(self, count, runs=1, reverse=False, chain=True):
+        if not count:
+            return []
+        sizes = [count // runs + (1 if i < count % runs else 0) for i in range(runs)]
+        result = []
+        for size in sizes:
+            if not size:
+                continue
+            run = []
+            while len(run) < size:
+                cluster = self.cursor
+                self.cursor += 1
+                if cluster - 2 >= self.cluster_count:
+                    sys.exit("Volume is full")
+                if self.is_free(cluster):
+                    run.append(cluster)
+            result.append(run)
+            self.cursor += 1
+        if reverse:
+            result.reverse()
+        clusters = [c for run in result for c in run]
+        self.take(clusters, chain)
+        return clusters
+
+    def write_clusters(self, clusters, data):
+        for i, cluster in enumerate(clusters):
+            chunk = data[i * self.cluster_bytes:(i + 1) * self.cluster_bytes]
+            offset = self.cluster_offset(cluster)
+            self.data[offset:offset + self.cluster_bytes] = chunk.ljust(self.cluster_bytes, b"\0")
+
+    def chain(self, cluster):
+        clusters = []
+        while 2 <= cluster < self.cluster_count + 2:
+            clusters.append(cluster)
+            cluster = self.fat[cluster] & self.fat_mask
+        return clusters
+
+    def write_dir(self, directory, parent_cluster):
+        entries_count = self.dir_header_count + sum(self.entries_count(c.name) for c in directory.children)
+        clusters = self.alloc(div_up(entries_count * 32, self.cluster_bytes), directory.runs,
+                              directory.reverse, chain=directory.runs > 1)
+        entries = self.dir_header(clusters[0], parent_cluster) + self.write_children(directory.children, clusters[0])
+        self.write_clusters(clusters, entries)
+        directory.clusters = clusters
+        return clusters[0], len(clusters) * self.cluster_bytes, directory.runs == 1
+
+    def write_children(self, children, dir_cluster):
+        entries = b""
+        for child in children:
+            if isinstance(child, Dir):
+                first, size, no_fat_chain = self.write_dir(child, dir_cluster)
+                entries += self.entry(child.name, True, first, size, no_fat_chain, False)
+                continue
+
+            no_fat_chain = child.runs == 1 and not child.chain
+            child.clusters = self.alloc(div_up(len(child.data), self.cluster_bytes), child.runs, child.reverse,
+                                        chain=not no_fat_chain)
+            self.write_clusters(child.clusters, child.data)
+            first = child.clusters[0] if child.clusters else 0
+            entries += self.entry(child.name, False, first, len(child.data), no_fat_chain, child.deleted)
+        return entries
+
+    def write_root(self, children):
+        # Appends to the root directory left by mkfs, extending its chain
+        clusters = self.chain(self.root_cluster)
+        old = b"".join(bytes(self.data[self.cluster_offset(c):self.cluster_offset(c) + self.cluster_bytes])
+                       for c in clusters)
+        used = 0
+        while used < len(old) and old[used] != 0:
+            used += 32
+        entries = old[:used] + self.write_children(children, self.root_cluster)
+        extra = div_up(len(entries), self.cluster_bytes) - len(clusters)
+        if extra > 0:
+            new = self.alloc(extra, chain=True)
+            self.fat[clusters[-1]] = new[0]
+            clusters += new
+        self.write_clusters(clusters, entries)
+
+
+class Fat32(Volume):
+    fat_mask = 0x0FFFFFFF
+    dir_header_count = 2
+
+    def __init__(self, data):
+        super().__init__(data)
+        bs = data[:SECTOR]
+        self.cluster_sectors = bs[13]
+        self.cluster_bytes = self.cluster_sectors * SECTOR
+        reserved, self.num_fats = struct.unpack_from("<HB", bs, 14)
+        total, self.fat_sectors, _, _, self.root_cluster = struct.unpack_from("<IIHHI", bs, 32)
+        self.fsinfo = struct.unpack_from("<H", bs, 48)[0]
+        self.fat_offset = reserved * SECTOR
+        self.heap_offset = self.fat_offset + self.num_fats * self.fat_sectors * SECTOR
+        self.cluster_count = (total * SECTOR - self.heap_offset) // self.cluster_bytes
+        self.fat = array("I", bytes(data[self.fat_offset:self.fat_offset + (self.cluster_count + 2) * 4]))
+
+    def is_free(self, cluster):
+        return self.fat[cluster] == 0
+
+    def take(self, clusters, chain):
+        for a, b in zip(clusters, clusters[1:]):
+            self.fat[a] = b
+        if clusters:
+            self.fat[clusters[-1]] = 0x0FFFFFFF
+
+    def finish(self):
+        fat = self.fat.tobytes()
+        for i in range(self.num_fats):
+            offset = self.fat_offset + i * self.fat_sectors * SECTOR
+            self.data[offset:offset + len(fat)] = fat
+        # Free count and next free cluster unknown
+        for sector in (self.fsinfo, self.fsinfo + 6):
+            struct.pack_into("<II", self.data, sector * SECTOR + 488, 0xFFFFFFFF, 0xFFFFFFFF)
+
+    def short_name(self, name, index):
+        stem, _, ext = name.rpartition(".") if "." in name else (name, "", "")
+        valid = set("ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-")
+        if (name.upper() == name and 0 < len(stem) <= 8 and len(ext) <= 3 and
+                set(stem) <= valid and set(ext) <= valid):
+            return stem.ljust(8).encode() + ext.ljust(3).encode(), False
+        basis = "".join(c for c in stem.upper() if c in valid) or "FILE"
+        tail = f"~{index}"
+        ext = "".join(c for c in ext.upper() if c in valid)[:3]
+        return (basis[:8 - len(tail)] + tail).ljust(8).encode() + ext.ljust(3).encode(), True
+
+    def entries_count(self, name):
+        return 1 + div_up(len(name), 13)
+
+    def dir_header(self, cluster, parent_cluster):
+        return (self.sfn_entry(b".          ", 0x10, cluster, 0) +
+                self.sfn_entry(b"..         ", 0x10, 0 if parent_cluster == self.root_cluster else parent_cluster, 0))
+
+    def sfn_entry(self, sfn, attr, cluster, size):
+        e = bytearray(32)
+        e[0:11] = sfn
+        e[11] = attr
+        struct.pack_into("<H", e, 20, cluster >> 16)
+        struct.pack_into("<HI", e, 26, cluster & 0xFFFF, size)
+        return bytes(e)
+
+    def entry(self, name, is_dir, cluster, size, no_fat_chain, deleted):
+        self.sfn_index = getattr(self, "sfn_index", 0) + 1
+        sfn, need_lfn = self.short_name(name, self.sfn_index)
+        entries = []
+        if need_lfn:
+            checksum = 0
+            for c in sfn:
+                checksum = (((checksum & 1) << 7) + (checksum >> 1) + c) & 0xFF
+            chars = list(struct.unpack(f"<{len(name)}H", name.encode("utf-16-le")))
+            if len(chars) % 13:
+                chars.append(0)
+            while len(chars) % 13:
+                chars.append(0xFFFF)
+            count = len(chars) // 13
+            for ordinal in range(count, 0, -1):
+                e = bytearray(32)
+                e[0] = ordinal | (0x40 if ordinal == count else 0)
+                e[11] = 0x0F
+                e[13] = checksum
+                part = chars[(ordinal - 1) * 13:ordinal * 13]
+                for k, offset in enumerate((1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30)):
+                    struct.pack_into("<H", e, offset, part[k])
+                entries.append(e)
+        entries.append(bytearray(self.sfn_entry(sfn, 0x10 if is_dir else 0x20, cluster, 0 if is_dir else size)))
+        if deleted:
+            for e in entries:
+                e[0] = 0xE5
+        return b"".join(entries)
+
+
+class ExFat(Volume):
+    fat_mask = 0xFFFFFFFF
+    dir_header_count = 0
+
+    def __init__(self, data):
+        super().__init__(data)
+        bs = data[:SECTOR]
+        fat_offset, _, heap_offset, self.cluster_count, self.root_cluster = struct.unpack_from("<IIIII", bs, 80)
+        self.cluster_bytes = SECTOR << bs[109]
+        self.fat_offset = fat_offset * SECTOR
+        self.heap_offset = heap_offset * SECTOR
+        self.fat = array("I", bytes(data[self.fat_offset:self.fat_offset + (self.cluster_count + 2) * 4]))
+
+        self.bitmap_offset = None
+        for cluster in self.chain(self.root_cluster):
+            offset = self.cluster_offset(cluster)
+            for i in range(offset, offset + self.cluster_bytes, 32):
+                if data[i] == 0x81:
+                    self.bitmap_offset = self.cluster_offset(struct.unpack_from("<I", data, i + 20)[0])
+        if self.bitmap_offset is None:
+            sys.exit("No exFAT allocation bitmap")
+
+    def is_free(self, cluster):
+        bit = cluster - 2
+        return not self.data[self.bitmap_offset + bit // 8] & (1 << bit % 8)
+
+    def take(self, clusters, chain):
+        for cluster in clusters:
+            bit = cluster - 2
+            self.data[self.bitmap_offset + bit // 8] |= 1 << bit % 8
+        if chain:
+            for a, b in zip(clusters, clusters[1:]):
+                self.fat[a] = b
+            if clusters:
+                self.fat[clusters[-1]] = 0xFFFFFFFF
+
+    def finish(self):
+        fat = self.fat.tobytes()
+        self.data[self.fat_offset:self.fat_offset + len(fat)] = fat
+
+    def entries_count(self, name):
+        return 2 + div_up(len(name), 15)
+
+    def dir_header(self, cluster, parent_cluster):
+        return b""
+
+    def entry(self, name, is_dir, cluster, size, no_fat_chain, deleted):
+        units = name.encode("utf-16-le")
+        name_hash = 0
+        for b in name.upper().encode("utf-16-le"):
+            name_hash = (((name_hash << 15) | (name_hash >> 1)) + b) & 0xFFFF
+
+        file_entry = bytearray(32)
+        file_entry[0] = 0x85
+        file_entry[1] = 1 + div_up(len(name), 15)
+        struct.pack_into("<H", file_entry, 4, 0x10 if is_dir else 0x20)
+        stream = bytearray(32)
+        stream[0] = 0xC0
+        stream[1] = 0x01 | (0x02 if no_fat_chain else 0)
+        stream[3] = len(name)
+        struct.pack_into("<HHQ", stream, 4, name_hash, 0, size)
+        struct.pack_into("<IQ", stream, 20, cluster, size)
+        entries = [file_entry, stream]
+        for i in range(0, len(units), 30):
+            e = bytearray(32)
+            e[0] = 0xC1
+            e[2:2 + len(units[i:i + 30])] = units[i:i + 30]
+            entries.append(e)
+
+        checksum = 0
+        for i, b in enumerate(b"".join(entries)):
+            if i not in (2, 3):
+                checksum = (((checksum << 15) | (checksum >> 1)) + b) & 0xFFFF
+        struct.pack_into("<H", file_entry, 2, checksum)
+        if deleted:
+            for e in entries:
+                e[0] &= 0x7F
+        return b"".join(entries)
+
+
+# =============================================================================
+# Formatters, used when mkfs.vfat/mkfs.exfat are not installed
+# =============================================================================
+
+
+def format_fat32(size):
+    total = size // SECTOR
+    reserved, num_fats, cluster_sectors = 32, 2, 1
+    fat_sectors = 1
+    while True:
+        clusters = (total - reserved - num_fats * fat_sectors) // cluster_sectors
+        needed = div_up((clusters + 2) * 4, SECTOR)
+        if needed <= fat_sectors:
+            break
+        fat_sectors = needed
+
+    data = bytearray(size)
+    bs = bytearray(SECTOR)
+    bs[0:3] = b"\xeb\x58\x90"
+    bs[3:11] = b"MSWIN4.1"
+    struct.pack_into("<HBHBHHBHHHII", bs, 11, SECTOR, cluster_sectors, reserved, num_fats, 0, 0, 0xF8, 0, 63, 255, 0,
+                     total)
+    struct.pack_into("<IHHIHH", bs, 36, fat_sectors, 0, 0, 2, 1, 6)
+    struct.pack_into("<BBBI", bs, 64, 0x80, 0, 0x29, 0x12345678)
+    bs[71:82] = b"ROMS       "
+    bs[82:90] = b"FAT32   "
+    bs[510:512] = b"\x55\xaa"
+    fsinfo = bytearray(SECTOR)
+    struct.pack_into("<I", fsinfo, 0, 0x41615252)
+    struct.pack_into("<IIII", fsinfo, 484, 0x61417272, 0xFFFFFFFF, 0xFFFFFFFF, 0)
+    struct.pack_into("<I", fsinfo, 508, 0xAA550000)
+    for sector, content in ((0, bs), (1, fsinfo), (6, bs), (7, fsinfo)):
+        data[sector * SECTOR:(sector + 1) * SECTOR] = content
+    for i in range(num_fats):
+        offset = (reserved + i * fat_sectors) * SECTOR
+        struct.pack_into("<III", data, offset, 0x0FFFFFF8, 0x0FFFFFFF, 0x0FFFFFFF)
+    return data
+
+
+def format_exfat(size):
+    total = size // SECTOR
+    cluster_shift = 3
+    cluster_sectors = 1 << cluster_shift
+    cluster_bytes = cluster_sectors * SECTOR
+    fat_offset = 128
+    fat_length = 1
+    while True:
+        heap_offset = div_up(fat_offset + fat_length, cluster_sectors) * cluster_sectors
+        clusters = (total - heap_offset) // cluster_sectors
+        needed = div_up((clusters + 2) * 4, SECTOR)
+        if needed <= fat_length:
+            break
+        fat_length = needed
+
+    # Compressed up-case table: ASCII, then the identity for the rest
+    upcase = array("H", [ord(chr(c).upper()) if c < 128 else c for c in range(128)])
+    upcase = upcase.tobytes() + struct.pack("<HH", 0xFFFF, 0x10000 - 128)
+    upcase_checksum = 0
+    for b in upcase:
+        upcase_checksum = (((upcase_checksum << 31) | (upcase_checksum >> 1)) + b) & 0xFFFFFFFF
+
+    bitmap_size = div_up(clusters, 8)
+    bitmap_cluster = 2
+    upcase_cluster = bitmap_cluster + div_up(bitmap_size, cluster_bytes)
+    root_cluster = upcase_cluster + div_up(len(upcase), cluster_bytes)
+
+    data = bytearray(size)
+    boot = bytearray(12 * SECTOR)
+    boot[0:3] = b"\xeb\x76\x90"
+    boot[3:11] = b"EXFAT   "
+    struct.pack_into("<QQIIIIIIHHBBBBB", boot, 64, 0, total, fat_offset, fat_length, heap_offset, clusters,
+                     root_cluster, 0x12345678, 0x0100, 0, 9, cluster_shift, 1, 0x80, 0xFF)
+    boot[510:512] = b"\x55\xaa"
+    for sector in range(1, 9):
+        boot[sector * SECTOR + 510:sector * SECTOR + 512] = b"\x55\xaa"
+    checksum = 0
+    for i, b in enumerate(boot[:11 * SECTOR]):
+        if i not in (106, 107, 112):
+            checksum = (((checksum << 31) | (checksum >> 1)) + b) & 0xFFFFFFFF
+    boot[11 * SECTOR:] = struct.pack("<I", checksum) * (SECTOR // 4)
+    data[0:len(boot)] = boot
+    data[len(boot):2 * len(boot)] = boot
+
+    fat = array("I", [0xFFFFFFF8, 0xFFFFFFFF] + [0] * clusters)
+    for first, last in ((bitmap_cluster, upcase_cluster - 1), (upcase_cluster, root_cluster - 1),
+                        (root_cluster, root_cluster)):
+        for cluster in range(first, last):
+            fat[cluster] = cluster + 1
+        fat[last] = 0xFFFFFFFF
+    data[fat_offset * SECTOR:fat_offset * SECTOR + len(fat) * 4] = fat.tobytes()
+
+    def cluster_offset(cluster):
+        return (heap_offset + (cluster - 2) * cluster_sectors) * SECTOR
+
+    for bit in range(root_cluster - 1):
+        data[cluster_offset(bitmap_cluster) + bit // 8] |= 1 << bit % 8
+    data[cluster_offset(upcase_cluster):cluster_offset(upcase_cluster) + len(upcase)] = upcase
+    root = bytearray(64)
+    root[0] = 0x81
+    struct.pack_into("<IQ", root, 20, bitmap_cluster, bitmap_size)
+    root[32] = 0x82
+    struct.pack_into("<I", root, 36, upcase_checksum)
+    struct.pack_into("<IQ", root, 52, upcase_cluster, len(upcase))
+    data[cluster_offset(root_cluster):cluster_offset(root_cluster) + len(root)] = root
+    return data
+
+
+def make_volume(fs_type, size, tmp, use_mkfs):
+    path = os.path.join(tmp, f"{fs_type}.vol")
+    tool = {"fat32": ["mkfs.vfat", "-F", "32", "-s", "1", "-S", "512", "-n", "ROMS"], "exfat": ["mkfs.exfat"]}[fs_type]
+    if use_mkfs and shutil.which(tool[0]):
+        with open(path, "wb") as f:
+            f.truncate(size)
+        subprocess.run(tool + [path], check=True, stdout=subprocess.DEVNULL)
+        with open(path, "rb") as f:
+            return bytearray(f.read()), tool[0]
+    return (format_fat32(size) if fs_type == "fat32" else format_exfat(size)), "builtin formatter"
+
+
+# =============================================================================
+# Test
+# =============================================================================
+
+
+def make_card(volume, layout, tmp, rng):
+    """Writes the volume behind the tools/sd_card.py layout or alone."""
+    card = os.path.join(tmp, f"card_{layout}.img")
+    if layout == "superfloppy":
+        with open(card, "wb") as f:
+            f.write(volume)
+        return card
+
+    image = os.path.join(tmp, "extflash.bin")
+    catalog = os.path.join(tmp, "rom_catalog.bin")
+    for path, size in ((image, 64 * 1024), (catalog, 8 * 1024)):
+        with open(path, "wb") as f:
+            f.write(rng.randbytes(size))
+    fs_start_mb = 260
+    with open(card, "wb") as f:
+        f.truncate(fs_start_mb * 1024 * 1024 + len(volume))
+    subprocess.run([sys.executable, os.path.join(REPO, "tools", "sd_card.py"), card, "--image", image,
+                    "--catalog", catalog, "--fs-start-mb", str(fs_start_mb)], check=True, stdout=subprocess.DEVNULL)
+    with open(card, "r+b") as f:
+        f.seek(fs_start_mb * 1024 * 1024)
+        f.write(volume)
+    return card
+
+
+def expected_extents(vol, clusters):
+    extents = 0
+    for i, cluster in enumerate(clusters):
+        if not i or cluster != clusters[i - 1] + 1:
+            extents += 1
+    return extents
+
+
+def run_case(binary, fs_type, layout, args, tmp, rng):
+    data, formatter = make_volume(fs_type, args.size_mb * 1024 * 1024, tmp, not args.builtin)
+    vol = Fat32(data) if fs_type == "fat32" else ExFat(data)
+    tree = rom_tree(rng)
+    for _, entry in walk(tree):
+        if isinstance(entry, File) and not entry.deleted:
+            entry.data = rng.randbytes(entry.size)
+    vol.write_root(tree)
+    vol.finish()
+    card = make_card(vol.data, layout, tmp, rng)
+
+    # Every file, the case insensitive lookups and the paths that must fail
+    checks = []
+    for path, entry in walk(tree):
+        if isinstance(entry, File):
+            if entry.deleted:
+                checks.append((path, None))
+            else:
+                extents = expected_extents(vol, entry.clusters)
+                checks.append((path, entry if extents <= MAX_EXTENTS else None))
+                checks.append((path.upper(), checks[-1][1]))
+        else:
+            checks.append((path, None))
+    checks += [("/roms/nes/missing.nes", None), ("/roms/nes/super game (usa).nes/x", None), ("/", None),
+               ("/roms/nes/super game (usa)", None)]
+
+    stdin = "".join(f"{path}\t{os.path.join(tmp, 'out%d' % i)}\n" for i, (path, _) in enumerate(checks))
+    result = subprocess.run([binary, card, str(args.seed)], input=stdin, capture_output=True, text=True)
+    lines = result.stdout.splitlines()
+    failures = [line for line in lines if line.startswith("FAIL")]
+    # The driver's own messages, e.g. "FS: File is too fragmented"
+    lines = [line for line in lines if not line.startswith(("FAIL", "FS:"))]
+    if result.returncode or len(lines) != len(checks):
+        failures.append(f"FAIL: harness exited with {result.returncode} after {len(lines)} of {len(checks)} files")
+
+    fragmented = 0
+    for i, ((path, entry), line) in enumerate(zip(checks, lines)):
+        if entry is None:
+            if line != "missing":
+                failures.append(f"FAIL: {path} should not open, got {line}")
+            continue
+        if line == "missing":
+            failures.append(f"FAIL: {path} not found")
+            continue
+        size, extents = map(int, line.split())
+        with open(os.path.join(tmp, f"out{i}"), "rb") as f:
+            read = f.read()
+        if size != len(entry.data) or read != entry.data:
+            failures.append(f"FAIL: {path} data differs")
+        if extents != expected_extents(vol, entry.clusters):
+            failures.append(f"FAIL: {path} has {extents} extents, {expected_extents(vol, entry.clusters)} expected")
+        fragmented += extents > 1
+
+    for line in failures[:20]:
+        print(line)
+    print(f"{fs_type:5} {layout:11} ({formatter}): {len(checks)} lookups, {fragmented} fragmented files read, "
+          f"{'FAIL' if failures else 'OK'}")
+    return bool(failures)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Test Core/Src/gw_fs.c against FAT32 and exFAT images on the host")
+    parser.add_argument("--size-mb", type=int, default=64, help="volume size (default: 64)")
+    parser.add_argument("--builtin", action="store_true", help="use the builtin formatters even if mkfs is found")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--cc", default="gcc")
+    args = parser.parse_args()
+
+    for tool in ("mkfs.vfat", "mkfs.exfat"):
+        if not args.builtin and not shutil.which(tool):
+            print(f"{tool} not found, using the builtin formatter")
+
+    rng = random.Random(args.seed)
+    failed = False
+    with tempfile.TemporaryDirectory() as tmp:
+        source = os.path.join(tmp, "harness.c")
+        with open(source, "w") as f:
+            f.write(HARNESS)
+        binary = os.path.join(tmp, "harness")
+        subprocess.run([args.cc, "-O1", "-g", "-std=gnu11", "-Wall", "-Wno-format", "-fsanitize=address,undefined",
+                        "-I", os.path.join(REPO, "Core", "Inc"), "-I", os.path.join(REPO, "Core", "Src"),
+                        source, "-o", binary], check=True)
+
+        for fs_type in ("fat32", "exfat"):
+            for layout in ("card", "superfloppy"):
+                failed |= run_case(binary, fs_type, layout, args, tmp, rng)
+
+    print("FAIL" if failed else "OK")
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,220 @@
+#!/usr/bin/env python3
+
+# Host test of the SD card ROM catalog reader in
+# Core/Src/retro-go/rom_catalog.c. Writes a catalog with the ROMCatalog
+# writer of parse_roms.py, builds rom_catalog.c with the host gcc against a
+# fake card holding it, maps the systems, pins the started ROMs and reads
+# them back after a simulated reset. Also checks that a pinned copy is
+# still matched to the catalog file it was pinned from, as the prefetch
+# relies on it when the prefetched game is started.
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+import zlib
+from pathlib import Path
+from types import SimpleNamespace
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, REPO)
+
+from parse_roms import ROMCatalog  # noqa: E402
+
+STUB_MAIN = """
+#pragma once
+#define PERSISTENT
+"""
+
+STUB_CRC32 = """
+#pragma once
+unsigned int crc32_le(unsigned int crc, unsigned char const *buf, unsigned int len);
+"""
+
+HARNESS = r"""
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "rom_catalog.c"
+
+uint8_t __SAVEFLASH_START__;
+
+static const rom_system_t nes = { .system_name = "NES", .extension = "nes" };
+static const rom_system_t gb = { .system_name = "GB", .extension = "gb" };
+static const rom_system_t sms = { .system_name = "SMS", .extension = "sms" };
+static const rom_system_t *systems[] = { &nes, &gb, &sms };
+const rom_manager_t rom_mgr = { .systems = systems, .systems_count = 3 };
+
+static FILE *card;
+static int failures;
+
+unsigned int crc32_le(unsigned int crc, unsigned char const *buf, unsigned int len)
+{
+    return crc32(crc, buf, len);
+}
+
+void sd_read(uint64_t lba, uint32_t offset, void *buffer, size_t buffer_size)
+{
+    memset(buffer, 0, buffer_size);
+    if (lba < SD_CATALOG_LBA)
+        return;
+    fseeko(card, (lba - SD_CATALOG_LBA) * 512 + offset, SEEK_SET);
+    fread(buffer, 1, buffer_size, card);
+}
+
+#define CHECK(cond)                                                 \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("FAIL: line %d: %s\n", __LINE__, #cond);         \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+// The heap mapping and the loaded pinned copies are lost on the reset,
+// the PERSISTENT pinned entries are not
+static void reset(void)
+{
+    for (int i = 0; i < ROM_CATALOG_MAX_SYSTEMS; i++) {
+        free(catalog.files[i]);
+        free(catalog.names[i]);
+    }
+    memset(&catalog, 0, sizeof(catalog));
+    memset(pinned_files, 0, sizeof(pinned_files));
+    memset(pinned_loaded, 0, sizeof(pinned_loaded));
+}
+
+// Prints the system ROMs as "name size crc" for the comparison in Python
+static void dump(const rom_system_t *system)
+{
+    const retro_emulator_file_t *files = rom_catalog_files(system);
+
+    for (uint32_t i = 0; i < rom_catalog_count(system); i++)
+        printf("%s %s %zu %08lx %llu\n", system->extension, files[i].name, files[i].size,
+               (unsigned long)files[i].checksum, (unsigned long long)files[i].lba);
+}
+
+int main(int argc, char **argv)
+{
+    card = fopen(argv[1], "rb");
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    dump(&nes);
+    dump(&gb);
+    CHECK(rom_catalog_count(&sms) == 0);
+    CHECK(rom_catalog_files(&sms) == NULL);
+
+    retro_emulator_file_t *nes_files = (retro_emulator_file_t *)rom_catalog_files(&nes);
+    retro_emulator_file_t *gb_files = (retro_emulator_file_t *)rom_catalog_files(&gb);
+    retro_emulator_file_t other = { .name = "not in the catalog" };
+
+    // Starting a ROM pins a copy of it, the prefetch of the same ROM must
+    // still be matched to it
+    retro_emulator_file_t *pinned_nes = rom_catalog_pin(&nes_files[1]);
+    CHECK(pinned_nes != &nes_files[1]);
+    CHECK(strcmp(pinned_nes->name, nes_files[1].name) == 0);
+    CHECK(rom_catalog_same_file(pinned_nes, &nes_files[1]));
+    CHECK(rom_catalog_same_file(&nes_files[1], pinned_nes));
+    CHECK(!rom_catalog_same_file(pinned_nes, &nes_files[0]));
+    CHECK(!rom_catalog_same_file(pinned_nes, &gb_files[1]));
+    CHECK(rom_catalog_same_file(&other, &other));
+    CHECK(!rom_catalog_same_file(&other, pinned_nes));
+    CHECK(!rom_catalog_same_file(&nes_files[0], &other));
+    CHECK(rom_catalog_pin(&other) == &other);
+
+    // Pinning again keeps the slot
+    CHECK(rom_catalog_pin(&nes_files[1]) == pinned_nes);
+    CHECK(rom_catalog_pin(pinned_nes) == pinned_nes);
+
+    // Only the last ROM_CATALOG_PINNED stay
+    retro_emulator_file_t *pinned_gb = rom_catalog_pin(&gb_files[0]);
+    for (int i = 0; i < ROM_CATALOG_PINNED - 1; i++)
+        rom_catalog_pin(&gb_files[1 + i]);
+    CHECK(rom_catalog_same_file(pinned_gb, &gb_files[0]));
+    CHECK(!rom_catalog_same_file(pinned_nes, &nes_files[1]));
+
+    // The pinned copy is read back from the card after the reset
+    retro_emulator_file_t *pinned_last = rom_catalog_pin(&gb_files[ROM_CATALOG_PINNED - 1]);
+    const char *name = strdup(pinned_last->name);
+    reset();
+    CHECK(rom_catalog_map_file(pinned_last));
+    CHECK(strcmp(pinned_last->name, name) == 0);
+    gb_files = (retro_emulator_file_t *)rom_catalog_files(&gb);
+    CHECK(rom_catalog_same_file(pinned_last, &gb_files[ROM_CATALOG_PINNED - 1]));
+    CHECK(!rom_catalog_same_file(pinned_last, &gb_files[0]));
+    CHECK(!rom_catalog_map_file(&other));
+    free((void *)name);
+    reset();
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures != 0;
+}
+"""
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Test Core/Src/retro-go/rom_catalog.c on the host")
+    parser.add_argument("--cc", default="gcc")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        roms = {}
+        catalog = ROMCatalog()
+        for folder, count in (("nes", 3), ("gb", 8)):
+            entries = []
+            for i in range(count):
+                path = Path(tmp) / f"{folder}{i}.{folder}"
+                data = bytes((i * 7 + j) & 0xFF for j in range(1000 + i * 700))
+                path.write_bytes(data)
+                rom = SimpleNamespace(name=f"{folder} game {i}", ext=folder, path=path, is_pal=False)
+                entries.append((rom, 0, 0))
+                roms[(folder, rom.name)] = data
+            catalog.add_system(folder, entries)
+        card = os.path.join(tmp, "catalog.bin")
+        catalog.write(card)
+
+        for name, text in (("main.h", STUB_MAIN), ("crc32.h", STUB_CRC32), ("odroid_sdcard.h", "")):
+            with open(os.path.join(tmp, name), "w") as f:
+                f.write(text)
+        source = os.path.join(tmp, "harness.c")
+        with open(source, "w") as f:
+            f.write(HARNESS)
+
+        binary = os.path.join(tmp, "harness")
+        cmd = [args.cc, "-O1", "-std=gnu11", "-w", "-fsanitize=address,undefined",
+               "-I", tmp, "-I", os.path.join(REPO, "Core", "Inc"),
+               "-I", os.path.join(REPO, "Core", "Inc", "retro-go"),
+               "-I", os.path.join(REPO, "Core", "Src", "retro-go"),
+               "-DSD_CARD=1", source, "-o", binary, "-lz"]
+        subprocess.run(cmd, check=True)
+        result = subprocess.run([binary, card], capture_output=True, text=True)
+        sys.stderr.write(result.stderr)
+
+        # The mapped entries must match the ROMs written, the data too
+        ok = result.returncode == 0
+        listed = 0
+        with open(card, "rb") as f:
+            for line in result.stdout.splitlines():
+                if line.startswith(("FAIL", "OK", "FAILED", "Catalog:")):
+                    print(line)
+                    continue
+                folder, rest = line.split(" ", 1)
+                name, size, crc, lba = rest.rsplit(" ", 3)
+                data = roms.get((folder, name))
+                f.seek((int(lba) - (2048 + 256 * 1024 * 1024 // 512)) * 512)
+                if data is None or int(size) != len(data) or int(crc, 16) != zlib.crc32(data) or \
+                        f.read(len(data)) != data:
+                    print(f"FAIL: {folder} {name} doesn't match")
+                    ok = False
+                listed += 1
+        if listed != len(roms):
+            print(f"FAIL: {listed} of {len(roms)} ROMs listed")
+            ok = False
+        return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
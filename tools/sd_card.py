@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+
+# Prepares the SD card (or a card image file) for the SD card builds.
+# Writes the MBR, the extflash image and the ROM catalog following the
+# layout in Core/Inc/gw_sd.h:
+#
+#   partition 1  type 0xDA (no filesystem), the image at SD_IMAGE_LBA and
+#                the catalog at SD_CATALOG_LBA
+#   partition 2  optional FAT32/exFAT volume with the ROMs of the SD_FS=1
+#                builds, under /roms/<system>/ as in the repo
+#
+# The second partition is kept when it's already there and doesn't overlap
+# the catalog, otherwise --fs-start-mb creates it up to the end of the card.
+# It has to be formatted afterwards, e.g. mkfs.vfat -F 32 /dev/sdX2 or
+# mkfs.exfat /dev/sdX2, and the roms directory copied to it.
+
+import argparse
+import os
+import struct
+import sys
+
+# Must match Core/Inc/gw_sd.h
+SECTOR_SIZE = 512
+IMAGE_LBA = 2048
+IMAGE_MAX_SIZE = 256 * 1024 * 1024
+CATALOG_LBA = IMAGE_LBA + IMAGE_MAX_SIZE // SECTOR_SIZE
+
+PARTITION_TYPE_RAW = 0xDA
+PARTITION_TYPE_FAT32 = 0x0C
+PARTITION_TYPE_EXFAT = 0x07
+PARTITION_TABLE = 446
+PARTITION_ENTRY = "<B3sB3sII"
+ALIGN = 2048  # 1MB, in sectors
+
+
+def align_up(value, alignment):
+    return (value + alignment - 1) // alignment * alignment
+
+
+def read_partitions(mbr):
+    if mbr[510:512] != b"\x55\xaa":
+        return [None] * 4
+
+    partitions = []
+    for i in range(4):
+        _, _, part_type, _, lba, count = struct.unpack_from(PARTITION_ENTRY, mbr, PARTITION_TABLE + 16 * i)
+        partitions.append((part_type, lba, count) if part_type else None)
+    return partitions
+
+
+def pack_partition(part_type, lba, count):
+    # Only LBA addressing, the CHS fields are set to the "too large" value
+    chs = b"\xfe\xff\xff"
+    return struct.pack(PARTITION_ENTRY, 0, chs, part_type, chs, lba, count)
+
+
+def copy_file(dev, path, lba, max_size=None):
+    size = os.path.getsize(path)
+    if max_size is not None and size > max_size:
+        sys.exit(f"{path} is {size} bytes, only {max_size} fit")
+
+    dev.seek(lba * SECTOR_SIZE)
+    with open(path, "rb") as f:
+        while chunk := f.read(1024 * 1024):
+            dev.write(chunk)
+    print(f"Wrote {path} ({size // 1024} KB) at sector {lba}")
+    return size
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Write the partition table, the image and the ROM catalog to the SD card")
+    parser.add_argument("device", help="card device (e.g. /dev/sdX) or image file")
+    parser.add_argument("--image", default="build/gw_retro_go_extflash.bin", help="extflash image, skipped if missing")
+    parser.add_argument("--catalog", default="build/rom_catalog.bin", help="ROM catalog, skipped if missing")
+    parser.add_argument("--fs-start-mb", type=int, help="creates the FAT32/exFAT partition from this offset")
+    parser.add_argument("--fs-type", choices=("fat32", "exfat"), default="fat32", help="type of the created partition")
+    args = parser.parse_args()
+
+    catalog_size = os.path.getsize(args.catalog) if os.path.exists(args.catalog) else 0
+    raw_end = align_up(CATALOG_LBA + align_up(catalog_size, SECTOR_SIZE) // SECTOR_SIZE, ALIGN)
+
+    with open(args.device, "r+b") as dev:
+        card_sectors = dev.seek(0, os.SEEK_END) // SECTOR_SIZE
+        dev.seek(0)
+        mbr = bytearray(dev.read(SECTOR_SIZE).ljust(SECTOR_SIZE, b"\0"))
+        old = read_partitions(mbr)
+
+        fs_part = old[1]
+        if args.fs_start_mb is not None:
+            lba = args.fs_start_mb * 1024 * 1024 // SECTOR_SIZE
+            part_type = PARTITION_TYPE_EXFAT if args.fs_type == "exfat" else PARTITION_TYPE_FAT32
+            fs_part = (part_type, lba, card_sectors - lba)
+        if fs_part:
+            if fs_part[1] < raw_end:
+                sys.exit(f"The filesystem partition at sector {fs_part[1]} overlaps the catalog "
+                         f"(ends at sector {raw_end}), use --fs-start-mb to move it")
+            if fs_part[1] + fs_part[2] > card_sectors:
+                sys.exit("The filesystem partition doesn't fit the card")
+            raw_end = fs_part[1]
+        elif raw_end > card_sectors:
+            sys.exit("The catalog doesn't fit the card")
+
+        # The boot code and the disk signature are kept
+        mbr[PARTITION_TABLE:510] = bytes(510 - PARTITION_TABLE)
+        mbr[PARTITION_TABLE:PARTITION_TABLE + 16] = pack_partition(PARTITION_TYPE_RAW, IMAGE_LBA, raw_end - IMAGE_LBA)
+        if fs_part:
+            mbr[PARTITION_TABLE + 16:PARTITION_TABLE + 32] = pack_partition(*fs_part)
+        mbr[510:512] = b"\x55\xaa"
+        dev.seek(0)
+        dev.write(mbr)
+        print(f"Partition 1: sectors {IMAGE_LBA}-{raw_end - 1}, image and catalog")
+        if fs_part:
+            print(f"Partition 2: sectors {fs_part[1]}-{fs_part[1] + fs_part[2] - 1}, filesystem")
+
+        if os.path.exists(args.image):
+            copy_file(dev, args.image, IMAGE_LBA, IMAGE_MAX_SIZE)
+        if catalog_size:
+            copy_file(dev, args.catalog, CATALOG_LBA)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
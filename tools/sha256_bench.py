@@ -0,0 +1,256 @@
+#!/usr/bin/env python3
+
+# Host check and benchmark of Core/Src/retro-go/sha256.c. Builds it with
+# the host gcc next to the previous byte at a time implementation, checks
+# that both give the same digests as hashlib for random lengths, buffer
+# alignments and update splits, then times both on the same buffer.
+
+import argparse
+import hashlib
+import os
+import random
+import subprocess
+import sys
+import tempfile
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+# The implementation before the word aligned, unrolled one
+REFERENCE = r"""
+#define REF_ROTRIGHT(a,b) (((a) >> (b)) | ((a) << (32-(b))))
+#define REF_CH(x,y,z) (((x) & (y)) ^ (~(x) & (z)))
+#define REF_MAJ(x,y,z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define REF_EP0(x) (REF_ROTRIGHT(x,2) ^ REF_ROTRIGHT(x,13) ^ REF_ROTRIGHT(x,22))
+#define REF_EP1(x) (REF_ROTRIGHT(x,6) ^ REF_ROTRIGHT(x,11) ^ REF_ROTRIGHT(x,25))
+#define REF_SIG0(x) (REF_ROTRIGHT(x,7) ^ REF_ROTRIGHT(x,18) ^ ((x) >> 3))
+#define REF_SIG1(x) (REF_ROTRIGHT(x,17) ^ REF_ROTRIGHT(x,19) ^ ((x) >> 10))
+
+static void ref_transform(SHA256_CTX *ctx, const BYTE data[])
+{
+    WORD a, b, c, d, e, f, g, h, i, j, t1, t2, m[64];
+
+    for (i = 0, j = 0; i < 16; ++i, j += 4)
+        m[i] = (data[j] << 24) | (data[j + 1] << 16) | (data[j + 2] << 8) | (data[j + 3]);
+    for ( ; i < 64; ++i)
+        m[i] = REF_SIG1(m[i - 2]) + m[i - 7] + REF_SIG0(m[i - 15]) + m[i - 16];
+
+    a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+    e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+
+    for (i = 0; i < 64; ++i) {
+        t1 = h + REF_EP1(e) + REF_CH(e,f,g) + k[i] + m[i];
+        t2 = REF_EP0(a) + REF_MAJ(a,b,c);
+        h = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+static void ref_update(SHA256_CTX *ctx, const BYTE data[], size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        ctx->data[ctx->datalen] = data[i];
+        ctx->datalen++;
+        if (ctx->datalen == 64) {
+            ref_transform(ctx, ctx->data);
+            ctx->bitlen += 512;
+            ctx->datalen = 0;
+        }
+    }
+}
+
+static void ref_final(SHA256_CTX *ctx, BYTE hash[])
+{
+    WORD i = ctx->datalen;
+
+    if (ctx->datalen < 56) {
+        ctx->data[i++] = 0x80;
+        while (i < 56)
+            ctx->data[i++] = 0x00;
+    } else {
+        ctx->data[i++] = 0x80;
+        while (i < 64)
+            ctx->data[i++] = 0x00;
+        ref_transform(ctx, ctx->data);
+        memset(ctx->data, 0, 56);
+    }
+
+    ctx->bitlen += ctx->datalen * 8;
+    for (i = 0; i < 8; ++i)
+        ctx->data[63 - i] = ctx->bitlen >> (i * 8);
+    ref_transform(ctx, ctx->data);
+
+    for (i = 0; i < 32; ++i)
+        hash[i] = ctx->state[i / 4] >> (24 - (i % 4) * 8);
+}
+"""
+
+HARNESS = r"""
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sha256.c"
+""" + REFERENCE + r"""
+static uint8_t *buf;
+static size_t buf_size;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void hash_new(const uint8_t *data, size_t len, size_t step, BYTE hash[32])
+{
+    SHA256_CTX ctx;
+
+    sha256_init(&ctx);
+    for (size_t done = 0; done < len; done += step)
+        sha256_update(&ctx, data + done, len - done < step ? len - done : step);
+    sha256_final(&ctx, hash);
+}
+
+static void hash_ref(const uint8_t *data, size_t len, size_t step, BYTE hash[32])
+{
+    SHA256_CTX ctx;
+
+    sha256_init(&ctx);
+    for (size_t done = 0; done < len; done += step)
+        ref_update(&ctx, data + done, len - done < step ? len - done : step);
+    ref_final(&ctx, hash);
+}
+
+static void print_hash(const BYTE hash[32])
+{
+    for (int i = 0; i < 32; i++)
+        printf("%02x", hash[i]);
+    printf("\n");
+}
+
+static double run(void (*hash)(const uint8_t *, size_t, size_t, BYTE *), size_t offset, size_t step)
+{
+    BYTE digest[32];
+    double t0 = now();
+
+    hash(buf + offset, buf_size - offset, step, digest);
+    return now() - t0;
+}
+
+static void bench(size_t offset, size_t step, double *ref_mbs, double *new_mbs)
+{
+    // Alternates the runs so both see the same clock changes
+    double ref_best = 1e9, new_best = 1e9;
+
+    for (int i = 0; i < REPEAT; i++) {
+        double t = run(hash_ref, offset, step);
+        if (t < ref_best)
+            ref_best = t;
+        t = run(hash_new, offset, step);
+        if (t < new_best)
+            new_best = t;
+    }
+    *ref_mbs = (buf_size - offset) / ref_best / 1e6;
+    *new_mbs = (buf_size - offset) / new_best / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *f = fopen(argv[1], "rb");
+    fseek(f, 0, SEEK_END);
+    buf_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(buf_size);
+    if (fread(buf, 1, buf_size, f) != buf_size)
+        return 2;
+    fclose(f);
+
+    // "offset length step" per line, prints both digests
+    size_t offset, len, step;
+    while (fscanf(stdin, "%zu %zu %zu", &offset, &len, &step) == 3) {
+        BYTE a[32], b[32];
+        hash_new(buf + offset, len, step, a);
+        hash_ref(buf + offset, len, step, b);
+        print_hash(a);
+        print_hash(b);
+    }
+    fflush(stdout);
+
+    static const struct { size_t offset, step; const char *name; } cases[] = {
+        { 0, (size_t)-1, "aligned, one update" },
+        { 1, (size_t)-1, "unaligned, one update" },
+        { 0, 1024, "aligned, 1kB updates" },
+        { 0, 100, "aligned, 100B updates" },
+    };
+    for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        double ref, new;
+        bench(cases[i].offset, cases[i].step, &ref, &new);
+        printf("BENCH %-24s reference %7.1f MB/s  optimised %7.1f MB/s  x%.2f\n",
+               cases[i].name, ref, new, new / ref);
+    }
+    return 0;
+}
+"""
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Check and benchmark Core/Src/retro-go/sha256.c on the host")
+    parser.add_argument("--size-kb", type=int, default=832, help="benchmark buffer size (default: 832)")
+    parser.add_argument("--vectors", type=int, default=2000, help="random digests to check")
+    parser.add_argument("--repeat", type=int, default=20, help="benchmark runs, the best is kept")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--cc", default="gcc")
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    data = rng.randbytes(args.size_kb * 1024)
+
+    # Every length around the block and padding boundaries, then random
+    # lengths, alignments and update splits
+    vectors = [(0, n, max(n, 1)) for n in range(0, 200)]
+    for _ in range(args.vectors):
+        offset = rng.randrange(4)
+        length = rng.choice((rng.randrange(256), rng.randrange(len(data) // 16)))
+        step = rng.choice((1, 3, 63, 64, 65, 1024, length or 1, rng.randrange(1, 5000)))
+        vectors.append((offset, length, step))
+
+    with tempfile.TemporaryDirectory() as tmp:
+        data_file = os.path.join(tmp, "data.bin")
+        with open(data_file, "wb") as f:
+            f.write(data)
+        source = os.path.join(tmp, "harness.c")
+        with open(source, "w") as f:
+            f.write(HARNESS)
+
+        binary = os.path.join(tmp, "harness")
+        cmd = [args.cc, "-O2", "-std=gnu11", "-w",
+               "-I", os.path.join(REPO, "Core", "Inc"), "-I", os.path.join(REPO, "Core", "Src", "retro-go"),
+               f"-DREPEAT={args.repeat}", source, "-o", binary]
+        subprocess.run(cmd, check=True)
+
+        stdin = "".join(f"{o} {n} {s}\n" for o, n, s in vectors)
+        out = subprocess.run([binary, data_file], input=stdin, capture_output=True, text=True, check=True).stdout
+        lines = out.splitlines()
+
+    failures = 0
+    for i, (offset, length, step) in enumerate(vectors):
+        expected = hashlib.sha256(data[offset:offset + length]).hexdigest()
+        new, ref = lines[2 * i], lines[2 * i + 1]
+        if new != expected or ref != expected:
+            failures += 1
+            if failures <= 10:
+                print(f"FAIL offset={offset} length={length} step={step}: optimised {new} reference {ref} hashlib {expected}")
+
+    print(f"{len(vectors) - failures} of {len(vectors)} digests match hashlib and the reference")
+    for line in lines[2 * len(vectors):]:
+        print(line[len("BENCH "):])
+
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,236 @@
+#!/usr/bin/env python3
+
+# Host test of the SoftSPI transfer kernels in Core/Inc/softspi_kernel.h.
+# Builds them with the host gcc against a simulated mode 0 slave (samples
+# MOSI on the rising SCK edge, shifts out MISO on the falling one), runs
+# the read, write and full-duplex kernels on random data and checks the
+# bit order and the data seen on both sides. Also checks that the default
+# pin macros drive BSRR/IDR the way the GPIO expects.
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+HARNESS_SIM = r"""
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PIN_SCK  0x01
+#define PIN_MOSI 0x02
+#define PIN_MISO 0x04
+
+static void sim_write(uint32_t mask, int value);
+static int sim_read(uint32_t mask);
+
+#define SOFTSPI_PIN_SET(p) sim_write((p)->mask, 1)
+#define SOFTSPI_PIN_RESET(p) sim_write((p)->mask, 0)
+#define SOFTSPI_PIN_WRITE(p, v) sim_write((p)->mask, (v) != 0)
+#define SOFTSPI_PIN_READ(p) sim_read((p)->mask)
+
+#include "softspi_kernel.h"
+
+#define MAX_LEN 4096
+
+// Slave side
+static int sck, mosi;
+static uint8_t slave_tx[MAX_LEN], slave_rx[MAX_LEN];
+static uint32_t tx_bit, rx_bit;
+static uint8_t rx_shift;
+static uint64_t pin_ops;
+static int errors;
+
+static void error(const char *msg)
+{
+    if (errors++ < 10)
+        printf("FAIL: %s (tx bit %u, rx bit %u)\n", msg, tx_bit, rx_bit);
+}
+
+static void sim_write(uint32_t mask, int value)
+{
+    pin_ops++;
+    if (mask == PIN_MOSI) {
+        // MOSI must be stable while SCK is high
+        if (sck && value != mosi)
+            error("MOSI changed while SCK high");
+        mosi = value;
+    } else if (mask == PIN_SCK) {
+        if (value && !sck) {
+            rx_shift = (rx_shift << 1) | mosi;
+            if (++rx_bit % 8 == 0)
+                slave_rx[rx_bit / 8 - 1] = rx_shift;
+        } else if (!value && sck) {
+            tx_bit++;
+        }
+        sck = value;
+    } else {
+        error("write to an unknown pin");
+    }
+}
+
+static int sim_read(uint32_t mask)
+{
+    pin_ops++;
+    if (mask != PIN_MISO) {
+        error("read of an unknown pin");
+        return 0;
+    }
+    if (!sck)
+        error("MISO sampled while SCK low");
+    return (slave_tx[tx_bit / 8] >> (7 - tx_bit % 8)) & 1;
+}
+
+static void slave_reset(void)
+{
+    sck = 0;
+    mosi = 0;
+    tx_bit = rx_bit = 0;
+    rx_shift = 0;
+    memset(slave_rx, 0, sizeof(slave_rx));
+    for (int i = 0; i < MAX_LEN; i++)
+        slave_tx[i] = rand();
+}
+
+static void check_end(uint32_t len)
+{
+    if (sck)
+        error("SCK left high");
+    if (tx_bit != len * 8 || rx_bit != len * 8)
+        error("wrong number of clocks");
+}
+
+int main(int argc, char **argv)
+{
+    const softspi_kernel_t k = {
+        .sck = { .mask = PIN_SCK },
+        .mosi = { .mask = PIN_MOSI },
+        .miso = { .mask = PIN_MISO },
+        .half_period = HALF_PERIOD,
+    };
+    static uint8_t tx[MAX_LEN], rx[MAX_LEN];
+    uint64_t read_ops = 0, write_ops = 0, write_read_ops = 0, bytes[3] = {0};
+
+    srand(SEED);
+    for (int run = 0; run < RUNS; run++) {
+        uint32_t len = run < 8 ? run : 1 + rand() % (run % 4 ? 16 : MAX_LEN);
+
+        for (uint32_t i = 0; i < len; i++)
+            tx[i] = rand();
+
+        // Read: MOSI held high, the slave data comes back MSB first
+        slave_reset();
+        pin_ops = 0;
+        memset(rx, 0, len);
+        softspi_kernel_read(&k, run % 2 ? rx : NULL, len);
+        read_ops += pin_ops;
+        bytes[0] += len;
+        check_end(len);
+        for (uint32_t i = 0; i < len; i++) {
+            if (slave_rx[i] != 0xFF)
+                error("read: MOSI not high");
+            if (run % 2 && rx[i] != slave_tx[i])
+                error("read: wrong data");
+        }
+
+        // Write: the slave sees the bytes MSB first
+        slave_reset();
+        pin_ops = 0;
+        softspi_kernel_write(&k, tx, len);
+        write_ops += pin_ops;
+        bytes[1] += len;
+        check_end(len);
+        if (memcmp(slave_rx, tx, len))
+            error("write: wrong data");
+
+        // Full duplex
+        slave_reset();
+        pin_ops = 0;
+        memset(rx, 0, len);
+        softspi_kernel_write_read(&k, tx, rx, len);
+        write_read_ops += pin_ops;
+        bytes[2] += len;
+        check_end(len);
+        if (memcmp(slave_rx, tx, len))
+            error("write_read: wrong data sent");
+        if (memcmp(rx, slave_tx, len))
+            error("write_read: wrong data received");
+    }
+
+    printf("pin accesses per byte: read %.1f, write %.1f, write_read %.1f\n",
+           (double)read_ops / bytes[0], (double)write_ops / bytes[1],
+           (double)write_read_ops / bytes[2]);
+    return errors ? 1 : 0;
+}
+"""
+
+# Default macros against plain variables standing in for BSRR and IDR
+HARNESS_REGS = r"""
+#include <stdio.h>
+
+#include "softspi_kernel.h"
+
+static volatile uint32_t bsrr, idr;
+
+int main(void)
+{
+    softspi_kernel_pin_t pin = { .bsrr = &bsrr, .idr = &idr, .mask = 1 << 5 };
+    int errors = 0;
+
+    SOFTSPI_PIN_SET(&pin);
+    errors += bsrr != (1 << 5);
+    SOFTSPI_PIN_RESET(&pin);
+    errors += bsrr != (1 << 21);
+    SOFTSPI_PIN_WRITE(&pin, 0x40);
+    errors += bsrr != (1 << 5);
+    SOFTSPI_PIN_WRITE(&pin, 0);
+    errors += bsrr != (1 << 21);
+    idr = ~(1u << 5);
+    errors += SOFTSPI_PIN_READ(&pin) != 0;
+    idr = 1 << 5;
+    errors += SOFTSPI_PIN_READ(&pin) != 1;
+
+    if (errors)
+        printf("FAIL: default pin macros\n");
+    return errors ? 1 : 0;
+}
+"""
+
+
+def build_and_run(cc, tmp, name, source, defines):
+    path = os.path.join(tmp, name + ".c")
+    with open(path, "w") as f:
+        f.write(source)
+    binary = os.path.join(tmp, name)
+    cmd = [cc, "-O2", "-std=gnu11", "-Wall", "-fsanitize=address,undefined",
+           "-I", os.path.join(REPO, "Core", "Inc"), path, "-o", binary]
+    cmd += [f"-D{k}={v}" for k, v in defines.items()]
+    subprocess.run(cmd, check=True)
+    result = subprocess.run([binary], capture_output=True, text=True)
+    sys.stdout.write(result.stdout)
+    return result.returncode
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Test the SoftSPI transfer kernels on the host")
+    parser.add_argument("--runs", type=int, default=200, help="transfers per kernel")
+    parser.add_argument("--half-period", type=int, default=1, help="pause loop iterations per half-period")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--cc", default="gcc")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        failed = build_and_run(args.cc, tmp, "sim", HARNESS_SIM,
+                               {"RUNS": args.runs, "SEED": args.seed, "HALF_PERIOD": args.half_period})
+        failed |= build_and_run(args.cc, tmp, "regs", HARNESS_REGS, {})
+
+    print("FAIL" if failed else "OK")
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())